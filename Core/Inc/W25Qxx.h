@@ -11,17 +11,233 @@
 // Comment out for some extra debugging info
 //#define SPIDEBUG					1
 
-#define FS_SIZE                 (1024 * 1024 * 8)                   // 8Mbyte
+#define FS_SIZE                 (1024 * 1024 * 8)                   // 8Mbyte, largest chip W25Q_Init accepts
 #define FS_PAGE_SIZE            256									// Winbond W25Qxx 256 Page program
 #define FS_SECTOR_SIZE          4096								// Winbond W25Qxx minimum erase size
+// FS_BLANK_CHECK reads a sector back before erasing it and skips the erase when it reads all 0xFF.
+// That is not safe after a power loss during an erase, a weakly erased sector can read back as 0xFF
+// and still not program reliably, so only enable it when erases can't be interrupted. Sectors the
+// driver erased itself are remembered in RAM (erased_map), which is not persisted, so that saving
+// only lasts until the next reboot.
+//#define FS_BLANK_CHECK        1									// Read a sector back before erasing it, uncomment to skip blank sectors
+#define FS_PREERASE_BLOCKS      8									// Free blocks stmlfs_gc keeps erased ahead of the allocator
+// FS_READAHEAD fills buffers inside W25Q_t by SPI DMA. The DMA1/DMA2 streams of the H7 can't reach
+// the DTCM, so W25Q_t must be placed in AXI SRAM or D2 SRAM (W25Q_Init asserts this). The end of
+// a transfer is reported by W25Q_SPI_RxCplt, registered with the HAL when
+// USE_HAL_SPI_REGISTER_CALLBACKS is 1, otherwise call it from HAL_SPI_RxCpltCallback.
+#define FS_READAHEAD            FS_SECTOR_SIZE						// Sequential read-ahead by SPI DMA, 2 buffers of this size, comment out to disable
+#define FS_SCHED_PAGES          16									// Pages the I/O scheduler holds back from the chip, comment out to write through
+//#define FS_TRACE              1024								// Block device calls kept in the trace ring, uncomment to enable
+//#define FS_RECORD													// stmlfs_ calls printed for Tools/lfsreplay.c once stmlfs_record enables them, uncomment to enable
+//#define FS_LATENCY												// Latency histogram per stmlfs_ call type, uncomment to enable
 
 #include "lfs_util.h"
 #include "lfs.h"
+#include "lfs_ring.h"
+#include "lfs_async.h"
+#include "lfs_lathist.h"
 
 struct littlfs_fsstat_t {
     lfs_size_t block_size;
     lfs_size_t block_count;
     lfs_size_t blocks_used;
+    uint32_t compactions;											// Metadata pairs rewritten since mount
+};
+
+struct littlfs_erasestat_t {
+    uint32_t pool_hits;												// Erase requests served by the pre-erase pool
+    uint32_t blank_hits;											// Erase requests skipped by the blank check
+    uint32_t sync_erases;											// Erases littlefs had to wait for
+    uint32_t pre_erases;											// Erases done ahead of time by stmlfs_preerase
+    uint32_t blocks_warm;											// Erased blocks ready for the next allocations
+};
+
+struct littlfs_sched_t {
+    uint32_t queued_pages;											// Pages programmed through the queue
+    uint32_t bursts;												// Times the queue was written to the chip
+    uint32_t reads_ahead;											// Reads served while programs were queued
+    uint32_t deferred_erases;										// Erases held back until the sector was programmed or the system idle
+    uint32_t background_erases;										// Erases run while the system was idle, suspended by reads
+    uint32_t dropped_pages;											// Queued pages never written, their sector was erased again
+};
+
+struct littlfs_readahead_t {
+    uint32_t hit_bytes;												// Bytes read from the read-ahead buffers
+    uint32_t prefetch_bytes;										// Bytes fetched ahead by DMA
+    uint32_t stalls;												// Reads that waited for a transfer still in flight
+};
+
+enum stmlfs_trace_op {
+	STMLFS_TRACE_READ  = 0,
+	STMLFS_TRACE_PROG  = 1,
+	STMLFS_TRACE_ERASE = 2,
+	STMLFS_TRACE_SYNC  = 3,
+};
+
+struct littlfs_trace_t {											// One block device call, 20 bytes
+    uint32_t start;													// DWT->CYCCNT when littlefs made the call
+    uint32_t end;													// and when it returned
+    uint32_t off;
+    uint32_t size;
+    uint16_t block;													// littlefs block
+    uint8_t op;														// enum stmlfs_trace_op
+    uint8_t vol;													// Volume number, see stmlfs_volume
+};
+
+#ifdef FS_TRACE
+#define STMLFS_TRACE_MAGIC		0x5453464C							// "LFST"
+#define STMLFS_TRACE_VERSION	1
+
+struct littlfs_tracebuf_t {											// The ring, a debugger dump of stmlfs_tracebuf decodes as is
+    uint32_t magic;
+    uint16_t version;
+    uint16_t rec_size;
+    uint32_t entries;
+    uint32_t head;													// Records written since stmlfs_trace_start, rec[head%entries] is the oldest once it wrapped
+    uint32_t clock_hz;												// DWT cycles per second
+    struct littlfs_trace_t rec[FS_TRACE];
+};
+
+extern struct littlfs_tracebuf_t stmlfs_tracebuf;
+#endif
+
+struct littlfs_spistat_t {											// Per chip, volumes sharing a chip see the same counts
+    uint32_t tx_bytes;												// Bytes sent, commands and addresses included
+    uint32_t rx_bytes;												// Bytes received, read-ahead DMA included
+    uint32_t busy_us;												// Time spent polling BUSY, timed with DWT->CYCCNT
+    uint32_t reads;													// Commands by opcode, 0x03
+    uint32_t page_programs;											// 0x02
+    uint32_t sector_erases;											// 0x20
+    uint32_t status_reads;											// 0x05, 0x35 and 0x15
+    uint32_t write_enables;											// 0x06
+    uint32_t suspends;												// 0x75
+    uint32_t resumes;												// 0x7A
+    uint32_t other_cmds;
+};
+
+struct littlfs_stats_t {											// Filled by stmlfs_stats
+    struct littlfs_spistat_t spi;									// Both chips of a striped or mirrored volume
+    struct lfs_fsstats lfs;											// Cache hits, commits, compactions, relocations and lookahead scans
+    uint32_t write_bytes;											// Bytes the application wrote to files
+    uint32_t prog_bytes;											// Bytes littlefs programmed
+};
+
+enum stmlfs_lat_op {												// stmlfs_ calls with a latency histogram
+	STMLFS_LAT_OPEN     = 0,										// stmlfs_file_open and stmlfs_opencfg
+	STMLFS_LAT_READ     = 1,										// stmlfs_file_read, readv and queued reads
+	STMLFS_LAT_WRITE    = 2,										// stmlfs_file_write, writev and queued writes
+	STMLFS_LAT_SYNC     = 3,										// stmlfs_fflush and queued syncs
+	STMLFS_LAT_CLOSE    = 4,
+	STMLFS_LAT_RENAME   = 5,										// stmlfs_rename and stmlfs_rename_batch
+	STMLFS_LAT_REMOVE   = 6,										// stmlfs_remove and stmlfs_remove_recursive
+	STMLFS_LAT_MKDIR    = 7,
+	STMLFS_LAT_DIR_READ = 8,
+	STMLFS_LAT_OPS      = 9,
+};
+
+#define STMLFS_LAT_BUCKETS		LFS_LATHIST_BUCKETS					// Bucket 0 is under 1us, bucket n from 2^(n-1) to 2^n us, the last one open ended
+
+struct littlfs_latency_t {											// Filled by stmlfs_latency, times in us
+    uint32_t count;
+    uint32_t min_us;
+    uint32_t mean_us;
+    uint32_t max_us;
+    uint32_t p50_us;												// Percentiles are interpolated within their bucket
+    uint32_t p90_us;
+    uint32_t p99_us;
+    uint32_t p999_us;
+    uint32_t bucket[STMLFS_LAT_BUCKETS];
+};
+
+struct littlfs_mirror_t {
+    uint32_t switched_reads;										// Reads moved to the other copy, the chip they stuck to was busy
+    uint32_t split_reads;											// Reads served half by each chip at the same time
+    uint32_t failovers;												// Mounts that only worked from one copy
+};
+
+
+typedef struct w25q {												// One chip, set up by W25Q_Init
+	SPI_HandleTypeDef *spi;
+	GPIO_TypeDef *cs_port;
+	uint16_t cs_pin;
+	uint32_t size;													// Bytes, at most FS_SIZE
+	struct w25q *next;												// Chips are kept in a list for the DMA callback
+	struct w25q *peer;												// Other chip of a striped volume
+
+	bool erase_bg;													// Background erase not finished yet
+	bool erase_held;												// and suspended for a read
+	bool prog_bg;													// Page program not finished yet
+	uint32_t erased_map[(FS_SIZE/FS_SECTOR_SIZE+31)/32];			// Sectors known to be all 0xFF
+	struct littlfs_erasestat_t erasestat;							// Pre-erase pool metrics
+	struct littlfs_spistat_t spistat;								// Bus and command counters
+	bool cmd_next;													// The next byte sent is an opcode
+	uint32_t busy_cycles;											// BUSY polling not yet counted in spistat.busy_us
+
+#ifdef FS_READAHEAD
+	uint8_t ra_buf[2][FS_READAHEAD] __attribute__((aligned(32)));	// DMA targets, D-cache line aligned
+	uint32_t ra_addr[2];											// Flash address of each buffer
+	uint32_t ra_len[2];
+	uint8_t ra_state[2];
+	volatile bool ra_busy;											// Read-ahead DMA transfer in progress
+	uint32_t ra_end;												// Flash address the next buffer fill starts at
+	uint32_t ra_next;												// End of the last read of the stream
+	uint32_t ra_last;												// End of the last read
+	uint8_t ra_cross;												// Files continued in the next sector the last 2 times, fetch across
+	bool ra_enable;
+	struct littlfs_readahead_t rastat;								// Read-ahead metrics
+#endif
+
+#ifdef FS_SCHED_PAGES
+	uint8_t sq_data[FS_SCHED_PAGES][FS_PAGE_SIZE];					// Programs not on the chip yet, one page each
+	uint32_t sq_addr[FS_SCHED_PAGES];								// Flash address of each page
+	uint32_t sq_sync[FS_SCHED_PAGES];								// sq_syncs when each page was queued
+	uint32_t sq_syncs;												// sched_flush calls, littlefs syncs
+	int sq_head;													// Oldest page, the queue is a ring
+	int sq_count;
+	uint32_t sq_erase_map[(FS_SIZE/FS_SECTOR_SIZE+31)/32];			// Sectors littlefs erased that are not erased on the chip yet
+	int32_t sq_erasing;												// Sector erasing in the background
+	bool sq_enable;
+	struct littlfs_sched_t sqstat;									// Scheduler metrics
+#endif
+} W25Q_t;
+
+typedef struct stmlfs {												// One filesystem, set up by stmlfs_init
+	lfs_t lfs;
+	struct lfs_config cfg;											// cfg.context points back here
+	W25Q_t *chip;
+	W25Q_t *stripe;													// Chip holding the odd blocks, NULL if not striped
+	W25Q_t *mirror;													// Chip holding a copy of every block, NULL if not mirrored
+	W25Q_t *reader;													// Copy reads are served from
+	W25Q_t *bad;													// Copy reads stay off, see stmlfs_mount, NULL if both are good
+	struct littlfs_mirror_t mirrorstat;								// Mirror metrics
+	lfs_block_t first;												// Sector on the chip littlefs block 0 maps to
+	lfs_async_t aqueue;												// Requests for stmlfs_async_work
+	uint32_t prog_bytes;											// Bytes programmed since boot
+	uint32_t prog_base;												// prog_bytes when stmlfs_stats last reset
+	uint32_t write_bytes;											// Bytes written to files since stmlfs_stats last reset
+	uint8_t vol;													// Volume number in the trace and the record, see stmlfs_volume
+#ifdef FS_RECORD
+	bool record;													// Calls are printed, see stmlfs_record
+#endif
+#ifdef FS_LATENCY
+	struct lfs_lathist lat[STMLFS_LAT_OPS];							// Latency histograms in DWT cycles, see stmlfs_latency
+#endif
+} stmlfs_t;
+
+enum stmlfs_part_type {
+	STMLFS_PART_LFS = 0,											// littlefs volume, mounted with stmlfs_init_part
+	STMLFS_PART_RAW = 1,											// Raw sectors, e.g. a firmware slot, see stmlfs_raw_read
+};
+
+struct stmlfs_part {												// One entry of a chip's partition table
+	const char *name;
+	uint8_t type;													// enum stmlfs_part_type
+	lfs_block_t first;												// First sector on the chip
+	lfs_block_t count;												// Sectors, a multiple of block_size/FS_SECTOR_SIZE
+	lfs_size_t block_size;											// littlefs block, a multiple of FS_SECTOR_SIZE, 0 for FS_SECTOR_SIZE
+	lfs_size_t cache_size;											// 0 for the default
+	int32_t block_cycles;											// 0 for the default, -1 disables wear levelling
+	uint8_t vol;													// Volume number in the trace, the record and the latency dump
 };
 
 
@@ -33,56 +249,107 @@ struct littlfs_fsstat_t {
 
 
 
-int stmlfs_mount(bool format);
-int stmlfs_file_open(lfs_file_t *file, const char *path, int flags);
-int stmlfs_file_read(lfs_file_t *file,void *buffer, lfs_size_t size);
-int stmlfs_file_rewind(lfs_file_t *file);
-lfs_ssize_t stmlfs_file_write(lfs_file_t *file,const void *buffer, lfs_size_t size);
-int stmlfs_file_close(lfs_file_t *file);
-int stmlfs_unmount(void);
-int stmlfs_remove(const char* path);
-int stmlfs_rename(const char* oldpath, const char* newpath);
-int stmlfs_fflush(lfs_file_t *file);
-int stmlfs_dir_open(const char* path);
-int stmlfs_dir_close(int dir);
-int stmlfs_dir_read(int dir, struct lfs_info* info);
-int stmlfs_dir_seek(int dir, lfs_off_t off);
-lfs_soff_t stmlfs_dir_tell(int dir);
-int stmlfs_dir_rewind(int dir);
-lfs_soff_t stmlfs_lseek(lfs_file_t *file, lfs_soff_t off, int whence);
-int stmlfs_truncate(lfs_file_t *file, lfs_off_t size);
-lfs_soff_t stmlfs_tell(lfs_file_t *file);
-int stmlfs_stat(const char* path, struct lfs_info* info);
-int stmlfs_fsstat(struct littlfs_fsstat_t* stat);
-lfs_ssize_t stmlfs_getattr(const char* path, uint8_t type, void* buffer, lfs_size_t size);
-int stmlfs_setattr(const char* path, uint8_t type, const void* buffer, lfs_size_t size);
-int stmlfs_removeattr(const char* path, uint8_t type);
-int stmlfs_opencfg(lfs_file_t *file, const char* path, int flags, const struct lfs_file_config* config);
-lfs_soff_t stmlfs_size(lfs_file_t *file);
-int stmlfs_mkdir(const char* path);
+void W25Q_Init(W25Q_t *chip, SPI_HandleTypeDef *spi, GPIO_TypeDef *cs_port, uint16_t cs_pin, uint32_t size);
+#ifdef FS_READAHEAD
+void W25Q_SPI_RxCplt(SPI_HandleTypeDef *hspi);
+#endif
+int stmlfs_init(stmlfs_t *fs, W25Q_t *chip, lfs_block_t first, lfs_block_t count);
+void stmlfs_volume(stmlfs_t *fs, uint8_t vol);
+int stmlfs_init_striped(stmlfs_t *fs, W25Q_t *chip, W25Q_t *stripe, lfs_block_t first, lfs_block_t count);
+int stmlfs_init_mirrored(stmlfs_t *fs, W25Q_t *chip, W25Q_t *mirror, lfs_block_t first, lfs_block_t count);
+int stmlfs_part_check(W25Q_t *chip, const struct stmlfs_part *table, int count);
+const struct stmlfs_part *stmlfs_part_find(const struct stmlfs_part *table, int count, const char *name);
+int stmlfs_init_part(stmlfs_t *fs, W25Q_t *chip, const struct stmlfs_part *part);
+int stmlfs_raw_read(W25Q_t *chip, const struct stmlfs_part *part, uint32_t off, void *buffer, uint32_t size);
+int stmlfs_raw_prog(W25Q_t *chip, const struct stmlfs_part *part, uint32_t off, const void *buffer, uint32_t size);
+int stmlfs_raw_erase(W25Q_t *chip, const struct stmlfs_part *part, uint32_t off, uint32_t size);
+int stmlfs_mount(stmlfs_t *fs, bool format);
+int stmlfs_file_open(stmlfs_t *fs, lfs_file_t *file, const char *path, int flags);
+int stmlfs_file_read(stmlfs_t *fs, lfs_file_t *file,void *buffer, lfs_size_t size);
+lfs_ssize_t stmlfs_file_readv(stmlfs_t *fs, lfs_file_t *file, const struct lfs_iovec *iov, lfs_size_t iovcnt);
+int stmlfs_file_rewind(stmlfs_t *fs, lfs_file_t *file);
+lfs_ssize_t stmlfs_file_write(stmlfs_t *fs, lfs_file_t *file,const void *buffer, lfs_size_t size);
+lfs_ssize_t stmlfs_file_writev(stmlfs_t *fs, lfs_file_t *file, const struct lfs_iovec *iov, lfs_size_t iovcnt);
+int stmlfs_file_close(stmlfs_t *fs, lfs_file_t *file);
+int stmlfs_unmount(stmlfs_t *fs);
+int stmlfs_checkpoint(stmlfs_t *fs);
+int stmlfs_remove(stmlfs_t *fs, const char* path);
+int stmlfs_rename(stmlfs_t *fs, const char* oldpath, const char* newpath);
+int stmlfs_remove_recursive(stmlfs_t *fs, const char* path);
+int stmlfs_rename_batch(stmlfs_t *fs, const char* const* oldpaths, const char* const* newpaths, lfs_size_t count);
+int stmlfs_fflush(stmlfs_t *fs, lfs_file_t *file);
+lfs_dir_t* stmlfs_dir_open(stmlfs_t *fs, const char* path);
+int stmlfs_dir_close(stmlfs_t *fs, lfs_dir_t* dir);
+int stmlfs_dir_read(stmlfs_t *fs, lfs_dir_t* dir, struct lfs_info* info);
+int stmlfs_dir_seek(stmlfs_t *fs, lfs_dir_t* dir, lfs_off_t off);
+lfs_soff_t stmlfs_dir_tell(stmlfs_t *fs, lfs_dir_t* dir);
+int stmlfs_dir_rewind(stmlfs_t *fs, lfs_dir_t* dir);
+lfs_soff_t stmlfs_lseek(stmlfs_t *fs, lfs_file_t *file, lfs_soff_t off, int whence);
+int stmlfs_truncate(stmlfs_t *fs, lfs_file_t *file, lfs_off_t size);
+lfs_ssize_t stmlfs_reserve(stmlfs_t *fs, lfs_file_t *file, lfs_size_t size);
+lfs_soff_t stmlfs_tell(stmlfs_t *fs, lfs_file_t *file);
+int stmlfs_stat(stmlfs_t *fs, const char* path, struct lfs_info* info);
+int stmlfs_async_read(stmlfs_t *fs, lfs_async_req_t *req, lfs_file_t *file, void *buffer, lfs_size_t size, void (*cb)(lfs_async_req_t *req), void *data);
+int stmlfs_async_write(stmlfs_t *fs, lfs_async_req_t *req, lfs_file_t *file, const void *buffer, lfs_size_t size, void (*cb)(lfs_async_req_t *req), void *data);
+int stmlfs_async_fflush(stmlfs_t *fs, lfs_async_req_t *req, lfs_file_t *file, void (*cb)(lfs_async_req_t *req), void *data);
+int stmlfs_async_close(stmlfs_t *fs, lfs_async_req_t *req, lfs_file_t *file, void (*cb)(lfs_async_req_t *req), void *data);
+bool stmlfs_async_done(stmlfs_t *fs, const lfs_async_req_t *req);
+int stmlfs_async_work(stmlfs_t *fs, uint32_t budget_ms);
+int stmlfs_gc(stmlfs_t *fs, uint32_t budget_ms);
+int stmlfs_preerase(stmlfs_t *fs, uint32_t budget_ms);
+int stmlfs_fsstat(stmlfs_t *fs, struct littlfs_fsstat_t* stat);
+int stmlfs_erasestat(stmlfs_t *fs, struct littlfs_erasestat_t* stat);
+uint32_t stmlfs_progbytes(stmlfs_t *fs);
+void stmlfs_readahead(stmlfs_t *fs, bool enable);
+int stmlfs_readaheadstat(stmlfs_t *fs, struct littlfs_readahead_t* stat);
+void stmlfs_sched(stmlfs_t *fs, bool enable);
+int stmlfs_sched_work(stmlfs_t *fs, uint32_t budget_ms);
+int stmlfs_schedstat(stmlfs_t *fs, struct littlfs_sched_t* stat);
+int stmlfs_mirrorstat(stmlfs_t *fs, struct littlfs_mirror_t* stat);
+int stmlfs_mirror_verify(stmlfs_t *fs);
+int stmlfs_mirror_rebuild(stmlfs_t *fs, W25Q_t *from);
+int stmlfs_stats(stmlfs_t *fs, struct littlfs_stats_t* stat, bool reset);
+void stmlfs_trace_start(void);
+void stmlfs_trace_stop(void);
+void stmlfs_trace_dump(void);
+void stmlfs_record(stmlfs_t *fs, bool enable);
+int stmlfs_latency(stmlfs_t *fs, uint8_t op, struct littlfs_latency_t* stat, bool reset);
+void stmlfs_latency_dump(stmlfs_t *fs);
+lfs_ssize_t stmlfs_getattr(stmlfs_t *fs, const char* path, uint8_t type, void* buffer, lfs_size_t size);
+int stmlfs_setattr(stmlfs_t *fs, const char* path, uint8_t type, const void* buffer, lfs_size_t size);
+int stmlfs_removeattr(stmlfs_t *fs, const char* path, uint8_t type);
+int stmlfs_opencfg(stmlfs_t *fs, lfs_file_t *file, const char* path, int flags, const struct lfs_file_config* config);
+lfs_soff_t stmlfs_size(stmlfs_t *fs, lfs_file_t *file);
+int stmlfs_mkdir(stmlfs_t *fs, const char* path);
+int stmlfs_ring_open(stmlfs_t *fs, lfs_ring_t *ring, const char* path, const struct lfs_ring_config* cfg);
 const char* stmlfs_errmsg(int err);
-void dump_dir(void);
+void dump_dir(stmlfs_t *fs);
 
 
 int stmlfs_hal_read(const struct lfs_config *c, lfs_block_t block, lfs_off_t off, void* buffer, lfs_size_t size);
+int stmlfs_hal_readspan(const struct lfs_config *c, lfs_block_t block, lfs_off_t off, void* buffer, lfs_size_t size);
 int stmlfs_hal_prog(const struct lfs_config *c, lfs_block_t block, lfs_off_t off, const void* buffer, lfs_size_t size);
 int stmlfs_hal_erase(const struct lfs_config *c, lfs_block_t sector);
 int stmlfs_hal_sync(const struct lfs_config *c);
+bool stmlfs_is_erased(stmlfs_t *fs, lfs_block_t block);
 
 
-void W25Q_Reset (void);
-uint32_t W25Q_ReadID (void);
-uint64_t W25Q_ReadUniqueID(void);
-void W25Q_ReadSFDP(uint8_t *rData);
-uint8_t W25Q_ReadStatus(int reg);
-void W25Q_WriteStatus(int reg, uint8_t status);
-void W25Q_Read(uint32_t block, uint16_t offset, uint32_t size, uint8_t *rData);
-void W25Q_FastRead(uint32_t block, uint16_t offset, uint32_t size, uint8_t *rData);
-void W25Q_Write_block(uint32_t block, uint16_t offset, uint32_t size, const uint8_t *data);
-void W25Q_Erase_Chip(void);
-void W25Q_Erase_Sector(uint16_t numsector);
-void write_enable(void);
-void write_disable(void);
+void W25Q_Reset(W25Q_t *chip);
+uint32_t W25Q_ReadID(W25Q_t *chip);
+uint64_t W25Q_ReadUniqueID(W25Q_t *chip);
+void W25Q_ReadSFDP(W25Q_t *chip, uint8_t *rData);
+uint8_t W25Q_ReadStatus(W25Q_t *chip, int reg);
+void W25Q_WriteStatus(W25Q_t *chip, int reg, uint8_t status);
+void W25Q_Read(W25Q_t *chip, uint32_t block, uint16_t offset, uint32_t size, uint8_t *rData);
+void W25Q_FastRead(W25Q_t *chip, uint32_t block, uint16_t offset, uint32_t size, uint8_t *rData);
+void W25Q_Write_block(W25Q_t *chip, uint32_t block, uint16_t offset, uint32_t size, const uint8_t *data);
+void W25Q_Erase_Chip(W25Q_t *chip);
+void W25Q_Erase_Sector(W25Q_t *chip, uint16_t numsector);
+void W25Q_Erase_Start(W25Q_t *chip, uint16_t numsector);
+bool W25Q_Busy(W25Q_t *chip);
+void W25Q_Wait(W25Q_t *chip);
+void write_enable(W25Q_t *chip);
+void write_disable(W25Q_t *chip);
 void delay_us(uint16_t us);
 
 #endif /* INC_W25QXX_H_ */
@@ -65,6 +65,20 @@ typedef uint32_t lfs_block_t;
 #define LFS_ATTR_MAX 1022
 #endif
 
+// Maximum number of entries lfs_remove_recursive and lfs_rename_batch
+// coalesce into a single metadata commit. Costs a few bytes of stack per
+// entry, not stored on disk.
+#ifndef LFS_BATCH_MAX
+#define LFS_BATCH_MAX 16
+#endif
+
+// Type of the root user attribute that holds the mount checkpoint, see
+// lfs_fs_checkpoint. Not available to the application, lfs_setattr and
+// lfs_removeattr return LFS_ERR_INVAL for it on the root.
+#ifndef LFS_CHECKPOINT_ATTR
+#define LFS_CHECKPOINT_ATTR 0xfc
+#endif
+
 // Possible error codes, these are negative to allow
 // valid positive return values
 enum lfs_error {
@@ -131,6 +145,7 @@ enum lfs_open_flags {
     LFS_O_EXCL   = 0x0200,    // Fail if a file already exists
     LFS_O_TRUNC  = 0x0400,    // Truncate the existing file to zero size
     LFS_O_APPEND = 0x0800,    // Move to end of file on every write
+    LFS_O_LOGAPPEND = 0x1000, // Keep appending in the last block (NOR only)
 #endif
 
     // internally used flags
@@ -180,6 +195,13 @@ struct lfs_config {
     // are propagated to the user.
     int (*sync)(const struct lfs_config *c);
 
+    // Read a region that starts in a block and may continue into the blocks
+    // that follow it, as if the device were one contiguous array. Optional,
+    // used to read physically consecutive blocks of a file in one go.
+    // Negative error codes are propagated to the user.
+    int (*read_span)(const struct lfs_config *c, lfs_block_t block,
+            lfs_off_t off, void *buffer, lfs_size_t size);
+
 #ifdef LFS_THREADSAFE
     // Lock the underlying block device. Negative error codes
     // are propagated to the user.
@@ -326,6 +348,40 @@ struct lfs_fsinfo {
 
     // Upper limit on the size of custom attributes in bytes.
     lfs_size_t attr_max;
+
+    // Number of metadata pair compactions since mount.
+    uint32_t compactions;
+};
+
+// Filesystem work counters, zeroed by lfs_mount
+struct lfs_fsstats {
+    // Reads served from the read cache and the program cache, and reads
+    // that had to go to the block device.
+    uint32_t rcache_hits;
+    uint32_t pcache_hits;
+    uint32_t cache_misses;
+
+    // Metadata commits, compactions included.
+    uint32_t commits;
+
+    // Metadata pairs rewritten into a freshly erased block.
+    uint32_t compactions;
+
+    // Metadata or data blocks moved to a new block because they were bad
+    // or had reached block_cycles.
+    uint32_t relocations;
+
+    // Of those, metadata pairs moved because their revision count reached
+    // block_cycles, the wear leveling itself.
+    uint32_t wear_relocations;
+
+    // Filesystem traversals to refill the lookahead buffer.
+    uint32_t lookahead_scans;
+
+    // Bytes programmed and blocks erased for metadata pairs, inline files
+    // included. Everything else the block device saw was file data.
+    uint32_t meta_prog_bytes;
+    uint32_t meta_erases;
 };
 
 // Custom attribute structure, used to describe custom attributes
@@ -342,6 +398,15 @@ struct lfs_attr {
     lfs_size_t size;
 };
 
+// Buffer descriptor for vectored reads and writes
+struct lfs_iovec {
+    // Pointer to the buffer
+    void *buffer;
+
+    // Size of the buffer in bytes
+    lfs_size_t size;
+};
+
 // Optional configuration provided during lfs_file_opencfg
 struct lfs_file_config {
     // Optional statically allocated file buffer. Must be cache_size.
@@ -414,6 +479,11 @@ typedef struct lfs_file {
     lfs_off_t off;
     lfs_cache_t cache;
 
+    struct lfs_reserve {
+        lfs_block_t block;
+        lfs_size_t count;
+    } reserve;
+
     const struct lfs_file_config *cfg;
 } lfs_file_t;
 
@@ -431,6 +501,28 @@ typedef struct lfs_gstate {
     lfs_block_t pair[2];
 } lfs_gstate_t;
 
+// littlefs incremental traversal type, see lfs_fs_traversestep
+typedef struct lfs_traverse {
+    uint32_t gen;
+    uint8_t state;
+    bool orphans;
+    uint16_t id;
+    lfs_mdir_t m;
+    lfs_block_t tortoise[2];
+    lfs_size_t tortoise_i;
+    lfs_size_t tortoise_period;
+    lfs_file_t *file;
+    lfs_block_t head;
+    lfs_off_t index;
+} lfs_traverse_t;
+
+// Incremental traversal results
+enum lfs_traverse_result {
+    LFS_TRAVERSE_DONE      = 0, // Traversal has completed
+    LFS_TRAVERSE_MORE      = 1, // There are blocks left to traverse
+    LFS_TRAVERSE_RESTARTED = 2, // Filesystem changed, traversal started over
+};
+
 // The littlefs filesystem type
 typedef struct lfs {
     lfs_cache_t rcache;
@@ -457,6 +549,29 @@ typedef struct lfs {
         uint8_t *buffer;
     } lookahead;
 
+    struct lfs_prescan {
+        lfs_block_t start;
+        lfs_block_t size;
+        uint8_t *buffer;
+        lfs_traverse_t trav;
+    } prescan;
+
+    struct lfs_usage {
+        lfs_block_t used;
+        lfs_block_t seen;
+        lfs_traverse_t trav;
+    } usage;
+
+    struct lfs_reserved {
+        lfs_block_t start;
+        lfs_block_t end;
+    } reserved;
+
+    lfs_block_t gctail[2];
+    uint32_t gen;
+    uint8_t mountck;
+    struct lfs_fsstats stats;
+
     const struct lfs_config *cfg;
     lfs_size_t block_count;
     lfs_size_t name_max;
@@ -519,6 +634,31 @@ int lfs_remove(lfs_t *lfs, const char *path);
 int lfs_rename(lfs_t *lfs, const char *oldpath, const char *newpath);
 #endif
 
+#ifndef LFS_READONLY
+// Removes a file or directory and everything below it
+//
+// Files are removed in batches of up to LFS_BATCH_MAX per metadata commit.
+// Removing the root directory removes its contents, the root itself stays.
+// If interrupted, entries removed so far stay removed.
+//
+// Returns a negative error code on failure.
+int lfs_remove_recursive(lfs_t *lfs, const char *path);
+#endif
+
+#ifndef LFS_READONLY
+// Rename or move a number of files or directories
+//
+// Behaves as if lfs_rename was called for oldpaths[i] and newpaths[i] in
+// order. Consecutive renames that stay within one metadata pair and don't
+// replace an existing entry are coalesced into a single commit of up to
+// LFS_BATCH_MAX entries, the rest fall back to lfs_rename.
+//
+// Returns a negative error code on failure. Renames before the failing
+// entry may have been applied.
+int lfs_rename_batch(lfs_t *lfs, const char *const *oldpaths,
+        const char *const *newpaths, lfs_size_t count);
+#endif
+
 // Find info about a file or directory
 //
 // Fills out the info structure, based on the specified file or directory.
@@ -587,6 +727,12 @@ int lfs_file_open(lfs_t *lfs, lfs_file_t *file,
 // above. The config struct must remain allocated while the file is open, and
 // the config struct must be zeroed for defaults and backwards compatibility.
 //
+// With LFS_O_LOGAPPEND, the first write at the end of the file after opening
+// or syncing continues in the partially filled last block instead of copying
+// it to a new block, as long as the rest of that block still reads as erased.
+// This relies on the block device allowing a prog unit to be programmed again
+// with the same data, which holds for NOR flash erasing to 0xff.
+//
 // Returns a negative error code on failure.
 int lfs_file_opencfg(lfs_t *lfs, lfs_file_t *file,
         const char *path, int flags,
@@ -613,6 +759,15 @@ int lfs_file_sync(lfs_t *lfs, lfs_file_t *file);
 lfs_ssize_t lfs_file_read(lfs_t *lfs, lfs_file_t *file,
         void *buffer, lfs_size_t size);
 
+// Read data from file into several buffers
+//
+// Fills the iovcnt buffers in iov one after the other, as a single
+// lfs_file_read into their concatenation would.
+//
+// Returns the number of bytes read, or a negative error code on failure.
+lfs_ssize_t lfs_file_readv(lfs_t *lfs, lfs_file_t *file,
+        const struct lfs_iovec *iov, lfs_size_t iovcnt);
+
 #ifndef LFS_READONLY
 // Write data to file
 //
@@ -622,6 +777,16 @@ lfs_ssize_t lfs_file_read(lfs_t *lfs, lfs_file_t *file,
 // Returns the number of bytes written, or a negative error code on failure.
 lfs_ssize_t lfs_file_write(lfs_t *lfs, lfs_file_t *file,
         const void *buffer, lfs_size_t size);
+
+// Write data to file from several buffers
+//
+// Writes the iovcnt buffers in iov one after the other, as a single
+// lfs_file_write of their concatenation would. Useful for records that
+// are assembled from a header, payload and trailer in separate buffers.
+//
+// Returns the number of bytes written, or a negative error code on failure.
+lfs_ssize_t lfs_file_writev(lfs_t *lfs, lfs_file_t *file,
+        const struct lfs_iovec *iov, lfs_size_t iovcnt);
 #endif
 
 // Change the position of the file
@@ -638,6 +803,26 @@ lfs_soff_t lfs_file_seek(lfs_t *lfs, lfs_file_t *file,
 int lfs_file_truncate(lfs_t *lfs, lfs_file_t *file, lfs_off_t size);
 #endif
 
+#ifndef LFS_READONLY
+// Reserve blocks for appending size bytes to the file
+//
+// Looks for a physically contiguous run of free blocks, starting where the
+// block allocator currently is, and sets it aside for this file. Writes at
+// the end of the file take their blocks from the reservation in order, so
+// they don't wait for the block allocator and the file ends up contiguous
+// on the device. If no run is long enough, the longest one is reserved and
+// writes beyond it allocate blocks as usual.
+//
+// The reservation only exists in RAM and is released when the file is
+// closed, calling this again replaces it. This traverses the filesystem
+// once per 8*cache_size blocks of the device. An inline file is first moved
+// out to a block of its own, taken from the block allocator as usual.
+//
+// Returns the number of blocks reserved, or a negative error code on
+// failure.
+lfs_ssize_t lfs_file_reserve(lfs_t *lfs, lfs_file_t *file, lfs_size_t size);
+#endif
+
 // Return the position of the file
 //
 // Equivalent to lfs_file_seek(lfs, file, 0, LFS_SEEK_CUR)
@@ -720,9 +905,22 @@ int lfs_fs_stat(lfs_t *lfs, struct lfs_fsinfo *fsinfo);
 // Note: Result is best effort. If files share COW structures, the returned
 // size may be larger than the filesystem actually is.
 //
+// The count is kept up to date as the filesystem changes, so only the first
+// call after mounting needs to traverse the filesystem, and lfs_fs_gcstep
+// does that ahead of time. Blocks written by open files are counted once the
+// file is synced.
+//
 // Returns the number of allocated blocks, or a negative error code on failure.
 lfs_ssize_t lfs_fs_size(lfs_t *lfs);
 
+// Get the work counters
+//
+// Copies the counters into stats, then zeroes them if reset is set. Never
+// touches the block device.
+//
+// Returns a negative error code on failure.
+int lfs_fs_stats(lfs_t *lfs, struct lfs_fsstats *stats, bool reset);
+
 // Traverse through all blocks in use by the filesystem
 //
 // The provided callback will be called with each block address that is
@@ -732,6 +930,33 @@ lfs_ssize_t lfs_fs_size(lfs_t *lfs);
 // Returns a negative error code on failure.
 int lfs_fs_traverse(lfs_t *lfs, int (*cb)(void*, lfs_block_t), void *data);
 
+// Start an incremental traversal of the blocks in use by the filesystem
+//
+// Initializes the traversal state for lfs_fs_traversestep. The state is
+// owned by the caller and needs no cleanup.
+//
+// Returns a negative error code on failure.
+int lfs_fs_traversestart(lfs_t *lfs, lfs_traverse_t *trav);
+
+// Continue an incremental traversal
+//
+// Calls the provided callback for roughly count more blocks in use by the
+// filesystem, stopping early at the end of the traversal. This allows the
+// work of lfs_fs_traverse to be spread over several calls, for example from
+// an idle loop.
+//
+// The blocks reported only form a consistent picture if the filesystem is
+// not modified while the traversal is in progress. If a block was allocated
+// or metadata was committed since the previous step, the traversal starts
+// over without calling the callback and LFS_TRAVERSE_RESTARTED is returned,
+// callers that accumulate results should discard them.
+//
+// Returns LFS_TRAVERSE_MORE if there are blocks left, LFS_TRAVERSE_DONE once
+// the traversal has completed, LFS_TRAVERSE_RESTARTED, or a negative error
+// code on failure.
+int lfs_fs_traversestep(lfs_t *lfs, lfs_traverse_t *trav,
+        int (*cb)(void*, lfs_block_t), void *data, lfs_size_t count);
+
 #ifndef LFS_READONLY
 // Attempt to make the filesystem consistent and ready for writing
 //
@@ -744,6 +969,26 @@ int lfs_fs_traverse(lfs_t *lfs, int (*cb)(void*, lfs_block_t), void *data);
 int lfs_fs_mkconsistent(lfs_t *lfs);
 #endif
 
+#ifndef LFS_READONLY
+// Write a mount checkpoint
+//
+// Records the state lfs_mount otherwise has to collect from every metadata
+// pair, so the next mount only needs to read the superblock and the root
+// directory. Intended to be called before lfs_unmount, or periodically when
+// the filesystem is idle. The checkpoint is removed again before the next
+// change to the filesystem, so it can only be used while it is up to date,
+// and calling this again without changes in between does nothing.
+//
+// The checkpoint is stored as the root user attribute LFS_CHECKPOINT_ATTR,
+// with a generation number that must match one appended to the superblock
+// entry. Firmware that rewrites the superblock without knowing about
+// checkpoints invalidates it that way, but other changes by such firmware
+// are not detected, so it must not write to a filesystem that has one.
+//
+// Returns a negative error code on failure.
+int lfs_fs_checkpoint(lfs_t *lfs);
+#endif
+
 #ifndef LFS_READONLY
 // Attempt any janitorial work
 //
@@ -762,6 +1007,35 @@ int lfs_fs_mkconsistent(lfs_t *lfs);
 int lfs_fs_gc(lfs_t *lfs);
 #endif
 
+#ifndef LFS_READONLY
+// Attempt a bounded amount of janitorial work
+//
+// Does the same work as lfs_fs_gc, but at most one metadata pair is
+// compacted per call. Once all metadata pairs have been visited, the next
+// lookahead window of the block allocator is scanned a few blocks per call,
+// so the allocator can move on without traversing the filesystem. The
+// position is kept in the filesystem, so repeated calls, for example from an
+// idle loop, work through the whole filesystem and wrap around.
+//
+// Returns true (1) if there is more work in the current pass, false (0)
+// once a full pass has completed, or a negative error code on failure.
+int lfs_fs_gcstep(lfs_t *lfs);
+#endif
+
+#ifndef LFS_READONLY
+// Report the blocks the block allocator will hand out next
+//
+// Fills blocks with up to count free blocks, in the order lfs_alloc will
+// use them. Only the current lookahead window is considered, so fewer
+// blocks may be returned even if the filesystem has more free space;
+// lfs_fs_gcstep moves on to the next window. The blocks stay free until the
+// next write to the filesystem, which makes this useful for erasing blocks
+// ahead of time in the block device.
+//
+// Returns the number of blocks found, or a negative error code on failure.
+lfs_ssize_t lfs_fs_nextfree(lfs_t *lfs, lfs_block_t *blocks, lfs_size_t count);
+#endif
+
 #ifndef LFS_READONLY
 // Grows the filesystem to a new size, updating the superblock with the new
 // block count.
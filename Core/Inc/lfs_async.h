@@ -0,0 +1,174 @@
+/*
+ * Asynchronous request queue for the little filesystem
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#ifndef LFS_ASYNC_H
+#define LFS_ASYNC_H
+
+#include "lfs.h"
+
+#ifdef LFS_ASYNC_PTHREAD
+#include <pthread.h>
+#endif
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+
+/// Definitions ///
+
+// Request operations
+enum lfs_async_op {
+    LFS_ASYNC_READ  = 0, // Read size bytes into buffer
+    LFS_ASYNC_WRITE = 1, // Write size bytes from buffer
+    LFS_ASYNC_SYNC  = 2, // Sync the file
+    LFS_ASYNC_CLOSE = 3, // Close the file
+};
+
+// Request states
+enum lfs_async_state {
+    LFS_ASYNC_IDLE   = 0, // Never submitted
+    LFS_ASYNC_QUEUED = 1, // Waiting for the worker
+    LFS_ASYNC_BUSY   = 2, // Being run by the worker
+    LFS_ASYNC_DONE   = 3, // Finished, result is valid
+};
+
+// Queue configuration
+struct lfs_async_config {
+    // Opaque user provided context that can be used to pass
+    // information to the callbacks
+    void *context;
+
+    // Protect the queue against submitters and the worker running
+    // concurrently, for example by masking interrupts or taking a mutex.
+    // Held only for a few instructions, never across a filesystem call.
+    void (*lock)(const struct lfs_async_config *c);
+    void (*unlock)(const struct lfs_async_config *c);
+
+    // Optional, called after a request is queued, for example to wake a
+    // sleeping worker thread. May be NULL.
+    void (*notify)(const struct lfs_async_config *c);
+};
+
+// Request type, owned by the caller and linked into the queue while
+// pending. Must be zero initialized before its first use. The request, its
+// file and its buffer must stay valid until the request is done.
+typedef struct lfs_async_req {
+    struct lfs_async_req *next;
+    uint8_t op;
+    volatile uint8_t state;
+    lfs_file_t *file;
+    void *buffer;
+    lfs_size_t size;
+    volatile lfs_ssize_t result;
+
+    // Optional completion callback, called by the worker once the request
+    // is done. It may submit the request again. May be NULL.
+    void (*cb)(struct lfs_async_req *req);
+
+    // Opaque user provided context for the completion callback
+    void *data;
+} lfs_async_req_t;
+
+// Queue type
+typedef struct lfs_async {
+    lfs_t *lfs;
+    const struct lfs_async_config *cfg;
+    lfs_async_req_t *head;
+    lfs_async_req_t *tail;
+} lfs_async_t;
+
+
+/// Queue operations ///
+
+// Initialize an empty request queue for the filesystem lfs
+void lfs_async_init(lfs_async_t *queue, lfs_t *lfs,
+        const struct lfs_async_config *cfg);
+
+// Queue a request to read size bytes from file into buffer
+//
+// Never blocks on the filesystem, safe to call from an interrupt if the
+// lock callbacks are. The result is the return value of lfs_file_read.
+//
+// Returns LFS_ERR_INVAL if the request is still pending.
+int lfs_async_read(lfs_async_t *queue, lfs_async_req_t *req,
+        lfs_file_t *file, void *buffer, lfs_size_t size,
+        void (*cb)(lfs_async_req_t *req), void *data);
+
+#ifndef LFS_READONLY
+// Queue a request to write size bytes from buffer to file
+//
+// The result is the return value of lfs_file_write.
+//
+// Returns LFS_ERR_INVAL if the request is still pending.
+int lfs_async_write(lfs_async_t *queue, lfs_async_req_t *req,
+        lfs_file_t *file, const void *buffer, lfs_size_t size,
+        void (*cb)(lfs_async_req_t *req), void *data);
+
+// Queue a request to sync file
+//
+// The result is the return value of lfs_file_sync.
+//
+// Returns LFS_ERR_INVAL if the request is still pending.
+int lfs_async_sync(lfs_async_t *queue, lfs_async_req_t *req,
+        lfs_file_t *file, void (*cb)(lfs_async_req_t *req), void *data);
+#endif
+
+// Queue a request to close file
+//
+// The result is the return value of lfs_file_close.
+//
+// Returns LFS_ERR_INVAL if the request is still pending.
+int lfs_async_close(lfs_async_t *queue, lfs_async_req_t *req,
+        lfs_file_t *file, void (*cb)(lfs_async_req_t *req), void *data);
+
+// Check if a request is done
+//
+// Once it is, req->result holds the result and the request can be reused.
+bool lfs_async_done(lfs_async_t *queue, const lfs_async_req_t *req);
+
+// Run the oldest queued request
+//
+// Called by the flash worker, a thread or task of its own or the idle
+// part of a main loop. Requests run in the order they were queued, one at
+// a time, and their completion callbacks are called from here. littlefs is
+// synchronous, so the worker is the one context that waits for the flash
+// while a request runs.
+//
+// Returns 1 if a request was run, 0 if the queue was empty.
+int lfs_async_work(lfs_async_t *queue);
+
+
+#ifdef LFS_ASYNC_PTHREAD
+/// Threaded host build ///
+
+// Queue lock for a threaded build on Linux. Use the callbacks below in the
+// queue configuration with its context pointing to one of these, set up
+// with PTHREAD_MUTEX_INITIALIZER and PTHREAD_COND_INITIALIZER or
+// pthread_mutex_init and pthread_cond_init.
+struct lfs_async_pthread {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+};
+
+void lfs_async_pthread_lock(const struct lfs_async_config *c);
+void lfs_async_pthread_unlock(const struct lfs_async_config *c);
+void lfs_async_pthread_notify(const struct lfs_async_config *c);
+
+// Put the worker thread to sleep while the queue is empty
+//
+// Returns once a request is queued or notify is called, which the caller
+// can also use to wake the worker for other reasons, such as shutting it
+// down.
+void lfs_async_pthread_wait(lfs_async_t *queue);
+#endif
+
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+
+#endif
@@ -0,0 +1,103 @@
+/*
+ * Benchmark suite for the little filesystem
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#ifndef LFS_BENCH_H
+#define LFS_BENCH_H
+
+#include "lfs.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+
+/// Definitions ///
+
+// Directory the benchmarks work in, removed again when they are done
+#ifndef LFS_BENCH_DIR
+#define LFS_BENCH_DIR "bench"
+#endif
+
+// Benchmark configuration
+struct lfs_bench_config {
+    // Opaque user provided context that can be used to pass
+    // information to the callbacks
+    void *context;
+
+    // Time in microseconds since an arbitrary start. Real time on a
+    // target, simulated flash time on a host.
+    uint32_t (*clock_us)(const struct lfs_bench_config *c);
+
+    // Bytes programmed to the flash since an arbitrary start, used for the
+    // write amplification. May be NULL.
+    uint32_t (*prog_bytes)(const struct lfs_bench_config *c);
+
+    // Called after every read of the sequential read benchmark with the
+    // bytes read, to spend the time the application would take to process
+    // them. May be NULL.
+    void (*process)(const struct lfs_bench_config *c, lfs_size_t size);
+
+    // Called by the mixed trace benchmark to wait us microseconds for its
+    // next request, time the port can give to its background work. May be
+    // NULL, the requests then follow each other without a pause.
+    void (*idle)(const struct lfs_bench_config *c, uint32_t us);
+
+    // Run only the benchmarks whose name starts with this, NULL runs all.
+    const char *only;
+
+    // Size of the file written and read by the sequential and random
+    // benchmarks, 0 for 256 KiB.
+    lfs_size_t seq_size;
+
+    // Bytes the fill benchmark writes at most, 0 fills the filesystem.
+    // Aging only runs when this is 0.
+    lfs_size_t fill_size;
+
+    // Seed of the random sizes, offsets and orders, the same seed runs the
+    // same workload.
+    uint32_t seed;
+};
+
+// Result of one benchmark, also printed as a line of JSON
+struct lfs_bench_result {
+    const char *name;
+    lfs_size_t param;       // I/O size, file size or aging round, 0 if none
+    uint32_t ops;           // Filesystem calls timed
+    uint32_t bytes;         // Bytes read or written by the application
+    uint32_t us;            // Time taken
+    uint32_t prog_bytes;    // Bytes programmed to the flash meanwhile
+    uint32_t p50_us;        // Median and 99th percentile of the operations
+    uint32_t p99_us;
+    uint32_t max_us;        // Slowest operation
+};
+
+
+/// Benchmark operations ///
+
+#ifndef LFS_READONLY
+// Run the benchmark suite on a mounted filesystem
+//
+// Sequential write and read at several I/O sizes, random reads, small file
+// churn, deep directories, append logging with and without
+// LFS_O_LOGAPPEND, appending to and reading back a ring log, lookups mixed
+// with a logger, filling the filesystem and rewriting it while aged.
+// Every result is printed as a line of JSON starting with {"bench": for
+// scripts to pick out of the output, together with the operations and MB
+// per second, the write amplification and the latency percentiles of the
+// single operations. Everything the benchmarks create is removed again,
+// which needs the filesystem to hold no more than a few files beforehand
+// for the fill and aging results to mean anything.
+//
+// Returns the number of benchmarks run, or a negative error code on failure.
+int lfs_bench_run(lfs_t *lfs, const struct lfs_bench_config *cfg);
+#endif
+
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+
+#endif
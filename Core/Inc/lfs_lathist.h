@@ -0,0 +1,57 @@
+/*
+ * Latency histogram for the little filesystem
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#ifndef LFS_LATHIST_H
+#define LFS_LATHIST_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+
+/// Definitions ///
+
+// Bucket 0 counts calls under 1us, bucket n calls from 2^(n-1) to 2^n us,
+// the last one is open ended
+#ifndef LFS_LATHIST_BUCKETS
+#define LFS_LATHIST_BUCKETS 24
+#endif
+
+// Latencies of one kind of call. Times are kept in ticks of whatever clock
+// the caller times with, a cycle counter on a target or simulated time on a
+// host, and only converted to microseconds for the buckets.
+struct lfs_lathist {
+    uint32_t count;
+    uint32_t min;
+    uint32_t max;
+    uint64_t total;
+    uint32_t bucket[LFS_LATHIST_BUCKETS];
+};
+
+
+/// Histogram operations ///
+
+// Count a call that took ticks, with tick_us ticks to the microsecond
+void lfs_lathist_add(struct lfs_lathist *h, uint32_t ticks, uint32_t tick_us);
+
+// Estimate a percentile in microseconds, permille 500 for the median
+//
+// The estimate is interpolated within the bucket the percentile falls in,
+// good to a few percent where bucket widths are small against the spread,
+// and never outside the minimum and maximum, which are exact.
+//
+// Returns 0 if no calls were counted.
+uint32_t lfs_lathist_pct(const struct lfs_lathist *h,
+        uint32_t permille, uint32_t tick_us);
+
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+
+#endif
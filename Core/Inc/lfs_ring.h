@@ -0,0 +1,126 @@
+/*
+ * Fixed-size ring log on top of the little filesystem
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#ifndef LFS_RING_H
+#define LFS_RING_H
+
+#include "lfs.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+
+/// Definitions ///
+
+// Maximum length of the ring's directory path, the segment files are named
+// <path>/0 to <path>/<segments-1>
+#ifndef LFS_RING_PATH_MAX
+#define LFS_RING_PATH_MAX 32
+#endif
+
+// User attribute type holding the ring state, on the ring directory and on
+// each segment file
+#ifndef LFS_RING_ATTR
+#define LFS_RING_ATTR 0xfb
+#endif
+
+// Geometry of a ring log, must be the same every time the ring is opened
+struct lfs_ring_config {
+    // Size of a record in bytes, every append writes exactly one record.
+    lfs_size_t record_size;
+
+    // Number of records per segment file. Segments are rotated as a whole,
+    // so this is also the granularity in which old records are dropped.
+    lfs_size_t segment_records;
+
+    // Number of segment files, at least 2. The ring keeps between
+    // (segments-1)*segment_records and segments*segment_records records.
+    lfs_size_t segments;
+};
+
+// Ring log type
+typedef struct lfs_ring {
+    lfs_t *lfs;
+    struct lfs_ring_config cfg;
+    lfs_file_t file;
+    struct lfs_file_config filecfg;
+    struct lfs_attr attr;
+    uint32_t segbase;
+    uint32_t base;
+    uint32_t head;
+    uint32_t full;
+    uint32_t next;
+    bool open;
+    char path[LFS_RING_PATH_MAX];
+} lfs_ring_t;
+
+
+/// Ring log operations ///
+
+#ifndef LFS_READONLY
+// Open a ring log, creating it if it does not exist
+//
+// The ring lives in its own directory at path. Records are numbered with a
+// 32-bit sequence number starting at 0 when the ring is created, which wraps
+// around to 0 after 2^32 records. Compare sequence numbers by their
+// difference rather than by value, as lfs_ring_read does. Opening
+// recovers the head of the ring from the state attributes and the size of
+// the newest segment file, it does not read any records.
+//
+// Returns LFS_ERR_INVAL if the ring exists with a different geometry, or a
+// negative error code on failure.
+int lfs_ring_open(lfs_t *lfs, lfs_ring_t *ring,
+        const char *path, const struct lfs_ring_config *cfg);
+
+// Close a ring log
+//
+// Any pending records are written out to storage as though lfs_ring_sync
+// had been called.
+//
+// Returns a negative error code on failure.
+int lfs_ring_close(lfs_ring_t *ring);
+
+// Append one record of cfg.record_size bytes
+//
+// Records are written to the newest segment file, which stays open. When it
+// is full, the oldest segment file is truncated and reused, which drops its
+// records from the ring. If reopening fails the error is returned and the
+// next append tries again. Appended records are only guaranteed to survive a
+// power loss after lfs_ring_sync.
+//
+// Returns a negative error code on failure.
+int lfs_ring_append(lfs_ring_t *ring, const void *record);
+
+// Write out any pending records
+//
+// Returns a negative error code on failure.
+int lfs_ring_sync(lfs_ring_t *ring);
+
+// Read up to count records starting at sequence number seq
+//
+// Any sequence number between lfs_ring_first and lfs_ring_next can be used
+// as a starting point, the position is computed and not searched for.
+//
+// Returns the number of records read, 0 at the head of the ring,
+// LFS_ERR_NOENT if seq has already been overwritten, or a negative error
+// code on failure.
+lfs_ssize_t lfs_ring_read(lfs_ring_t *ring, uint32_t seq,
+        void *buffer, lfs_size_t count);
+
+// Sequence number of the oldest record still in the ring
+uint32_t lfs_ring_first(const lfs_ring_t *ring);
+
+// Sequence number the next appended record will get
+uint32_t lfs_ring_next(const lfs_ring_t *ring);
+#endif
+
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+
+#endif
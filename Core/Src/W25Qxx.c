@@ -5,242 +5,1445 @@
  *      Author: hans6
  */
 
+#include <stdarg.h>
 #include "main.h"
 #include "W25Qxx.h"
 
 extern TIM_HandleTypeDef htim1;										// Not used for this demo
-extern SPI_HandleTypeDef hspi1;
 
-#define W25Q_SPI hspi1
-
-static lfs_t lfs;													// Littlefs
-
-
-const struct lfs_config stmconfig = {
+static W25Q_t *chips;												// Every chip set up by W25Q_Init
+static bool sector_is_erased(W25Q_t *chip, lfs_block_t block);
+static void chip_prog(W25Q_t *chip, lfs_block_t block, lfs_off_t off, const void* buffer, lfs_size_t size);
+static bool chip_erase(W25Q_t *chip, lfs_block_t block);
+static void flash_read(W25Q_t *chip, lfs_block_t block, lfs_off_t off, lfs_size_t size, uint8_t *buffer);
+static void mirror_read(stmlfs_t *fs, lfs_block_t block, lfs_off_t off, lfs_size_t size, uint8_t *buffer);
+static void map_programmed(W25Q_t *chip, uint32_t addr, uint32_t size);
+static void prog_wait(W25Q_t *chip);
+static void busy_count(W25Q_t *chip, uint32_t start);
+static int aqueue_mask;												// PRIMASK saved by aqueue_lock
+
+#ifdef FS_READAHEAD
+enum {RA_EMPTY, RA_BUSY, RA_READY};
+
+static void readahead_wait(W25Q_t *chip, bool stop);
+static lfs_size_t readahead_copy(W25Q_t *chip, uint32_t addr, uint8_t *buffer, lfs_size_t size);
+static void readahead_next(W25Q_t *chip, uint32_t addr, lfs_size_t size, lfs_size_t hit);
+static void readahead_drop(W25Q_t *chip, uint32_t addr, uint32_t size);
+static void readahead_fetch(W25Q_t *chip, uint32_t addr, uint32_t size);
+#endif
+
+#ifdef FS_SCHED_PAGES
+static void sched_prog(W25Q_t *chip, uint32_t addr, const uint8_t *data, lfs_size_t size);
+static void sched_patch(W25Q_t *chip, uint32_t addr, uint8_t *buffer, lfs_size_t size);
+static void sched_write(W25Q_t *chip);
+static void sched_flush(W25Q_t *chip);
+static void sched_drop(W25Q_t *chip, lfs_block_t block);
+static bool sched_erase_start(W25Q_t *chip, lfs_block_t block);
+static bool sched_erased(W25Q_t *chip);
+static int sched_work(W25Q_t *chip, uint32_t start, uint32_t budget_ms);
+#endif
+
+#ifdef FS_TRACE
+static void trace_add(stmlfs_t *fs, uint8_t op, lfs_block_t block, lfs_off_t off, lfs_size_t size, uint32_t start);
+#define TRACE_START()					uint32_t trace_start=DWT->CYCCNT
+#define TRACE_END(op,block,off,size)	trace_add(fs,op,block,off,size,trace_start)
+#else
+#define TRACE_START()
+#define TRACE_END(op,block,off,size)
+#endif
+
+#ifdef FS_RECORD
+#define RECORD_PATH						128								// Longest path record_tree follows
+static void record(stmlfs_t *fs, const char *path, const char *path2, const char *fmt, ...);
+static void record_tree(stmlfs_t *fs, char *path, size_t len);
+#define RECORD(...)						record(fs,__VA_ARGS__)
+#else
+#define RECORD(...)
+#endif
+
+#ifdef FS_LATENCY
+#define LATENCY_START()					uint32_t lat_start=DWT->CYCCNT
+#define LATENCY_END(op)					lfs_lathist_add(&fs->lat[op],DWT->CYCCNT-lat_start,SystemCoreClock/1000000)
+#else
+#define LATENCY_START()
+#define LATENCY_END(op)
+#endif
+
+
+static const struct lfs_config stmconfig = {
     // block device operations
     .read  = stmlfs_hal_read,
     .prog  = stmlfs_hal_prog,
     .erase = stmlfs_hal_erase,
     .sync  = stmlfs_hal_sync,
+    .read_span = stmlfs_hal_readspan,
 
     // block device configuration
     .read_size      = FS_PAGE_SIZE,
     .prog_size      = FS_PAGE_SIZE,
     .block_size     = FS_SECTOR_SIZE,
-    .block_count    = FS_SIZE/FS_SECTOR_SIZE,
     .cache_size     = FS_SECTOR_SIZE/4,
     .lookahead_size = 32,                                           // must be multiple of 8
-    .block_cycles   = 100,                                          // 100(better wear levelling)-1000(better performance)
+    .block_cycles   = 100,                                          // Metadata pair erases before it moves on, measure with lfsreplay -w and -Y
 };
 
-int save_and_disable_interrupts(void) {								// Not used
+int save_and_disable_interrupts(void) {
     uint32_t store_primask = __get_PRIMASK();
     __disable_irq();
     return store_primask;
 }
 
-void restore_interrupts(int mask) {									// Not used
+void restore_interrupts(int mask) {
     __set_PRIMASK(mask);
 }
 
-int stmlfs_hal_sync(const struct lfs_config *c)
+static void aqueue_lock(const struct lfs_async_config *c)			// Requests may be queued from interrupts
+{
+    UNUSED(*c);
+    aqueue_mask=save_and_disable_interrupts();
+}
+
+static void aqueue_unlock(const struct lfs_async_config *c)
 {
     UNUSED(*c);
+    restore_interrupts(aqueue_mask);
+}
+
+static const struct lfs_async_config aqueue_config = {
+    .lock   = aqueue_lock,
+    .unlock = aqueue_unlock,
+};
+
+//-------------------------------------------------------------------------------------------------
+// Chips and filesystems
+// A W25Q_t is one chip on its own chip select and holds all the driver state for it, chips on the
+// same SPI bus take turns. A stmlfs_t is a littlefs volume on a range of sectors of a chip, so a
+// chip can be split in partitions that are mounted side by side. littlefs hands the stmlfs_t back
+// to the stmlfs_hal_ callbacks through lfs_config.context.
+//-------------------------------------------------------------------------------------------------
+void W25Q_Init(W25Q_t *chip, SPI_HandleTypeDef *spi, GPIO_TypeDef *cs_port, uint16_t cs_pin, uint32_t size)
+{
+	assert(size<=FS_SIZE);											// FS_SIZE sizes the sector maps
+	assert(size<=16777216);											// Chip <= 16Mbyte, change R/W to 32bits address
+
+	for (W25Q_t **c=&chips; *c; c=&(*c)->next) {
+		if (*c==chip) {												// Set up again, take it out of the list first
+			*c=chip->next;
+			break;
+		}
+	}
+	memset(chip,0,sizeof(*chip));
+	chip->spi=spi;
+	chip->cs_port=cs_port;
+	chip->cs_pin=cs_pin;
+	chip->size=size;
+	CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;					// BUSY waits are timed with the cycle counter
+	DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+#ifdef FS_READAHEAD
+	assert(spi->hdmarx==NULL || (uintptr_t)chip->ra_buf-D1_DTCMRAM_BASE>=0x20000);	// 128K DTCM, out of DMA reach, see FS_READAHEAD
+	chip->ra_next=UINT32_MAX;
+	chip->ra_last=UINT32_MAX;
+	chip->ra_cross=2;
+	chip->ra_enable=true;
+#if (USE_HAL_SPI_REGISTER_CALLBACKS == 1U)
+	HAL_SPI_RegisterCallback(spi,HAL_SPI_RX_COMPLETE_CB_ID,W25Q_SPI_RxCplt);
+#endif
+#endif
+#ifdef FS_SCHED_PAGES
+	chip->sq_erasing=-1;
+	chip->sq_enable=true;
+#endif
+	chip->next=chips;
+	chips=chip;
+}
+
+int stmlfs_init(stmlfs_t *fs, W25Q_t *chip, lfs_block_t first, lfs_block_t count)
+{
+    if (count==0 || first+count>chip->size/FS_SECTOR_SIZE) return LFS_ERR_INVAL;
+
+    memset(fs,0,sizeof(*fs));
+    fs->cfg=stmconfig;
+    fs->cfg.context=fs;
+    fs->cfg.block_count=count;
+    fs->chip=chip;
+    fs->first=first;
     return LFS_ERR_OK;
 }
 
-int stmlfs_mount(bool format)
+void stmlfs_volume(stmlfs_t *fs, uint8_t vol)						// Number in the trace, the record and the latency dump, 0 after stmlfs_init
 {
-	int err=-1;
+    fs->vol=vol;
+}
 
-	assert(FS_SIZE<16777216);										// Chip < 16Mbyte, change R/W to 32bits address
+//-------------------------------------------------------------------------------------------------
+// Striped volume, littlefs block 2n is sector first+n of chip and block 2n+1 the same sector of
+// stripe. Both chips program and erase in parallel, a sequential write keeps each at about half
+// the load. count is the number of sectors used on each chip.
+//-------------------------------------------------------------------------------------------------
+int stmlfs_init_striped(stmlfs_t *fs, W25Q_t *chip, W25Q_t *stripe, lfs_block_t first, lfs_block_t count)
+{
+    if (stripe==chip || first+count>stripe->size/FS_SECTOR_SIZE) return LFS_ERR_INVAL;
+
+    int err=stmlfs_init(fs,chip,first,count);
+    if (err) return err;
+    fs->cfg.block_count=2*count;
+    fs->stripe=stripe;
+    chip->peer=stripe;												// Either one helps the other while it waits
+    stripe->peer=chip;
+    return LFS_ERR_OK;
+}
+
+//-------------------------------------------------------------------------------------------------
+// Mirrored volume, every block is programmed and erased on both chips at the same time and read
+// from whichever copy is free, see mirror_read. count is the number of sectors of each chip.
+//-------------------------------------------------------------------------------------------------
+int stmlfs_init_mirrored(stmlfs_t *fs, W25Q_t *chip, W25Q_t *mirror, lfs_block_t first, lfs_block_t count)
+{
+    if (mirror==chip || first+count>mirror->size/FS_SECTOR_SIZE) return LFS_ERR_INVAL;
+
+    int err=stmlfs_init(fs,chip,first,count);
+    if (err) return err;
+    fs->mirror=mirror;
+    fs->reader=chip;
+    chip->peer=mirror;												// Queued pages go out to both in turn
+    mirror->peer=chip;
+    return LFS_ERR_OK;
+}
+
+//-------------------------------------------------------------------------------------------------
+// Partition table
+// A chip can be split in littlefs volumes and raw regions, each littlefs volume with its own block
+// size, cache size and wear levelling. Larger blocks mean fewer, bigger erases and less metadata for
+// read-mostly data, small blocks and a small cache suit a log that syncs often. The table lives in
+// the application, typically const, stmlfs_part_check tells if it fits the chip.
+//-------------------------------------------------------------------------------------------------
+static int part_valid(W25Q_t *chip, const struct stmlfs_part *part)
+{
+    lfs_size_t block_size=part->block_size ? part->block_size : FS_SECTOR_SIZE;
+    lfs_size_t cache_size=part->cache_size ? part->cache_size : stmconfig.cache_size;
+
+    if (part->count==0 || part->first+part->count>chip->size/FS_SECTOR_SIZE) return LFS_ERR_INVAL;
+    if (part->type==STMLFS_PART_RAW) return LFS_ERR_OK;
+    if (part->type!=STMLFS_PART_LFS || block_size%FS_SECTOR_SIZE || part->count%(block_size/FS_SECTOR_SIZE)) return LFS_ERR_INVAL;
+    if (cache_size%FS_PAGE_SIZE || block_size%cache_size) return LFS_ERR_INVAL;
+    return LFS_ERR_OK;
+}
+
+int stmlfs_part_check(W25Q_t *chip, const struct stmlfs_part *table, int count)
+{
+    for (int i=0; i<count; i++) {
+    	if (part_valid(chip,&table[i])) return LFS_ERR_INVAL;
+    	for (int j=0; j<i; j++) {										// No two share a sector
+    		if (table[i].first<table[j].first+table[j].count && table[j].first<table[i].first+table[i].count) return LFS_ERR_INVAL;
+    	}
+    }
+    return LFS_ERR_OK;
+}
+
+const struct stmlfs_part *stmlfs_part_find(const struct stmlfs_part *table, int count, const char *name)
+{
+    for (int i=0; i<count; i++) {
+    	if (strcmp(table[i].name,name)==0) return &table[i];
+    }
+    return NULL;
+}
+
+int stmlfs_init_part(stmlfs_t *fs, W25Q_t *chip, const struct stmlfs_part *part)
+{
+    if (part->type!=STMLFS_PART_LFS || part_valid(chip,part)) return LFS_ERR_INVAL;
+
+    int err=stmlfs_init(fs,chip,part->first,part->count);
+    if (err) return err;
+    if (part->block_size) fs->cfg.block_size=part->block_size;
+    if (part->cache_size) fs->cfg.cache_size=part->cache_size;
+    if (part->block_cycles) fs->cfg.block_cycles=part->block_cycles;
+    fs->vol=part->vol;
+    fs->cfg.block_count=part->count/(fs->cfg.block_size/FS_SECTOR_SIZE);
+    return LFS_ERR_OK;
+}
+
+//-------------------------------------------------------------------------------------------------
+// Raw regions, off and size are bytes from the start of the partition. Programs and erases are on
+// the chip when these return, they do not go through the I/O scheduler. Erases are by sector, off
+// and size must be multiples of FS_SECTOR_SIZE.
+//-------------------------------------------------------------------------------------------------
+static bool raw_valid(const struct stmlfs_part *part, uint32_t off, uint32_t size)
+{
+    return part->type==STMLFS_PART_RAW && off<=part->count*FS_SECTOR_SIZE && size<=part->count*FS_SECTOR_SIZE-off;
+}
+
+int stmlfs_raw_read(W25Q_t *chip, const struct stmlfs_part *part, uint32_t off, void *buffer, uint32_t size)
+{
+    if (!raw_valid(part,off,size)) return LFS_ERR_INVAL;
+
+    uint32_t addr=part->first*FS_SECTOR_SIZE+off;
+    flash_read(chip,addr/FS_SECTOR_SIZE,addr%FS_SECTOR_SIZE,size,buffer);
+    return LFS_ERR_OK;
+}
+
+int stmlfs_raw_prog(W25Q_t *chip, const struct stmlfs_part *part, uint32_t off, const void *buffer, uint32_t size)
+{
+    if (!raw_valid(part,off,size)) return LFS_ERR_INVAL;
+    if (size==0) return LFS_ERR_OK;
+
+    uint32_t addr=part->first*FS_SECTOR_SIZE+off;
+    map_programmed(chip,addr,size);
+    W25Q_Write_block(chip,addr/FS_SECTOR_SIZE,addr%FS_SECTOR_SIZE,size,buffer);
+    prog_wait(chip);
+    return LFS_ERR_OK;
+}
+
+int stmlfs_raw_erase(W25Q_t *chip, const struct stmlfs_part *part, uint32_t off, uint32_t size)
+{
+    if (!raw_valid(part,off,size) || off%FS_SECTOR_SIZE || size%FS_SECTOR_SIZE) return LFS_ERR_INVAL;
+
+    for (lfs_block_t sector=part->first+off/FS_SECTOR_SIZE; sector<part->first+(off+size)/FS_SECTOR_SIZE; sector++) {
+    	if (sector_is_erased(chip, sector)) continue;
+    	W25Q_Erase_Sector(chip, sector);
+    	chip->erased_map[sector/32] |= (1U<<(sector%32));
+    	chip->erasestat.sync_erases++;
+    }
+    return LFS_ERR_OK;
+}
+
+static W25Q_t *fs_second(stmlfs_t *fs)								// Other chip of a striped or mirrored volume
+{
+    return fs->stripe ? fs->stripe : fs->mirror;
+}
+
+static W25Q_t *fs_sector(stmlfs_t *fs, lfs_block_t *block)			// Chip and first sector holding a littlefs block
+{
+    lfs_block_t sectors=fs->cfg.block_size/FS_SECTOR_SIZE;
+
+    if (fs->stripe==NULL) {
+    	*block=fs->first+*block*sectors;
+    	return fs->chip;
+    }
+    W25Q_t *chip=(*block&1) ? fs->stripe : fs->chip;
+    *block=fs->first+*block/2*sectors;
+    return chip;
+}
+
+static void stat_add(void *stat, const void *more, size_t size)	// Counters of both chips of a volume
+{
+	uint32_t *to=stat;
+	const uint32_t *from=more;
+
+	for (size_t i=0; i<size/sizeof(uint32_t); i++) to[i]+=from[i];
+}
+
+int stmlfs_hal_sync(const struct lfs_config *c)
+{
+    stmlfs_t *fs=c->context;
+    TRACE_START();
+#ifdef FS_SCHED_PAGES
+    sched_flush(fs->chip);											// Everything littlefs wrote is on the chip from here
+    if (fs_second(fs)) sched_flush(fs_second(fs));
+#endif
+    prog_wait(fs->chip);											// Including the last posted page
+    if (fs_second(fs)) prog_wait(fs_second(fs));
+    TRACE_END(STMLFS_TRACE_SYNC,0,0,0);
+    return LFS_ERR_OK;
+}
+
+int stmlfs_mount(stmlfs_t *fs, bool format)
+{
+	int err=-1;
 
     if (format) {
-    	err=lfs_format(&lfs,&stmconfig);
+    	err=lfs_format(&fs->lfs,&fs->cfg);
     	printf("lfs_format - returned: %d\n",err);
     }
-    err=lfs_mount(&lfs,&stmconfig);                              	// mount the filesystem
+    fs->bad=NULL;
+    err=lfs_mount(&fs->lfs,&fs->cfg);                              	// mount the filesystem
+    for (int i=0; err==LFS_ERR_CORRUPT && fs->mirror && i<2; i++) {	// Try each copy on its own
+    	fs->bad=i ? fs->chip : fs->mirror;
+    	fs->reader=i ? fs->mirror : fs->chip;
+    	err=lfs_mount(&fs->lfs,&fs->cfg);
+    	if (err==LFS_ERR_OK) {
+    		fs->mirrorstat.failovers++;
+    		printf("stmlfs_mount - copy on %s unreadable, rebuild it with stmlfs_mirror_rebuild\n",i ? "chip" : "mirror");
+    	}
+    }
+    if (err) fs->bad=NULL;
     printf("lfs_mount  - returned: %d\n",err);
+    lfs_async_init(&fs->aqueue,&fs->lfs,&aqueue_config);
+    RECORD(NULL,NULL,"mount %d %lu %lu %d",format,(unsigned long)fs->cfg.block_size,(unsigned long)fs->cfg.block_count,err);
+#ifdef FS_RECORD
+    char path[RECORD_PATH];
+    path[0]=0;
+    if (fs->record && err==LFS_ERR_OK) record_tree(fs,path,0);
+#endif
     return err;
 }
 
+static void flash_read(W25Q_t *chip, lfs_block_t block, lfs_off_t off, lfs_size_t size, uint8_t *buffer)
+{
+#ifdef FS_READAHEAD
+	uint32_t addr=block*FS_SECTOR_SIZE+off;
+	lfs_size_t n=readahead_copy(chip,addr,buffer,size);				// Whatever the read-ahead window holds
+	if (n<size) {
+		W25Q_Read(chip,(addr+n)/FS_SECTOR_SIZE,(addr+n)%FS_SECTOR_SIZE,size-n,buffer+n);
+	}
+	readahead_next(chip,addr,size,n);
+#else
+	W25Q_Read(chip,block+off/FS_SECTOR_SIZE,off%FS_SECTOR_SIZE,size,buffer);
+#endif
+#ifdef FS_SCHED_PAGES
+	sched_patch(chip,block*FS_SECTOR_SIZE+off,buffer,size);			// Add what is still queued
+#endif
+}
+
+//-------------------------------------------------------------------------------------------------
+// Mirrored reads
+// Reads stay on one copy, so its read-ahead keeps streaming, and move to the other one while that
+// copy is programming or erasing. With the chips on separate SPI ports a read of 2 pages or more
+// is split, the second half is fetched from the other copy by DMA while the first is read here,
+// as long as read-ahead is on.
+// Queued pages are the same on both chips, either copy reads back what littlefs wrote.
+// Once a mount has only worked from one copy (fs->bad), all reads stay on that copy.
+//-------------------------------------------------------------------------------------------------
+static void mirror_read(stmlfs_t *fs, lfs_block_t block, lfs_off_t off, lfs_size_t size, uint8_t *buffer)
+{
+	W25Q_t *other=(fs->reader==fs->chip) ? fs->mirror : fs->chip;
+
+	if (fs->bad) {
+		flash_read(fs->bad==fs->chip ? fs->mirror : fs->chip,block,off,size,buffer);
+		return;
+	}
+	if (W25Q_Busy(fs->reader) && !W25Q_Busy(other)) {
+		fs->reader=other;
+		other=(fs->reader==fs->chip) ? fs->mirror : fs->chip;
+		fs->mirrorstat.switched_reads++;
+	}
+#ifdef FS_READAHEAD
+	uint32_t half=lfs_min(size/2,FS_READAHEAD);
+	if (half>=FS_PAGE_SIZE && other->spi!=fs->reader->spi && other->ra_enable && other->spi->hdmarx && !W25Q_Busy(other)) {
+		uint32_t addr=block*FS_SECTOR_SIZE+off+size-half;
+		readahead_fetch(other,addr,half);
+		flash_read(fs->reader,block,off,size-half,buffer);
+		flash_read(other,addr/FS_SECTOR_SIZE,addr%FS_SECTOR_SIZE,half,buffer+size-half);	// Waits for the DMA if still running
+		fs->mirrorstat.split_reads++;
+		return;
+	}
+#endif
+	flash_read(fs->reader,block,off,size,buffer);
+}
+
 int stmlfs_hal_read(const struct lfs_config *c, lfs_block_t block, lfs_off_t off, void* buffer, lfs_size_t size)
 {
+	stmlfs_t *fs=c->context;
+
 	assert(block < c->block_count);
     assert(off + size <= c->block_size);
 
     dprintf("stmlfs_hal_read(block=%ld off=%ld size=%ld)\n",block,off,size);
-    W25Q_Read(block,off,size,buffer);
+    TRACE_START();
+    lfs_block_t sector=block;
+    W25Q_t *chip=fs_sector(fs,&sector);
+    if (fs->mirror) mirror_read(fs,sector,off,size,buffer);
+    else flash_read(chip,sector,off,size,buffer);
+    TRACE_END(STMLFS_TRACE_READ,block,off,size);
+
+    return LFS_ERR_OK;
+}
+
+int stmlfs_hal_readspan(const struct lfs_config *c, lfs_block_t block, lfs_off_t off, void* buffer, lfs_size_t size)
+{
+	stmlfs_t *fs=c->context;
+
+	assert(block*c->block_size + off + size <= c->block_count*c->block_size);
+
+    dprintf("stmlfs_hal_readspan(block=%ld off=%ld size=%ld)\n",block,off,size);
+    TRACE_START();
+    lfs_block_t next=block;
+    lfs_off_t at=off;
+    for (lfs_size_t left=size; left;) {								// Read address auto increments over sectors, not over chips
+    	lfs_size_t len=fs->stripe ? lfs_min(left,c->block_size-at) : left;
+    	lfs_block_t sector=next++;
+    	W25Q_t *chip=fs_sector(fs,&sector);
+    	if (fs->mirror) mirror_read(fs,sector,at,len,buffer);
+    	else flash_read(chip,sector,at,len,buffer);
+    	buffer=(uint8_t*)buffer+len;
+    	left-=len;
+    	at=0;
+    }
+    TRACE_END(STMLFS_TRACE_READ,block,off,size);					// One record, the decoder spreads it over the blocks
 
     return LFS_ERR_OK;
 }
 
 int stmlfs_hal_prog(const struct lfs_config *c, lfs_block_t block, lfs_off_t off, const void* buffer, lfs_size_t size)
 {
+	stmlfs_t *fs=c->context;
+
 	assert(block < c->block_count);
 
     dprintf("stmlfs_hal_prog(block=%ld off=%ld size=%ld)\n",block,off,size);
-    W25Q_Write_block(block,off,size,buffer);
+    TRACE_START();
+    lfs_block_t sector=block;
+    W25Q_t *chip=fs_sector(fs,&sector);								// Sector on the chip
+    fs->prog_bytes+=size;
+    if (fs->mirror==NULL) {
+    	chip_prog(chip,sector,off,buffer,size);
+    } else {
+    	for (lfs_size_t n=0; n<size; n+=FS_PAGE_SIZE) {				// A page to each chip in turn, both program at the same time
+    		chip_prog(chip,sector,off+n,(const uint8_t*)buffer+n,FS_PAGE_SIZE);
+    		chip_prog(fs->mirror,sector,off+n,(const uint8_t*)buffer+n,FS_PAGE_SIZE);
+    	}
+    }
+    TRACE_END(STMLFS_TRACE_PROG,block,off,size);
 
     return LFS_ERR_OK;
 }
 
+static void chip_prog(W25Q_t *chip, lfs_block_t block, lfs_off_t off, const void* buffer, lfs_size_t size)
+{
+    uint32_t addr=block*FS_SECTOR_SIZE+off;							// off can reach past the sector for blocks of several
+
+    map_programmed(chip,addr,size);
+#ifdef FS_SCHED_PAGES
+    if (chip->sq_enable) {
+    	sched_prog(chip,addr,buffer,size);
+    	return;
+    }
+#endif
+    W25Q_Write_block(chip,addr/FS_SECTOR_SIZE,addr%FS_SECTOR_SIZE,size,buffer);
+}
+
 int stmlfs_hal_erase(const struct lfs_config *c, lfs_block_t block)
 {
+	stmlfs_t *fs=c->context;
+
 	assert(block < c->block_count);
 
-    dprintf("stmlfs_hal_erase(block=%ld)\n",block);
-    W25Q_Erase_Sector(block);
+    TRACE_START();
+    lfs_block_t sector=block;
+    W25Q_t *chip=fs_sector(fs,&sector);
+    bool wait=false, wait_mirror=false;
+    for (lfs_block_t i=0; i<c->block_size/FS_SECTOR_SIZE; i++) {	// An erase waits for the one before it on the same chip
+    	wait|=chip_erase(chip, sector+i);
+    	wait_mirror|=fs->mirror && chip_erase(fs->mirror, sector+i);	// Both erase at the same time
+    }
+    uint32_t start=DWT->CYCCNT;
+    while ((wait && W25Q_Busy(chip)) || (wait_mirror && W25Q_Busy(fs->mirror)));
+    if (wait || wait_mirror) busy_count(wait ? chip : fs->mirror, start);	// Charged once, the mirror erases alongside
+    TRACE_END(STMLFS_TRACE_ERASE,block,0,c->block_size);
 
     return LFS_ERR_OK;
 }
 
+static bool chip_erase(W25Q_t *chip, lfs_block_t block)				// True if an erase was started and has to be waited for
+{
+#ifdef FS_SCHED_PAGES
+	sched_drop(chip, block);										// Pages still queued for the sector are stale
+#endif
+	if (chip->erased_map[block/32] & (1U<<(block%32))) {			// Erased ahead of time
+		chip->erasestat.pool_hits++;
+		return false;
+	}
+#ifdef FS_SCHED_PAGES
+	if (chip->sq_enable) {											// Erased on the chip once the sector is programmed or the system idle
+		chip->sq_erase_map[block/32] |= (1U<<(block%32));
+		chip->sqstat.deferred_erases++;
+		return false;
+	}
+#endif
+	if (sector_is_erased(chip, block)) {							// Skip the 45ms+ sector erase
+		dprintf("stmlfs_hal_erase(block=%ld) already blank\n",block);
+		chip->erasestat.blank_hits++;
+		return false;
+	}
+
+	dprintf("stmlfs_hal_erase(block=%ld)\n",block);
+	W25Q_Erase_Start(chip, block);
+	chip->erased_map[block/32] |= (1U<<(block%32));
+	chip->erasestat.sync_erases++;
+	return true;
+}
 
+//-------------------------------------------------------------------------------------------------
+// Block device trace
+// Every littlefs block device call of every volume goes into a RAM ring with its DWT start and end
+// cycle count, about 1us of overhead where a dprintf over the UART takes milliseconds and changes
+// the timing it is meant to show. stmlfs_trace_dump prints the ring, or halt the target and save
+// stmlfs_tracebuf from the debugger, Tools/lfstrace.py decodes either.
+//-------------------------------------------------------------------------------------------------
+#ifdef FS_TRACE
+struct littlfs_tracebuf_t stmlfs_tracebuf;
+static bool trace_on;
 
-int stmlfs_file_open(lfs_file_t *file, const char *path, int flags)
+static void trace_add(stmlfs_t *fs, uint8_t op, lfs_block_t block, lfs_off_t off, lfs_size_t size, uint32_t start)
 {
-    return lfs_file_open(&lfs, file, path, flags);
+	if (!trace_on) return;
+
+	struct littlfs_trace_t *rec=&stmlfs_tracebuf.rec[stmlfs_tracebuf.head%FS_TRACE];
+	rec->start=start;
+	rec->end=DWT->CYCCNT;
+	rec->off=off;
+	rec->size=size;
+	rec->block=block;
+	rec->op=op;
+	rec->vol=fs->vol;
+	stmlfs_tracebuf.head++;
 }
+#endif
 
-int stmlfs_file_read(lfs_file_t *file,void *buffer, lfs_size_t size)
+void stmlfs_trace_start(void)										// Empties the ring
 {
-    return lfs_file_read(&lfs, file, buffer, size);
+#ifdef FS_TRACE
+	CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;					// The cycle counter may not be running yet
+	DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+
+	stmlfs_tracebuf.magic=STMLFS_TRACE_MAGIC;
+	stmlfs_tracebuf.version=STMLFS_TRACE_VERSION;
+	stmlfs_tracebuf.rec_size=sizeof(struct littlfs_trace_t);
+	stmlfs_tracebuf.entries=FS_TRACE;
+	stmlfs_tracebuf.head=0;
+	stmlfs_tracebuf.clock_hz=SystemCoreClock;
+	trace_on=true;
+#endif
 }
 
-int stmlfs_file_rewind(lfs_file_t *file)
+void stmlfs_trace_stop(void)
 {
-    return lfs_file_rewind(&lfs, file);
+#ifdef FS_TRACE
+	trace_on=false;
+#endif
 }
 
-lfs_ssize_t stmlfs_file_write(lfs_file_t *file,const void *buffer, lfs_size_t size)
+void stmlfs_trace_dump(void)										// Oldest record first, one hex line each as it is in memory
 {
-    return lfs_file_write(&lfs, file,buffer,size);
+#ifdef FS_TRACE
+	bool was_on=trace_on;
+	trace_on=false;
+
+	uint32_t count=lfs_min(stmlfs_tracebuf.head,FS_TRACE);
+	printf("LFSTRACE %u %u %lu %lu %lu\n",stmlfs_tracebuf.version,stmlfs_tracebuf.rec_size,
+			(unsigned long)stmlfs_tracebuf.head,(unsigned long)count,(unsigned long)stmlfs_tracebuf.clock_hz);
+	for (uint32_t i=stmlfs_tracebuf.head-count; i!=stmlfs_tracebuf.head; i++) {
+		const uint8_t *p=(const uint8_t*)&stmlfs_tracebuf.rec[i%FS_TRACE];
+		printf("T ");
+		for (uint32_t n=0; n<sizeof(struct littlfs_trace_t); n++) printf("%02x",p[n]);
+		printf("\n");
+	}
+	printf("LFSTRACE END\n");
+	trace_on=was_on;
+#endif
 }
 
-int stmlfs_file_close(lfs_file_t *file)
+//-------------------------------------------------------------------------------------------------
+// Call latency
+// The stmlfs_ calls that reach the flash are timed with DWT->CYCCNT and counted per volume and call
+// type in the power of two buckets of lfs_lathist.c, which Tools/lfsreplay.c and lfs_bench.c use
+// as well. stmlfs_latency estimates percentiles from the buckets and stmlfs_latency_dump prints
+// every histogram in a form that can be compared between firmware builds.
+//-------------------------------------------------------------------------------------------------
+static const char *const latency_names[STMLFS_LAT_OPS]={"open","read","write","sync","close","rename","remove","mkdir","dir_read"};
+
+//-------------------------------------------------------------------------------------------------
+// Latency of one call type (enum stmlfs_lat_op) since stmlfs_init or the last reset. Reset starts the
+// histogram of that call type again after it is copied.
+//-------------------------------------------------------------------------------------------------
+int stmlfs_latency(stmlfs_t *fs, uint8_t op, struct littlfs_latency_t* stat, bool reset)
 {
-    return lfs_file_close(&lfs, file);
+	memset(stat,0,sizeof(*stat));
+	if (op>=STMLFS_LAT_OPS) return LFS_ERR_INVAL;
+#ifdef FS_LATENCY
+	struct lfs_lathist *h=&fs->lat[op];
+	uint32_t cycles_us=SystemCoreClock/1000000;
+
+	stat->count=h->count;
+	memcpy(stat->bucket,h->bucket,sizeof(stat->bucket));
+	if (h->count) {
+		stat->min_us=h->min/cycles_us;
+		stat->max_us=h->max/cycles_us;
+		stat->mean_us=(uint32_t)(h->total/h->count/cycles_us);
+		stat->p50_us=lfs_lathist_pct(h,500,cycles_us);
+		stat->p90_us=lfs_lathist_pct(h,900,cycles_us);
+		stat->p99_us=lfs_lathist_pct(h,990,cycles_us);
+		stat->p999_us=lfs_lathist_pct(h,999,cycles_us);
+	}
+	if (reset) memset(h,0,sizeof(*h));
+#else
+	UNUSED(*fs);
+	UNUSED(reset);
+#endif
+	return LFS_ERR_OK;
 }
 
-int stmlfs_unmount(void)
+void stmlfs_latency_dump(stmlfs_t *fs)								// A line per call type, the bucket counts last
 {
-    return lfs_unmount(&lfs);
+	printf("LFSLAT %u %s\n",fs->vol,"op count min mean p50 p90 p99 p999 max buckets");
+	for (uint8_t op=0; op<STMLFS_LAT_OPS; op++) {
+		struct littlfs_latency_t st;
+		stmlfs_latency(fs,op,&st,false);
+		if (st.count==0) continue;
+		printf("L %u %s %lu %lu %lu %lu %lu %lu %lu %lu",fs->vol,latency_names[op],(unsigned long)st.count,
+				(unsigned long)st.min_us,(unsigned long)st.mean_us,(unsigned long)st.p50_us,(unsigned long)st.p90_us,
+				(unsigned long)st.p99_us,(unsigned long)st.p999_us,(unsigned long)st.max_us);
+		for (int b=0; b<STMLFS_LAT_BUCKETS; b++) printf(" %lu",(unsigned long)st.bucket[b]);
+		printf("\n");
+	}
+	printf("LFSLAT END\n");
 }
 
-int stmlfs_remove(const char* path)
+//-------------------------------------------------------------------------------------------------
+// Erased sector tracking
+// A sector erased by this driver stays marked until it is programmed, so littlefs asking for it
+// again costs nothing. The map is RAM only and starts empty, sectors left blank by an earlier
+// boot (or a new chip) are found with a read-back which stops at the first non 0xFF byte.
+//-------------------------------------------------------------------------------------------------
+bool stmlfs_is_erased(stmlfs_t *fs, lfs_block_t block)
 {
-    return lfs_remove(&lfs, path);
+	W25Q_t *chip=fs_sector(fs,&block);
+
+	for (lfs_block_t i=0; i<fs->cfg.block_size/FS_SECTOR_SIZE; i++) {
+		if (!sector_is_erased(chip,block+i)) return false;
+		if (fs->mirror && !sector_is_erased(fs->mirror,block+i)) return false;
+	}
+	return true;
 }
 
-int stmlfs_rename(const char* oldpath, const char* newpath)
+static void map_programmed(W25Q_t *chip, uint32_t addr, uint32_t size)	// The sectors are not blank any more
 {
-    return lfs_rename(&lfs, oldpath, newpath);
+	for (uint32_t sector=addr/FS_SECTOR_SIZE; sector<=(addr+size-1)/FS_SECTOR_SIZE; sector++) {
+		chip->erased_map[sector/32] &= ~(1U<<(sector%32));
+	}
 }
 
-int stmlfs_fflush(lfs_file_t *file)
+static bool sector_is_erased(W25Q_t *chip, lfs_block_t block)
 {
-    return lfs_file_sync(&lfs, file);
+#ifdef FS_SCHED_PAGES
+	if ((int32_t)block==chip->sq_erasing) {							// Erasing in the background
+		W25Q_Wait(chip);
+		sched_erased(chip);
+	}
+#endif
+	if (chip->erased_map[block/32] & (1U<<(block%32))) return true;
+
+#ifdef FS_BLANK_CHECK
+	uint8_t page[FS_PAGE_SIZE];
+	for (uint32_t off=0; off<FS_SECTOR_SIZE; off+=FS_PAGE_SIZE) {
+		W25Q_Read(chip,block,off,FS_PAGE_SIZE,page);
+		for (int i=0; i<FS_PAGE_SIZE; i++) {
+			if (page[i]!=0xFF) return false;
+		}
+	}
+	chip->erased_map[block/32] |= (1U<<(block%32));
+	return true;
+#else
+	return false;
+#endif
 }
 
-int stmlfs_fsstat(struct littlfs_fsstat_t* stat)
+
+
+//-------------------------------------------------------------------------------------------------
+// API record
+// With stmlfs_record enabled every stmlfs_ call that can reach the flash prints a line
+//   R <ms> <volume> <op> <handle and sizes> <result> <paths>
+// Tools/lfsreplay.c replays a capture of these lines against littlefs on an emulated W25Q to try
+// other cache, lookahead and block_cycles settings on the real workload. Data is not recorded,
+// only sizes. Files are identified by the address of their lfs_file_t. Paths have spaces,
+// control characters and % escaped as %xx.
+//-------------------------------------------------------------------------------------------------
+#ifdef FS_RECORD
+static void record_path(const char *path)
+{
+	putchar(' ');
+	for (const uint8_t *c=(const uint8_t*)path; *c; c++) {
+		if (*c<=' ' || *c=='%' || *c>=0x7f) printf("%%%02x",*c);
+		else putchar(*c);
+	}
+}
+
+static void record(stmlfs_t *fs, const char *path, const char *path2, const char *fmt, ...)
+{
+	if (!fs->record) return;
+
+	va_list args;
+	printf("R %lu %u ",(unsigned long)HAL_GetTick(),fs->vol);
+	va_start(args,fmt);
+	vprintf(fmt,args);
+	va_end(args);
+	if (path) record_path(path);
+	if (path2) record_path(path2);
+	putchar('\n');
+}
+
+static void record_tree(stmlfs_t *fs, char *path, size_t len)		// What the volume holds at mount, replayed before the calls
+{
+	lfs_dir_t dir;
+	struct lfs_info info;
+
+	if (lfs_dir_open(&fs->lfs,&dir,len ? path : "/")!=LFS_ERR_OK) return;
+	while (lfs_dir_read(&fs->lfs,&dir,&info)>0) {
+		size_t n=len+1+strlen(info.name);
+		if (strcmp(info.name,".")==0 || strcmp(info.name,"..")==0 || n>=RECORD_PATH) continue;
+		path[len]='/';
+		strcpy(path+len+1,info.name);
+		if (info.type==LFS_TYPE_DIR) {
+			record(fs,path,NULL,"havedir 0");
+			record_tree(fs,path,n);
+		} else {
+			record(fs,path,NULL,"have %lu 0",(unsigned long)info.size);
+		}
+	}
+	path[len]=0;
+	lfs_dir_close(&fs->lfs,&dir);
+}
+#endif
+
+void stmlfs_record(stmlfs_t *fs, bool enable)						// Enable before stmlfs_mount to also record the files already there
+{
+#ifdef FS_RECORD
+	fs->record=enable;
+#else
+	UNUSED(*fs);
+	UNUSED(enable);
+#endif
+}
+
+int stmlfs_file_open(stmlfs_t *fs, lfs_file_t *file, const char *path, int flags)
+{
+    LATENCY_START();
+    int err=lfs_file_open(&fs->lfs, file, path, flags);
+    LATENCY_END(STMLFS_LAT_OPEN);
+    RECORD(path,NULL,"open %lx %x %d",(unsigned long)file,flags,err);
+    return err;
+}
+
+int stmlfs_file_read(stmlfs_t *fs, lfs_file_t *file,void *buffer, lfs_size_t size)
+{
+    LATENCY_START();
+    int res=lfs_file_read(&fs->lfs, file, buffer, size);
+    LATENCY_END(STMLFS_LAT_READ);
+    RECORD(NULL,NULL,"read %lx %lu %d",(unsigned long)file,(unsigned long)size,res);
+    return res;
+}
+
+lfs_ssize_t stmlfs_file_readv(stmlfs_t *fs, lfs_file_t *file, const struct lfs_iovec *iov, lfs_size_t iovcnt)
+{
+    LATENCY_START();
+    lfs_ssize_t res=lfs_file_readv(&fs->lfs, file, iov, iovcnt);
+    LATENCY_END(STMLFS_LAT_READ);
+#ifdef FS_RECORD
+    lfs_size_t size=0;
+    for (lfs_size_t i=0; i<iovcnt; i++) size+=iov[i].size;
+    RECORD(NULL,NULL,"read %lx %lu %ld",(unsigned long)file,(unsigned long)size,(long)res);
+#endif
+    return res;
+}
+
+int stmlfs_file_rewind(stmlfs_t *fs, lfs_file_t *file)
+{
+    int err=lfs_file_rewind(&fs->lfs, file);
+    RECORD(NULL,NULL,"seek %lx 0 %d %d",(unsigned long)file,LFS_SEEK_SET,err);
+    return err;
+}
+
+lfs_ssize_t stmlfs_file_write(stmlfs_t *fs, lfs_file_t *file,const void *buffer, lfs_size_t size)
+{
+    LATENCY_START();
+    lfs_ssize_t res=lfs_file_write(&fs->lfs, file,buffer,size);
+    LATENCY_END(STMLFS_LAT_WRITE);
+    if (res>0) fs->write_bytes+=res;
+    RECORD(NULL,NULL,"write %lx %lu %ld",(unsigned long)file,(unsigned long)size,(long)res);
+    return res;
+}
+
+lfs_ssize_t stmlfs_file_writev(stmlfs_t *fs, lfs_file_t *file, const struct lfs_iovec *iov, lfs_size_t iovcnt)
+{
+    LATENCY_START();
+    lfs_ssize_t res=lfs_file_writev(&fs->lfs, file, iov, iovcnt);
+    LATENCY_END(STMLFS_LAT_WRITE);
+    if (res>0) fs->write_bytes+=res;
+#ifdef FS_RECORD
+    lfs_size_t size=0;
+    for (lfs_size_t i=0; i<iovcnt; i++) size+=iov[i].size;
+    RECORD(NULL,NULL,"write %lx %lu %ld",(unsigned long)file,(unsigned long)size,(long)res);
+#endif
+    return res;
+}
+
+int stmlfs_file_close(stmlfs_t *fs, lfs_file_t *file)
+{
+    LATENCY_START();
+    int err=lfs_file_close(&fs->lfs, file);
+    LATENCY_END(STMLFS_LAT_CLOSE);
+    RECORD(NULL,NULL,"close %lx %d",(unsigned long)file,err);
+    return err;
+}
+
+int stmlfs_unmount(stmlfs_t *fs)
+{
+    int err=lfs_fs_checkpoint(&fs->lfs);							// Lets the next mount skip the metadata scan
+    if (err) printf("lfs_fs_checkpoint - returned: %d\n",err);		// Unmount anyway, the next mount scans
+    err=lfs_unmount(&fs->lfs);
+    RECORD(NULL,NULL,"unmount %d",err);
+    return err;
+}
+
+int stmlfs_checkpoint(stmlfs_t *fs)
+{
+    int err=lfs_fs_checkpoint(&fs->lfs);
+    RECORD(NULL,NULL,"checkpoint %d",err);
+    return err;
+}
+
+int stmlfs_remove(stmlfs_t *fs, const char* path)
+{
+    LATENCY_START();
+    int err=lfs_remove(&fs->lfs, path);
+    LATENCY_END(STMLFS_LAT_REMOVE);
+    RECORD(path,NULL,"remove %d",err);
+    return err;
+}
+
+int stmlfs_rename(stmlfs_t *fs, const char* oldpath, const char* newpath)
+{
+    LATENCY_START();
+    int err=lfs_rename(&fs->lfs, oldpath, newpath);
+    LATENCY_END(STMLFS_LAT_RENAME);
+    RECORD(oldpath,newpath,"rename %d",err);
+    return err;
+}
+
+int stmlfs_remove_recursive(stmlfs_t *fs, const char* path)
+{
+    LATENCY_START();
+    int err=lfs_remove_recursive(&fs->lfs, path);
+    LATENCY_END(STMLFS_LAT_REMOVE);
+    RECORD(path,NULL,"rmtree %d",err);
+    return err;
+}
+
+int stmlfs_rename_batch(stmlfs_t *fs, const char* const* oldpaths, const char* const* newpaths, lfs_size_t count)
+{
+    LATENCY_START();
+    int err=lfs_rename_batch(&fs->lfs, oldpaths, newpaths, count);
+    LATENCY_END(STMLFS_LAT_RENAME);
+    for (lfs_size_t i=0; i<count; i++) {							// A line per pair, the replay renames them together after the last
+    	RECORD(oldpaths[i],newpaths[i],"rbatch %lu %lu %d",(unsigned long)i,(unsigned long)count,err);
+    }
+    return err;
+}
+
+int stmlfs_fflush(stmlfs_t *fs, lfs_file_t *file)
+{
+    LATENCY_START();
+    int err=lfs_file_sync(&fs->lfs, file);
+    LATENCY_END(STMLFS_LAT_SYNC);
+    RECORD(NULL,NULL,"sync %lx %d",(unsigned long)file,err);
+    return err;
+}
+
+//-------------------------------------------------------------------------------------------------
+// Asynchronous requests
+// The stmlfs_async_ calls only queue the request and return, they can be used from interrupts.
+// stmlfs_async_work runs them in order from the main loop or a flash task and calls each
+// request's cb when it is done, req->result then holds what the blocking call would have
+// returned. Requests must be zeroed before their first use.
+//-------------------------------------------------------------------------------------------------
+int stmlfs_async_read(stmlfs_t *fs, lfs_async_req_t *req, lfs_file_t *file, void *buffer, lfs_size_t size, void (*cb)(lfs_async_req_t *req), void *data)
+{
+    return lfs_async_read(&fs->aqueue, req, file, buffer, size, cb, data);
+}
+
+int stmlfs_async_write(stmlfs_t *fs, lfs_async_req_t *req, lfs_file_t *file, const void *buffer, lfs_size_t size, void (*cb)(lfs_async_req_t *req), void *data)
+{
+    return lfs_async_write(&fs->aqueue, req, file, buffer, size, cb, data);
+}
+
+int stmlfs_async_fflush(stmlfs_t *fs, lfs_async_req_t *req, lfs_file_t *file, void (*cb)(lfs_async_req_t *req), void *data)
+{
+    return lfs_async_sync(&fs->aqueue, req, file, cb, data);
+}
+
+int stmlfs_async_close(stmlfs_t *fs, lfs_async_req_t *req, lfs_file_t *file, void (*cb)(lfs_async_req_t *req), void *data)
+{
+    return lfs_async_close(&fs->aqueue, req, file, cb, data);
+}
+
+bool stmlfs_async_done(stmlfs_t *fs, const lfs_async_req_t *req)
+{
+    return lfs_async_done(&fs->aqueue, req);
+}
+
+//-------------------------------------------------------------------------------------------------
+// Run queued requests for up to budget_ms. A request runs the blocking littlefs call, so it is
+// never interrupted and one long write can overrun the budget, but a write, sync or close is not
+// started while the chip is programming, erasing or holding an erase back: the time goes to the
+// scheduler, which starts held back erases and writes queued pages without waiting, and once the
+// budget is used the request is left for the next call. Reads suspend an erase and are not held back. Returns
+// the number of requests run.
+//-------------------------------------------------------------------------------------------------
+static bool async_chip_busy(W25Q_t *chip)							// A write would wait for the chip
 {
-    stat->block_count = stmconfig.block_count;
-    stat->block_size  = stmconfig.block_size;
-    stat->blocks_used = lfs_fs_size(&lfs);
+#ifdef FS_SCHED_PAGES
+	if (chip->sq_erasing>=0) return true;							// Erasing in the background, perhaps suspended
+	for (uint32_t i=0; i<sizeof(chip->sq_erase_map)/sizeof(chip->sq_erase_map[0]); i++) {
+		if (chip->sq_erase_map[i]) return true;						// Held back, the next queued pages may need it
+	}
+#endif
+	return W25Q_Busy(chip);
+}
+
+static bool async_flash_busy(stmlfs_t *fs)
+{
+	return async_chip_busy(fs->chip) || (fs_second(fs) && async_chip_busy(fs_second(fs)));
+}
+
+int stmlfs_async_work(stmlfs_t *fs, uint32_t budget_ms)
+{
+	uint32_t start=HAL_GetTick();
+	int n=0;
+
+	for (;;) {
+		aqueue_lock(&aqueue_config);								// Counted and recorded when it runs, the order the flash sees it in
+		lfs_async_req_t *req=fs->aqueue.head;
+		uint8_t op=req ? req->op : 0;
+		lfs_file_t *file=req ? req->file : NULL;
+		lfs_size_t size=req ? req->size : 0;
+		aqueue_unlock(&aqueue_config);
+		UNUSED(file);
+		if (req && op!=LFS_ASYNC_READ && async_flash_busy(fs)) {
+			stmlfs_sched_work(fs, 0);
+			if ((HAL_GetTick()-start)>=budget_ms) break;
+			continue;
+		}
+		LATENCY_START();
+		if (!lfs_async_work(&fs->aqueue)) break;
+		LATENCY_END(op==LFS_ASYNC_READ ? STMLFS_LAT_READ : op==LFS_ASYNC_WRITE ? STMLFS_LAT_WRITE :
+				op==LFS_ASYNC_SYNC ? STMLFS_LAT_SYNC : STMLFS_LAT_CLOSE);		// Completion callback included
+		n++;
+		if (op==LFS_ASYNC_WRITE) fs->write_bytes+=size;
+		RECORD(NULL,NULL,op==LFS_ASYNC_READ ? "read %lx %lu -" : op==LFS_ASYNC_WRITE ? "write %lx %lu -" :
+				op==LFS_ASYNC_SYNC ? "sync %lx -" : "close %lx -",(unsigned long)file,(unsigned long)size);
+		if ((HAL_GetTick()-start)>=budget_ms) break;
+	}
+	return n;
+}
+
+//-------------------------------------------------------------------------------------------------
+// Idle time garbage collection, call from the main loop or a low priority task. Compacts
+// metadata and refills the block allocator for up to budget_ms, then returns and continues
+// where it left off on the next call. Any time left is spent on the pre-erase pool. A single
+// compaction can overrun the budget by one sector erase. Returns 1 if the current pass is
+// incomplete, 0 once a full pass is done, or the lfs_fs_gcstep error.
+//-------------------------------------------------------------------------------------------------
+int stmlfs_gc(stmlfs_t *fs, uint32_t budget_ms)
+{
+	uint32_t start=HAL_GetTick();
+	int res;
+
+	do {
+		res=lfs_fs_gcstep(&fs->lfs);
+		RECORD(NULL,NULL,"gc %d",res);
+	} while (res>0 && (HAL_GetTick()-start)<budget_ms);
+
+	if ((HAL_GetTick()-start)<budget_ms) {							// Use what is left to empty the queue and fill the pool,
+		stmlfs_sched_work(fs, budget_ms-(HAL_GetTick()-start));		// also after a gc error, queued writes must still drain
+	}
+	if ((HAL_GetTick()-start)<budget_ms) {
+		stmlfs_preerase(fs, budget_ms-(HAL_GetTick()-start));
+	}
+	return res;
+}
+
+//-------------------------------------------------------------------------------------------------
+// Pre-erase pool
+// Erase the next FS_PREERASE_BLOCKS blocks the littlefs allocator will hand out while the system
+// is idle, stmlfs_hal_erase then finds them marked in erased_map and returns immediately.
+// Returns the number of warm blocks in the pool.
+//-------------------------------------------------------------------------------------------------
+int stmlfs_preerase(stmlfs_t *fs, uint32_t budget_ms)
+{
+	uint32_t start=HAL_GetTick();
+	lfs_block_t blocks[FS_PREERASE_BLOCKS];
+	int warm=0;
+
+	lfs_ssize_t n=lfs_fs_nextfree(&fs->lfs,blocks,FS_PREERASE_BLOCKS);
+	for (int i=0; i<n; i++) {
+		lfs_block_t first=blocks[i], sector;
+		W25Q_t *chip=fs_sector(fs,&first);
+		W25Q_t *copy=fs->mirror;
+		for (sector=first; sector<first+fs->cfg.block_size/FS_SECTOR_SIZE; sector++) {
+#ifdef FS_SCHED_PAGES
+			sched_drop(chip, sector);								// Free, anything still queued for it is stale
+			if (copy) sched_drop(copy, sector);
+#endif
+			bool erase=!sector_is_erased(chip, sector);
+			bool erase_copy=copy && !sector_is_erased(copy, sector);
+			if (erase || erase_copy) {
+				if ((HAL_GetTick()-start)>=budget_ms) break;		// Each erase takes 45ms+
+				if (erase) W25Q_Erase_Start(chip, sector);
+				if (erase_copy) W25Q_Erase_Start(copy, sector);		// Both copies erase at the same time
+				while ((erase && W25Q_Busy(chip)) || (erase_copy && W25Q_Busy(copy)));
+				chip->erased_map[sector/32] |= (1U<<(sector%32));
+				chip->erasestat.pre_erases+=erase;
+				if (copy) {
+					copy->erased_map[sector/32] |= (1U<<(sector%32));
+					copy->erasestat.pre_erases+=erase_copy;
+				}
+			}
+		}
+		if (sector<first+fs->cfg.block_size/FS_SECTOR_SIZE) break;	// Out of time
+		warm++;
+	}
+	return (n<0) ? n : warm;
+}
+
+int stmlfs_erasestat(stmlfs_t *fs, struct littlfs_erasestat_t* stat)
+{
+	lfs_block_t blocks[FS_PREERASE_BLOCKS];
+
+	*stat=fs->chip->erasestat;										// Shared by all partitions of the chip
+	if (fs_second(fs)) stat_add(stat,&fs_second(fs)->erasestat,sizeof(*stat));
+	stat->blocks_warm=0;
+	lfs_ssize_t n=lfs_fs_nextfree(&fs->lfs,blocks,FS_PREERASE_BLOCKS);
+	for (int i=0; i<n; i++) {
+		lfs_block_t sector=blocks[i], j=0;
+		W25Q_t *chip=fs_sector(fs,&sector);
+		while (j<fs->cfg.block_size/FS_SECTOR_SIZE && (chip->erased_map[(sector+j)/32] & (1U<<((sector+j)%32)))) j++;
+		if (j==fs->cfg.block_size/FS_SECTOR_SIZE) stat->blocks_warm++;
+	}
+	return LFS_ERR_OK;
+}
+
+uint32_t stmlfs_progbytes(stmlfs_t *fs)
+{
+	return fs->prog_bytes;
+}
+
+void stmlfs_readahead(stmlfs_t *fs, bool enable)
+{
+#ifdef FS_READAHEAD
+	readahead_drop(fs->chip,0,fs->chip->size);
+	fs->chip->ra_enable=enable;
+	if (fs_second(fs)) {
+		readahead_drop(fs_second(fs),0,fs_second(fs)->size);
+		fs_second(fs)->ra_enable=enable;
+	}
+#else
+	UNUSED(*fs);
+	UNUSED(enable);
+#endif
+}
+
+int stmlfs_readaheadstat(stmlfs_t *fs, struct littlfs_readahead_t* stat)
+{
+#ifdef FS_READAHEAD
+	*stat=fs->chip->rastat;
+	if (fs_second(fs)) stat_add(stat,&fs_second(fs)->rastat,sizeof(*stat));
+#else
+	UNUSED(*fs);
+	memset(stat,0,sizeof(*stat));
+#endif
     return LFS_ERR_OK;
 }
 
+//-------------------------------------------------------------------------------------------------
+// Write queued pages to the chip while the system is idle, at least one and then until budget_ms
+// is used. Held back erases are started in the background instead of waited for, the queue stops
+// at a page whose sector is still erasing. Call it again to let the erase continue after reads
+// have suspended it. Returns 1 while work is left, 0 once all is done.
+//-------------------------------------------------------------------------------------------------
+int stmlfs_sched_work(stmlfs_t *fs, uint32_t budget_ms)
+{
+#ifdef FS_SCHED_PAGES
+	uint32_t start=HAL_GetTick();
+	int res=sched_work(fs->chip,start,budget_ms);
+
+	if (fs->mirror && fs->chip->sq_erasing>=0) return 1;			// One copy stays readable while the other erases
+	if (fs_second(fs)) res|=sched_work(fs_second(fs),start,budget_ms);
+	return res;
+#else
+	UNUSED(*fs);
+	UNUSED(budget_ms);
+	return 0;
+#endif
+}
 
+#ifdef FS_SCHED_PAGES
+static int sched_work(W25Q_t *chip, uint32_t start, uint32_t budget_ms)
+{
+	int n=0;
+
+	if (!sched_erased(chip)) return 1;								// Programs wait for the erase
+	while (chip->sq_count) {
+		lfs_block_t block=chip->sq_addr[chip->sq_head]/FS_SECTOR_SIZE;
+		if (chip->sq_erase_map[block/32] & (1U<<(block%32))) {
+			if (sched_erase_start(chip, block)) chip->sqstat.background_erases++;
+			return 1;
+		}
+		if (n && (HAL_GetTick()-start)>=budget_ms) return 1;
+		sched_write(chip);
+		n++;
+	}
+	for (uint32_t i=0; i<sizeof(chip->sq_erase_map)/sizeof(chip->sq_erase_map[0]); i++) {
+		if (chip->sq_erase_map[i]) {
+			if (sched_erase_start(chip, i*32+__builtin_ctz(chip->sq_erase_map[i]))) chip->sqstat.background_erases++;
+			return 1;
+		}
+	}
+	return 0;
+}
+#endif
 
-lfs_soff_t stmlfs_lseek(lfs_file_t *file, lfs_soff_t off, int whence)
+void stmlfs_sched(stmlfs_t *fs, bool enable)
 {
-    return lfs_file_seek(&lfs, file, off, whence);
+#ifdef FS_SCHED_PAGES
+	while (stmlfs_sched_work(fs, UINT32_MAX));						// Written through from now on, the sectors must be erased
+	fs->chip->sq_enable=enable;
+	if (fs_second(fs)) fs_second(fs)->sq_enable=enable;
+#else
+	UNUSED(*fs);
+	UNUSED(enable);
+#endif
 }
 
-int stmlfs_truncate(lfs_file_t *file, lfs_off_t size)
+int stmlfs_schedstat(stmlfs_t *fs, struct littlfs_sched_t* stat)
 {
-    return lfs_file_truncate(&lfs, file, size);
+#ifdef FS_SCHED_PAGES
+	*stat=fs->chip->sqstat;
+	if (fs_second(fs)) stat_add(stat,&fs_second(fs)->sqstat,sizeof(*stat));
+#else
+	UNUSED(*fs);
+	memset(stat,0,sizeof(*stat));
+#endif
+    return LFS_ERR_OK;
 }
 
-lfs_soff_t stmlfs_tell(lfs_file_t *file)
+int stmlfs_mirrorstat(stmlfs_t *fs, struct littlfs_mirror_t* stat)
 {
-    return lfs_file_tell(&lfs, file);
+	*stat=fs->mirrorstat;
+    return LFS_ERR_OK;
 }
 
-int stmlfs_stat(const char* path, struct lfs_info* info)
+//-------------------------------------------------------------------------------------------------
+// Mirror scrubbing
+// littlefs only checksums its metadata, so a copy that returns wrong file data goes unnoticed by
+// reads. stmlfs_mirror_verify compares the two copies sector by sector and returns the number of
+// sectors that differ, it can't tell which copy is right. stmlfs_mirror_rebuild copies every
+// differing sector from the copy on chip from to the other one, for example after replacing a
+// chip or after a mount that only worked from one copy, and returns the number of sectors copied.
+// Both wait for all queued programs and erases first and may be called while mounted.
+//-------------------------------------------------------------------------------------------------
+static int mirror_scrub(stmlfs_t *fs, W25Q_t *from)
 {
-    return lfs_stat(&lfs, path, info);
+	uint8_t a[FS_PAGE_SIZE], b[FS_PAGE_SIZE];
+	W25Q_t *to=(from==NULL) ? NULL : (from==fs->chip) ? fs->mirror : fs->chip;
+	lfs_block_t count=fs->cfg.block_count*(fs->cfg.block_size/FS_SECTOR_SIZE);
+	int differ=0;
+
+	if (fs->mirror==NULL) return LFS_ERR_INVAL;
+	while (stmlfs_sched_work(fs, UINT32_MAX));						// Queued pages and held back erases to both chips
+	for (lfs_block_t sector=fs->first; sector<fs->first+count; sector++) {
+		bool same=true;
+		for (lfs_off_t off=0; off<FS_SECTOR_SIZE && same; off+=FS_PAGE_SIZE) {
+			flash_read(fs->chip,sector,off,FS_PAGE_SIZE,a);
+			flash_read(fs->mirror,sector,off,FS_PAGE_SIZE,b);
+			same=(memcmp(a,b,FS_PAGE_SIZE)==0);
+		}
+		if (same) continue;
+		differ++;
+		if (to==NULL) continue;										// Only verifying
+
+#ifdef FS_READAHEAD
+		readahead_drop(to,sector*FS_SECTOR_SIZE,FS_SECTOR_SIZE);
+#endif
+		W25Q_Erase_Sector(to, sector);
+		to->erased_map[sector/32] |= (1U<<(sector%32));
+		for (lfs_off_t off=0; off<FS_SECTOR_SIZE; off+=FS_PAGE_SIZE) {
+			flash_read(from,sector,off,FS_PAGE_SIZE,a);
+			bool blank=true;
+			for (int i=0; i<FS_PAGE_SIZE && blank; i++) blank=(a[i]==0xFF);
+			if (blank) continue;									// Left erased
+			map_programmed(to,sector*FS_SECTOR_SIZE+off,FS_PAGE_SIZE);
+			W25Q_Write_block(to,sector,off,FS_PAGE_SIZE,a);
+			prog_wait(to);
+		}
+	}
+	if (to) fs->bad=NULL;											// Both copies are good again
+	return differ;
 }
 
-lfs_ssize_t stmlfs_getattr(const char* path, uint8_t type, void* buffer, lfs_size_t size)
+int stmlfs_mirror_verify(stmlfs_t *fs)
 {
-    return lfs_getattr(&lfs, path, type, buffer, size);
+	return mirror_scrub(fs,NULL);
 }
 
-int stmlfs_setattr(const char* path, uint8_t type, const void* buffer, lfs_size_t size)
+int stmlfs_mirror_rebuild(stmlfs_t *fs, W25Q_t *from)
 {
-    return lfs_setattr(&lfs, path, type, buffer, size);
+	if (from!=fs->chip && from!=fs->mirror) return LFS_ERR_INVAL;
+	return mirror_scrub(fs,from);
 }
 
-int stmlfs_removeattr(const char* path, uint8_t type)
+//-------------------------------------------------------------------------------------------------
+// Work counters of the whole stack for telemetry, from SPI bytes and commands up to littlefs
+// commits and compactions. prog_bytes against write_bytes is the write amplification. With reset
+// the counters restart from zero after they are copied, the SPI ones for every volume on the chip.
+//-------------------------------------------------------------------------------------------------
+int stmlfs_stats(stmlfs_t *fs, struct littlfs_stats_t* stat, bool reset)
 {
-    return lfs_removeattr(&lfs, path, type);
+	memset(stat,0,sizeof(*stat));
+	stat_add(&stat->spi,&fs->chip->spistat,sizeof(stat->spi));
+	if (fs_second(fs)) stat_add(&stat->spi,&fs_second(fs)->spistat,sizeof(stat->spi));
+	stat->write_bytes=fs->write_bytes;
+	stat->prog_bytes=fs->prog_bytes-fs->prog_base;
+	int err=lfs_fs_stats(&fs->lfs,&stat->lfs,reset);
+
+	if (reset) {
+		memset(&fs->chip->spistat,0,sizeof(fs->chip->spistat));
+		if (fs_second(fs)) memset(&fs_second(fs)->spistat,0,sizeof(fs->chip->spistat));
+		fs->write_bytes=0;
+		fs->prog_base=fs->prog_bytes;
+	}
+	return err;
 }
 
-int stmlfs_opencfg(lfs_file_t *file, const char* path, int flags, const struct lfs_file_config* config)
+int stmlfs_fsstat(stmlfs_t *fs, struct littlfs_fsstat_t* stat)
 {
-    return lfs_file_opencfg(&lfs, file, path, flags, config);
+    stat->block_count = fs->cfg.block_count;
+    stat->block_size  = fs->cfg.block_size;
+    stat->blocks_used = lfs_fs_size(&fs->lfs);
+    stat->compactions = fs->lfs.stats.compactions;
+    return LFS_ERR_OK;
 }
 
-lfs_soff_t stmlfs_size(lfs_file_t *file)
+
+
+lfs_soff_t stmlfs_lseek(stmlfs_t *fs, lfs_file_t *file, lfs_soff_t off, int whence)
+{
+    lfs_soff_t res=lfs_file_seek(&fs->lfs, file, off, whence);
+    RECORD(NULL,NULL,"seek %lx %ld %d %ld",(unsigned long)file,(long)off,whence,(long)res);
+    return res;
+}
+
+int stmlfs_truncate(stmlfs_t *fs, lfs_file_t *file, lfs_off_t size)
+{
+    int err=lfs_file_truncate(&fs->lfs, file, size);
+    RECORD(NULL,NULL,"truncate %lx %lu %d",(unsigned long)file,(unsigned long)size,err);
+    return err;
+}
+
+lfs_ssize_t stmlfs_reserve(stmlfs_t *fs, lfs_file_t *file, lfs_size_t size)
+{
+    lfs_ssize_t res=lfs_file_reserve(&fs->lfs, file, size);
+    RECORD(NULL,NULL,"reserve %lx %lu %ld",(unsigned long)file,(unsigned long)size,(long)res);
+    return res;
+}
+
+lfs_soff_t stmlfs_tell(stmlfs_t *fs, lfs_file_t *file)
+{
+    return lfs_file_tell(&fs->lfs, file);
+}
+
+int stmlfs_stat(stmlfs_t *fs, const char* path, struct lfs_info* info)
+{
+    int err=lfs_stat(&fs->lfs, path, info);
+    RECORD(path,NULL,"stat %d",err);
+    return err;
+}
+
+lfs_ssize_t stmlfs_getattr(stmlfs_t *fs, const char* path, uint8_t type, void* buffer, lfs_size_t size)
+{
+    lfs_ssize_t res=lfs_getattr(&fs->lfs, path, type, buffer, size);
+    RECORD(path,NULL,"getattr %u %lu %ld",type,(unsigned long)size,(long)res);
+    return res;
+}
+
+int stmlfs_setattr(stmlfs_t *fs, const char* path, uint8_t type, const void* buffer, lfs_size_t size)
+{
+    int err=lfs_setattr(&fs->lfs, path, type, buffer, size);
+    RECORD(path,NULL,"setattr %u %lu %d",type,(unsigned long)size,err);
+    return err;
+}
+
+int stmlfs_removeattr(stmlfs_t *fs, const char* path, uint8_t type)
+{
+    int err=lfs_removeattr(&fs->lfs, path, type);
+    RECORD(path,NULL,"removeattr %u %d",type,err);
+    return err;
+}
+
+int stmlfs_opencfg(stmlfs_t *fs, lfs_file_t *file, const char* path, int flags, const struct lfs_file_config* config)
 {
-    return lfs_file_size(&lfs, file);
+    LATENCY_START();
+    int err=lfs_file_opencfg(&fs->lfs, file, path, flags, config);
+    LATENCY_END(STMLFS_LAT_OPEN);
+    RECORD(path,NULL,"open %lx %x %d",(unsigned long)file,flags,err);
+    return err;
+}
+
+lfs_soff_t stmlfs_size(stmlfs_t *fs, lfs_file_t *file)
+{
+    return lfs_file_size(&fs->lfs, file);
+}
+
+int stmlfs_mkdir(stmlfs_t *fs, const char* path)
+{
+    LATENCY_START();
+    int err=lfs_mkdir(&fs->lfs, path);
+    LATENCY_END(STMLFS_LAT_MKDIR);
+    RECORD(path,NULL,"mkdir %d",err);
+    return err;
 }
 
-int stmlfs_mkdir(const char* path)
+int stmlfs_ring_open(stmlfs_t *fs, lfs_ring_t *ring, const char* path, const struct lfs_ring_config* cfg)
 {
-    return lfs_mkdir(&lfs, path);
+    return lfs_ring_open(&fs->lfs, ring, path, cfg);
 }
 
 
 
 
-int stmlfs_dir_open(const char* path)
+lfs_dir_t* stmlfs_dir_open(stmlfs_t *fs, const char* path)
 {
 	lfs_dir_t* dir = lfs_malloc(sizeof(lfs_dir_t));
 	if (dir == NULL)
-		return -1;
-	if (lfs_dir_open(&lfs, dir, path) != LFS_ERR_OK) {
+		return NULL;
+	int err=lfs_dir_open(&fs->lfs, dir, path);
+	RECORD(path,NULL,"dopen %lx %d",(unsigned long)dir,err);
+	if (err != LFS_ERR_OK) {
 		lfs_free(dir);
-		return -1;
+		return NULL;
 	}
-	return (int)dir;
+	return dir;
 }
 
-int stmlfs_dir_close(int dir)
+int stmlfs_dir_close(stmlfs_t *fs, lfs_dir_t* dir)
 {
-	return lfs_dir_close(&lfs, (lfs_dir_t*)dir);
-	lfs_free((void*)dir);
+	int err=lfs_dir_close(&fs->lfs, dir);
+	RECORD(NULL,NULL,"dclose %lx %d",(unsigned long)dir,err);
+	lfs_free(dir);
+	return err;
 }
 
-int stmlfs_dir_read(int dir, struct lfs_info* info)
+int stmlfs_dir_read(stmlfs_t *fs, lfs_dir_t* dir, struct lfs_info* info)
 {
-    return lfs_dir_read(&lfs, (lfs_dir_t*)dir, info);
+    LATENCY_START();
+    int res=lfs_dir_read(&fs->lfs, dir, info);
+    LATENCY_END(STMLFS_LAT_DIR_READ);
+    RECORD(NULL,NULL,"dread %lx %d",(unsigned long)dir,res);
+    return res;
 }
 
-int stmlfs_dir_seek(int dir, lfs_off_t off)
+int stmlfs_dir_seek(stmlfs_t *fs, lfs_dir_t* dir, lfs_off_t off)
 {
-    return lfs_dir_seek(&lfs, (lfs_dir_t*)dir, off);
+    return lfs_dir_seek(&fs->lfs, dir, off);
 }
 
-lfs_soff_t stmlfs_dir_tell(int dir)
+lfs_soff_t stmlfs_dir_tell(stmlfs_t *fs, lfs_dir_t* dir)
 {
-    return lfs_dir_tell(&lfs, (lfs_dir_t*)dir);
+    return lfs_dir_tell(&fs->lfs, dir);
 }
 
-int stmlfs_dir_rewind(int dir)
+int stmlfs_dir_rewind(stmlfs_t *fs, lfs_dir_t* dir)
 {
-    return lfs_dir_rewind(&lfs, (lfs_dir_t*)dir);
+    return lfs_dir_rewind(&fs->lfs, dir);
 }
 
 const char* stmlfs_errmsg(int err)
@@ -274,19 +1477,19 @@ const char* stmlfs_errmsg(int err)
 //-------------------------------------------------------------------------------------------------
 // display each directory entry name
 //-------------------------------------------------------------------------------------------------
-void dump_dir(void)
+void dump_dir(stmlfs_t *fs)
 {
-    int dir = stmlfs_dir_open("/");
-    if (dir < 0) {
+    lfs_dir_t* dir = stmlfs_dir_open(fs, "/");
+    if (dir == NULL) {
     	printf("\nstmlfs_dir_open failed\n");
     	return;
     }
 
     struct lfs_info info;
-    while (stmlfs_dir_read(dir, &info) > 0) {
+    while (stmlfs_dir_read(fs, dir, &info) > 0) {
         printf("%16.16s ", info.name);
         if (info.type==LFS_TYPE_REG) {
-            printf(" %04ld\n",info.size);
+            printf(" %04ld\n",(long)info.size);
             // static const char *prefixes[] = {"", "K", "M", "G"};
             // for (int i = sizeof(prefixes)/sizeof(prefixes[0])-1; i >= 0; i--) {
             //     if (info.size >= (1 << 10*i)-1) {
@@ -298,10 +1501,10 @@ void dump_dir(void)
             printf("\n");
         }
     }
-    stmlfs_dir_close(dir);
+    stmlfs_dir_close(fs, dir);
 
     struct littlfs_fsstat_t stat;                                      // Show file system sizes
-    stmlfs_fsstat(&stat);
+    stmlfs_fsstat(fs, &stat);
     printf("\nBlocks %d, block size %d, used %d\n", (int)stat.block_count, (int)stat.block_size,(int)stat.blocks_used);
 
 }
@@ -312,56 +1515,98 @@ void dump_dir(void)
 // STM32 SPI Driver
 //-------------------------------------------------------------------------------------------------
 
+static void read_ready(W25Q_t *chip);
+
 void W25Q_Delay(uint32_t time)
 {
 	HAL_Delay(time);
 }
 
-void csLOW (void)
+void csLOW(W25Q_t *chip)
+{
+#ifdef FS_READAHEAD
+	for (W25Q_t *c=chips; c; c=c->next) {
+		if (c->spi==chip->spi) readahead_wait(c, true);				// Stop a read-ahead transfer, the bus is needed
+	}
+#endif
+	HAL_GPIO_WritePin(chip->cs_port, chip->cs_pin, GPIO_PIN_RESET);
+	chip->cmd_next=true;
+}
+
+void csHIGH(W25Q_t *chip)
+{
+	HAL_GPIO_WritePin(chip->cs_port, chip->cs_pin, GPIO_PIN_SET);
+}
+
+void SPI_Write(W25Q_t *chip, uint8_t *data, uint16_t len)
 {
-	HAL_GPIO_WritePin(SPI1_CS_GPIO_Port, SPI1_CS_Pin, GPIO_PIN_RESET);
+	struct littlfs_spistat_t *stat=&chip->spistat;
+
+	if (chip->cmd_next) {											// First byte after /CS went low
+		switch (data[0]) {
+			case 0x03: stat->reads++; break;
+			case 0x02: stat->page_programs++; break;
+			case 0x20: stat->sector_erases++; break;
+			case 0x05: case 0x35: case 0x15: stat->status_reads++; break;
+			case 0x06: stat->write_enables++; break;
+			case 0x75: stat->suspends++; break;
+			case 0x7A: stat->resumes++; break;
+			default: stat->other_cmds++; break;
+		}
+		chip->cmd_next=false;
+	}
+	stat->tx_bytes+=len;
+	HAL_SPI_Transmit(chip->spi, data, len, 2000);
 }
 
-void csHIGH (void)
+void SPI_Read(W25Q_t *chip, uint8_t *data, uint16_t len)
 {
-	HAL_GPIO_WritePin(SPI1_CS_GPIO_Port, SPI1_CS_Pin, GPIO_PIN_SET);
+	chip->spistat.rx_bytes+=len;
+	HAL_SPI_Receive(chip->spi, data, len, 5000);
 }
 
-void SPI_Write (uint8_t *data, uint16_t len)
+static void busy_wait(W25Q_t *chip)									// Poll BUSY until the chip is done
 {
-	HAL_SPI_Transmit(&W25Q_SPI, data, len, 2000);
+	uint32_t start=DWT->CYCCNT;
+
+	while(W25Q_ReadStatus(chip, 1)&0x01);
+	busy_count(chip, start);
 }
 
-void SPI_Read (uint8_t *data, uint16_t len)
+static void busy_count(W25Q_t *chip, uint32_t start)
 {
-	HAL_SPI_Receive(&W25Q_SPI, data, len, 5000);
+	uint32_t cycles_us=SystemCoreClock/1000000;
+
+	chip->busy_cycles+=DWT->CYCCNT-start;							// Whole us only, the rest carries over
+	chip->spistat.busy_us+=chip->busy_cycles/cycles_us;
+	chip->busy_cycles%=cycles_us;
 }
 
 /**************************************************************************************************/
 
-void W25Q_Reset (void)
+void W25Q_Reset(W25Q_t *chip)
 {
 	uint8_t tData[2];
 	tData[0] = 0x66;  												// enable Reset
 	tData[1] = 0x99;  												// Reset
-	csLOW();
-	SPI_Write(tData, 2);
-	csHIGH();
+	csLOW(chip);
+	SPI_Write(chip, tData, 2);
+	csHIGH(chip);
 	W25Q_Delay(100);
 }
 
-uint32_t W25Q_ReadID (void)
+uint32_t W25Q_ReadID(W25Q_t *chip)
 {
 	uint8_t tData = 0x9F;  // Read JEDEC ID
 	uint8_t rData[3];
-	csLOW();
-	SPI_Write(&tData, 1);
-	SPI_Read(rData, 3);
-	csHIGH();
+	csLOW(chip);
+	SPI_Write(chip, &tData, 1);
+	SPI_Read(chip, rData, 3);
+	csHIGH(chip);
 	return ((rData[0]<<16)|(rData[1]<<8)|rData[2]);
 }
 
-uint8_t W25Q_ReadStatus(int reg)									// Read status reg1,2,3
+uint8_t W25Q_ReadStatus(W25Q_t *chip, int reg)						// Read status reg1,2,3
 {
 	uint8_t tData,rData;
 	switch(reg){
@@ -372,14 +1617,14 @@ uint8_t W25Q_ReadStatus(int reg)									// Read status reg1,2,3
 			printf("Invalid status register 0\n");
 			return 0;
 	}
-	csLOW();
-	SPI_Write(&tData, 1);
-	SPI_Read(&rData, 1);
-	csHIGH();
+	csLOW(chip);
+	SPI_Write(chip, &tData, 1);
+	SPI_Read(chip, &rData, 1);
+	csHIGH(chip);
 	return (rData);
 }
 
-void W25Q_WriteStatus(int reg, uint8_t newstatus)
+void W25Q_WriteStatus(W25Q_t *chip, int reg, uint8_t newstatus)
 {
 	uint8_t tData[2];
 	switch(reg){
@@ -390,23 +1635,23 @@ void W25Q_WriteStatus(int reg, uint8_t newstatus)
 	}
 
 	tData[1]=newstatus;
-	write_enable();
-	csLOW();
-	SPI_Write(tData, 2);
-	csHIGH();
-	write_disable();
+	write_enable(chip);
+	csLOW(chip);
+	SPI_Write(chip, tData, 2);
+	csHIGH(chip);
+	write_disable(chip);
 }
 
-uint64_t W25Q_ReadUniqueID(void)
+uint64_t W25Q_ReadUniqueID(W25Q_t *chip)
 {
 	uint8_t tData[5];  												// Read Unique 64bits  ID
 	uint8_t rData[8];
 
 	tData[0] = 0x4B;
-	csLOW();
-	SPI_Write(tData, 5);
-	SPI_Read(rData, 8);
-	csHIGH();
+	csLOW(chip);
+	SPI_Write(chip, tData, 5);
+	SPI_Read(chip, rData, 8);
+	csHIGH(chip);
 	printf("64bits Identifier = 0x");
 	for (int i=0;i<8;i++) printf("%02x",rData[i]);
 	printf("\n");
@@ -415,16 +1660,16 @@ uint64_t W25Q_ReadUniqueID(void)
 			((uint64_t)rData[4]<<24)|((uint64_t)rData[5]<<16)|((uint64_t)rData[6]<<8)|(uint64_t)rData[7]);
 }
 
-void W25Q_ReadSFDP(uint8_t *rData)
+void W25Q_ReadSFDP(W25Q_t *chip, uint8_t *rData)
 {
 	uint8_t tData[5]={0x5A,0,0,0,0};
-	csLOW();  														// pull the CS Low
-	SPI_Write(tData, 5);
-	SPI_Read(rData, 256);  											// Read the data
-	csHIGH();  														// pull the CS High
+	csLOW(chip);													// pull the CS Low
+	SPI_Write(chip, tData, 5);
+	SPI_Read(chip, rData, 256);										// Read the data
+	csHIGH(chip);													// pull the CS High
 }
 
-void W25Q_Read (uint32_t block, uint16_t offset, uint32_t size, uint8_t *rData)
+void W25Q_Read(W25Q_t *chip, uint32_t block, uint16_t offset, uint32_t size, uint8_t *rData)
 {
 	uint8_t tData[6];
 	uint32_t memAddr = (block*FS_SECTOR_SIZE) + offset;
@@ -434,13 +1679,19 @@ void W25Q_Read (uint32_t block, uint16_t offset, uint32_t size, uint8_t *rData)
 	tData[2] = (memAddr>>8)&0xFF;
 	tData[3] = (memAddr)&0xFF; 										// LSB of the memory Address
 
-	csLOW();  														// pull the CS Low
-	SPI_Write(tData, 4);  											// 24 bit memory address
-	SPI_Read(rData, size);  										// Read the data
-	csHIGH();  														// pull the CS High
+	read_ready(chip);
+	csLOW(chip);													// pull the CS Low
+	SPI_Write(chip, tData, 4);										// 24 bit memory address
+	while (size) {
+		uint16_t len = (size > 0x8000) ? 0x8000 : size;				// HAL transfers are limited to 16 bits
+		SPI_Read(chip, rData, len);									// Read the data
+		rData += len;
+		size -= len;
+	}
+	csHIGH(chip);													// pull the CS High
 }
 
-void W25Q_FastRead (uint32_t block, uint16_t offset, uint32_t size, uint8_t *rData)
+void W25Q_FastRead(W25Q_t *chip, uint32_t block, uint16_t offset, uint32_t size, uint8_t *rData)
 {
 	uint8_t tData[6];
 	uint32_t memAddr = (block*FS_SECTOR_SIZE) + offset;
@@ -451,65 +1702,147 @@ void W25Q_FastRead (uint32_t block, uint16_t offset, uint32_t size, uint8_t *rDa
 	tData[3] = (memAddr)&0xFF; 										// LSB of the memory Address
 	tData[4] = 0;  													// Dummy clock
 
-	csLOW();  														// pull the CS Low
-	SPI_Write(tData, 5);  											// 24 bit memory address
-	SPI_Read(rData, size);  										// Read the data
-	csHIGH();  														// pull the CS High
+	read_ready(chip);
+	csLOW(chip);													// pull the CS Low
+	SPI_Write(chip, tData, 5);										// 24 bit memory address
+	SPI_Read(chip, rData, size);									// Read the data
+	csHIGH(chip);													// pull the CS High
 }
 
-void write_enable(void)
+void write_enable(W25Q_t *chip)
 {
 	uint8_t tData = 0x06;  											// enable write
-	csLOW();
-	SPI_Write(&tData, 1);
-	csHIGH();
-	W25Q_Delay(5);  												// 5ms delay
+	W25Q_Wait(chip);												// One program or erase at a time
+	csLOW(chip);
+	SPI_Write(chip, &tData, 1);
+	csHIGH(chip);													// WEL is set when CS goes high, no need to wait
 }
 
-void write_disable(void)
+void write_disable(W25Q_t *chip)
 {
 	uint8_t tData = 0x04;  											// disable write
-	csLOW();
-	SPI_Write(&tData, 1);
-	csHIGH();
-	W25Q_Delay(5);  												// 5ms delay
+	csLOW(chip);
+	SPI_Write(chip, &tData, 1);
+	csHIGH(chip);
 }
 
-void W25Q_Erase_Chip(void)
+void W25Q_Erase_Chip(W25Q_t *chip)
 {
 	uint8_t tData = 0x60;  											// Chip Erase
 
-	write_enable();
-	csLOW();
-	SPI_Write(&tData, 1);
-	csHIGH();
-	write_disable();
+#ifdef FS_READAHEAD
+	readahead_drop(chip,0,chip->size);
+#endif
+	write_enable(chip);
+	csLOW(chip);
+	SPI_Write(chip, &tData, 1);
+	csHIGH(chip);
+	write_disable(chip);
 
-	while(W25Q_ReadStatus(1)&0x01);									// Wait for BUSY to go low, TODO add timeout?
+	busy_wait(chip);												// Wait for BUSY to go low, TODO add timeout?
 }
 
-void W25Q_Erase_Sector(uint16_t numsector)
+void W25Q_Erase_Sector(W25Q_t *chip, uint16_t numsector)
 {
 	uint8_t tData[6];
 	uint32_t memAddr = numsector*FS_SECTOR_SIZE;					// Each sector contains 16 pages * 256 bytes
 
-	write_enable();
+#ifdef FS_READAHEAD
+	readahead_drop(chip,memAddr,FS_SECTOR_SIZE);
+#endif
+	write_enable(chip);
 
 	tData[0] = 0x20;  												// Erase sector
 	tData[1] = (memAddr>>16)&0xFF;  								// MSB of the memory Address
 	tData[2] = (memAddr>>8)&0xFF;
 	tData[3] = (memAddr)&0xFF; 										// LSB of the memory Address
 
-	csLOW();
-	SPI_Write(tData, 4);
-	csHIGH();
+	csLOW(chip);
+	SPI_Write(chip, tData, 4);
+	csHIGH(chip);
 
-	while(W25Q_ReadStatus(1)&0x01);									// Check BUSY is low, if not wait, TODO add timeout?
+	busy_wait(chip);												// Check BUSY is low, if not wait, TODO add timeout?
 
-	write_disable();
+	write_disable(chip);
 }
 
-void Write_page(uint32_t page, uint16_t offset, uint32_t size, const uint8_t *data)
+//-------------------------------------------------------------------------------------------------
+// Background program and erase
+// Write_page and W25Q_Erase_Start return as soon as the chip is busy, the next command to the chip
+// waits for it instead, so the CPU, or another chip, gets the time. A read during an erase
+// suspends it and leaves it suspended, so a burst of reads pays tSUS once. W25Q_Busy lets it
+// continue, programs and erases wait for it to finish. The sector itself reads back as garbage
+// until then. A read during a page program just waits, that takes under a ms.
+//-------------------------------------------------------------------------------------------------
+void W25Q_Erase_Start(W25Q_t *chip, uint16_t numsector)
+{
+	uint8_t tData[4];
+	uint32_t memAddr = numsector*FS_SECTOR_SIZE;
+
+#ifdef FS_READAHEAD
+	readahead_drop(chip,memAddr,FS_SECTOR_SIZE);
+#endif
+	write_enable(chip);
+
+	tData[0] = 0x20;  												// Erase sector
+	tData[1] = (memAddr>>16)&0xFF;  								// MSB of the memory Address
+	tData[2] = (memAddr>>8)&0xFF;
+	tData[3] = (memAddr)&0xFF; 										// LSB of the memory Address
+
+	csLOW(chip);
+	SPI_Write(chip, tData, 4);
+	csHIGH(chip);
+	chip->erase_bg=true;
+}
+
+static void prog_wait(W25Q_t *chip)
+{
+	if (chip->prog_bg) {
+		busy_wait(chip);
+		chip->prog_bg=false;
+	}
+}
+
+static void read_ready(W25Q_t *chip)
+{
+	uint8_t tData = 0x75;  											// Erase suspend
+
+	prog_wait(chip);
+	if (!chip->erase_bg || chip->erase_held) return;
+	csLOW(chip);
+	SPI_Write(chip, &tData, 1);
+	csHIGH(chip);
+	busy_wait(chip);												// Suspended within tSUS
+	chip->erase_held=(W25Q_ReadStatus(chip, 2)&0x80)!=0;			// SUS clear, it had finished already
+	chip->erase_bg=chip->erase_held;
+}
+
+bool W25Q_Busy(W25Q_t *chip)										// True while a background program or erase is running
+{
+	uint8_t tData = 0x7A;  											// Erase resume
+
+	if (chip->erase_held) {
+		csLOW(chip);
+		SPI_Write(chip, &tData, 1);
+		csHIGH(chip);
+		chip->erase_held=false;
+	}
+	if ((chip->erase_bg || chip->prog_bg) && !(W25Q_ReadStatus(chip, 1)&0x01)) {
+		chip->erase_bg=false;
+		chip->prog_bg=false;
+	}
+	return chip->erase_bg || chip->prog_bg;
+}
+
+void W25Q_Wait(W25Q_t *chip)
+{
+	uint32_t start=DWT->CYCCNT;
+
+	while (W25Q_Busy(chip));
+	busy_count(chip, start);
+}
+
+void Write_page(W25Q_t *chip, uint32_t page, uint16_t offset, uint32_t size, const uint8_t *data)
 {
 	uint8_t tData[266];
 	uint32_t memAddr = (page*FS_PAGE_SIZE)+offset;
@@ -517,7 +1850,10 @@ void Write_page(uint32_t page, uint16_t offset, uint32_t size, const uint8_t *da
 
 	dprintf("W25Q_Write(page=%ld, offset=%d, memaddr=%ld) memAddr=%08lx\n",page,offset,size,memAddr);
 
-	write_enable();
+#ifdef FS_READAHEAD
+	readahead_drop(chip,memAddr,size);
+#endif
+	write_enable(chip);
 
 	tData[0] = 0x02;  												// block program
 	tData[1] = (memAddr>>16)&0xFF;  								// MSB of the memory Address
@@ -527,45 +1863,38 @@ void Write_page(uint32_t page, uint16_t offset, uint32_t size, const uint8_t *da
 
 	memcpy(&tData[indx],data,size);
 
-	csLOW();
-	SPI_Write(tData, indx+size);
-	csHIGH();
-
-	while(W25Q_ReadStatus(1)&0x01);									// Check BUSY is low, if not wait, TODO add timeout?
-	write_disable();
+	csLOW(chip);
+	SPI_Write(chip, tData, indx+size);
+	csHIGH(chip);
+	chip->prog_bg=true;												// The next command waits for it, WEL clears by itself
 }
 
-void W25Q_Write_block(uint32_t block, uint16_t offset, uint32_t size, const uint8_t *data)
+void W25Q_Write_block(W25Q_t *chip, uint32_t block, uint16_t offset, uint32_t size, const uint8_t *data)
 {
 	uint32_t startpage=((block*FS_SECTOR_SIZE)+offset)/FS_PAGE_SIZE;
 	uint32_t bytesleft=size;
 	uint32_t newoff=offset%256;
 	uint32_t bufptr=0;
 
-	dprintf("W25Q_Write_block(%ld,%d,%ld)  startpage=%ld newoff=%ld\n",block,offset,size,startpage,newoff);
+	dprintf("W25Q_Write_block(chip,%ld,%d,%ld)  startpage=%ld newoff=%ld\n",block,offset,size,startpage,newoff);
 
-	dprintf("First %ld,%04ld,%03ld ",startpage,newoff,(FS_PAGE_SIZE-newoff));
-	Write_page(startpage, newoff, (FS_PAGE_SIZE-newoff), data);				// First block
-	bufptr=(FS_PAGE_SIZE-newoff);
-	bytesleft-=(FS_PAGE_SIZE-newoff);
+	bufptr=lfs_min(size,FS_PAGE_SIZE-newoff);						// Up to the end of the first page
+	dprintf("First %ld,%04ld,%03ld ",startpage,newoff,bufptr);
+	Write_page(chip, startpage, newoff, bufptr, data);				// First block
+	bytesleft-=bufptr;
 
 	startpage++;
 	while (bytesleft) {
 
 		if (bytesleft>256) {
 			dprintf("Page %ld,%04d,%03d ",startpage,0,FS_PAGE_SIZE);
-			Write_page(startpage, 0, FS_PAGE_SIZE, &data[bufptr]);
+			Write_page(chip, startpage, 0, FS_PAGE_SIZE, &data[bufptr]);
 			bytesleft-=FS_PAGE_SIZE;
 			bufptr+=FS_PAGE_SIZE;
 		} else {
-			if (newoff) {
-				dprintf("Last  %ld,%04d,%03ld ",startpage,0,newoff);
-				Write_page(startpage, 0, newoff, &data[bufptr]);	// Last block
-			} else {
-				dprintf("Last  %ld,%04d,%03ld ",startpage,0,bytesleft);
-				Write_page(startpage, 0, bytesleft, &data[bufptr]);
-				bufptr+=bytesleft;
-			}
+			dprintf("Last  %ld,%04d,%03ld ",startpage,0,bytesleft);
+			Write_page(chip, startpage, 0, bytesleft, &data[bufptr]);	// Last block
+			bufptr+=bytesleft;
 			bytesleft=0;
 		}
 		startpage++;
@@ -573,6 +1902,315 @@ void W25Q_Write_block(uint32_t block, uint16_t offset, uint32_t size, const uint
 	dprintf("\n");
 }
 
+//-------------------------------------------------------------------------------------------------
+// Sequential read-ahead
+// When a read starts where the previous one ended, the data that follows is fetched by SPI DMA
+// while the caller works on what it has. Two buffers take turns, one is refilled as soon as the
+// reads have gone past it. A read that finds its data in a buffer only waits for the part still
+// in flight. Anything else that needs the bus stops the transfer in csLOW, what has arrived by then
+// is kept.
+// Fills stop at sector ends. The next sector is only fetched as long as the stream keeps running
+// into it, the ctz pointer lookups littlefs does between two blocks of a file do not end the
+// stream. Needs the SPI RX DMA stream set up in CubeMX, and the W25Q_t holding the buffers in DMA
+// reachable RAM (AXI SRAM on the H7). Without a DMA stream linked to the SPI handle the reads stay
+// synchronous.
+//-------------------------------------------------------------------------------------------------
+#ifdef FS_READAHEAD
+static void readahead_wait(W25Q_t *chip, bool stop)
+{
+	uint32_t left=0;
+
+	if (stop && chip->ra_busy) {
+		left=__HAL_DMA_GET_COUNTER(chip->spi->hdmarx);				// Bytes not transferred yet
+		HAL_SPI_Abort(chip->spi);
+		csHIGH(chip);
+		chip->ra_busy=false;
+	}
+	while (chip->ra_busy) {
+		__WFI();													// Woken by the DMA complete interrupt
+	}
+	for (int i=0; i<2; i++) {
+		if (chip->ra_state[i]==RA_BUSY) {
+#if defined(__DCACHE_PRESENT) && (__DCACHE_PRESENT == 1U)
+			SCB_InvalidateDCache_by_Addr((void *)chip->ra_buf[i],FS_READAHEAD);	// Drop lines cached during the transfer
+#endif
+			chip->ra_len[i]-=left;									// Only the latest fill can be in flight
+			chip->ra_end-=left;
+			chip->rastat.prefetch_bytes-=left;
+			chip->ra_state[i]=chip->ra_len[i] ? RA_READY : RA_EMPTY;
+		}
+	}
+}
+
+static void readahead_start(W25Q_t *chip, int i, uint32_t len)
+{
+	uint8_t tData[4];
+
+	tData[0] = 0x03;  												// enable Read
+	tData[1] = (chip->ra_end>>16)&0xFF;								// MSB of the memory Address
+	tData[2] = (chip->ra_end>>8)&0xFF;
+	tData[3] = (chip->ra_end)&0xFF;									// LSB of the memory Address
+
+	read_ready(chip);
+	csLOW(chip);
+	SPI_Write(chip, tData, 4);
+	chip->ra_busy=true;
+	chip->spistat.rx_bytes+=len;									// Counted when started, an aborted transfer too
+	if (HAL_SPI_Receive_DMA(chip->spi, chip->ra_buf[i], len)!=HAL_OK) {
+		chip->ra_busy=false;
+		csHIGH(chip);
+		return;
+	}
+	chip->ra_addr[i]=chip->ra_end;
+	chip->ra_len[i]=len;
+	chip->ra_state[i]=RA_BUSY;
+	chip->ra_end+=len;
+	chip->rastat.prefetch_bytes+=len;
+}
+
+static lfs_size_t readahead_copy(W25Q_t *chip, uint32_t addr, uint8_t *buffer, lfs_size_t size)
+{
+	lfs_size_t n=0;
+
+	while (n<size) {
+		int i=0;
+		while (i<2 && (chip->ra_state[i]==RA_EMPTY || addr+n-chip->ra_addr[i]>=chip->ra_len[i])) i++;
+		if (i==2) break;
+
+		if (chip->ra_state[i]==RA_BUSY) {
+			chip->rastat.stalls++;
+			readahead_wait(chip, false);
+		}
+		uint32_t pos=addr+n-chip->ra_addr[i];
+		lfs_size_t len=lfs_min(size-n,chip->ra_len[i]-pos);
+		memcpy(buffer+n,&chip->ra_buf[i][pos],len);
+		n+=len;
+		if (pos+len==chip->ra_len[i]) chip->ra_state[i]=RA_EMPTY;	// Read past, free for the next fill
+	}
+	chip->rastat.hit_bytes+=n;
+	return n;
+}
+
+static void readahead_next(W25Q_t *chip, uint32_t addr, lfs_size_t size, lfs_size_t hit)
+{
+	bool stream=(addr==chip->ra_next);
+	bool start=(addr==chip->ra_last);
+
+	chip->ra_last=addr+size;
+	if (!stream && !start) return;
+
+	if (hit<size) {													// Ran past the window, restart it here
+		for (int i=0; i<2; i++) {
+			if (chip->ra_state[i]!=RA_EMPTY && chip->ra_addr[i]%FS_SECTOR_SIZE==0) chip->ra_cross=0;	// Fetched a sector the file did not continue in
+		}
+		readahead_drop(chip,0,chip->size);
+		chip->ra_end=addr+size;
+	}
+	if (addr==chip->ra_next && addr%FS_SECTOR_SIZE==0 && chip->ra_cross<2) chip->ra_cross++;	// The file did continue in this sector
+	chip->ra_next=addr+size;
+	if (!chip->ra_enable || chip->spi->hdmarx==NULL) return;
+	if (chip->ra_next%FS_SECTOR_SIZE==0) return;					// Keep the bus free for the lookup of the next block
+
+	for (int i=0; i<2 && !chip->ra_busy; i++) {						// One transfer at a time, the next read starts the other
+		uint32_t len=lfs_min(FS_READAHEAD,FS_SECTOR_SIZE-chip->ra_end%FS_SECTOR_SIZE);
+		if (chip->ra_state[i]==RA_EMPTY && chip->ra_end<chip->size && (chip->ra_cross==2 || chip->ra_end%FS_SECTOR_SIZE)) {
+			readahead_start(chip,i,len);
+		}
+	}
+}
+
+static void readahead_drop(W25Q_t *chip, uint32_t addr, uint32_t size)
+{
+	readahead_wait(chip, true);
+	for (int i=0; i<2; i++) {
+		if (chip->ra_addr[i]<addr+size && addr<chip->ra_addr[i]+chip->ra_len[i]) chip->ra_state[i]=RA_EMPTY;
+	}
+}
+
+static void readahead_fetch(W25Q_t *chip, uint32_t addr, uint32_t size)	// Fetch a range a read asks for next, at most FS_READAHEAD
+{
+	readahead_drop(chip,0,chip->size);
+	chip->ra_end=addr;
+	readahead_start(chip,0,size);
+}
+
+void W25Q_SPI_RxCplt(SPI_HandleTypeDef *hspi)						// SPI DMA receive complete, see FS_READAHEAD
+{
+	for (W25Q_t *chip=chips; chip; chip=chip->next) {
+		if (chip->spi==hspi && chip->ra_busy) {
+			csHIGH(chip);											// End of the read-ahead transfer
+			chip->ra_busy=false;
+		}
+	}
+}
+#endif
+
+//-------------------------------------------------------------------------------------------------
+// I/O scheduler
+// Programs are queued in RAM by page and go to the chip when littlefs syncs, when the queue is
+// full, or from stmlfs_sched_work while the system is idle. Reads do not wait for them, they are
+// served from the flash with the queued pages laid over the result. Programs to a page that is
+// already queued are merged into it. The part of a page nobody programmed stays 0xFF, which
+// leaves the flash as it is, so everything reaches the chip as whole page programs.
+// Sector erases are held back until the first queued page of the sector goes out or they can run
+// in the background, reads of the sector meanwhile return 0xFF.
+// Power loss safety rests on the order pages reach the chip. littlefs calls sync after it has
+// programmed the CRC of a commit (lfs_dir_commitcrc), and sched_flush writes the queue out
+// strictly in FIFO order, the order the pages were first programmed, so the file data a commit
+// points to is on the chip before the commit itself. A sync empties the queue, pages are only
+// merged with programs made since the last sync, never across one.
+//-------------------------------------------------------------------------------------------------
+#ifdef FS_SCHED_PAGES
+static int sched_find(W25Q_t *chip, uint32_t page)
+{
+	for (int i=0; i<chip->sq_count; i++) {
+		int slot=(chip->sq_head+i)%FS_SCHED_PAGES;
+		if (chip->sq_addr[slot]==page) return slot;
+	}
+	return -1;
+}
+
+static void sched_prog(W25Q_t *chip, uint32_t addr, const uint8_t *data, lfs_size_t size)
+{
+	while (size) {
+		uint32_t page=addr-addr%FS_PAGE_SIZE;
+		lfs_size_t len=lfs_min(size,page+FS_PAGE_SIZE-addr);
+		int slot=sched_find(chip, page);
+		if (slot<0) {
+			if (chip->sq_count==FS_SCHED_PAGES) sched_write(chip);	// Full, make room
+			slot=(chip->sq_head+chip->sq_count)%FS_SCHED_PAGES;
+			chip->sq_count++;
+			chip->sq_addr[slot]=page;
+			chip->sq_sync[slot]=chip->sq_syncs;
+			memset(chip->sq_data[slot],0xFF,FS_PAGE_SIZE);
+			chip->sqstat.queued_pages++;
+		}
+		assert(chip->sq_sync[slot]==chip->sq_syncs);				// Never merged across a sync
+		for (lfs_size_t i=0; i<len; i++) {
+			chip->sq_data[slot][addr-page+i]&=data[i];				// Programming only clears bits
+		}
+		addr+=len;
+		data+=len;
+		size-=len;
+	}
+}
+
+static void sched_patch(W25Q_t *chip, uint32_t addr, uint8_t *buffer, lfs_size_t size)
+{
+	for (uint32_t a=addr-addr%FS_SECTOR_SIZE; a<addr+size; a+=FS_SECTOR_SIZE) {
+		lfs_block_t block=a/FS_SECTOR_SIZE;
+		if (chip->sq_erase_map[block/32] & (1U<<(block%32))) {
+			uint32_t from=lfs_max(a,addr), to=lfs_min(a+FS_SECTOR_SIZE,addr+size);
+			memset(buffer+from-addr,0xFF,to-from);
+		}
+	}
+	if (chip->sq_count) chip->sqstat.reads_ahead++;
+	for (int i=0; i<chip->sq_count; i++) {
+		int slot=(chip->sq_head+i)%FS_SCHED_PAGES;
+		uint32_t page=chip->sq_addr[slot];
+		if (page<addr+size && addr<page+FS_PAGE_SIZE) {
+			uint32_t from=lfs_max(page,addr), to=lfs_min(page+FS_PAGE_SIZE,addr+size);
+			for (uint32_t a=from; a<to; a++) buffer[a-addr]&=chip->sq_data[slot][a-page];
+		}
+	}
+}
+
+static bool sched_erase_start(W25Q_t *chip, lfs_block_t block)		// Start erasing a held back sector, false if it is blank
+{
+	if (sector_is_erased(chip, block)) {
+		chip->sq_erase_map[block/32] &= ~(1U<<(block%32));
+		chip->erasestat.blank_hits++;
+		return false;
+	}
+	W25Q_Erase_Start(chip, block);
+	chip->sq_erasing=block;
+	return true;
+}
+
+static bool sched_erased(W25Q_t *chip)								// True once no erase runs in the background
+{
+	if (chip->sq_erasing<0) return true;
+	if (W25Q_Busy(chip)) return false;
+
+	lfs_block_t block=chip->sq_erasing;
+	chip->sq_erasing=-1;
+	chip->sq_erase_map[block/32] &= ~(1U<<(block%32));
+	chip->erased_map[block/32] |= (1U<<(block%32));
+	return true;
+}
+
+static bool sched_idle(W25Q_t *chip)								// True once the chip can take the next command
+{
+	return sched_erased(chip) && !W25Q_Busy(chip);
+}
+
+static void sched_step(W25Q_t *chip)								// Start the oldest page, or the erase it needs, the chip must be idle
+{
+	uint32_t addr=chip->sq_addr[chip->sq_head];
+	lfs_block_t block=addr/FS_SECTOR_SIZE;
+
+	if ((chip->sq_erase_map[block/32] & (1U<<(block%32))) && sched_erase_start(chip, block)) {
+		chip->erasestat.sync_erases++;								// First page of the sector, it waits for the erase
+		return;
+	}
+	chip->erased_map[block/32] &= ~(1U<<(block%32));
+	Write_page(chip,addr/FS_PAGE_SIZE,0,FS_PAGE_SIZE,chip->sq_data[chip->sq_head]);
+	chip->sq_head=(chip->sq_head+1)%FS_SCHED_PAGES;
+	chip->sq_count--;
+}
+
+static void sched_wait(W25Q_t *chip)
+{
+	uint32_t start=DWT->CYCCNT;
+
+	while (!sched_idle(chip)) {
+		W25Q_t *peer=chip->peer;									// Keep the stripe partner busy meanwhile
+		if (peer && peer->sq_count && sched_idle(peer)) sched_step(peer);
+	}
+	busy_count(chip, start);
+}
+
+static void sched_write(W25Q_t *chip)								// Oldest queued page to the chip
+{
+	int count=chip->sq_count;
+
+	while (chip->sq_count==count) {
+		sched_wait(chip);
+		sched_step(chip);
+	}
+}
+
+static void sched_flush(W25Q_t *chip)
+{
+	if (chip->sq_count) chip->sqstat.bursts++;
+	while (chip->sq_count) {
+		sched_write(chip);
+	}
+	chip->sq_syncs++;
+}
+
+static void sched_drop(W25Q_t *chip, lfs_block_t block)				// The sector is erased again or free, its queued pages are stale
+{
+	int n=0;
+
+	for (int i=0; i<chip->sq_count; i++) {
+		int from=(chip->sq_head+i)%FS_SCHED_PAGES;
+		if (chip->sq_addr[from]/FS_SECTOR_SIZE==block) {
+			chip->sqstat.dropped_pages++;
+			continue;
+		}
+		int to=(chip->sq_head+n)%FS_SCHED_PAGES;
+		if (to!=from) {
+			chip->sq_addr[to]=chip->sq_addr[from];
+			chip->sq_sync[to]=chip->sq_sync[from];
+			memcpy(chip->sq_data[to],chip->sq_data[from],FS_PAGE_SIZE);
+		}
+		n++;
+	}
+	chip->sq_count=n;
+	chip->sq_erase_map[block/32] &= ~(1U<<(block%32));
+}
+#endif
 
 void delay_us(uint16_t us)
 {
@@ -60,6 +60,7 @@ static int lfs_bd_read(lfs_t *lfs,
                 // is already in pcache?
                 diff = lfs_min(diff, pcache->size - (off-pcache->off));
                 memcpy(data, &pcache->buffer[off-pcache->off], diff);
+                lfs->stats.pcache_hits += 1;
 
                 data += diff;
                 off += diff;
@@ -77,6 +78,7 @@ static int lfs_bd_read(lfs_t *lfs,
                 // is already in rcache?
                 diff = lfs_min(diff, rcache->size - (off-rcache->off));
                 memcpy(data, &rcache->buffer[off-rcache->off], diff);
+                lfs->stats.rcache_hits += 1;
 
                 data += diff;
                 off += diff;
@@ -92,6 +94,7 @@ static int lfs_bd_read(lfs_t *lfs,
                 size >= lfs->cfg->read_size) {
             // bypass cache?
             diff = lfs_aligndown(diff, lfs->cfg->read_size);
+            lfs->stats.cache_misses += 1;
             int err = lfs->cfg->read(lfs->cfg, block, off, data, diff);
             if (err) {
                 return err;
@@ -105,6 +108,7 @@ static int lfs_bd_read(lfs_t *lfs,
 
         // load to cache, first condition can no longer fail
         LFS_ASSERT(!lfs->block_count || block < lfs->block_count);
+        lfs->stats.cache_misses += 1;
         rcache->block = block;
         rcache->off = lfs_aligndown(off, lfs->cfg->read_size);
         rcache->size = lfs_min(
@@ -185,6 +189,11 @@ static int lfs_bd_flush(lfs_t *lfs,
             return err;
         }
 
+        // files program through their own cache
+        if (pcache == &lfs->pcache) {
+            lfs->stats.meta_prog_bytes += diff;
+        }
+
         if (validate) {
             // check data on disk
             lfs_cache_drop(lfs, rcache);
@@ -246,8 +255,11 @@ static int lfs_bd_prog(lfs_t *lfs,
             size -= diff;
 
             pcache->size = lfs_max(pcache->size, off - pcache->off);
-            if (pcache->size == lfs->cfg->cache_size) {
-                // eagerly flush out pcache if we fill up
+            if (pcache->size == lfs->cfg->cache_size
+                    || off == lfs->cfg->block_size) {
+                // eagerly flush out pcache if we fill up or reach the end
+                // of the block, a pcache reloaded by lfs_file_reusetail
+                // isn't aligned to cache_size
                 int err = lfs_bd_flush(lfs, pcache, rcache, validate);
                 if (err) {
                     return err;
@@ -491,6 +503,49 @@ static inline void lfs_superblock_tole32(lfs_superblock_t *superblock) {
 }
 #endif
 
+// mount checkpoint, stored in the superblock pair, see lfs_fs_checkpoint
+struct lfs_mountck {
+    lfs_block_t root[2];
+    lfs_gstate_t gstate;
+    lfs_block_t used;
+    uint32_t gen;
+    uint32_t crc;
+};
+
+// the superblock entry as written with a checkpoint, the generation follows
+// the superblock and must match the one in the checkpoint
+struct lfs_mountck_superblock {
+    lfs_superblock_t superblock;
+    uint32_t gen;
+};
+
+// mount checkpoint states
+enum {
+    LFS_MOUNTCK_NONE    = 0, // no checkpoint on disk
+    LFS_MOUNTCK_VALID   = 1, // checkpoint on disk matches the filesystem
+    LFS_MOUNTCK_STALE   = 2, // checkpoint on disk is out of date
+};
+
+static void lfs_mountck_fromle32(struct lfs_mountck *ck) {
+    ck->root[0] = lfs_fromle32(ck->root[0]);
+    ck->root[1] = lfs_fromle32(ck->root[1]);
+    lfs_gstate_fromle32(&ck->gstate);
+    ck->used    = lfs_fromle32(ck->used);
+    ck->gen     = lfs_fromle32(ck->gen);
+    ck->crc     = lfs_fromle32(ck->crc);
+}
+
+#ifndef LFS_READONLY
+static void lfs_mountck_tole32(struct lfs_mountck *ck) {
+    ck->root[0] = lfs_tole32(ck->root[0]);
+    ck->root[1] = lfs_tole32(ck->root[1]);
+    lfs_gstate_tole32(&ck->gstate);
+    ck->used    = lfs_tole32(ck->used);
+    ck->gen     = lfs_tole32(ck->gen);
+    ck->crc     = lfs_tole32(ck->crc);
+}
+#endif
+
 #ifndef LFS_NO_ASSERT
 static bool lfs_mlist_isopen(struct lfs_mlist *head,
         struct lfs_mlist *node) {
@@ -565,9 +620,12 @@ static int lfs_fs_pred(lfs_t *lfs, const lfs_block_t dir[2],
 static lfs_stag_t lfs_fs_parent(lfs_t *lfs, const lfs_block_t dir[2],
         lfs_mdir_t *parent);
 static int lfs_fs_forceconsistency(lfs_t *lfs);
+static int lfs_fs_uncheckpoint(lfs_t *lfs);
 #endif
 
 static void lfs_fs_prepsuperblock(lfs_t *lfs, bool needssuperblock);
+static int lfs_fs_getcheckpoint(lfs_t *lfs, const lfs_mdir_t *dir,
+        struct lfs_mountck *ck);
 
 #ifdef LFS_MIGRATE
 static int lfs1_traverse(lfs_t *lfs,
@@ -584,9 +642,29 @@ static int lfs_file_close_(lfs_t *lfs, lfs_file_t *file);
 static lfs_soff_t lfs_file_size_(lfs_t *lfs, lfs_file_t *file);
 
 static lfs_ssize_t lfs_fs_size_(lfs_t *lfs);
+#ifndef LFS_READONLY
+static int lfs_fs_size_count(void *p, lfs_block_t block);
+#endif
 static int lfs_fs_traverse_(lfs_t *lfs,
         int (*cb)(void *data, lfs_block_t block), void *data,
         bool includeorphans);
+static void lfs_fs_traverseinit(lfs_t *lfs, lfs_traverse_t *trav,
+        bool includeorphans);
+static int lfs_fs_traversestep_(lfs_t *lfs, lfs_traverse_t *trav,
+        int (*cb)(void *data, lfs_block_t block), void *data,
+        lfs_size_t count);
+
+// states of an incremental traversal, see lfs_fs_traversestep_
+enum {
+    LFS_TRAV_MDIR       = 0, // visit the mdir at m.tail
+    LFS_TRAV_ENTRY      = 1, // visit entry id in m
+    LFS_TRAV_CTZ        = 2, // walk a ctz list of entry id-1 in m
+    LFS_TRAV_FILE       = 3, // visit the dirty ctz list of an open file
+    LFS_TRAV_FILECTZ    = 4, // walk the dirty ctz list of an open file
+    LFS_TRAV_FILEPOS    = 5, // visit the blocks being written by a file
+    LFS_TRAV_FILEBLOCK  = 6, // walk the blocks being written by a file
+    LFS_TRAV_DONE       = 7,
+};
 
 static int lfs_deinit(lfs_t *lfs);
 static int lfs_unmount_(lfs_t *lfs);
@@ -602,12 +680,19 @@ static void lfs_alloc_ckpoint(lfs_t *lfs) {
     lfs->lookahead.ckpoint = lfs->block_count;
 }
 
+// forget any prescanned lookahead window, this must be done whenever the
+// lookahead window moves by other means
+static void lfs_alloc_unstage(lfs_t *lfs) {
+    lfs->prescan.size = 0;
+}
+
 // drop the lookahead buffer, this is done during mounting and failed
 // traversals in order to avoid invalid lookahead state
 static void lfs_alloc_drop(lfs_t *lfs) {
     lfs->lookahead.size = 0;
     lfs->lookahead.next = 0;
     lfs_alloc_ckpoint(lfs);
+    lfs_alloc_unstage(lfs);
 }
 
 #ifndef LFS_READONLY
@@ -624,6 +709,56 @@ static int lfs_alloc_lookahead(void *p, lfs_block_t block) {
 }
 #endif
 
+#ifndef LFS_READONLY
+// recompute the range covering every block set aside by an open file,
+// needed whenever a reservation is taken, shrinks or goes away
+static void lfs_alloc_reservebounds(lfs_t *lfs) {
+    lfs->reserved.start = 0;
+    lfs->reserved.end = 0;
+    for (lfs_file_t *f = (lfs_file_t*)lfs->mlist; f; f = f->next) {
+        if (f->type != LFS_TYPE_REG || f->reserve.count == 0) {
+            continue;
+        }
+
+        if (lfs->reserved.start == lfs->reserved.end) {
+            lfs->reserved.start = f->reserve.block;
+            lfs->reserved.end = f->reserve.block + f->reserve.count;
+        } else {
+            lfs->reserved.start = lfs_min(lfs->reserved.start,
+                    f->reserve.block);
+            lfs->reserved.end = lfs_max(lfs->reserved.end,
+                    f->reserve.block + f->reserve.count);
+        }
+    }
+}
+
+// is a block set aside by an open file, see lfs_file_reserve
+static bool lfs_alloc_isreserved(lfs_t *lfs, lfs_block_t block) {
+    // most blocks are outside every reservation, only walk the open files
+    // for the few that aren't
+    if (block - lfs->reserved.start
+            >= lfs->reserved.end - lfs->reserved.start) {
+        return false;
+    }
+
+    for (lfs_file_t *f = (lfs_file_t*)lfs->mlist; f; f = f->next) {
+        if (f->type == LFS_TYPE_REG
+                && block - f->reserve.block < f->reserve.count) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// is the block at this offset in the lookahead window free to allocate
+static bool lfs_alloc_isfree(lfs_t *lfs, lfs_block_t off) {
+    return !(lfs->lookahead.buffer[off / 8] & (1U << (off % 8)))
+            && !lfs_alloc_isreserved(lfs,
+                (lfs->lookahead.start + off) % lfs->block_count);
+}
+#endif
+
 #ifndef LFS_READONLY
 static int lfs_alloc_scan(lfs_t *lfs) {
     // move lookahead buffer to the first unused block
@@ -637,8 +772,12 @@ static int lfs_alloc_scan(lfs_t *lfs) {
             8*lfs->cfg->lookahead_size,
             lfs->lookahead.ckpoint);
 
+    // any prescanned window is now out of date
+    lfs_alloc_unstage(lfs);
+
     // find mask of free blocks from tree
     memset(lfs->lookahead.buffer, 0, lfs->cfg->lookahead_size);
+    lfs->stats.lookahead_scans += 1;
     int err = lfs_fs_traverse_(lfs, lfs_alloc_lookahead, lfs, true);
     if (err) {
         lfs_alloc_drop(lfs);
@@ -649,13 +788,95 @@ static int lfs_alloc_scan(lfs_t *lfs) {
 }
 #endif
 
+// Prescanning the next lookahead window
+//
+// The window following the current one can be scanned incrementally while
+// the allocator is idle, into a second buffer. This is safe because, until
+// the allocator moves on, new allocations only come from the current window,
+// so blocks in the next window can only stop being in use. Any other move of
+// the lookahead window drops the prescanned one.
+//
+// This needs a second lookahead buffer and at least two windows worth of
+// blocks, so it is only available when littlefs allocates its own buffers.
+#ifndef LFS_READONLY
+static bool lfs_alloc_canstage(lfs_t *lfs) {
+    return lfs->prescan.buffer
+            && 2*8*lfs->cfg->lookahead_size <= lfs->block_count;
+}
+#endif
+
+#ifndef LFS_READONLY
+static int lfs_alloc_stagelookahead(void *p, lfs_block_t block) {
+    lfs_t *lfs = (lfs_t*)p;
+    lfs_block_t off = ((block - lfs->prescan.start)
+            + lfs->block_count) % lfs->block_count;
+
+    if (off < lfs->prescan.size) {
+        lfs->prescan.buffer[off / 8] |= 1U << (off % 8);
+    }
+
+    return 0;
+}
+#endif
+
+#ifndef LFS_READONLY
+static int lfs_alloc_stage(lfs_t *lfs, lfs_size_t count) {
+    if (lfs->prescan.size == 0) {
+        // start on the window following the current one
+        lfs->prescan.start = (lfs->lookahead.start + lfs->lookahead.size)
+                % lfs->block_count;
+        lfs->prescan.size = 8*lfs->cfg->lookahead_size;
+        memset(lfs->prescan.buffer, 0, lfs->cfg->lookahead_size);
+        lfs_fs_traverseinit(lfs, &lfs->prescan.trav, true);
+    }
+
+    int res = lfs_fs_traversestep_(lfs, &lfs->prescan.trav,
+            lfs_alloc_stagelookahead, lfs, count);
+    if (res < 0) {
+        lfs_alloc_unstage(lfs);
+        return res;
+    }
+
+    if (res == LFS_TRAVERSE_RESTARTED) {
+        memset(lfs->prescan.buffer, 0, lfs->cfg->lookahead_size);
+    }
+
+    return res != LFS_TRAVERSE_DONE;
+}
+#endif
+
+#ifndef LFS_READONLY
+static bool lfs_alloc_adopt(lfs_t *lfs) {
+    // only a completed prescan of the window that follows the blocks we've
+    // looked at can be used
+    if (lfs->prescan.size == 0
+            || lfs->prescan.trav.state != LFS_TRAV_DONE
+            || lfs->prescan.start != (lfs->lookahead.start
+                + lfs->lookahead.next) % lfs->block_count) {
+        return false;
+    }
+
+    uint8_t *buffer = lfs->lookahead.buffer;
+    lfs->lookahead.buffer = lfs->prescan.buffer;
+    lfs->prescan.buffer = buffer;
+
+    lfs->lookahead.start = lfs->prescan.start;
+    lfs->lookahead.next = 0;
+    lfs->lookahead.size = lfs_min(lfs->prescan.size, lfs->lookahead.ckpoint);
+    lfs_alloc_unstage(lfs);
+    return true;
+}
+#endif
+
 #ifndef LFS_READONLY
 static int lfs_alloc(lfs_t *lfs, lfs_block_t *block) {
+    // let incremental traversals know the filesystem is changing
+    lfs->gen += 1;
+
     while (true) {
         // scan our lookahead buffer for free blocks
         while (lfs->lookahead.next < lfs->lookahead.size) {
-            if (!(lfs->lookahead.buffer[lfs->lookahead.next / 8]
-                    & (1U << (lfs->lookahead.next % 8)))) {
+            if (lfs_alloc_isfree(lfs, lfs->lookahead.next)) {
                 // found a free block
                 *block = (lfs->lookahead.start + lfs->lookahead.next)
                         % lfs->block_count;
@@ -667,8 +888,7 @@ static int lfs_alloc(lfs_t *lfs, lfs_block_t *block) {
                     lfs->lookahead.ckpoint -= 1;
 
                     if (lfs->lookahead.next >= lfs->lookahead.size
-                            || !(lfs->lookahead.buffer[lfs->lookahead.next / 8]
-                                & (1U << (lfs->lookahead.next % 8)))) {
+                            || lfs_alloc_isfree(lfs, lfs->lookahead.next)) {
                         return 0;
                     }
                 }
@@ -692,8 +912,13 @@ static int lfs_alloc(lfs_t *lfs, lfs_block_t *block) {
             return LFS_ERR_NOSPC;
         }
 
-        // No blocks in our lookahead buffer, we need to scan the filesystem for
-        // unused blocks in the next lookahead window.
+        // No blocks in our lookahead buffer, use the next lookahead window if
+        // it has already been scanned, otherwise we need to scan the
+        // filesystem for unused blocks in the next lookahead window.
+        if (lfs_alloc_adopt(lfs)) {
+            continue;
+        }
+
         int err = lfs_alloc_scan(lfs);
         if(err) {
             return err;
@@ -1639,6 +1864,10 @@ static int lfs_dir_commitattr(lfs_t *lfs, struct lfs_commit *commit,
 #ifndef LFS_READONLY
 
 static int lfs_dir_commitcrc(lfs_t *lfs, struct lfs_commit *commit) {
+    // let incremental traversals know the filesystem is changing
+    lfs->gen += 1;
+    lfs->stats.commits += 1;
+
     // align to program units
     //
     // this gets a bit complex as we have two types of crcs:
@@ -1827,6 +2056,35 @@ static int lfs_dir_alloc(lfs_t *lfs, lfs_mdir_t *dir) {
 }
 #endif
 
+// forget the used block count, it is recounted on demand
+static void lfs_fs_dropusage(lfs_t *lfs) {
+    lfs->usage.used = LFS_BLOCK_NULL;
+    lfs->usage.seen = 0;
+    lfs_fs_traverseinit(lfs, &lfs->usage.trav, false);
+}
+
+#ifndef LFS_READONLY
+// account for blocks added to or removed from the filesystem, this is a noop
+// until the used block count is known
+static void lfs_fs_addusage(lfs_t *lfs, lfs_ssize_t delta) {
+    if (lfs->usage.used != LFS_BLOCK_NULL) {
+        lfs->usage.used += delta;
+    }
+}
+#endif
+
+#ifndef LFS_READONLY
+// keep lfs_fs_gcstep's position valid if a metadata pair is relocated or
+// dropped from the metadata list
+static void lfs_fs_gcfix(lfs_t *lfs,
+        const lfs_block_t oldpair[2], const lfs_block_t newpair[2]) {
+    if (lfs_pair_cmp(lfs->gctail, oldpair) == 0) {
+        lfs->gctail[0] = newpair[0];
+        lfs->gctail[1] = newpair[1];
+    }
+}
+#endif
+
 #ifndef LFS_READONLY
 static int lfs_dir_drop(lfs_t *lfs, lfs_mdir_t *dir, lfs_mdir_t *tail) {
     // steal state
@@ -1844,6 +2102,8 @@ static int lfs_dir_drop(lfs_t *lfs, lfs_mdir_t *dir, lfs_mdir_t *tail) {
         return err;
     }
 
+    lfs_fs_gcfix(lfs, tail->pair, tail->tail);
+    lfs_fs_addusage(lfs, -2);
     return 0;
 }
 #endif
@@ -1872,6 +2132,7 @@ static int lfs_dir_split(lfs_t *lfs,
     dir->tail[0] = tail.pair[0];
     dir->tail[1] = tail.pair[1];
     dir->split = true;
+    lfs_fs_addusage(lfs, +2);
 
     // update root if needed
     if (lfs_pair_cmp(dir->pair, lfs->root) == 0 && split == 0) {
@@ -1945,6 +2206,7 @@ static int lfs_dir_compact(lfs_t *lfs,
 
     if (tired && lfs_pair_cmp(dir->pair, (const lfs_block_t[2]){0, 1}) != 0) {
         // we're writing too much, time to relocate
+        lfs->stats.wear_relocations += 1;
         goto relocate;
     }
 
@@ -1971,6 +2233,7 @@ static int lfs_dir_compact(lfs_t *lfs,
                 }
                 return err;
             }
+            lfs->stats.meta_erases += 1;
 
             // write out header
             dir->rev = lfs_tole32(dir->rev);
@@ -2052,10 +2315,14 @@ static int lfs_dir_compact(lfs_t *lfs,
 
             // successful compaction, swap dir pair to indicate most recent
             LFS_ASSERT(commit.off % lfs->cfg->prog_size == 0);
+            lfs->stats.compactions += 1;
             lfs_pair_swap(dir->pair);
             dir->count = end - begin;
             dir->off = commit.off;
             dir->etag = commit.ptag;
+            // the rest of the block is freshly erased, this matters if we
+            // were forced to compact by lfs_fs_gc
+            dir->erased = true;
             // update gstate
             lfs->gdelta = (lfs_gstate_t){0};
             if (!relocated) {
@@ -2067,6 +2334,7 @@ static int lfs_dir_compact(lfs_t *lfs,
 relocate:
         // commit was corrupted, drop caches and prepare to relocate block
         relocated = true;
+        lfs->stats.relocations += 1;
         lfs_cache_drop(lfs, &lfs->pcache);
         if (!tired) {
             LFS_DEBUG("Bad block at 0x%"PRIx32, dir->pair[1]);
@@ -2169,9 +2437,16 @@ static int lfs_dir_splittingcompact(lfs_t *lfs, lfs_mdir_t *dir,
             && lfs_pair_cmp(dir->pair, (const lfs_block_t[2]){0, 1}) == 0) {
         // oh no! we're writing too much to the superblock,
         // should we expand?
-        lfs_ssize_t size = lfs_fs_size_(lfs);
-        if (size < 0) {
-            return size;
+        //
+        // note we can't start keeping track of used blocks in the middle
+        // of a commit, so count them the hard way if we don't know
+        lfs_size_t size = lfs->usage.used;
+        if (size == LFS_BLOCK_NULL) {
+            size = 0;
+            int err = lfs_fs_traverse_(lfs, lfs_fs_size_count, &size, false);
+            if (err) {
+                return err;
+            }
         }
 
         // littlefs cannot reclaim expanded superblocks, so expand cautiously
@@ -2377,6 +2652,10 @@ fixmlist:;
 #ifndef LFS_READONLY
 static int lfs_dir_orphaningcommit(lfs_t *lfs, lfs_mdir_t *dir,
         const struct lfs_mattr *attrs, int attrcount) {
+    // any mount checkpoint must be removed before we change anything,
+    // see lfs_fs_uncheckpoint
+    LFS_ASSERT(lfs->mountck == LFS_MOUNTCK_NONE);
+
     // check for any inline files that aren't RAM backed and
     // forcefully evict them, needed for filesystem consistency
     for (lfs_file_t *f = (lfs_file_t*)lfs->mlist; f; f = f->next) {
@@ -2435,6 +2714,8 @@ static int lfs_dir_orphaningcommit(lfs_t *lfs, lfs_mdir_t *dir,
             return state;
         }
 
+        lfs_fs_gcfix(lfs, dir->pair, dir->tail);
+        lfs_fs_addusage(lfs, -2);
         ldir = pdir;
     }
 
@@ -2452,6 +2733,8 @@ static int lfs_dir_orphaningcommit(lfs_t *lfs, lfs_mdir_t *dir,
             lfs->root[1] = ldir.pair[1];
         }
 
+        lfs_fs_gcfix(lfs, lpair, ldir.pair);
+
         // update internally tracked dirs
         for (struct lfs_mlist *d = lfs->mlist; d; d = d->next) {
             if (lfs_pair_cmp(lpair, d->m.pair) == 0) {
@@ -2572,6 +2855,8 @@ static int lfs_dir_commit(lfs_t *lfs, lfs_mdir_t *dir,
         const struct lfs_mattr *attrs, int attrcount) {
     int orphans = lfs_dir_orphaningcommit(lfs, dir, attrs, attrcount);
     if (orphans < 0) {
+        // we may have gotten partway, don't trust the used block count
+        lfs_fs_dropusage(lfs);
         return orphans;
     }
 
@@ -2581,6 +2866,7 @@ static int lfs_dir_commit(lfs_t *lfs, lfs_mdir_t *dir,
         // created some
         int err = lfs_fs_deorphan(lfs, false);
         if (err) {
+            lfs_fs_dropusage(lfs);
             return err;
         }
     }
@@ -2599,6 +2885,13 @@ static int lfs_mkdir_(lfs_t *lfs, const char *path) {
         return err;
     }
 
+    // removing the mount checkpoint commits to the superblock pair, do it
+    // before looking anything up so what we find stays valid
+    err = lfs_fs_uncheckpoint(lfs);
+    if (err) {
+        return err;
+    }
+
     struct lfs_mlist cwd;
     cwd.next = lfs->mlist;
     uint16_t id;
@@ -2684,6 +2977,7 @@ static int lfs_mkdir_(lfs_t *lfs, const char *path) {
         return err;
     }
 
+    lfs_fs_addusage(lfs, +2);
     return 0;
 }
 #endif
@@ -2853,6 +3147,73 @@ static int lfs_ctz_index(lfs_t *lfs, lfs_off_t *off) {
     return i;
 }
 
+#ifndef LFS_READONLY
+// allocate a block for a file, from its reservation if it has one
+static int lfs_file_alloc(lfs_t *lfs, lfs_file_t *file, lfs_block_t *block) {
+    if (file->reserve.count == 0) {
+        return lfs_alloc(lfs, block);
+    }
+
+    // a reserved block still counts against the blocks we may hand out
+    // since the last checkpoint, and the lookahead window must not reach past
+    // what is left or the math in lfs_alloc underflows
+    if (lfs->lookahead.ckpoint == 0) {
+        LFS_ERROR("No more free space 0x%"PRIx32,
+                (lfs->lookahead.start + lfs->lookahead.next)
+                    % lfs->block_count);
+        return LFS_ERR_NOSPC;
+    }
+    lfs->lookahead.ckpoint -= 1;
+    lfs->lookahead.size = lfs_min(lfs->lookahead.size,
+            lfs->lookahead.next + lfs->lookahead.ckpoint);
+
+    *block = file->reserve.block;
+    file->reserve.block += 1;
+    file->reserve.count -= 1;
+    lfs_alloc_reservebounds(lfs);
+
+    // no longer protected by the reservation, but the lookahead window or
+    // a prescanned window may still think it is free
+    lfs->gen += 1;
+    lfs_alloc_lookahead(lfs, *block);
+    if (lfs->prescan.size) {
+        lfs_alloc_stagelookahead(lfs, *block);
+    }
+    return 0;
+}
+#endif
+
+#ifndef LFS_READONLY
+// number of blocks in a ctz list of the given size
+static lfs_size_t lfs_ctz_count(lfs_t *lfs, lfs_size_t size) {
+    if (size == 0) {
+        return 0;
+    }
+
+    return lfs_ctz_index(lfs, &(lfs_off_t){size-1}) + 1;
+}
+#endif
+
+#ifndef LFS_READONLY
+// number of blocks in the ctz list of an entry, if it has one
+static lfs_ssize_t lfs_dir_getctzcount(lfs_t *lfs,
+        const lfs_mdir_t *dir, uint16_t id) {
+    struct lfs_ctz ctz;
+    lfs_stag_t tag = lfs_dir_get(lfs, dir, LFS_MKTAG(0x700, 0x3ff, 0),
+            LFS_MKTAG(LFS_TYPE_STRUCT, id, sizeof(ctz)), &ctz);
+    if (tag < 0) {
+        return (tag == LFS_ERR_NOENT) ? 0 : tag;
+    }
+    lfs_ctz_fromle32(&ctz);
+
+    if (lfs_tag_type3(tag) != LFS_TYPE_CTZSTRUCT) {
+        return 0;
+    }
+
+    return lfs_ctz_count(lfs, ctz.size);
+}
+#endif
+
 static int lfs_ctz_find(lfs_t *lfs,
         const lfs_cache_t *pcache, lfs_cache_t *rcache,
         lfs_block_t head, lfs_size_t size,
@@ -2888,14 +3249,14 @@ static int lfs_ctz_find(lfs_t *lfs,
 }
 
 #ifndef LFS_READONLY
-static int lfs_ctz_extend(lfs_t *lfs,
+static int lfs_ctz_extend(lfs_t *lfs, lfs_file_t *file,
         lfs_cache_t *pcache, lfs_cache_t *rcache,
         lfs_block_t head, lfs_size_t size,
         lfs_block_t *block, lfs_off_t *off) {
     while (true) {
         // go ahead and grab a block
         lfs_block_t nblock;
-        int err = lfs_alloc(lfs, &nblock);
+        int err = lfs_file_alloc(lfs, file, &nblock);
         if (err) {
             return err;
         }
@@ -2979,6 +3340,7 @@ static int lfs_ctz_extend(lfs_t *lfs,
         }
 
 relocate:
+        lfs->stats.relocations += 1;
         LFS_DEBUG("Bad block at 0x%"PRIx32, nblock);
 
         // just clear cache and try a new block
@@ -3053,6 +3415,7 @@ static int lfs_file_opencfg_(lfs_t *lfs, lfs_file_t *file,
     file->flags = flags;
     file->pos = 0;
     file->off = 0;
+    file->reserve.count = 0;
     file->cache.buffer = NULL;
 
     // allocate entry for file if it doesn't exist
@@ -3084,6 +3447,13 @@ static int lfs_file_opencfg_(lfs_t *lfs, lfs_file_t *file,
             goto cleanup;
         }
 
+        // the mount checkpoint goes first, file->m is in the mlist so it is
+        // kept up to date if this commits to the same pair
+        err = lfs_fs_uncheckpoint(lfs);
+        if (err) {
+            goto cleanup;
+        }
+
         // get next slot and create entry to remember name
         err = lfs_dir_commit(lfs, &file->m, LFS_MKATTRS(
                 {LFS_MKTAG(LFS_TYPE_CREATE, file->id, 0), NULL},
@@ -3216,6 +3586,11 @@ static int lfs_file_close_(lfs_t *lfs, lfs_file_t *file) {
 
     // remove from list of mdirs
     lfs_mlist_remove(lfs, (struct lfs_mlist*)file);
+#ifndef LFS_READONLY
+    if (file->reserve.count) {
+        lfs_alloc_reservebounds(lfs);
+    }
+#endif
 
     // clean up memory
     if (!file->cfg->buffer) {
@@ -3231,7 +3606,7 @@ static int lfs_file_relocate(lfs_t *lfs, lfs_file_t *file) {
     while (true) {
         // just relocate what exists into new block
         lfs_block_t nblock;
-        int err = lfs_alloc(lfs, &nblock);
+        int err = lfs_file_alloc(lfs, file, &nblock);
         if (err) {
             return err;
         }
@@ -3289,6 +3664,7 @@ static int lfs_file_relocate(lfs_t *lfs, lfs_file_t *file) {
         return 0;
 
 relocate:
+        lfs->stats.relocations += 1;
         LFS_DEBUG("Bad block at 0x%"PRIx32, nblock);
 
         // just clear cache and try a new block
@@ -3368,6 +3744,7 @@ static int lfs_file_flush(lfs_t *lfs, lfs_file_t *file) {
                 break;
 
 relocate:
+                lfs->stats.relocations += 1;
                 LFS_DEBUG("Bad block at 0x%"PRIx32, file->block);
                 err = lfs_file_relocate(lfs, file);
                 if (err) {
@@ -3407,6 +3784,12 @@ static int lfs_file_sync_(lfs_t *lfs, lfs_file_t *file) {
 
     if ((file->flags & LFS_F_DIRTY) &&
             !lfs_pair_isnull(file->m.pair)) {
+        // the file may have been opened before the last checkpoint
+        err = lfs_fs_uncheckpoint(lfs);
+        if (err) {
+            return err;
+        }
+
         // before we commit metadata, we need sync the disk to make sure
         // data writes don't complete after metadata writes
         if (!(file->flags & LFS_F_INLINE)) {
@@ -3436,6 +3819,15 @@ static int lfs_file_sync_(lfs_t *lfs, lfs_file_t *file) {
             size = sizeof(ctz);
         }
 
+        // find how many blocks we are replacing
+        lfs_ssize_t oldcount = 0;
+        if (lfs->usage.used != LFS_BLOCK_NULL) {
+            oldcount = lfs_dir_getctzcount(lfs, &file->m, file->id);
+            if (oldcount < 0) {
+                return oldcount;
+            }
+        }
+
         // commit file data and attributes
         err = lfs_dir_commit(lfs, &file->m, LFS_MKATTRS(
                 {LFS_MKTAG(type, file->id, size), buffer},
@@ -3446,6 +3838,11 @@ static int lfs_file_sync_(lfs_t *lfs, lfs_file_t *file) {
             return err;
         }
 
+        if (!(file->flags & LFS_F_INLINE)) {
+            lfs_fs_addusage(lfs, lfs_ctz_count(lfs, file->ctz.size));
+        }
+        lfs_fs_addusage(lfs, -oldcount);
+
         file->flags &= ~LFS_F_DIRTY;
     }
 
@@ -3453,6 +3850,79 @@ static int lfs_file_sync_(lfs_t *lfs, lfs_file_t *file) {
 }
 #endif
 
+// read the current block and as many whole blocks after it as fit in the
+// buffer with a single read_span call, if they are physically consecutive,
+// returns 0 if they aren't
+static lfs_ssize_t lfs_file_readspan(lfs_t *lfs, lfs_file_t *file,
+        uint8_t *buffer, lfs_size_t size) {
+    const lfs_size_t block_size = lfs->cfg->block_size;
+    lfs_off_t start = lfs_aligndown(file->off, lfs->cfg->read_size);
+    lfs_off_t index = lfs_ctz_index(lfs, &(lfs_off_t){file->pos});
+
+    lfs_size_t raw = block_size - start;
+    lfs_size_t diff = block_size - file->off;
+    lfs_size_t count = 0;
+    while (true) {
+        lfs_size_t skip = 4*(lfs_ctz(index+count+1) + 1);
+        if (raw + block_size > size
+                || file->pos + diff + (block_size-skip) > file->ctz.size
+                || file->block + count+1 >= lfs->block_count) {
+            break;
+        }
+
+        raw += block_size;
+        diff += block_size-skip;
+        count += 1;
+    }
+
+    if (count == 0) {
+        return 0;
+    }
+
+    // the last block must be where the ctz list says it is...
+    lfs_block_t last;
+    int err = lfs_ctz_find(lfs, NULL, &file->cache,
+            file->ctz.head, file->ctz.size,
+            file->pos+diff-1, &last, &(lfs_off_t){0});
+    if (err) {
+        return err;
+    }
+
+    if (last != file->block + count) {
+        return 0;
+    }
+
+    err = lfs->cfg->read_span(lfs->cfg, file->block, start, buffer, raw);
+    LFS_ASSERT(err <= 0);
+    if (err) {
+        return err;
+    }
+
+    // ...and every block in between must point to the one before it, which
+    // we get for free as the first skip-list pointer of each block
+    for (lfs_size_t i = 1; i <= count; i++) {
+        lfs_block_t prev;
+        memcpy(&prev, &buffer[i*block_size - start], sizeof(prev));
+        if (lfs_fromle32(prev) != file->block + i-1) {
+            return 0;
+        }
+    }
+
+    // squeeze out everything that isn't file data
+    lfs_size_t n = block_size - file->off;
+    memmove(buffer, &buffer[file->off - start], n);
+    for (lfs_size_t i = 1; i <= count; i++) {
+        lfs_size_t skip = 4*(lfs_ctz(index+i) + 1);
+        memmove(&buffer[n], &buffer[i*block_size - start + skip],
+                block_size-skip);
+        n += block_size-skip;
+    }
+
+    file->block += count;
+    file->off = block_size;
+    return diff;
+}
+
 static lfs_ssize_t lfs_file_flushedread(lfs_t *lfs, lfs_file_t *file,
         void *buffer, lfs_size_t size) {
     uint8_t *data = buffer;
@@ -3466,6 +3936,10 @@ static lfs_ssize_t lfs_file_flushedread(lfs_t *lfs, lfs_file_t *file,
     size = lfs_min(size, file->ctz.size - file->pos);
     nsize = size;
 
+    // give up on reading spans after the first miss, the file is likely
+    // fragmented around here
+    bool span = (lfs->cfg->read_span != NULL);
+
     while (nsize > 0) {
         // check if we need a new block
         if (!(file->flags & LFS_F_READING) ||
@@ -3485,6 +3959,24 @@ static lfs_ssize_t lfs_file_flushedread(lfs_t *lfs, lfs_file_t *file,
             file->flags |= LFS_F_READING;
         }
 
+        // large reads can continue over consecutive blocks in one go
+        if (span && !(file->flags & LFS_F_INLINE)
+                && nsize >= 2*lfs->cfg->block_size) {
+            lfs_ssize_t res = lfs_file_readspan(lfs, file, data, nsize);
+            if (res < 0) {
+                return res;
+            }
+
+            if (res > 0) {
+                file->pos += res;
+                data += res;
+                nsize -= res;
+                continue;
+            }
+
+            span = false;
+        }
+
         // read as much as we can in current block
         lfs_size_t diff = lfs_min(nsize, lfs->cfg->block_size - file->off);
         if (file->flags & LFS_F_INLINE) {
@@ -3514,8 +4006,8 @@ static lfs_ssize_t lfs_file_flushedread(lfs_t *lfs, lfs_file_t *file,
     return size;
 }
 
-static lfs_ssize_t lfs_file_read_(lfs_t *lfs, lfs_file_t *file,
-        void *buffer, lfs_size_t size) {
+static lfs_ssize_t lfs_file_readv_(lfs_t *lfs, lfs_file_t *file,
+        const struct lfs_iovec *iov, lfs_size_t iovcnt) {
     LFS_ASSERT((file->flags & LFS_O_RDONLY) == LFS_O_RDONLY);
 
 #ifndef LFS_READONLY
@@ -3528,11 +4020,76 @@ static lfs_ssize_t lfs_file_read_(lfs_t *lfs, lfs_file_t *file,
     }
 #endif
 
-    return lfs_file_flushedread(lfs, file, buffer, size);
+    lfs_size_t size = 0;
+    for (lfs_size_t i = 0; i < iovcnt; i++) {
+        lfs_ssize_t res = lfs_file_flushedread(lfs, file,
+                iov[i].buffer, iov[i].size);
+        if (res < 0) {
+            return res;
+        }
+
+        size += res;
+        if ((lfs_size_t)res < iov[i].size) {
+            // end of file
+            break;
+        }
+    }
+
+    return size;
+}
+
+static lfs_ssize_t lfs_file_read_(lfs_t *lfs, lfs_file_t *file,
+        void *buffer, lfs_size_t size) {
+    const struct lfs_iovec iov = {buffer, size};
+    return lfs_file_readv_(lfs, file, &iov, 1);
 }
 
 
 #ifndef LFS_READONLY
+static int lfs_file_reusetail(lfs_t *lfs, lfs_file_t *file, lfs_off_t off) {
+    // the rest of the block must still be erased, a write that never made
+    // it into a commit leaves data behind that we can't program over
+    //
+    // our cache is unused until we reload it below, so scan the block
+    // through it a cache at a time
+    for (lfs_off_t roff = lfs_aligndown(off, lfs->cfg->read_size);
+            roff < lfs->cfg->block_size; roff += lfs->cfg->cache_size) {
+        lfs_size_t diff = lfs_min(lfs->cfg->cache_size,
+                lfs->cfg->block_size - roff);
+        int err = lfs_bd_read(lfs,
+                NULL, &lfs->rcache, diff,
+                file->block, roff, file->cache.buffer, diff);
+        if (err) {
+            lfs_cache_zero(lfs, &file->cache);
+            return err;
+        }
+
+        for (lfs_off_t i = lfs_max(off, roff) - roff; i < diff; i++) {
+            if (file->cache.buffer[i] != 0xff) {
+                lfs_cache_zero(lfs, &file->cache);
+                return false;
+            }
+        }
+    }
+    lfs_cache_zero(lfs, &file->cache);
+
+    // reload the partially programmed prog unit into our cache, programming
+    // the same bits again leaves NOR flash unchanged
+    lfs_off_t aoff = lfs_aligndown(off, lfs->cfg->prog_size);
+    int err = lfs_bd_read(lfs,
+            NULL, &lfs->rcache, off-aoff,
+            file->block, aoff, file->cache.buffer, off-aoff);
+    if (err) {
+        return err;
+    }
+
+    file->cache.block = file->block;
+    file->cache.off = aoff;
+    file->cache.size = off-aoff;
+    file->off = off;
+    return true;
+}
+
 static lfs_ssize_t lfs_file_flushedwrite(lfs_t *lfs, lfs_file_t *file,
         const void *buffer, lfs_size_t size) {
     const uint8_t *data = buffer;
@@ -3555,9 +4112,10 @@ static lfs_ssize_t lfs_file_flushedwrite(lfs_t *lfs, lfs_file_t *file,
             if (!(file->flags & LFS_F_INLINE)) {
                 if (!(file->flags & LFS_F_WRITING) && file->pos > 0) {
                     // find out which block we're extending from
+                    lfs_off_t off;
                     int err = lfs_ctz_find(lfs, NULL, &file->cache,
                             file->ctz.head, file->ctz.size,
-                            file->pos-1, &file->block, &(lfs_off_t){0});
+                            file->pos-1, &file->block, &off);
                     if (err) {
                         file->flags |= LFS_F_ERRED;
                         return err;
@@ -3565,11 +4123,29 @@ static lfs_ssize_t lfs_file_flushedwrite(lfs_t *lfs, lfs_file_t *file,
 
                     // mark cache as dirty since we may have read data into it
                     lfs_cache_zero(lfs, &file->cache);
+
+                    // log files keep appending to their last block if it
+                    // isn't full, instead of copying it out
+                    if ((file->flags & LFS_O_LOGAPPEND)
+                            && file->pos == file->ctz.size
+                            && off+1 < lfs->cfg->block_size) {
+                        int res = lfs_file_reusetail(lfs, file, off+1);
+                        if (res < 0) {
+                            file->flags |= LFS_F_ERRED;
+                            return res;
+                        }
+
+                        if (res) {
+                            file->flags |= LFS_F_WRITING;
+                            continue;
+                        }
+                    }
                 }
 
                 // extend file with new blocks
                 lfs_alloc_ckpoint(lfs);
-                int err = lfs_ctz_extend(lfs, &file->cache, &lfs->rcache,
+                int err = lfs_ctz_extend(lfs, file,
+                        &file->cache, &lfs->rcache,
                         file->block, file->pos,
                         &file->block, &file->off);
                 if (err) {
@@ -3599,6 +4175,7 @@ static lfs_ssize_t lfs_file_flushedwrite(lfs_t *lfs, lfs_file_t *file,
 
             break;
 relocate:
+            lfs->stats.relocations += 1;
             err = lfs_file_relocate(lfs, file);
             if (err) {
                 file->flags |= LFS_F_ERRED;
@@ -3617,8 +4194,8 @@ relocate:
     return size;
 }
 
-static lfs_ssize_t lfs_file_write_(lfs_t *lfs, lfs_file_t *file,
-        const void *buffer, lfs_size_t size) {
+// get the file ready for writing size bytes at the current position
+static int lfs_file_writeprep(lfs_t *lfs, lfs_file_t *file, lfs_size_t size) {
     LFS_ASSERT((file->flags & LFS_O_WRONLY) == LFS_O_WRONLY);
 
     if (file->flags & LFS_F_READING) {
@@ -3651,6 +4228,16 @@ static lfs_ssize_t lfs_file_write_(lfs_t *lfs, lfs_file_t *file,
         }
     }
 
+    return 0;
+}
+
+static lfs_ssize_t lfs_file_write_(lfs_t *lfs, lfs_file_t *file,
+        const void *buffer, lfs_size_t size) {
+    int err = lfs_file_writeprep(lfs, file, size);
+    if (err) {
+        return err;
+    }
+
     lfs_ssize_t nsize = lfs_file_flushedwrite(lfs, file, buffer, size);
     if (nsize < 0) {
         return nsize;
@@ -3659,12 +4246,40 @@ static lfs_ssize_t lfs_file_write_(lfs_t *lfs, lfs_file_t *file,
     file->flags &= ~LFS_F_ERRED;
     return nsize;
 }
-#endif
 
-static lfs_soff_t lfs_file_seek_(lfs_t *lfs, lfs_file_t *file,
-        lfs_soff_t off, int whence) {
-    // find new pos
-    lfs_off_t npos = file->pos;
+static lfs_ssize_t lfs_file_writev_(lfs_t *lfs, lfs_file_t *file,
+        const struct lfs_iovec *iov, lfs_size_t iovcnt) {
+    lfs_size_t size = 0;
+    for (lfs_size_t i = 0; i < iovcnt; i++) {
+        if (iov[i].size > lfs->file_max - size) {
+            return LFS_ERR_FBIG;
+        }
+        size += iov[i].size;
+    }
+
+    int err = lfs_file_writeprep(lfs, file, size);
+    if (err) {
+        return err;
+    }
+
+    // the buffers go through the file cache back to back, as one write
+    for (lfs_size_t i = 0; i < iovcnt; i++) {
+        lfs_ssize_t res = lfs_file_flushedwrite(lfs, file,
+                iov[i].buffer, iov[i].size);
+        if (res < 0) {
+            return res;
+        }
+    }
+
+    file->flags &= ~LFS_F_ERRED;
+    return size;
+}
+#endif
+
+static lfs_soff_t lfs_file_seek_(lfs_t *lfs, lfs_file_t *file,
+        lfs_soff_t off, int whence) {
+    // find new pos
+    lfs_off_t npos = file->pos;
     if (whence == LFS_SEEK_SET) {
         npos = off;
     } else if (whence == LFS_SEEK_CUR) {
@@ -3807,6 +4422,122 @@ static int lfs_file_truncate_(lfs_t *lfs, lfs_file_t *file, lfs_off_t size) {
 }
 #endif
 
+#ifndef LFS_READONLY
+struct lfs_file_reservescan {
+    lfs_block_t start;
+    lfs_block_t size;
+    lfs_block_t block_count;
+    uint8_t *buffer;
+};
+
+static int lfs_file_reservescan(void *p, lfs_block_t block) {
+    struct lfs_file_reservescan *scan = p;
+    lfs_block_t off = ((block - scan->start)
+            + scan->block_count) % scan->block_count;
+
+    if (off < scan->size) {
+        scan->buffer[off / 8] |= 1U << (off % 8);
+    }
+
+    return 0;
+}
+
+static lfs_ssize_t lfs_file_reserve_(lfs_t *lfs, lfs_file_t *file,
+        lfs_size_t size) {
+    // the file cache doubles as our bitmap, so get any pending writes out
+    int err = lfs_file_flush(lfs, file);
+    if (err) {
+        return err;
+    }
+
+    file->reserve.count = 0;
+    lfs_alloc_reservebounds(lfs);
+    if (size == 0) {
+        return 0;
+    }
+
+    // an inline file keeps its data in the cache, move it out to a block
+    // first, appending to it would have to anyway
+    if ((file->flags & LFS_F_INLINE) && file->ctz.size > 0) {
+        lfs_off_t pos = file->pos;
+        file->pos = file->ctz.size;
+        err = lfs_file_outline(lfs, file);
+        if (!err) {
+            err = lfs_file_flush(lfs, file);
+        }
+        file->pos = pos;
+        if (err) {
+            file->flags |= LFS_F_ERRED;
+            return err;
+        }
+    }
+
+    // blocks needed to append size bytes, including the copy of a
+    // partially filled last block, see lfs_ctz_extend
+    lfs_size_t need = lfs_ctz_count(lfs, file->ctz.size + size);
+    if (!(file->flags & LFS_F_INLINE) && file->ctz.size > 0) {
+        lfs_off_t noff = file->ctz.size - 1;
+        lfs_ctz_index(lfs, &noff);
+        need -= lfs_ctz_count(lfs, file->ctz.size);
+        need += (noff+1 != lfs->cfg->block_size) ? 1 : 0;
+    }
+
+    // look for the first long enough run of free blocks, starting where the
+    // allocator is to keep wear spread out, a window of 8*cache_size blocks
+    // per traversal
+    struct lfs_file_reservescan scan = {
+        .start = (lfs->lookahead.start + lfs->lookahead.next)
+                % lfs->block_count,
+        .block_count = lfs->block_count,
+        .buffer = file->cache.buffer,
+    };
+    lfs_block_t best = 0;
+    lfs_size_t bestcount = 0;
+    lfs_size_t run = 0;
+    for (lfs_block_t i = 0; i < lfs->block_count && bestcount < need;
+            i += scan.size) {
+        scan.size = lfs_min(8*lfs->cfg->cache_size, lfs->block_count - i);
+        memset(scan.buffer, 0, lfs->cfg->cache_size);
+        err = lfs_fs_traverse_(lfs, lfs_file_reservescan, &scan, true);
+        if (err) {
+            lfs_cache_zero(lfs, &file->cache);
+            return err;
+        }
+
+        for (lfs_block_t off = 0; off < scan.size; off++) {
+            lfs_block_t block = (scan.start + off) % lfs->block_count;
+            if (block == 0) {
+                // runs can't wrap around the end of the device
+                run = 0;
+            }
+
+            if ((scan.buffer[off / 8] & (1U << (off % 8)))
+                    || lfs_alloc_isreserved(lfs, block)) {
+                run = 0;
+                continue;
+            }
+
+            run += 1;
+            if (run > bestcount) {
+                best = block+1 - run;
+                bestcount = run;
+                if (bestcount == need) {
+                    break;
+                }
+            }
+        }
+
+        scan.start = (scan.start + scan.size) % lfs->block_count;
+    }
+
+    lfs_cache_zero(lfs, &file->cache);
+    file->reserve.block = best;
+    file->reserve.count = bestcount;
+    lfs_alloc_reservebounds(lfs);
+    return bestcount;
+}
+#endif
+
 static lfs_soff_t lfs_file_tell_(lfs_t *lfs, lfs_file_t *file) {
     (void)lfs;
     return file->pos;
@@ -3846,32 +4577,20 @@ static int lfs_stat_(lfs_t *lfs, const char *path, struct lfs_info *info) {
 }
 
 #ifndef LFS_READONLY
-static int lfs_remove_(lfs_t *lfs, const char *path) {
-    // deorphan if we haven't yet, needed at most once after poweron
-    int err = lfs_fs_forceconsistency(lfs);
-    if (err) {
-        return err;
-    }
-
-    lfs_mdir_t cwd;
-    lfs_stag_t tag = lfs_dir_find(lfs, &cwd, &path, NULL);
-    if (tag < 0 || lfs_tag_id(tag) == 0x3ff) {
-        return (tag < 0) ? (int)tag : LFS_ERR_INVAL;
-    }
-
+static int lfs_dir_remove(lfs_t *lfs, lfs_mdir_t *cwd, lfs_stag_t tag) {
     struct lfs_mlist dir;
     dir.next = lfs->mlist;
     if (lfs_tag_type3(tag) == LFS_TYPE_DIR) {
         // must be empty before removal
         lfs_block_t pair[2];
-        lfs_stag_t res = lfs_dir_get(lfs, &cwd, LFS_MKTAG(0x700, 0x3ff, 0),
+        lfs_stag_t res = lfs_dir_get(lfs, cwd, LFS_MKTAG(0x700, 0x3ff, 0),
                 LFS_MKTAG(LFS_TYPE_STRUCT, lfs_tag_id(tag), 8), pair);
         if (res < 0) {
             return (int)res;
         }
         lfs_pair_fromle32(pair);
 
-        err = lfs_dir_fetch(lfs, &dir.m, pair);
+        int err = lfs_dir_fetch(lfs, &dir.m, pair);
         if (err) {
             return err;
         }
@@ -3893,14 +4612,25 @@ static int lfs_remove_(lfs_t *lfs, const char *path) {
         lfs->mlist = &dir;
     }
 
+    // find how many blocks we are freeing
+    lfs_ssize_t count = 0;
+    if (lfs_tag_type3(tag) == LFS_TYPE_REG
+            && lfs->usage.used != LFS_BLOCK_NULL) {
+        count = lfs_dir_getctzcount(lfs, cwd, lfs_tag_id(tag));
+        if (count < 0) {
+            return count;
+        }
+    }
+
     // delete the entry
-    err = lfs_dir_commit(lfs, &cwd, LFS_MKATTRS(
+    int err = lfs_dir_commit(lfs, cwd, LFS_MKATTRS(
             {LFS_MKTAG(LFS_TYPE_DELETE, lfs_tag_id(tag), 0), NULL}));
     if (err) {
         lfs->mlist = dir.next;
         return err;
     }
 
+    lfs_fs_addusage(lfs, -count);
     lfs->mlist = dir.next;
     if (lfs_tag_type3(tag) == LFS_TYPE_DIR) {
         // fix orphan
@@ -3909,12 +4639,12 @@ static int lfs_remove_(lfs_t *lfs, const char *path) {
             return err;
         }
 
-        err = lfs_fs_pred(lfs, dir.m.pair, &cwd);
+        err = lfs_fs_pred(lfs, dir.m.pair, cwd);
         if (err) {
             return err;
         }
 
-        err = lfs_dir_drop(lfs, &cwd, &dir.m);
+        err = lfs_dir_drop(lfs, cwd, &dir.m);
         if (err) {
             return err;
         }
@@ -3925,31 +4655,225 @@ static int lfs_remove_(lfs_t *lfs, const char *path) {
 #endif
 
 #ifndef LFS_READONLY
-static int lfs_rename_(lfs_t *lfs, const char *oldpath, const char *newpath) {
+static int lfs_remove_(lfs_t *lfs, const char *path) {
     // deorphan if we haven't yet, needed at most once after poweron
     int err = lfs_fs_forceconsistency(lfs);
     if (err) {
         return err;
     }
 
-    // find old entry
-    lfs_mdir_t oldcwd;
-    lfs_stag_t oldtag = lfs_dir_find(lfs, &oldcwd, &oldpath, NULL);
+    // removing the mount checkpoint commits to the superblock pair, do it
+    // before looking anything up so what we find stays valid
+    err = lfs_fs_uncheckpoint(lfs);
+    if (err) {
+        return err;
+    }
+
+    lfs_mdir_t cwd;
+    lfs_stag_t tag = lfs_dir_find(lfs, &cwd, &path, NULL);
+    if (tag < 0 || lfs_tag_id(tag) == 0x3ff) {
+        return (tag < 0) ? (int)tag : LFS_ERR_INVAL;
+    }
+
+    return lfs_dir_remove(lfs, &cwd, tag);
+}
+#endif
+
+#ifndef LFS_READONLY
+// find the first entry of a given type in a directory, following any
+// split metadata pairs, dir is left on the pair containing the entry
+static lfs_stag_t lfs_dir_findtype(lfs_t *lfs, lfs_mdir_t *dir,
+        uint16_t type) {
+    while (true) {
+        for (uint16_t id = 0; id < dir->count; id++) {
+            lfs_stag_t tag = lfs_dir_get(lfs, dir, LFS_MKTAG(0x700, 0x3ff, 0),
+                    LFS_MKTAG(LFS_TYPE_NAME, id, 0), NULL);
+            if (tag < 0) {
+                return tag;
+            }
+
+            if (lfs_tag_type3(tag) == type) {
+                return tag;
+            }
+        }
+
+        if (!dir->split) {
+            return LFS_ERR_NOENT;
+        }
+
+        int err = lfs_dir_fetch(lfs, dir, dir->tail);
+        if (err) {
+            return err;
+        }
+    }
+}
+
+// remove all regular files in a directory, up to LFS_BATCH_MAX per commit,
+// returns true if anything was removed
+static int lfs_dir_removefiles(lfs_t *lfs, lfs_mdir_t *dir) {
+    bool removed = false;
+    while (true) {
+        // delete from the highest id down so earlier deletes don't shift
+        // the ids of later ones
+        struct lfs_mattr attrs[LFS_BATCH_MAX];
+        int attrcount = 0;
+        lfs_ssize_t count = 0;
+        for (uint16_t id = dir->count; id > 0 && attrcount < LFS_BATCH_MAX;
+                id--) {
+            lfs_stag_t tag = lfs_dir_get(lfs, dir, LFS_MKTAG(0x700, 0x3ff, 0),
+                    LFS_MKTAG(LFS_TYPE_NAME, id-1, 0), NULL);
+            if (tag < 0) {
+                return tag;
+            }
+
+            if (lfs_tag_type3(tag) == LFS_TYPE_REG) {
+                if (lfs->usage.used != LFS_BLOCK_NULL) {
+                    lfs_ssize_t res = lfs_dir_getctzcount(lfs, dir, id-1);
+                    if (res < 0) {
+                        return res;
+                    }
+                    count += res;
+                }
+
+                attrs[attrcount] = (struct lfs_mattr){
+                        LFS_MKTAG(LFS_TYPE_DELETE, id-1, 0), NULL};
+                attrcount += 1;
+            }
+        }
+
+        if (attrcount > 0) {
+            // note if this empties the pair it may be dropped, but dir
+            // still points to the rest of the directory
+            int err = lfs_dir_commit(lfs, dir, attrs, attrcount);
+            if (err) {
+                return err;
+            }
+
+            lfs_fs_addusage(lfs, -count);
+
+            removed = true;
+            continue;
+        }
+
+        if (!dir->split) {
+            return removed;
+        }
+
+        int err = lfs_dir_fetch(lfs, dir, dir->tail);
+        if (err) {
+            return err;
+        }
+    }
+}
+
+static int lfs_remove_recursive_(lfs_t *lfs, const char *path) {
+    // deorphan if we haven't yet, needed at most once after poweron
+    int err = lfs_fs_forceconsistency(lfs);
+    if (err) {
+        return err;
+    }
+
+    // removing the mount checkpoint commits to the superblock pair, do it
+    // before looking anything up so what we find stays valid
+    err = lfs_fs_uncheckpoint(lfs);
+    if (err) {
+        return err;
+    }
+
+    while (true) {
+        lfs_mdir_t cwd;
+        const char *name = path;
+        lfs_stag_t tag = lfs_dir_find(lfs, &cwd, &name, NULL);
+        if (tag < 0) {
+            return (int)tag;
+        }
+
+        if (lfs_tag_type3(tag) != LFS_TYPE_DIR) {
+            return lfs_dir_remove(lfs, &cwd, tag);
+        }
+
+        // walk down to a directory without any subdirectories, this way
+        // we never have more than one orphan at a time
+        lfs_block_t pair[2] = {lfs->root[0], lfs->root[1]};
+        bool istarget = true;
+        while (true) {
+            if (lfs_tag_id(tag) != 0x3ff) {
+                lfs_stag_t res = lfs_dir_get(lfs, &cwd,
+                        LFS_MKTAG(0x700, 0x3ff, 0),
+                        LFS_MKTAG(LFS_TYPE_STRUCT, lfs_tag_id(tag), 8), pair);
+                if (res < 0) {
+                    return (int)res;
+                }
+                lfs_pair_fromle32(pair);
+            }
+
+            lfs_mdir_t dir;
+            err = lfs_dir_fetch(lfs, &dir, pair);
+            if (err) {
+                return err;
+            }
+
+            lfs_stag_t res = lfs_dir_findtype(lfs, &dir, LFS_TYPE_DIR);
+            if (res == LFS_ERR_NOENT) {
+                break;
+            } else if (res < 0) {
+                return (int)res;
+            }
+
+            cwd = dir;
+            tag = res;
+            istarget = false;
+        }
+
+        // remove any files, this may relocate things so start over
+        // afterwards
+        lfs_mdir_t dir;
+        err = lfs_dir_fetch(lfs, &dir, pair);
+        if (err) {
+            return err;
+        }
+
+        int res = lfs_dir_removefiles(lfs, &dir);
+        if (res < 0) {
+            return res;
+        } else if (res) {
+            continue;
+        }
+
+        // the root directory itself can't be removed
+        if (lfs_tag_id(tag) == 0x3ff) {
+            return 0;
+        }
+
+        // directory is empty now, remove it
+        err = lfs_dir_remove(lfs, &cwd, tag);
+        if (err) {
+            return err;
+        }
+
+        if (istarget) {
+            return 0;
+        }
+    }
+}
+#endif
+
+#ifndef LFS_READONLY
+static int lfs_dir_rename(lfs_t *lfs,
+        lfs_mdir_t *oldcwd, lfs_stag_t oldtag,
+        lfs_mdir_t *newcwd, lfs_stag_t prevtag, uint16_t newid,
+        const char *newpath) {
     if (oldtag < 0 || lfs_tag_id(oldtag) == 0x3ff) {
         return (oldtag < 0) ? (int)oldtag : LFS_ERR_INVAL;
     }
 
-    // find new entry
-    lfs_mdir_t newcwd;
-    uint16_t newid;
-    lfs_stag_t prevtag = lfs_dir_find(lfs, &newcwd, &newpath, &newid);
     if ((prevtag < 0 || lfs_tag_id(prevtag) == 0x3ff) &&
             !(prevtag == LFS_ERR_NOENT && newid != 0x3ff)) {
         return (prevtag < 0) ? (int)prevtag : LFS_ERR_INVAL;
     }
 
     // if we're in the same pair there's a few special cases...
-    bool samepair = (lfs_pair_cmp(oldcwd.pair, newcwd.pair) == 0);
+    bool samepair = (lfs_pair_cmp(oldcwd->pair, newcwd->pair) == 0);
     uint16_t newoldid = lfs_tag_id(oldtag);
 
     struct lfs_mlist prevdir;
@@ -3977,7 +4901,7 @@ static int lfs_rename_(lfs_t *lfs, const char *oldpath, const char *newpath) {
     } else if (lfs_tag_type3(prevtag) == LFS_TYPE_DIR) {
         // must be empty before removal
         lfs_block_t prevpair[2];
-        lfs_stag_t res = lfs_dir_get(lfs, &newcwd, LFS_MKTAG(0x700, 0x3ff, 0),
+        lfs_stag_t res = lfs_dir_get(lfs, newcwd, LFS_MKTAG(0x700, 0x3ff, 0),
                 LFS_MKTAG(LFS_TYPE_STRUCT, newid, 8), prevpair);
         if (res < 0) {
             return (int)res;
@@ -3985,7 +4909,7 @@ static int lfs_rename_(lfs_t *lfs, const char *oldpath, const char *newpath) {
         lfs_pair_fromle32(prevpair);
 
         // must be empty before removal
-        err = lfs_dir_fetch(lfs, &prevdir.m, prevpair);
+        int err = lfs_dir_fetch(lfs, &prevdir.m, prevpair);
         if (err) {
             return err;
         }
@@ -4007,17 +4931,28 @@ static int lfs_rename_(lfs_t *lfs, const char *oldpath, const char *newpath) {
         lfs->mlist = &prevdir;
     }
 
+    // find how many blocks we are freeing if we replace a file
+    lfs_ssize_t count = 0;
+    if (prevtag != LFS_ERR_NOENT
+            && lfs_tag_type3(prevtag) == LFS_TYPE_REG
+            && lfs->usage.used != LFS_BLOCK_NULL) {
+        count = lfs_dir_getctzcount(lfs, newcwd, newid);
+        if (count < 0) {
+            return count;
+        }
+    }
+
     if (!samepair) {
-        lfs_fs_prepmove(lfs, newoldid, oldcwd.pair);
+        lfs_fs_prepmove(lfs, newoldid, oldcwd->pair);
     }
 
     // move over all attributes
-    err = lfs_dir_commit(lfs, &newcwd, LFS_MKATTRS(
+    int err = lfs_dir_commit(lfs, newcwd, LFS_MKATTRS(
             {LFS_MKTAG_IF(prevtag != LFS_ERR_NOENT,
                 LFS_TYPE_DELETE, newid, 0), NULL},
             {LFS_MKTAG(LFS_TYPE_CREATE, newid, 0), NULL},
             {LFS_MKTAG(lfs_tag_type3(oldtag), newid, strlen(newpath)), newpath},
-            {LFS_MKTAG(LFS_FROM_MOVE, newid, lfs_tag_id(oldtag)), &oldcwd},
+            {LFS_MKTAG(LFS_FROM_MOVE, newid, lfs_tag_id(oldtag)), oldcwd},
             {LFS_MKTAG_IF(samepair,
                 LFS_TYPE_DELETE, newoldid, 0), NULL}));
     if (err) {
@@ -4025,12 +4960,14 @@ static int lfs_rename_(lfs_t *lfs, const char *oldpath, const char *newpath) {
         return err;
     }
 
+    lfs_fs_addusage(lfs, -count);
+
     // let commit clean up after move (if we're different! otherwise move
     // logic already fixed it for us)
     if (!samepair && lfs_gstate_hasmove(&lfs->gstate)) {
         // prep gstate and delete move id
         lfs_fs_prepmove(lfs, 0x3ff, NULL);
-        err = lfs_dir_commit(lfs, &oldcwd, LFS_MKATTRS(
+        err = lfs_dir_commit(lfs, oldcwd, LFS_MKATTRS(
                 {LFS_MKTAG(LFS_TYPE_DELETE, lfs_tag_id(oldtag), 0), NULL}));
         if (err) {
             lfs->mlist = prevdir.next;
@@ -4047,15 +4984,225 @@ static int lfs_rename_(lfs_t *lfs, const char *oldpath, const char *newpath) {
             return err;
         }
 
-        err = lfs_fs_pred(lfs, prevdir.m.pair, &newcwd);
-        if (err) {
-            return err;
+        err = lfs_fs_pred(lfs, prevdir.m.pair, newcwd);
+        if (err) {
+            return err;
+        }
+
+        err = lfs_dir_drop(lfs, newcwd, &prevdir.m);
+        if (err) {
+            return err;
+        }
+    }
+
+    return 0;
+}
+#endif
+
+#ifndef LFS_READONLY
+static int lfs_rename_(lfs_t *lfs, const char *oldpath, const char *newpath) {
+    // deorphan if we haven't yet, needed at most once after poweron
+    int err = lfs_fs_forceconsistency(lfs);
+    if (err) {
+        return err;
+    }
+
+    // removing the mount checkpoint commits to the superblock pair, do it
+    // before looking anything up so what we find stays valid
+    err = lfs_fs_uncheckpoint(lfs);
+    if (err) {
+        return err;
+    }
+
+    // find old entry
+    lfs_mdir_t oldcwd;
+    lfs_stag_t oldtag = lfs_dir_find(lfs, &oldcwd, &oldpath, NULL);
+    if (oldtag < 0 || lfs_tag_id(oldtag) == 0x3ff) {
+        return (oldtag < 0) ? (int)oldtag : LFS_ERR_INVAL;
+    }
+
+    // find new entry
+    lfs_mdir_t newcwd;
+    uint16_t newid;
+    lfs_stag_t prevtag = lfs_dir_find(lfs, &newcwd, &newpath, &newid);
+
+    return lfs_dir_rename(lfs, &oldcwd, oldtag,
+            &newcwd, prevtag, newid, newpath);
+}
+#endif
+
+#ifndef LFS_READONLY
+// compare two names in the order entries are sorted in a metadata pair,
+// this must match lfs_dir_find_match with a as the name on disk
+static int lfs_name_cmp(const char *a, lfs_size_t asize,
+        const char *b, lfs_size_t bsize) {
+    int res = memcmp(a, b, lfs_min(asize, bsize));
+    if (res) {
+        return (res < 0) ? LFS_CMP_LT : LFS_CMP_GT;
+    }
+
+    if (asize != bsize) {
+        return (bsize < asize) ? LFS_CMP_LT : LFS_CMP_GT;
+    }
+
+    return LFS_CMP_EQ;
+}
+
+struct lfs_rename_entry {
+    const char *name;
+    lfs_size_t nlen;
+    uint16_t type;
+    uint16_t oldid;
+    uint16_t newid;
+};
+
+// commit a batch of renames within a single metadata pair, ids are those
+// found on disk before any of the renames
+static int lfs_rename_commitbatch(lfs_t *lfs, lfs_mdir_t *cwd,
+        const struct lfs_rename_entry *entries, lfs_size_t count) {
+    // the moves read the old entries from the pair as it is on disk
+    lfs_mdir_t oldcwd = *cwd;
+    struct lfs_mattr attrs[4*LFS_BATCH_MAX];
+    int attrcount = 0;
+
+    // delete the old entries first, each delete shifts down any later
+    // entries with higher ids
+    for (lfs_size_t i = 0; i < count; i++) {
+        uint16_t id = entries[i].oldid;
+        for (lfs_size_t j = 0; j < i; j++) {
+            if (entries[j].oldid < entries[i].oldid) {
+                id -= 1;
+            }
+        }
+
+        attrs[attrcount] = (struct lfs_mattr){
+                LFS_MKTAG(LFS_TYPE_DELETE, id, 0), NULL};
+        attrcount += 1;
+    }
+
+    // then create the new entries at their sorted positions, accounting
+    // for deleted entries and any new entries created before them
+    for (lfs_size_t i = 0; i < count; i++) {
+        uint16_t id = entries[i].newid;
+        for (lfs_size_t j = 0; j < count; j++) {
+            if (entries[j].oldid < entries[i].newid) {
+                id -= 1;
+            }
+
+            if (j < i && lfs_name_cmp(
+                    entries[j].name, entries[j].nlen,
+                    entries[i].name, entries[i].nlen) == LFS_CMP_LT) {
+                id += 1;
+            }
+        }
+
+        attrs[attrcount+0] = (struct lfs_mattr){
+                LFS_MKTAG(LFS_TYPE_CREATE, id, 0), NULL};
+        attrs[attrcount+1] = (struct lfs_mattr){
+                LFS_MKTAG(entries[i].type, id, entries[i].nlen),
+                entries[i].name};
+        attrs[attrcount+2] = (struct lfs_mattr){
+                LFS_MKTAG(LFS_FROM_MOVE, id, entries[i].oldid), &oldcwd};
+        attrcount += 3;
+    }
+
+    return lfs_dir_commit(lfs, cwd, attrs, attrcount);
+}
+
+static int lfs_rename_batch_(lfs_t *lfs, const char *const *oldpaths,
+        const char *const *newpaths, lfs_size_t count) {
+    // deorphan if we haven't yet, needed at most once after poweron
+    int err = lfs_fs_forceconsistency(lfs);
+    if (err) {
+        return err;
+    }
+
+    // removing the mount checkpoint commits to the superblock pair, do it
+    // before looking anything up so what we find stays valid
+    err = lfs_fs_uncheckpoint(lfs);
+    if (err) {
+        return err;
+    }
+
+    lfs_mdir_t cwd;
+    struct lfs_rename_entry entries[LFS_BATCH_MAX];
+    lfs_size_t pending = 0;
+    lfs_size_t i = 0;
+    while (i < count || pending > 0) {
+        bool batch = false;
+        lfs_mdir_t oldcwd;
+        lfs_stag_t oldtag = LFS_ERR_NOENT;
+        lfs_mdir_t newcwd;
+        lfs_stag_t prevtag = LFS_ERR_NOENT;
+        const char *newpath = NULL;
+        uint16_t newid = 0x3ff;
+        if (i < count) {
+            // find old entry
+            const char *oldpath = oldpaths[i];
+            oldtag = lfs_dir_find(lfs, &oldcwd, &oldpath, NULL);
+
+            // find new entry
+            newpath = newpaths[i];
+            prevtag = lfs_dir_find(lfs, &newcwd, &newpath, &newid);
+
+            // only simple renames within one pair can be batched, anything
+            // that replaces or moves between pairs needs the full rename
+            batch = oldtag >= 0 && lfs_tag_id(oldtag) != 0x3ff
+                    && prevtag == LFS_ERR_NOENT && newid != 0x3ff
+                    && strlen(newpath) <= lfs->name_max
+                    && lfs_pair_cmp(oldcwd.pair, newcwd.pair) == 0
+                    && (pending == 0
+                        || lfs_pair_cmp(cwd.pair, newcwd.pair) == 0);
+
+            // renaming the same entry twice or to the same name depends
+            // on the earlier rename being on disk
+            for (lfs_size_t j = 0; batch && j < pending; j++) {
+                if (entries[j].oldid == lfs_tag_id(oldtag)
+                        || lfs_name_cmp(entries[j].name, entries[j].nlen,
+                            newpath, strlen(newpath)) == LFS_CMP_EQ) {
+                    batch = false;
+                }
+            }
+        }
+
+        if (!batch || pending == LFS_BATCH_MAX) {
+            if (pending > 0) {
+                // commit what we have, this changes what is on disk so
+                // look up the current entry again afterwards
+                err = lfs_rename_commitbatch(lfs, &cwd, entries, pending);
+                if (err) {
+                    return err;
+                }
+
+                pending = 0;
+                continue;
+            }
+
+            if (!batch) {
+                err = lfs_dir_rename(lfs, &oldcwd, oldtag,
+                        &newcwd, prevtag, newid, newpath);
+                if (err) {
+                    return err;
+                }
+
+                i += 1;
+                continue;
+            }
         }
 
-        err = lfs_dir_drop(lfs, &newcwd, &prevdir.m);
-        if (err) {
-            return err;
+        if (pending == 0) {
+            cwd = newcwd;
         }
+
+        entries[pending] = (struct lfs_rename_entry){
+            .name = newpath,
+            .nlen = strlen(newpath),
+            .type = lfs_tag_type3(oldtag),
+            .oldid = lfs_tag_id(oldtag),
+            .newid = newid,
+        };
+        pending += 1;
+        i += 1;
     }
 
     return 0;
@@ -4098,12 +5245,33 @@ static lfs_ssize_t lfs_getattr_(lfs_t *lfs, const char *path,
 #ifndef LFS_READONLY
 static int lfs_commitattr(lfs_t *lfs, const char *path,
         uint8_t type, const void *buffer, lfs_size_t size) {
+    const char *name = path;
     lfs_mdir_t cwd;
-    lfs_stag_t tag = lfs_dir_find(lfs, &cwd, &path, NULL);
+    lfs_stag_t tag = lfs_dir_find(lfs, &cwd, &name, NULL);
     if (tag < 0) {
         return tag;
     }
 
+    // the mount checkpoint is ours
+    if (lfs_tag_id(tag) == 0x3ff && type == LFS_CHECKPOINT_ATTR) {
+        return LFS_ERR_INVAL;
+    }
+
+    // removing a mount checkpoint commits to the superblock pair, which may
+    // be the pair we just found, so look the path up again afterwards
+    if (lfs->mountck != LFS_MOUNTCK_NONE) {
+        int err = lfs_fs_uncheckpoint(lfs);
+        if (err) {
+            return err;
+        }
+
+        name = path;
+        tag = lfs_dir_find(lfs, &cwd, &name, NULL);
+        if (tag < 0) {
+            return tag;
+        }
+    }
+
     uint16_t id = lfs_tag_id(tag);
     if (id == 0x3ff) {
         // special case for root
@@ -4209,6 +5377,10 @@ static int lfs_init(lfs_t *lfs, const struct lfs_config *cfg) {
     LFS_ASSERT(lfs->cfg->compact_thresh == (lfs_size_t)-1
             || lfs->cfg->compact_thresh <= lfs->cfg->block_size);
 
+    // cleanup frees the prescan buffer, so clear it before anything can fail
+    lfs->prescan.buffer = NULL;
+    lfs->prescan.size = 0;
+
     // setup read cache
     if (lfs->cfg->read_buffer) {
         lfs->rcache.buffer = lfs->cfg->read_buffer;
@@ -4248,6 +5420,18 @@ static int lfs_init(lfs_t *lfs, const struct lfs_config *cfg) {
         }
     }
 
+    // a second lookahead buffer lets us prescan the next lookahead window,
+    // this is only done if we allocate the first one
+#ifndef LFS_READONLY
+    if (!lfs->cfg->lookahead_buffer) {
+        lfs->prescan.buffer = lfs_malloc(lfs->cfg->lookahead_size);
+        if (!lfs->prescan.buffer) {
+            err = LFS_ERR_NOMEM;
+            goto cleanup;
+        }
+    }
+#endif
+
     // check that the size limits are sane
     LFS_ASSERT(lfs->cfg->name_max <= LFS_NAME_MAX);
     lfs->name_max = lfs->cfg->name_max;
@@ -4298,6 +5482,14 @@ static int lfs_init(lfs_t *lfs, const struct lfs_config *cfg) {
     lfs->gdisk = (lfs_gstate_t){0};
     lfs->gstate = (lfs_gstate_t){0};
     lfs->gdelta = (lfs_gstate_t){0};
+    lfs->gctail[0] = 0;
+    lfs->gctail[1] = 1;
+    lfs->gen = 0;
+    lfs->reserved.start = 0;
+    lfs->reserved.end = 0;
+    memset(&lfs->stats, 0, sizeof(lfs->stats));
+    lfs_fs_dropusage(lfs);
+    lfs->mountck = LFS_MOUNTCK_NONE;
 #ifdef LFS_MIGRATE
     lfs->lfs1 = NULL;
 #endif
@@ -4321,6 +5513,7 @@ static int lfs_deinit(lfs_t *lfs) {
 
     if (!lfs->cfg->lookahead_buffer) {
         lfs_free(lfs->lookahead.buffer);
+        lfs_free(lfs->prescan.buffer);
     }
 
     return 0;
@@ -4404,6 +5597,8 @@ static int lfs_mount_(lfs_t *lfs, const struct lfs_config *cfg) {
 
     // scan directory blocks for superblock and any global updates
     lfs_mdir_t dir = {.tail = {0, 1}};
+    struct lfs_mountck ck;
+    bool fast = false;
     lfs_block_t tortoise[2] = {LFS_BLOCK_NULL, LFS_BLOCK_NULL};
     lfs_size_t tortoise_i = 1;
     lfs_size_t tortoise_period = 1;
@@ -4429,13 +5624,14 @@ static int lfs_mount_(lfs_t *lfs, const struct lfs_config *cfg) {
                 NULL,
                 lfs_dir_find_match, &(struct lfs_dir_find_match){
                     lfs, "littlefs", 8});
-        if (tag < 0) {
+        // a checkpoint root we can't fetch is stale, see below
+        if (tag < 0 && !fast) {
             err = tag;
             goto cleanup;
         }
 
         // has superblock?
-        if (tag && !lfs_tag_isdelete(tag)) {
+        if (tag > 0 && !lfs_tag_isdelete(tag)) {
             // update root
             lfs->root[0] = dir.pair[0];
             lfs->root[1] = dir.pair[1];
@@ -4539,6 +5735,52 @@ static int lfs_mount_(lfs_t *lfs, const struct lfs_config *cfg) {
             }
         }
 
+        if (fast) {
+            // the root the checkpoint points to must fetch and have a
+            // superblock, otherwise the checkpoint is stale and we need a
+            // full scan
+            if (tag > 0 && lfs_pair_cmp(lfs->root, ck.root) == 0) {
+                break;
+            }
+
+            LFS_WARN("Stale mount checkpoint, root "
+                    "{0x%"PRIx32", 0x%"PRIx32"} (%"PRId32")",
+                    ck.root[0], ck.root[1], (tag < 0) ? tag : 0);
+            lfs->mountck = LFS_MOUNTCK_STALE;
+            fast = false;
+            lfs->gstate = (lfs_gstate_t){0};
+            dir.tail[0] = 0;
+            dir.tail[1] = 1;
+            tortoise[0] = LFS_BLOCK_NULL;
+            tortoise[1] = LFS_BLOCK_NULL;
+            tortoise_i = 1;
+            tortoise_period = 1;
+            continue;
+        }
+
+        // a mount checkpoint in the superblock pair lets us skip straight
+        // to the root, see lfs_fs_checkpoint
+        if (lfs->mountck == LFS_MOUNTCK_NONE
+                && lfs_pair_cmp(dir.pair, (const lfs_block_t[2]){0, 1}) == 0) {
+            int res = lfs_fs_getcheckpoint(lfs, &dir, &ck);
+            if (res < 0) {
+                err = res;
+                goto cleanup;
+            }
+
+            if (res) {
+                lfs->mountck = LFS_MOUNTCK_VALID;
+                fast = true;
+                if (lfs_pair_cmp(lfs->root, ck.root) == 0) {
+                    break;
+                }
+
+                dir.tail[0] = ck.root[0];
+                dir.tail[1] = ck.root[1];
+                continue;
+            }
+        }
+
         // has gstate?
         err = lfs_dir_getgstate(lfs, &dir, &lfs->gstate);
         if (err) {
@@ -4546,6 +5788,13 @@ static int lfs_mount_(lfs_t *lfs, const struct lfs_config *cfg) {
         }
     }
 
+    // the checkpoint has the gstate and used block count we would otherwise
+    // have had to collect
+    if (fast) {
+        lfs_gstate_xor(&lfs->gstate, &ck.gstate);
+        lfs->usage.used = ck.used;
+    }
+
     // update littlefs with gstate
     if (!lfs_gstate_iszero(&lfs->gstate)) {
         LFS_DEBUG("Found pending gstate 0x%08"PRIx32"%08"PRIx32"%08"PRIx32,
@@ -4611,6 +5860,7 @@ static int lfs_fs_stat_(lfs_t *lfs, struct lfs_fsinfo *fsinfo) {
     fsinfo->file_max = lfs->file_max;
     fsinfo->attr_max = lfs->attr_max;
 
+    fsinfo->compactions = lfs->stats.compactions;
     return 0;
 }
 
@@ -4721,6 +5971,227 @@ int lfs_fs_traverse_(lfs_t *lfs,
     return 0;
 }
 
+static int lfs_ctz_traversestep(lfs_t *lfs,
+        const lfs_cache_t *pcache, lfs_cache_t *rcache,
+        lfs_traverse_t *trav, lfs_size_t *n, lfs_size_t count,
+        int (*cb)(void*, lfs_block_t), void *data) {
+    // same as lfs_ctz_traverse, but trav->head/index are kept between calls
+    // and trav->head has not been reported yet
+    while (*n < count) {
+        int err = cb(data, trav->head);
+        if (err) {
+            return err;
+        }
+        *n += 1;
+
+        if (trav->index == 0) {
+            return false;
+        }
+
+        lfs_block_t heads[2];
+        int skips = 2 - (trav->index & 1);
+        err = lfs_bd_read(lfs,
+                pcache, rcache, skips*sizeof(trav->head),
+                trav->head, 0, &heads, skips*sizeof(trav->head));
+        heads[0] = lfs_fromle32(heads[0]);
+        heads[1] = lfs_fromle32(heads[1]);
+        if (err) {
+            return err;
+        }
+
+        for (int i = 0; i < skips-1; i++) {
+            err = cb(data, heads[i]);
+            if (err) {
+                return err;
+            }
+            *n += 1;
+        }
+
+        trav->head = heads[skips-1];
+        trav->index -= skips;
+    }
+
+    return true;
+}
+
+static void lfs_fs_traverseinit(lfs_t *lfs, lfs_traverse_t *trav,
+        bool includeorphans) {
+    trav->gen = lfs->gen;
+    trav->state = LFS_TRAV_MDIR;
+    trav->orphans = includeorphans;
+    trav->id = 0;
+    trav->m.tail[0] = 0;
+    trav->m.tail[1] = 1;
+    trav->tortoise[0] = LFS_BLOCK_NULL;
+    trav->tortoise[1] = LFS_BLOCK_NULL;
+    trav->tortoise_i = 1;
+    trav->tortoise_period = 1;
+    trav->file = NULL;
+}
+
+static int lfs_fs_traversestep_(lfs_t *lfs, lfs_traverse_t *trav,
+        int (*cb)(void *data, lfs_block_t block), void *data,
+        lfs_size_t count) {
+    // anything we have seen may be out of date if the filesystem changed,
+    // this also protects trav->m and trav->file from going stale
+    if (trav->gen != lfs->gen) {
+        lfs_fs_traverseinit(lfs, trav, trav->orphans);
+        return LFS_TRAVERSE_RESTARTED;
+    }
+
+    // files can be closed without changing the filesystem, make sure the
+    // one we are looking at is still open
+    if (trav->file) {
+        struct lfs_mlist *m = lfs->mlist;
+        while (m && m != (struct lfs_mlist*)trav->file) {
+            m = m->next;
+        }
+
+        if (!m) {
+            lfs_fs_traverseinit(lfs, trav, trav->orphans);
+            return LFS_TRAVERSE_RESTARTED;
+        }
+    }
+
+    lfs_size_t n = 0;
+    while (n < count && trav->state != LFS_TRAV_DONE) {
+        if (trav->state == LFS_TRAV_MDIR) {
+            if (lfs_pair_isnull(trav->m.tail)) {
+#ifndef LFS_READONLY
+                // on to any open files
+                trav->state = LFS_TRAV_FILE;
+                trav->file = (lfs_file_t*)lfs->mlist;
+#else
+                trav->state = LFS_TRAV_DONE;
+#endif
+                continue;
+            }
+
+            // detect cycles with Brent's algorithm
+            if (lfs_pair_issync(trav->m.tail, trav->tortoise)) {
+                LFS_WARN("Cycle detected in tail list");
+                return LFS_ERR_CORRUPT;
+            }
+            if (trav->tortoise_i == trav->tortoise_period) {
+                trav->tortoise[0] = trav->m.tail[0];
+                trav->tortoise[1] = trav->m.tail[1];
+                trav->tortoise_i = 0;
+                trav->tortoise_period *= 2;
+            }
+            trav->tortoise_i += 1;
+
+            for (int i = 0; i < 2; i++) {
+                int err = cb(data, trav->m.tail[i]);
+                if (err) {
+                    return err;
+                }
+                n += 1;
+            }
+
+            int err = lfs_dir_fetch(lfs, &trav->m, trav->m.tail);
+            if (err) {
+                return err;
+            }
+
+            trav->id = 0;
+            trav->state = LFS_TRAV_ENTRY;
+        } else if (trav->state == LFS_TRAV_ENTRY) {
+            if (trav->id >= trav->m.count) {
+                trav->state = LFS_TRAV_MDIR;
+                continue;
+            }
+
+            struct lfs_ctz ctz;
+            lfs_stag_t tag = lfs_dir_get(lfs, &trav->m,
+                    LFS_MKTAG(0x700, 0x3ff, 0),
+                    LFS_MKTAG(LFS_TYPE_STRUCT, trav->id, sizeof(ctz)), &ctz);
+            trav->id += 1;
+            if (tag < 0) {
+                if (tag == LFS_ERR_NOENT) {
+                    continue;
+                }
+                return tag;
+            }
+            lfs_ctz_fromle32(&ctz);
+
+            if (lfs_tag_type3(tag) == LFS_TYPE_CTZSTRUCT && ctz.size > 0) {
+                trav->head = ctz.head;
+                trav->index = lfs_ctz_index(lfs, &(lfs_off_t){ctz.size-1});
+                trav->state = LFS_TRAV_CTZ;
+            } else if (trav->orphans &&
+                    lfs_tag_type3(tag) == LFS_TYPE_DIRSTRUCT) {
+                for (int i = 0; i < 2; i++) {
+                    int err = cb(data, (&ctz.head)[i]);
+                    if (err) {
+                        return err;
+                    }
+                    n += 1;
+                }
+            }
+        } else if (trav->state == LFS_TRAV_CTZ) {
+            int res = lfs_ctz_traversestep(lfs, NULL, &lfs->rcache,
+                    trav, &n, count, cb, data);
+            if (res < 0) {
+                return res;
+            }
+
+            if (!res) {
+                trav->state = LFS_TRAV_ENTRY;
+            }
+#ifndef LFS_READONLY
+        } else if (trav->state == LFS_TRAV_FILE) {
+            lfs_file_t *f = trav->file;
+            if (!f) {
+                trav->state = LFS_TRAV_DONE;
+                continue;
+            }
+
+            trav->state = LFS_TRAV_FILEPOS;
+            if (f->type == LFS_TYPE_REG
+                    && (f->flags & LFS_F_DIRTY)
+                    && !(f->flags & LFS_F_INLINE)
+                    && f->ctz.size > 0) {
+                trav->head = f->ctz.head;
+                trav->index = lfs_ctz_index(lfs, &(lfs_off_t){f->ctz.size-1});
+                trav->state = LFS_TRAV_FILECTZ;
+            }
+        } else if (trav->state == LFS_TRAV_FILEPOS) {
+            lfs_file_t *f = trav->file;
+            if (f->type == LFS_TYPE_REG
+                    && (f->flags & LFS_F_WRITING)
+                    && !(f->flags & LFS_F_INLINE)
+                    && f->pos > 0) {
+                trav->head = f->block;
+                trav->index = lfs_ctz_index(lfs, &(lfs_off_t){f->pos-1});
+                trav->state = LFS_TRAV_FILEBLOCK;
+            } else {
+                trav->file = f->next;
+                trav->state = LFS_TRAV_FILE;
+            }
+        } else {
+            int res = lfs_ctz_traversestep(lfs, &trav->file->cache,
+                    &lfs->rcache, trav, &n, count, cb, data);
+            if (res < 0) {
+                return res;
+            }
+
+            if (!res) {
+                if (trav->state == LFS_TRAV_FILECTZ) {
+                    trav->state = LFS_TRAV_FILEPOS;
+                } else {
+                    trav->file = trav->file->next;
+                    trav->state = LFS_TRAV_FILE;
+                }
+            }
+#endif
+        }
+    }
+
+    return (trav->state == LFS_TRAV_DONE)
+            ? LFS_TRAVERSE_DONE
+            : LFS_TRAVERSE_MORE;
+}
+
 #ifndef LFS_READONLY
 static int lfs_fs_pred(lfs_t *lfs,
         const lfs_block_t pair[2], lfs_mdir_t *pdir) {
@@ -5036,6 +6507,9 @@ static int lfs_fs_deorphan(lfs_t *lfs, bool powerloss) {
                         return state;
                     }
 
+                    lfs_fs_gcfix(lfs, dir.pair, dir.tail);
+                    lfs_fs_addusage(lfs, -2);
+
                     // did our commit create more orphans?
                     if (state == LFS_OK_ORPHANED) {
                         moreorphans = true;
@@ -5059,6 +6533,17 @@ static int lfs_fs_deorphan(lfs_t *lfs, bool powerloss) {
 
 #ifndef LFS_READONLY
 static int lfs_fs_forceconsistency(lfs_t *lfs) {
+    // only remove the mount checkpoint if one of the below is going to
+    // commit, a consistent filesystem keeps its checkpoint
+    if (lfs_gstate_needssuperblock(&lfs->gstate)
+            || lfs_gstate_hasmove(&lfs->gdisk)
+            || lfs_gstate_hasorphans(&lfs->gstate)) {
+        int err = lfs_fs_uncheckpoint(lfs);
+        if (err) {
+            return err;
+        }
+    }
+
     int err = lfs_fs_desuperblock(lfs);
     if (err) {
         return err;
@@ -5069,60 +6554,263 @@ static int lfs_fs_forceconsistency(lfs_t *lfs) {
         return err;
     }
 
-    err = lfs_fs_deorphan(lfs, true);
-    if (err) {
-        return err;
+    err = lfs_fs_deorphan(lfs, true);
+    if (err) {
+        return err;
+    }
+
+    return 0;
+}
+#endif
+
+#ifndef LFS_READONLY
+static int lfs_fs_mkconsistent_(lfs_t *lfs) {
+    // lfs_fs_forceconsistency does most of the work here
+    int err = lfs_fs_forceconsistency(lfs);
+    if (err) {
+        return err;
+    }
+
+    // do we have any pending gstate?
+    lfs_gstate_t delta = {0};
+    lfs_gstate_xor(&delta, &lfs->gdisk);
+    lfs_gstate_xor(&delta, &lfs->gstate);
+    if (!lfs_gstate_iszero(&delta)) {
+        err = lfs_fs_uncheckpoint(lfs);
+        if (err) {
+            return err;
+        }
+
+        // lfs_dir_commit will implicitly write out any pending gstate
+        lfs_mdir_t root;
+        err = lfs_dir_fetch(lfs, &root, lfs->root);
+        if (err) {
+            return err;
+        }
+
+        err = lfs_dir_commit(lfs, &root, NULL, 0);
+        if (err) {
+            return err;
+        }
+    }
+
+    return 0;
+}
+#endif
+
+// Mount checkpoints
+//
+// Mounting needs the root pair and the gstate, which normally means fetching
+// every metadata pair in the tail list. A checkpoint records these in the
+// superblock pair, so mount only needs to fetch the superblock pair and the
+// root. Rather than trying to detect whether a checkpoint is out of date, it
+// is removed before the first change to the filesystem, so a checkpoint on
+// disk is always current.
+//
+// As a guard against checkpoints this driver didn't write, each one carries a
+// generation that is also appended to the superblock entry in the same
+// commit. Anything that rewrites the superblock without knowing about
+// checkpoints drops the generation, and a checkpoint only counts if the two
+// match. Changes to other metadata pairs by such firmware still go unnoticed.
+static int lfs_fs_getcheckpoint(lfs_t *lfs, const lfs_mdir_t *dir,
+        struct lfs_mountck *ck) {
+    lfs_stag_t tag = lfs_dir_get(lfs, dir, LFS_MKTAG(0x7ff, 0x3ff, 0),
+            LFS_MKTAG(LFS_TYPE_USERATTR + LFS_CHECKPOINT_ATTR, 0, sizeof(*ck)),
+            ck);
+    if (tag < 0) {
+        return (tag == LFS_ERR_NOENT) ? false : tag;
+    }
+
+    // ignore anything we don't recognize
+    if (lfs_tag_size(tag) != sizeof(*ck)
+            || lfs_crc(0xffffffff, ck, sizeof(*ck) - sizeof(ck->crc))
+                != lfs_fromle32(ck->crc)) {
+        return false;
+    }
+    lfs_mountck_fromle32(ck);
+
+    if (ck->root[0] >= lfs->block_count || ck->root[1] >= lfs->block_count) {
+        return false;
+    }
+
+    struct lfs_mountck_superblock sb;
+    tag = lfs_dir_get(lfs, dir, LFS_MKTAG(0x7ff, 0x3ff, 0),
+            LFS_MKTAG(LFS_TYPE_INLINESTRUCT, 0, sizeof(sb)),
+            &sb);
+    if (tag < 0) {
+        return tag;
+    }
+
+    if (lfs_tag_size(tag) < sizeof(sb) || lfs_fromle32(sb.gen) != ck->gen) {
+        LFS_DEBUG("Mount checkpoint generation 0x%08"PRIx32" not in "
+                "superblock", ck->gen);
+        return false;
+    }
+
+    return true;
+}
+
+#ifndef LFS_READONLY
+static void lfs_fs_mkcheckpoint(lfs_t *lfs, struct lfs_mountck *ck,
+        uint32_t gen) {
+    ck->root[0] = lfs->root[0];
+    ck->root[1] = lfs->root[1];
+    ck->gstate = lfs->gstate;
+    ck->used = lfs->usage.used;
+    ck->gen = gen;
+    lfs_mountck_tole32(ck);
+    ck->crc = lfs_tole32(lfs_crc(0xffffffff, ck,
+            sizeof(*ck) - sizeof(ck->crc)));
+}
+#endif
+
+#ifndef LFS_READONLY
+static int lfs_fs_checkpoint_(lfs_t *lfs) {
+    // nothing changed since the last checkpoint?
+    if (lfs->mountck == LFS_MOUNTCK_VALID) {
+        return 0;
+    }
+
+    // only record a consistent filesystem
+    int err = lfs_fs_forceconsistency(lfs);
+    if (err) {
+        return err;
+    }
+
+    // the superblock is rewritten as it is on disk, with the next generation
+    // appended
+    lfs_mdir_t dir;
+    err = lfs_dir_fetch(lfs, &dir, (const lfs_block_t[2]){0, 1});
+    if (err) {
+        return err;
+    }
+
+    struct lfs_mountck_superblock sb;
+    lfs_stag_t tag = lfs_dir_get(lfs, &dir, LFS_MKTAG(0x7ff, 0x3ff, 0),
+            LFS_MKTAG(LFS_TYPE_INLINESTRUCT, 0, sizeof(sb)),
+            &sb);
+    if (tag < 0) {
+        return tag;
+    }
+    uint32_t gen = (lfs_tag_size(tag) < sizeof(sb))
+            ? 1 : lfs_fromle32(sb.gen) + 1;
+    sb.gen = lfs_tole32(gen);
+
+    // committing may expand the superblock, which changes the root, so
+    // repeat until what we've written is up to date
+    //
+    // this replaces any stale checkpoint, if we fail part way there may be
+    // one on disk that does not match, so it is treated as stale
+    lfs->mountck = LFS_MOUNTCK_NONE;
+    struct lfs_mountck ck;
+    lfs_fs_mkcheckpoint(lfs, &ck, gen);
+    while (true) {
+        err = lfs_dir_fetch(lfs, &dir, (const lfs_block_t[2]){0, 1});
+        if (err) {
+            lfs->mountck = LFS_MOUNTCK_STALE;
+            return err;
+        }
+
+        err = lfs_dir_commit(lfs, &dir, LFS_MKATTRS(
+                {LFS_MKTAG(LFS_TYPE_INLINESTRUCT, 0, sizeof(sb)), &sb},
+                {LFS_MKTAG(LFS_TYPE_USERATTR + LFS_CHECKPOINT_ATTR,
+                    0, sizeof(ck)), &ck}));
+        if (err) {
+            lfs->mountck = LFS_MOUNTCK_STALE;
+            return err;
+        }
+
+        struct lfs_mountck nck;
+        lfs_fs_mkcheckpoint(lfs, &nck, gen);
+        if (memcmp(&nck, &ck, sizeof(ck)) == 0) {
+            break;
+        }
+        ck = nck;
     }
 
+    lfs->mountck = LFS_MOUNTCK_VALID;
     return 0;
 }
 #endif
 
 #ifndef LFS_READONLY
-static int lfs_fs_mkconsistent_(lfs_t *lfs) {
-    // lfs_fs_forceconsistency does most of the work here
-    int err = lfs_fs_forceconsistency(lfs);
+static int lfs_fs_uncheckpoint(lfs_t *lfs) {
+    if (lfs->mountck == LFS_MOUNTCK_NONE) {
+        return 0;
+    }
+
+    // removing the checkpoint is a change itself
+    uint8_t mountck = lfs->mountck;
+    lfs->mountck = LFS_MOUNTCK_NONE;
+
+    lfs_mdir_t dir;
+    int err = lfs_dir_fetch(lfs, &dir, (const lfs_block_t[2]){0, 1});
     if (err) {
+        lfs->mountck = mountck;
         return err;
     }
 
-    // do we have any pending gstate?
-    lfs_gstate_t delta = {0};
-    lfs_gstate_xor(&delta, &lfs->gdisk);
-    lfs_gstate_xor(&delta, &lfs->gstate);
-    if (!lfs_gstate_iszero(&delta)) {
-        // lfs_dir_commit will implicitly write out any pending gstate
-        lfs_mdir_t root;
-        err = lfs_dir_fetch(lfs, &root, lfs->root);
-        if (err) {
-            return err;
-        }
-
-        err = lfs_dir_commit(lfs, &root, NULL, 0);
-        if (err) {
-            return err;
-        }
+    err = lfs_dir_commit(lfs, &dir, LFS_MKATTRS(
+            {LFS_MKTAG(LFS_TYPE_USERATTR + LFS_CHECKPOINT_ATTR, 0, 0x3ff),
+                NULL}));
+    if (err) {
+        lfs->mountck = mountck;
+        return err;
     }
 
     return 0;
 }
 #endif
 
+#ifndef LFS_READONLY
 static int lfs_fs_size_count(void *p, lfs_block_t block) {
     (void)block;
     lfs_size_t *size = p;
     *size += 1;
     return 0;
 }
+#endif
+
+static int lfs_fs_usagecount(void *p, lfs_block_t block) {
+    (void)block;
+    lfs_t *lfs = p;
+    // blocks written by open files are counted when the files are synced
+    if (lfs->usage.trav.state < LFS_TRAV_FILE) {
+        lfs->usage.seen += 1;
+    }
+    return 0;
+}
+
+static int lfs_fs_stepusage(lfs_t *lfs, lfs_size_t count) {
+    int res = lfs_fs_traversestep_(lfs, &lfs->usage.trav,
+            lfs_fs_usagecount, lfs, count);
+    if (res < 0) {
+        lfs_fs_dropusage(lfs);
+        return res;
+    }
+
+    if (res == LFS_TRAVERSE_RESTARTED) {
+        lfs->usage.seen = 0;
+        return true;
+    } else if (res == LFS_TRAVERSE_MORE) {
+        return true;
+    }
+
+    lfs->usage.used = lfs->usage.seen;
+    return false;
+}
 
 static lfs_ssize_t lfs_fs_size_(lfs_t *lfs) {
-    lfs_size_t size = 0;
-    int err = lfs_fs_traverse_(lfs, lfs_fs_size_count, &size, false);
-    if (err) {
-        return err;
+    // count used blocks if we haven't yet, from then on the count is kept
+    // up to date
+    while (lfs->usage.used == LFS_BLOCK_NULL) {
+        int err = lfs_fs_stepusage(lfs, (lfs_size_t)-1);
+        if (err < 0) {
+            return err;
+        }
     }
 
-    return size;
+    return lfs->usage.used;
 }
 
 // explicit garbage collection
@@ -5153,6 +6841,18 @@ static int lfs_fs_gc_(lfs_t *lfs) {
             if (!mdir.erased || ((lfs->cfg->compact_thresh == 0)
                     ? mdir.off > lfs->cfg->block_size - lfs->cfg->block_size/8
                     : mdir.off > lfs->cfg->compact_thresh)) {
+                // the mount checkpoint goes first, this may commit to
+                // this very pair so fetch it again
+                err = lfs_fs_uncheckpoint(lfs);
+                if (err) {
+                    return err;
+                }
+
+                err = lfs_dir_fetch(lfs, &mdir, mdir.pair);
+                if (err) {
+                    return err;
+                }
+
                 // the easiest way to trigger a compaction is to mark
                 // the mdir as unerased and add an empty commit
                 mdir.erased = false;
@@ -5176,17 +6876,126 @@ static int lfs_fs_gc_(lfs_t *lfs) {
 }
 #endif
 
+#ifndef LFS_READONLY
+static int lfs_fs_gcstep_(lfs_t *lfs) {
+    int err = lfs_fs_forceconsistency(lfs);
+    if (err) {
+        return err;
+    }
+
+    // compact the next mdir if it needs it, see lfs_fs_gc_
+    if (!lfs_pair_isnull(lfs->gctail) && lfs->cfg->compact_thresh
+            < lfs->cfg->block_size - lfs->cfg->prog_size) {
+        lfs_mdir_t mdir;
+        err = lfs_dir_fetch(lfs, &mdir, lfs->gctail);
+        if (err) {
+            // the pair may be gone, start over with the next pass instead
+            // of failing on it forever
+            lfs->gctail[0] = 0;
+            lfs->gctail[1] = 1;
+            return err;
+        }
+
+        // move on first, if the commit relocates anything our position
+        // gets fixed up
+        lfs->gctail[0] = mdir.tail[0];
+        lfs->gctail[1] = mdir.tail[1];
+
+        if (!mdir.erased || ((lfs->cfg->compact_thresh == 0)
+                ? mdir.off > lfs->cfg->block_size - lfs->cfg->block_size/8
+                : mdir.off > lfs->cfg->compact_thresh)) {
+            err = lfs_fs_uncheckpoint(lfs);
+            if (err) {
+                return err;
+            }
+
+            err = lfs_dir_fetch(lfs, &mdir, mdir.pair);
+            if (err) {
+                return err;
+            }
+
+            mdir.erased = false;
+            err = lfs_dir_commit(lfs, &mdir, NULL, 0);
+            if (err) {
+                return err;
+            }
+        }
+
+        return true;
+    }
+
+    // end of the pass, count the used blocks if we don't know them yet and
+    // scan the next lookahead window, a bit at a time, one lookahead buffer
+    // worth of blocks keeps each step short
+    if (lfs->usage.used == LFS_BLOCK_NULL) {
+        int res = lfs_fs_stepusage(lfs, lfs->cfg->lookahead_size);
+        if (res) {
+            return res;
+        }
+    }
+
+    if (lfs_alloc_canstage(lfs)) {
+        if (lfs->prescan.size == 0
+                || lfs->prescan.trav.state != LFS_TRAV_DONE) {
+            int res = lfs_alloc_stage(lfs, lfs->cfg->lookahead_size);
+            if (res) {
+                return res;
+            }
+        }
+
+        // move on right away if the current window is used up
+        if (lfs->lookahead.next >= lfs->lookahead.size) {
+            lfs_alloc_adopt(lfs);
+        }
+    } else if (lfs->lookahead.size < 8*lfs->cfg->lookahead_size) {
+        // otherwise try to populate the lookahead buffer in one go
+        err = lfs_alloc_scan(lfs);
+        if (err) {
+            return err;
+        }
+    }
+
+    lfs->gctail[0] = 0;
+    lfs->gctail[1] = 1;
+    return false;
+}
+#endif
+
+#ifndef LFS_READONLY
+static lfs_ssize_t lfs_fs_nextfree_(lfs_t *lfs,
+        lfs_block_t *blocks, lfs_size_t count) {
+    // everything from lookahead.next on is free and not handed out yet,
+    // lfs_alloc returns blocks in exactly this order
+    lfs_size_t n = 0;
+    for (lfs_block_t i = lfs->lookahead.next;
+            i < lfs->lookahead.size && n < count; i++) {
+        if (lfs_alloc_isfree(lfs, i)) {
+            blocks[n] = (lfs->lookahead.start + i) % lfs->block_count;
+            n += 1;
+        }
+    }
+
+    return n;
+}
+#endif
+
 #ifndef LFS_READONLY
 static int lfs_fs_grow_(lfs_t *lfs, lfs_size_t block_count) {
     // shrinking is not supported
     LFS_ASSERT(block_count >= lfs->block_count);
 
     if (block_count > lfs->block_count) {
+        int err = lfs_fs_uncheckpoint(lfs);
+        if (err) {
+            return err;
+        }
+
         lfs->block_count = block_count;
+        lfs_alloc_unstage(lfs);
 
         // fetch the root
         lfs_mdir_t root;
-        int err = lfs_dir_fetch(lfs, &root, lfs->root);
+        err = lfs_dir_fetch(lfs, &root, lfs->root);
         if (err) {
             return err;
         }
@@ -5203,9 +7012,12 @@ static int lfs_fs_grow_(lfs_t *lfs, lfs_size_t block_count) {
 
         superblock.block_count = lfs->block_count;
 
+        // the tag may include the checkpoint generation, which we did not
+        // read, write the superblock without it, the checkpoint is gone
         lfs_superblock_tole32(&superblock);
         err = lfs_dir_commit(lfs, &root, LFS_MKATTRS(
-                {tag, &superblock}));
+                {LFS_MKTAG(LFS_TYPE_INLINESTRUCT, 0, sizeof(superblock)),
+                    &superblock}));
         if (err) {
             return err;
         }
@@ -5986,6 +7798,40 @@ int lfs_rename(lfs_t *lfs, const char *oldpath, const char *newpath) {
 }
 #endif
 
+#ifndef LFS_READONLY
+int lfs_remove_recursive(lfs_t *lfs, const char *path) {
+    int err = LFS_LOCK(lfs->cfg);
+    if (err) {
+        return err;
+    }
+    LFS_TRACE("lfs_remove_recursive(%p, \"%s\")", (void*)lfs, path);
+
+    err = lfs_remove_recursive_(lfs, path);
+
+    LFS_TRACE("lfs_remove_recursive -> %d", err);
+    LFS_UNLOCK(lfs->cfg);
+    return err;
+}
+#endif
+
+#ifndef LFS_READONLY
+int lfs_rename_batch(lfs_t *lfs, const char *const *oldpaths,
+        const char *const *newpaths, lfs_size_t count) {
+    int err = LFS_LOCK(lfs->cfg);
+    if (err) {
+        return err;
+    }
+    LFS_TRACE("lfs_rename_batch(%p, %p, %p, %"PRIu32")",
+            (void*)lfs, (void*)oldpaths, (void*)newpaths, count);
+
+    err = lfs_rename_batch_(lfs, oldpaths, newpaths, count);
+
+    LFS_TRACE("lfs_rename_batch -> %d", err);
+    LFS_UNLOCK(lfs->cfg);
+    return err;
+}
+#endif
+
 int lfs_stat(lfs_t *lfs, const char *path, struct lfs_info *info) {
     int err = LFS_LOCK(lfs->cfg);
     if (err) {
@@ -6135,6 +7981,23 @@ lfs_ssize_t lfs_file_read(lfs_t *lfs, lfs_file_t *file,void *buffer, lfs_size_t
     return res;
 }
 
+lfs_ssize_t lfs_file_readv(lfs_t *lfs, lfs_file_t *file,
+        const struct lfs_iovec *iov, lfs_size_t iovcnt) {
+    int err = LFS_LOCK(lfs->cfg);
+    if (err) {
+        return err;
+    }
+    LFS_TRACE("lfs_file_readv(%p, %p, %p, %"PRIu32")",
+            (void*)lfs, (void*)file, (void*)iov, iovcnt);
+    LFS_ASSERT(lfs_mlist_isopen(lfs->mlist, (struct lfs_mlist*)file));
+
+    lfs_ssize_t res = lfs_file_readv_(lfs, file, iov, iovcnt);
+
+    LFS_TRACE("lfs_file_readv -> %"PRId32, res);
+    LFS_UNLOCK(lfs->cfg);
+    return res;
+}
+
 #ifndef LFS_READONLY
 lfs_ssize_t lfs_file_write(lfs_t *lfs, lfs_file_t *file,
         const void *buffer, lfs_size_t size) {
@@ -6152,6 +8015,23 @@ lfs_ssize_t lfs_file_write(lfs_t *lfs, lfs_file_t *file,
     LFS_UNLOCK(lfs->cfg);
     return res;
 }
+
+lfs_ssize_t lfs_file_writev(lfs_t *lfs, lfs_file_t *file,
+        const struct lfs_iovec *iov, lfs_size_t iovcnt) {
+    int err = LFS_LOCK(lfs->cfg);
+    if (err) {
+        return err;
+    }
+    LFS_TRACE("lfs_file_writev(%p, %p, %p, %"PRIu32")",
+            (void*)lfs, (void*)file, (void*)iov, iovcnt);
+    LFS_ASSERT(lfs_mlist_isopen(lfs->mlist, (struct lfs_mlist*)file));
+
+    lfs_ssize_t res = lfs_file_writev_(lfs, file, iov, iovcnt);
+
+    LFS_TRACE("lfs_file_writev -> %"PRId32, res);
+    LFS_UNLOCK(lfs->cfg);
+    return res;
+}
 #endif
 
 lfs_soff_t lfs_file_seek(lfs_t *lfs, lfs_file_t *file,
@@ -6189,6 +8069,24 @@ int lfs_file_truncate(lfs_t *lfs, lfs_file_t *file, lfs_off_t size) {
 }
 #endif
 
+#ifndef LFS_READONLY
+lfs_ssize_t lfs_file_reserve(lfs_t *lfs, lfs_file_t *file, lfs_size_t size) {
+    int err = LFS_LOCK(lfs->cfg);
+    if (err) {
+        return err;
+    }
+    LFS_TRACE("lfs_file_reserve(%p, %p, %"PRIu32")",
+            (void*)lfs, (void*)file, size);
+    LFS_ASSERT(lfs_mlist_isopen(lfs->mlist, (struct lfs_mlist*)file));
+
+    lfs_ssize_t res = lfs_file_reserve_(lfs, file, size);
+
+    LFS_TRACE("lfs_file_reserve -> %"PRId32, res);
+    LFS_UNLOCK(lfs->cfg);
+    return res;
+}
+#endif
+
 lfs_soff_t lfs_file_tell(lfs_t *lfs, lfs_file_t *file) {
     int err = LFS_LOCK(lfs->cfg);
     if (err) {
@@ -6350,6 +8248,23 @@ int lfs_fs_stat(lfs_t *lfs, struct lfs_fsinfo *fsinfo) {
     return err;
 }
 
+int lfs_fs_stats(lfs_t *lfs, struct lfs_fsstats *stats, bool reset) {
+    int err = LFS_LOCK(lfs->cfg);
+    if (err) {
+        return err;
+    }
+    LFS_TRACE("lfs_fs_stats(%p, %p, %d)", (void*)lfs, (void*)stats, reset);
+
+    *stats = lfs->stats;
+    if (reset) {
+        memset(&lfs->stats, 0, sizeof(lfs->stats));
+    }
+
+    LFS_TRACE("lfs_fs_stats -> %d", 0);
+    LFS_UNLOCK(lfs->cfg);
+    return 0;
+}
+
 lfs_ssize_t lfs_fs_size(lfs_t *lfs) {
     int err = LFS_LOCK(lfs->cfg);
     if (err) {
@@ -6379,6 +8294,36 @@ int lfs_fs_traverse(lfs_t *lfs, int (*cb)(void *, lfs_block_t), void *data) {
     return err;
 }
 
+int lfs_fs_traversestart(lfs_t *lfs, lfs_traverse_t *trav) {
+    int err = LFS_LOCK(lfs->cfg);
+    if (err) {
+        return err;
+    }
+    LFS_TRACE("lfs_fs_traversestart(%p, %p)", (void*)lfs, (void*)trav);
+
+    lfs_fs_traverseinit(lfs, trav, true);
+
+    LFS_TRACE("lfs_fs_traversestart -> %d", 0);
+    LFS_UNLOCK(lfs->cfg);
+    return 0;
+}
+
+int lfs_fs_traversestep(lfs_t *lfs, lfs_traverse_t *trav,
+        int (*cb)(void *, lfs_block_t), void *data, lfs_size_t count) {
+    int err = LFS_LOCK(lfs->cfg);
+    if (err) {
+        return err;
+    }
+    LFS_TRACE("lfs_fs_traversestep(%p, %p, %p, %p, %"PRIu32")",
+            (void*)lfs, (void*)trav, (void*)(uintptr_t)cb, data, count);
+
+    err = lfs_fs_traversestep_(lfs, trav, cb, data, count);
+
+    LFS_TRACE("lfs_fs_traversestep -> %d", err);
+    LFS_UNLOCK(lfs->cfg);
+    return err;
+}
+
 #ifndef LFS_READONLY
 int lfs_fs_mkconsistent(lfs_t *lfs) {
     int err = LFS_LOCK(lfs->cfg);
@@ -6395,6 +8340,22 @@ int lfs_fs_mkconsistent(lfs_t *lfs) {
 }
 #endif
 
+#ifndef LFS_READONLY
+int lfs_fs_checkpoint(lfs_t *lfs) {
+    int err = LFS_LOCK(lfs->cfg);
+    if (err) {
+        return err;
+    }
+    LFS_TRACE("lfs_fs_checkpoint(%p)", (void*)lfs);
+
+    err = lfs_fs_checkpoint_(lfs);
+
+    LFS_TRACE("lfs_fs_checkpoint -> %d", err);
+    LFS_UNLOCK(lfs->cfg);
+    return err;
+}
+#endif
+
 #ifndef LFS_READONLY
 int lfs_fs_gc(lfs_t *lfs) {
     int err = LFS_LOCK(lfs->cfg);
@@ -6411,6 +8372,39 @@ int lfs_fs_gc(lfs_t *lfs) {
 }
 #endif
 
+#ifndef LFS_READONLY
+int lfs_fs_gcstep(lfs_t *lfs) {
+    int err = LFS_LOCK(lfs->cfg);
+    if (err) {
+        return err;
+    }
+    LFS_TRACE("lfs_fs_gcstep(%p)", (void*)lfs);
+
+    err = lfs_fs_gcstep_(lfs);
+
+    LFS_TRACE("lfs_fs_gcstep -> %d", err);
+    LFS_UNLOCK(lfs->cfg);
+    return err;
+}
+#endif
+
+#ifndef LFS_READONLY
+lfs_ssize_t lfs_fs_nextfree(lfs_t *lfs, lfs_block_t *blocks, lfs_size_t count) {
+    int err = LFS_LOCK(lfs->cfg);
+    if (err) {
+        return err;
+    }
+    LFS_TRACE("lfs_fs_nextfree(%p, %p, %"PRIu32")",
+            (void*)lfs, (void*)blocks, count);
+
+    lfs_ssize_t res = lfs_fs_nextfree_(lfs, blocks, count);
+
+    LFS_TRACE("lfs_fs_nextfree -> %"PRId32, res);
+    LFS_UNLOCK(lfs->cfg);
+    return res;
+}
+#endif
+
 #ifndef LFS_READONLY
 int lfs_fs_grow(lfs_t *lfs, lfs_size_t block_count) {
     int err = LFS_LOCK(lfs->cfg);
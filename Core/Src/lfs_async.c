@@ -0,0 +1,170 @@
+/*
+ * Asynchronous request queue for the little filesystem
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#include "lfs_async.h"
+#include "lfs_util.h"
+
+// Requests form a singly linked FIFO. Submitters only append at the tail
+// and the worker only removes at the head, both under the queue lock, and
+// the filesystem call itself runs with the lock released. The lock is all
+// the synchronization there is, so a request's result and state are only
+// read through lfs_async_done or from the completion callback.
+
+void lfs_async_init(lfs_async_t *queue, lfs_t *lfs,
+        const struct lfs_async_config *cfg) {
+    queue->lfs = lfs;
+    queue->cfg = cfg;
+    queue->head = NULL;
+    queue->tail = NULL;
+}
+
+static int lfs_async_submit(lfs_async_t *queue, lfs_async_req_t *req,
+        uint8_t op, lfs_file_t *file, void *buffer, lfs_size_t size,
+        void (*cb)(lfs_async_req_t *req), void *data) {
+    queue->cfg->lock(queue->cfg);
+    if (req->state == LFS_ASYNC_QUEUED || req->state == LFS_ASYNC_BUSY) {
+        queue->cfg->unlock(queue->cfg);
+        return LFS_ERR_INVAL;
+    }
+
+    req->next = NULL;
+    req->op = op;
+    req->file = file;
+    req->buffer = buffer;
+    req->size = size;
+    req->result = 0;
+    req->cb = cb;
+    req->data = data;
+    req->state = LFS_ASYNC_QUEUED;
+
+    if (queue->tail) {
+        queue->tail->next = req;
+    } else {
+        queue->head = req;
+    }
+    queue->tail = req;
+    queue->cfg->unlock(queue->cfg);
+
+    if (queue->cfg->notify) {
+        queue->cfg->notify(queue->cfg);
+    }
+    return 0;
+}
+
+int lfs_async_read(lfs_async_t *queue, lfs_async_req_t *req,
+        lfs_file_t *file, void *buffer, lfs_size_t size,
+        void (*cb)(lfs_async_req_t *req), void *data) {
+    return lfs_async_submit(queue, req, LFS_ASYNC_READ,
+            file, buffer, size, cb, data);
+}
+
+#ifndef LFS_READONLY
+int lfs_async_write(lfs_async_t *queue, lfs_async_req_t *req,
+        lfs_file_t *file, const void *buffer, lfs_size_t size,
+        void (*cb)(lfs_async_req_t *req), void *data) {
+    return lfs_async_submit(queue, req, LFS_ASYNC_WRITE,
+            file, (void*)buffer, size, cb, data);
+}
+
+int lfs_async_sync(lfs_async_t *queue, lfs_async_req_t *req,
+        lfs_file_t *file, void (*cb)(lfs_async_req_t *req), void *data) {
+    return lfs_async_submit(queue, req, LFS_ASYNC_SYNC,
+            file, NULL, 0, cb, data);
+}
+#endif
+
+int lfs_async_close(lfs_async_t *queue, lfs_async_req_t *req,
+        lfs_file_t *file, void (*cb)(lfs_async_req_t *req), void *data) {
+    return lfs_async_submit(queue, req, LFS_ASYNC_CLOSE,
+            file, NULL, 0, cb, data);
+}
+
+bool lfs_async_done(lfs_async_t *queue, const lfs_async_req_t *req) {
+    queue->cfg->lock(queue->cfg);
+    bool done = (req->state == LFS_ASYNC_DONE);
+    queue->cfg->unlock(queue->cfg);
+    return done;
+}
+
+int lfs_async_work(lfs_async_t *queue) {
+    queue->cfg->lock(queue->cfg);
+    lfs_async_req_t *req = queue->head;
+    if (!req) {
+        queue->cfg->unlock(queue->cfg);
+        return 0;
+    }
+
+    queue->head = req->next;
+    if (!queue->head) {
+        queue->tail = NULL;
+    }
+    req->state = LFS_ASYNC_BUSY;
+    queue->cfg->unlock(queue->cfg);
+
+    lfs_ssize_t res;
+    switch (req->op) {
+        case LFS_ASYNC_READ:
+            res = lfs_file_read(queue->lfs, req->file,
+                    req->buffer, req->size);
+            break;
+#ifndef LFS_READONLY
+        case LFS_ASYNC_WRITE:
+            res = lfs_file_write(queue->lfs, req->file,
+                    req->buffer, req->size);
+            break;
+        case LFS_ASYNC_SYNC:
+            res = lfs_file_sync(queue->lfs, req->file);
+            break;
+#endif
+        case LFS_ASYNC_CLOSE:
+            res = lfs_file_close(queue->lfs, req->file);
+            break;
+        default:
+            res = LFS_ERR_INVAL;
+            break;
+    }
+
+    // the callback may hand the request straight back to us
+    void (*cb)(lfs_async_req_t *req) = req->cb;
+    queue->cfg->lock(queue->cfg);
+    req->result = res;
+    req->state = LFS_ASYNC_DONE;
+    queue->cfg->unlock(queue->cfg);
+
+    if (cb) {
+        cb(req);
+    }
+    return 1;
+}
+
+#ifdef LFS_ASYNC_PTHREAD
+void lfs_async_pthread_lock(const struct lfs_async_config *c) {
+    struct lfs_async_pthread *p = c->context;
+    pthread_mutex_lock(&p->mutex);
+}
+
+void lfs_async_pthread_unlock(const struct lfs_async_config *c) {
+    struct lfs_async_pthread *p = c->context;
+    pthread_mutex_unlock(&p->mutex);
+}
+
+void lfs_async_pthread_notify(const struct lfs_async_config *c) {
+    // signal under the mutex, or the worker may miss it between looking at
+    // the queue and going to sleep
+    struct lfs_async_pthread *p = c->context;
+    pthread_mutex_lock(&p->mutex);
+    pthread_cond_signal(&p->cond);
+    pthread_mutex_unlock(&p->mutex);
+}
+
+void lfs_async_pthread_wait(lfs_async_t *queue) {
+    struct lfs_async_pthread *p = queue->cfg->context;
+    pthread_mutex_lock(&p->mutex);
+    if (!queue->head) {
+        pthread_cond_wait(&p->cond, &p->mutex);
+    }
+    pthread_mutex_unlock(&p->mutex);
+}
+#endif
@@ -0,0 +1,701 @@
+/*
+ * Benchmark suite for the little filesystem
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#include "lfs_bench.h"
+#include "lfs_lathist.h"
+#include "lfs_ring.h"
+#include "lfs_util.h"
+#include <stdio.h>
+
+#ifndef LFS_READONLY
+
+// The benchmarks only use the public API, so the same code times a target
+// against its real flash and a host against an emulated one. Every benchmark
+// takes the clock and the programmed byte count before and after the calls
+// it times, setup and cleanup are left out, and every single call or pair of
+// calls it counts as an operation into a latency histogram. Each one runs on a fresh part of
+// LFS_BENCH_DIR and removes it again, only fill and age depend on each other.
+
+#define LFS_BENCH_IO_MAX 4096      // Largest I/O size, the size of the buffer
+#define LFS_BENCH_PATH_MAX 128
+#define LFS_BENCH_CHURN_FILES 32   // Files alive at once in the churn benchmark
+#define LFS_BENCH_CHURN_OPS 500
+#define LFS_BENCH_DEPTH 16         // Directory levels of the deep benchmarks
+#define LFS_BENCH_STATS 200
+#define LFS_BENCH_RANDOM_READS 1000
+#define LFS_BENCH_RANDOM_SIZE 256
+#define LFS_BENCH_LOG_RECORDS 1000
+#define LFS_BENCH_LOG_SIZE 64
+#define LFS_BENCH_RING_RECORDS 5000
+#define LFS_BENCH_RING_SEGMENT 256 // Records per segment of the ring
+#define LFS_BENCH_RING_SEGMENTS 8
+#define LFS_BENCH_RING_SYNC 16     // Records appended between ring syncs
+#define LFS_BENCH_TRACE_EVENTS 2000
+#define LFS_BENCH_TRACE_TABLE (32*1024) // File the trace looks records up in
+#define LFS_BENCH_TRACE_SYNC 32    // Log records written between syncs
+#define LFS_BENCH_FILL_FILE (64*1024)
+#define LFS_BENCH_FILL_FILES 1024  // Enough to fill 64 MiB
+#define LFS_BENCH_AGE_ROUNDS 3
+
+typedef struct lfs_bench {
+    lfs_t *lfs;
+    const struct lfs_bench_config *cfg;
+    uint32_t rand;
+    int count;
+    uint32_t start_us;
+    uint32_t start_prog;
+    struct lfs_lathist lat;     // Latency of the operations, in us
+    bool filled;
+    uint32_t fill_map[LFS_BENCH_FILL_FILES/32];   // Fill files that exist
+} lfs_bench_t;
+
+static uint8_t lfs_bench_buf[LFS_BENCH_IO_MAX];
+
+static uint32_t lfs_bench_random(lfs_bench_t *b) {
+    // xorshift32, never zero
+    b->rand ^= b->rand << 13;
+    b->rand ^= b->rand >> 17;
+    b->rand ^= b->rand << 5;
+    return b->rand;
+}
+
+static bool lfs_bench_selected(lfs_bench_t *b, const char *name) {
+    return !b->cfg->only
+            || strncmp(name, b->cfg->only, strlen(b->cfg->only)) == 0;
+}
+
+static uint32_t lfs_bench_prog(lfs_bench_t *b) {
+    return b->cfg->prog_bytes ? b->cfg->prog_bytes(b->cfg) : 0;
+}
+
+static void lfs_bench_start(lfs_bench_t *b) {
+    memset(&b->lat, 0, sizeof(b->lat));
+    b->start_prog = lfs_bench_prog(b);
+    b->start_us = b->cfg->clock_us(b->cfg);
+}
+
+static uint32_t lfs_bench_now(lfs_bench_t *b) {
+    return b->cfg->clock_us(b->cfg);
+}
+
+// Count an operation that started at start
+static void lfs_bench_op(lfs_bench_t *b, uint32_t start) {
+    lfs_lathist_add(&b->lat, lfs_bench_now(b) - start, 1);
+}
+
+static void lfs_bench_report(lfs_bench_t *b, const char *name,
+        lfs_size_t param, uint32_t ops, uint32_t bytes) {
+    struct lfs_bench_result res = {
+        .name = name,
+        .param = param,
+        .ops = ops,
+        .bytes = bytes,
+        .us = b->cfg->clock_us(b->cfg) - b->start_us,
+        .prog_bytes = lfs_bench_prog(b) - b->start_prog,
+        .p50_us = lfs_lathist_pct(&b->lat, 500, 1),
+        .p99_us = lfs_lathist_pct(&b->lat, 990, 1),
+        .max_us = b->lat.max,
+    };
+
+    // integer arithmetic only, printf on a target may not do floats
+    uint32_t us = lfs_max(res.us, 1);
+    uint32_t ops_s = (uint32_t)((uint64_t)res.ops*10000000 / us);
+    uint32_t mb_s = (uint32_t)((uint64_t)res.bytes*1000 / us);
+    uint32_t wa = res.bytes ? (uint32_t)((uint64_t)res.prog_bytes*100
+            / res.bytes) : 0;
+    printf("{\"bench\":\"%s\",\"param\":%lu,\"ops\":%lu,\"bytes\":%lu,"
+            "\"ms\":%lu.%03lu,\"ops_s\":%lu.%lu,\"mb_s\":%lu.%03lu,"
+            "\"prog_bytes\":%lu,\"wa\":%lu.%02lu,\"p50_us\":%lu,"
+            "\"p99_us\":%lu,\"max_us\":%lu}\n",
+            res.name, (unsigned long)res.param, (unsigned long)res.ops,
+            (unsigned long)res.bytes,
+            (unsigned long)(res.us/1000), (unsigned long)(res.us%1000),
+            (unsigned long)(ops_s/10), (unsigned long)(ops_s%10),
+            (unsigned long)(mb_s/1000), (unsigned long)(mb_s%1000),
+            (unsigned long)res.prog_bytes,
+            (unsigned long)(wa/100), (unsigned long)(wa%100),
+            (unsigned long)res.p50_us, (unsigned long)res.p99_us,
+            (unsigned long)res.max_us);
+    b->count += 1;
+}
+
+// Write size bytes to path in io sized calls, ops counts the calls
+static int lfs_bench_write(lfs_bench_t *b, const char *path,
+        lfs_size_t size, lfs_size_t io, int flags, uint32_t *ops) {
+    lfs_file_t file;
+    int err = lfs_file_open(b->lfs, &file, path,
+            LFS_O_WRONLY | LFS_O_CREAT | flags);
+    if (err) {
+        return err;
+    }
+
+    for (lfs_size_t done = 0; done < size; done += io) {
+        lfs_size_t n = lfs_min(io, size - done);
+        uint32_t start = lfs_bench_now(b);
+        lfs_ssize_t res = lfs_file_write(b->lfs, &file, lfs_bench_buf, n);
+        lfs_bench_op(b, start);
+        if (res < 0) {
+            lfs_file_close(b->lfs, &file);
+            return res;
+        }
+        *ops += 1;
+    }
+
+    return lfs_file_close(b->lfs, &file);
+}
+
+static int lfs_bench_sequential(lfs_bench_t *b) {
+    static const lfs_size_t ios[] = {16, 256, LFS_BENCH_IO_MAX};
+    lfs_size_t size = b->cfg->seq_size ? b->cfg->seq_size : 256*1024;
+    const char *path = LFS_BENCH_DIR "/seq";
+
+    for (unsigned i = 0; i < sizeof(ios)/sizeof(ios[0]); i++) {
+        uint32_t ops = 0;
+        if (lfs_bench_selected(b, "seq_write")) {
+            lfs_bench_start(b);
+            int err = lfs_bench_write(b, path, size, ios[i],
+                    LFS_O_TRUNC, &ops);
+            if (err) {
+                return err;
+            }
+            lfs_bench_report(b, "seq_write", ios[i], ops, size);
+        }
+
+        if (lfs_bench_selected(b, "seq_read")) {
+            if (!ops) {
+                int err = lfs_bench_write(b, path, size, LFS_BENCH_IO_MAX,
+                        LFS_O_TRUNC, &ops);
+                if (err) {
+                    return err;
+                }
+            }
+            ops = 0;
+
+            lfs_file_t file;
+            lfs_bench_start(b);
+            int err = lfs_file_open(b->lfs, &file, path, LFS_O_RDONLY);
+            if (err) {
+                return err;
+            }
+            uint32_t bytes = 0;
+            lfs_ssize_t res;
+            uint32_t start = lfs_bench_now(b);
+            while ((res = lfs_file_read(b->lfs, &file,
+                    lfs_bench_buf, ios[i])) > 0) {
+                lfs_bench_op(b, start);
+                bytes += res;
+                ops += 1;
+                if (b->cfg->process) {
+                    b->cfg->process(b->cfg, res);
+                }
+                start = lfs_bench_now(b);
+            }
+            lfs_file_close(b->lfs, &file);
+            if (res < 0) {
+                return res;
+            }
+            lfs_bench_report(b, "seq_read", ios[i], ops, bytes);
+        }
+    }
+
+    int err = lfs_remove(b->lfs, path);
+    return err == LFS_ERR_NOENT ? 0 : err;
+}
+
+static int lfs_bench_random_read(lfs_bench_t *b) {
+    lfs_size_t size = b->cfg->seq_size ? b->cfg->seq_size : 256*1024;
+    const char *path = LFS_BENCH_DIR "/random";
+    uint32_t ops = 0;
+
+    int err = lfs_bench_write(b, path, size, LFS_BENCH_IO_MAX, 0, &ops);
+    if (err) {
+        return err;
+    }
+
+    lfs_file_t file;
+    err = lfs_file_open(b->lfs, &file, path, LFS_O_RDONLY);
+    if (err) {
+        return err;
+    }
+    lfs_bench_start(b);
+    for (ops = 0; ops < LFS_BENCH_RANDOM_READS; ops++) {
+        lfs_soff_t off = lfs_bench_random(b)
+                % (size - LFS_BENCH_RANDOM_SIZE + 1);
+        uint32_t start = lfs_bench_now(b);
+        lfs_soff_t pos = lfs_file_seek(b->lfs, &file, off, LFS_SEEK_SET);
+        lfs_ssize_t res = lfs_file_read(b->lfs, &file,
+                lfs_bench_buf, LFS_BENCH_RANDOM_SIZE);
+        lfs_bench_op(b, start);
+        if (pos < 0 || res < 0) {
+            lfs_file_close(b->lfs, &file);
+            return pos < 0 ? pos : res;
+        }
+    }
+    lfs_bench_report(b, "rand_read", LFS_BENCH_RANDOM_SIZE,
+            ops, ops*LFS_BENCH_RANDOM_SIZE);
+    lfs_file_close(b->lfs, &file);
+    return lfs_remove(b->lfs, path);
+}
+
+// Small files created and removed in random order, a config directory or a
+// spool of messages
+static int lfs_bench_churn(lfs_bench_t *b) {
+    const char *dir = LFS_BENCH_DIR "/churn";
+    uint32_t alive = 0;
+    uint32_t ops = 0;
+    uint32_t bytes = 0;
+    char path[LFS_BENCH_PATH_MAX];
+
+    int err = lfs_mkdir(b->lfs, dir);
+    if (err) {
+        return err;
+    }
+
+    lfs_bench_start(b);
+    for (int i = 0; i < LFS_BENCH_CHURN_OPS; i++) {
+        uint32_t slot = lfs_bench_random(b) % LFS_BENCH_CHURN_FILES;
+        snprintf(path, sizeof(path), "%s/%lu", dir, (unsigned long)slot);
+        if (alive & (1u << slot)) {
+            uint32_t start = lfs_bench_now(b);
+            err = lfs_remove(b->lfs, path);
+            lfs_bench_op(b, start);
+            ops += 1;
+        } else {
+            lfs_size_t size = 16 + lfs_bench_random(b) % 2033;
+            uint32_t calls = 0;
+            err = lfs_bench_write(b, path, size, size, LFS_O_EXCL, &calls);
+            bytes += size;
+            ops += 1;
+        }
+        if (err) {
+            return err;
+        }
+        alive ^= 1u << slot;
+    }
+    lfs_bench_report(b, "churn", 0, ops, bytes);
+
+    return lfs_remove_recursive(b->lfs, dir);
+}
+
+// A file at the bottom of LFS_BENCH_DEPTH directories, every lookup walks
+// all the levels
+static int lfs_bench_deep(lfs_bench_t *b) {
+    char path[LFS_BENCH_PATH_MAX];
+    lfs_size_t len = strlen(LFS_BENCH_DIR);
+    memcpy(path, LFS_BENCH_DIR, len+1);
+
+    lfs_bench_start(b);
+    for (int i = 0; i < LFS_BENCH_DEPTH; i++) {
+        len += snprintf(path+len, sizeof(path)-len, "/d%02d", i);
+        uint32_t start = lfs_bench_now(b);
+        int err = lfs_mkdir(b->lfs, path);
+        lfs_bench_op(b, start);
+        if (err) {
+            return err;
+        }
+    }
+    lfs_bench_report(b, "deep_mkdir", LFS_BENCH_DEPTH, LFS_BENCH_DEPTH, 0);
+
+    memcpy(path+len, "/f", 3);
+    uint32_t ops = 0;
+    int err = lfs_bench_write(b, path, LFS_BENCH_LOG_SIZE,
+            LFS_BENCH_LOG_SIZE, 0, &ops);
+    if (err) {
+        return err;
+    }
+    lfs_bench_start(b);
+    for (ops = 0; ops < LFS_BENCH_STATS; ops++) {
+        struct lfs_info info;
+        uint32_t start = lfs_bench_now(b);
+        err = lfs_stat(b->lfs, path, &info);
+        lfs_bench_op(b, start);
+        if (err) {
+            return err;
+        }
+    }
+    lfs_bench_report(b, "deep_stat", LFS_BENCH_DEPTH, ops, 0);
+
+    // remove bottom up, the file first
+    lfs_bench_start(b);
+    for (ops = 0; ops <= LFS_BENCH_DEPTH; ops++) {
+        uint32_t start = lfs_bench_now(b);
+        err = lfs_remove(b->lfs, path);
+        lfs_bench_op(b, start);
+        if (err) {
+            return err;
+        }
+        *strrchr(path, '/') = '\0';
+    }
+    lfs_bench_report(b, "deep_remove", LFS_BENCH_DEPTH, ops, 0);
+    return 0;
+}
+
+// Records appended and synced one at a time, the file stays open. flags
+// adds LFS_O_LOGAPPEND for the variant that keeps programming the partially
+// filled last block instead of copying it on every sync.
+static int lfs_bench_append_log(lfs_bench_t *b, const char *name, int flags) {
+    const char *path = LFS_BENCH_DIR "/log";
+    lfs_file_t file;
+
+    if (!lfs_bench_selected(b, name)) {
+        return 0;
+    }
+
+    int err = lfs_file_open(b->lfs, &file, path,
+            LFS_O_WRONLY | LFS_O_CREAT | LFS_O_APPEND | flags);
+    if (err) {
+        return err;
+    }
+
+    lfs_bench_start(b);
+    uint32_t ops;
+    for (ops = 0; ops < LFS_BENCH_LOG_RECORDS; ops++) {
+        uint32_t start = lfs_bench_now(b);
+        lfs_ssize_t res = lfs_file_write(b->lfs, &file,
+                lfs_bench_buf, LFS_BENCH_LOG_SIZE);
+        if (res >= 0) {
+            res = lfs_file_sync(b->lfs, &file);
+        }
+        lfs_bench_op(b, start);
+        if (res < 0) {
+            lfs_file_close(b->lfs, &file);
+            return res;
+        }
+    }
+    lfs_bench_report(b, name, LFS_BENCH_LOG_SIZE,
+            ops, ops*LFS_BENCH_LOG_SIZE);
+
+    err = lfs_file_close(b->lfs, &file);
+    if (err) {
+        return err;
+    }
+    return lfs_remove(b->lfs, path);
+}
+
+static int lfs_bench_append(lfs_bench_t *b) {
+    int err = lfs_bench_append_log(b, "append_log", 0);
+    if (err) {
+        return err;
+    }
+    return lfs_bench_append_log(b, "append_log_inplace", LFS_O_LOGAPPEND);
+}
+
+// Records appended to a fixed size ring that wraps several times, synced
+// every LFS_BENCH_RING_SYNC records, then everything still in the ring read
+// back in LFS_BENCH_RING_SYNC record calls
+static int lfs_bench_ring(lfs_bench_t *b) {
+    const struct lfs_ring_config cfg = {
+        .record_size = LFS_BENCH_LOG_SIZE,
+        .segment_records = LFS_BENCH_RING_SEGMENT,
+        .segments = LFS_BENCH_RING_SEGMENTS,
+    };
+    const char *path = LFS_BENCH_DIR "/ring";
+    lfs_ring_t ring;
+
+    int err = lfs_ring_open(b->lfs, &ring, path, &cfg);
+    if (err) {
+        return err;
+    }
+
+    if (lfs_bench_selected(b, "ring_append")) {
+        lfs_bench_start(b);
+        uint32_t ops;
+        for (ops = 0; ops < LFS_BENCH_RING_RECORDS; ops++) {
+            uint32_t start = lfs_bench_now(b);
+            err = lfs_ring_append(&ring, lfs_bench_buf);
+            if (!err && ops % LFS_BENCH_RING_SYNC
+                    == LFS_BENCH_RING_SYNC-1) {
+                err = lfs_ring_sync(&ring);
+            }
+            lfs_bench_op(b, start);
+            if (err) {
+                lfs_ring_close(&ring);
+                return err;
+            }
+        }
+        err = lfs_ring_sync(&ring);
+        if (err) {
+            lfs_ring_close(&ring);
+            return err;
+        }
+        lfs_bench_report(b, "ring_append", LFS_BENCH_LOG_SIZE,
+                ops, ops*LFS_BENCH_LOG_SIZE);
+    }
+
+    if (lfs_bench_selected(b, "ring_read")) {
+        uint32_t seq = lfs_ring_first(&ring);
+        uint32_t ops = 0;
+        uint32_t records = 0;
+        lfs_ssize_t res;
+        lfs_bench_start(b);
+        uint32_t start = lfs_bench_now(b);
+        while ((res = lfs_ring_read(&ring, seq, lfs_bench_buf,
+                LFS_BENCH_RING_SYNC)) > 0) {
+            lfs_bench_op(b, start);
+            seq += res;
+            records += res;
+            ops += 1;
+            start = lfs_bench_now(b);
+        }
+        if (res < 0) {
+            lfs_ring_close(&ring);
+            return res;
+        }
+        lfs_bench_report(b, "ring_read", LFS_BENCH_LOG_SIZE,
+                ops, records*LFS_BENCH_LOG_SIZE);
+    }
+
+    err = lfs_ring_close(&ring);
+    if (err) {
+        return err;
+    }
+    return lfs_remove_recursive(b->lfs, path);
+}
+
+// The trace of the demo's scheduler benchmark: a logger appending records
+// and syncing every LFS_BENCH_TRACE_SYNC of them, mixed with lookups of
+// LFS_BENCH_RANDOM_SIZE bytes at random places in a table file. Requests
+// arrive 2 ms apart on average and a quarter of them are lookups, the time
+// until the next one is given to the idle callback. Only the lookups are
+// counted, from when they were due, so a lookup stuck behind a program or
+// erase shows up in the percentiles.
+static int lfs_bench_mixed(lfs_bench_t *b) {
+    const char *table_path = LFS_BENCH_DIR "/table";
+    const char *log_path = LFS_BENCH_DIR "/mixed";
+    lfs_file_t table;
+    lfs_file_t log;
+    uint32_t ops = 0;
+
+    int err = lfs_bench_write(b, table_path, LFS_BENCH_TRACE_TABLE,
+            LFS_BENCH_RANDOM_SIZE, 0, &ops);
+    if (err) {
+        return err;
+    }
+    err = lfs_file_open(b->lfs, &table, table_path, LFS_O_RDONLY);
+    if (err) {
+        return err;
+    }
+    err = lfs_file_open(b->lfs, &log, log_path,
+            LFS_O_WRONLY | LFS_O_CREAT | LFS_O_APPEND | LFS_O_LOGAPPEND);
+    if (err) {
+        lfs_file_close(b->lfs, &table);
+        return err;
+    }
+
+    // the demo's generator, so seed 1 replays the demo's trace
+    uint32_t seed = b->cfg->seed ? b->cfg->seed : 1;
+    uint32_t writes = 0;
+    ops = 0;
+    lfs_bench_start(b);
+    uint32_t due = b->start_us;
+    for (int i = 0; i < LFS_BENCH_TRACE_EVENTS; i++) {
+        seed = seed*1103515245 + 12345;
+        due += (seed >> 16) % 4000;
+        uint32_t now = lfs_bench_now(b);
+        if (b->cfg->idle && (int32_t)(due - now) > 0) {
+            b->cfg->idle(b->cfg, due - now);
+            now = lfs_bench_now(b);
+        }
+        // without idle, or with a clock coarser than the wait, a request can
+        // be issued before it is due, it then counts from when it was issued
+        uint32_t start = (int32_t)(now - due) < 0 ? now : due;
+
+        lfs_ssize_t res;
+        if ((seed >> 8) % 4 == 0) {
+            lfs_soff_t off = (seed >> 4)
+                    % (LFS_BENCH_TRACE_TABLE - LFS_BENCH_RANDOM_SIZE);
+            res = lfs_file_seek(b->lfs, &table, off, LFS_SEEK_SET);
+            if (res >= 0) {
+                res = lfs_file_read(b->lfs, &table,
+                        lfs_bench_buf, LFS_BENCH_RANDOM_SIZE);
+            }
+            lfs_bench_op(b, start);
+            ops += 1;
+        } else {
+            res = lfs_file_write(b->lfs, &log,
+                    lfs_bench_buf, LFS_BENCH_LOG_SIZE);
+            if (res >= 0 && ++writes % LFS_BENCH_TRACE_SYNC == 0) {
+                res = lfs_file_sync(b->lfs, &log);
+            }
+        }
+        if (res < 0) {
+            lfs_file_close(b->lfs, &log);
+            lfs_file_close(b->lfs, &table);
+            return res;
+        }
+    }
+    lfs_bench_report(b, "mixed_read", LFS_BENCH_RANDOM_SIZE,
+            ops, ops*LFS_BENCH_RANDOM_SIZE);
+
+    err = lfs_file_close(b->lfs, &log);
+    int err2 = lfs_file_close(b->lfs, &table);
+    if (err || err2) {
+        return err ? err : err2;
+    }
+    err = lfs_remove(b->lfs, log_path);
+    if (err) {
+        return err;
+    }
+    return lfs_remove(b->lfs, table_path);
+}
+
+// Write fill files into the free slots of fill_map until the filesystem is
+// full, or limit bytes are written. A file that did not fit is removed.
+static int lfs_bench_fill_files(lfs_bench_t *b, lfs_size_t limit,
+        uint32_t *files, uint32_t *bytes) {
+    char path[LFS_BENCH_PATH_MAX];
+
+    for (uint32_t i = 0; i < LFS_BENCH_FILL_FILES; i++) {
+        if (b->fill_map[i/32] & (1u << (i%32))) {
+            continue;
+        }
+        if (limit && *bytes + LFS_BENCH_FILL_FILE > limit) {
+            return 0;
+        }
+
+        snprintf(path, sizeof(path), LFS_BENCH_DIR "/fill/%lu",
+                (unsigned long)i);
+        uint32_t ops = 0;
+        int err = lfs_bench_write(b, path, LFS_BENCH_FILL_FILE,
+                LFS_BENCH_IO_MAX, LFS_O_TRUNC, &ops);
+        if (err == LFS_ERR_NOSPC) {
+            b->filled = true;
+            err = lfs_remove(b->lfs, path);
+            return err == LFS_ERR_NOENT ? 0 : err;
+        } else if (err) {
+            return err;
+        }
+
+        b->fill_map[i/32] |= 1u << (i%32);
+        *files += 1;
+        *bytes += LFS_BENCH_FILL_FILE;
+    }
+    return 0;
+}
+
+static int lfs_bench_fill(lfs_bench_t *b) {
+    int err = lfs_mkdir(b->lfs, LFS_BENCH_DIR "/fill");
+    if (err && err != LFS_ERR_EXIST) {
+        return err;
+    }
+    memset(b->fill_map, 0, sizeof(b->fill_map));
+    b->filled = false;
+
+    uint32_t files = 0;
+    uint32_t bytes = 0;
+    lfs_bench_start(b);
+    err = lfs_bench_fill_files(b, b->cfg->fill_size, &files, &bytes);
+    if (err) {
+        return err;
+    }
+    lfs_bench_report(b, "fill", LFS_BENCH_FILL_FILE, files, bytes);
+    return 0;
+}
+
+// Remove a random half of the fill files and fill the holes again, the
+// free blocks are scattered over the whole filesystem by now
+static int lfs_bench_age(lfs_bench_t *b) {
+    char path[LFS_BENCH_PATH_MAX];
+
+    if (!b->filled) {
+        int err = lfs_bench_fill(b);
+        if (err || !b->filled) {
+            return err;
+        }
+    }
+
+    for (int round = 1; round <= LFS_BENCH_AGE_ROUNDS; round++) {
+        for (uint32_t i = 0; i < LFS_BENCH_FILL_FILES; i++) {
+            if (!(b->fill_map[i/32] & (1u << (i%32)))
+                    || (lfs_bench_random(b) & 1)) {
+                continue;
+            }
+            snprintf(path, sizeof(path), LFS_BENCH_DIR "/fill/%lu",
+                    (unsigned long)i);
+            int err = lfs_remove(b->lfs, path);
+            if (err) {
+                return err;
+            }
+            b->fill_map[i/32] &= ~(1u << (i%32));
+        }
+
+        uint32_t files = 0;
+        uint32_t bytes = 0;
+        lfs_bench_start(b);
+        int err = lfs_bench_fill_files(b, 0, &files, &bytes);
+        if (err) {
+            return err;
+        }
+        lfs_bench_report(b, "age", round, files, bytes);
+    }
+    return 0;
+}
+
+int lfs_bench_run(lfs_t *lfs, const struct lfs_bench_config *cfg) {
+    static const struct {
+        const char *prefix;     // Names of the results it reports
+        int (*run)(lfs_bench_t *b);
+    } benches[] = {
+        {"seq_", lfs_bench_sequential},
+        {"rand_read", lfs_bench_random_read},
+        {"churn", lfs_bench_churn},
+        {"deep_", lfs_bench_deep},
+        {"append_log", lfs_bench_append},
+        {"ring_", lfs_bench_ring},
+        {"mixed_read", lfs_bench_mixed},
+        {"fill", lfs_bench_fill},
+        {"age", lfs_bench_age},
+    };
+    lfs_bench_t b = {
+        .lfs = lfs,
+        .cfg = cfg,
+        .rand = cfg->seed ? cfg->seed : 1,
+    };
+
+    for (lfs_size_t i = 0; i < sizeof(lfs_bench_buf); i++) {
+        lfs_bench_buf[i] = (uint8_t)lfs_bench_random(&b);
+    }
+
+    printf("{\"bench\":\"config\",\"block_size\":%lu,\"block_count\":%lu,"
+            "\"cache_size\":%lu,\"lookahead_size\":%lu,\"seq_size\":%lu,"
+            "\"seed\":%lu}\n",
+            (unsigned long)lfs->cfg->block_size,
+            (unsigned long)lfs->cfg->block_count,
+            (unsigned long)lfs->cfg->cache_size,
+            (unsigned long)lfs->cfg->lookahead_size,
+            (unsigned long)(cfg->seq_size ? cfg->seq_size : 256*1024),
+            (unsigned long)cfg->seed);
+
+    int err = lfs_mkdir(lfs, LFS_BENCH_DIR);
+    if (err) {
+        return err;
+    }
+
+    for (unsigned i = 0; i < sizeof(benches)/sizeof(benches[0]); i++) {
+        // a selection like "seq_read" picks the group that reports it
+        const char *only = cfg->only;
+        if (only && strncmp(only, benches[i].prefix, strlen(only)) != 0
+                && strncmp(benches[i].prefix, only,
+                    strlen(benches[i].prefix)) != 0) {
+            continue;
+        }
+        if (benches[i].run == lfs_bench_age && cfg->fill_size) {
+            continue;
+        }
+
+        err = benches[i].run(&b);
+        if (err) {
+            break;
+        }
+    }
+
+    int rerr = lfs_remove_recursive(lfs, LFS_BENCH_DIR);
+    if (err) {
+        return err;
+    }
+    return rerr ? rerr : b.count;
+}
+
+#endif
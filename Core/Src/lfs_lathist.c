@@ -0,0 +1,52 @@
+/*
+ * Latency histogram for the little filesystem
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#include "lfs_lathist.h"
+#include "lfs_util.h"
+
+// Power of two buckets keep the tail of a call type visible next to
+// thousands of fast cache hits in a few words of RAM, and need no division
+// but the one to microseconds. Nothing here depends on the target, so the
+// port and the host tools count latencies the same way.
+
+void lfs_lathist_add(struct lfs_lathist *h, uint32_t ticks, uint32_t tick_us) {
+    uint32_t us = ticks / tick_us;
+
+    if (h->count == 0 || ticks < h->min) {
+        h->min = ticks;
+    }
+    if (ticks > h->max) {
+        h->max = ticks;
+    }
+    h->total += ticks;
+    h->count += 1;
+    h->bucket[us ? lfs_min(lfs_npw2(us+1), LFS_LATHIST_BUCKETS-1) : 0] += 1;
+}
+
+uint32_t lfs_lathist_pct(const struct lfs_lathist *h,
+        uint32_t permille, uint32_t tick_us) {
+    if (h->count == 0) {
+        return 0;
+    }
+
+    // calls at or below the percentile
+    uint32_t rank = (uint32_t)(((uint64_t)h->count*permille + 999) / 1000);
+    uint32_t seen = 0;
+    uint32_t us = 0;
+    for (int b = 0; b < LFS_LATHIST_BUCKETS; b++) {
+        if (h->bucket[b] && seen + h->bucket[b] >= rank) {
+            uint32_t lo = b ? 1u << (b-1) : 0;
+            uint32_t hi = b < LFS_LATHIST_BUCKETS-1
+                    ? 1u << b : h->max/tick_us + 1;
+            us = lo + (uint32_t)((uint64_t)(hi-lo)*(rank-seen)
+                    / h->bucket[b]);
+            break;
+        }
+        seen += h->bucket[b];
+    }
+
+    // the ends of the spread are known exactly
+    return lfs_max(h->min/tick_us, lfs_min(us, h->max/tick_us));
+}
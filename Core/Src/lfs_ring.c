@@ -0,0 +1,299 @@
+/*
+ * Fixed-size ring log on top of the little filesystem
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#include "lfs_ring.h"
+#include "lfs_util.h"
+
+#ifndef LFS_READONLY
+
+// The ring is a directory of segment files, each holding segment_records
+// records. The segments are used in turn, so the segment and offset of a
+// sequence number follow from its distance to the oldest record, and appends
+// and seeks never search. Distances are taken modulo 2^32, which lets
+// sequence numbers wrap around. Only the newest segment, the head, is
+// partially filled.
+//
+// The directory attribute records the geometry, the first sequence number of
+// the head segment, its index and how many full segments precede it, and is
+// only written when the head moves on. Every segment file also carries its
+// own first sequence number, committed atomically with its data, so a head
+// segment whose truncation never made it to disk is recognized on open.
+
+// on-disk ring state, little-endian
+struct lfs_ring_state {
+    uint32_t record_size;
+    uint32_t segment_records;
+    uint32_t segments;
+    uint32_t base;
+    uint32_t head;
+    uint32_t full;
+};
+
+// segment holding seq, which must be between first and next
+static uint32_t lfs_ring_segment(const lfs_ring_t *ring, uint32_t seq) {
+    uint32_t back = ring->full - (seq - lfs_ring_first(ring))
+            / ring->cfg.segment_records;
+    return (ring->head + ring->cfg.segments - back) % ring->cfg.segments;
+}
+
+static void lfs_ring_segpath(const lfs_ring_t *ring, uint32_t seg,
+        char *buf) {
+    lfs_size_t len = strlen(ring->path);
+    memcpy(buf, ring->path, len);
+    buf[len++] = '/';
+
+    // segment index in decimal
+    char digits[10];
+    lfs_size_t n = 0;
+    do {
+        digits[n++] = '0' + seg % 10;
+        seg /= 10;
+    } while (seg);
+
+    while (n > 0) {
+        buf[len++] = digits[--n];
+    }
+    buf[len] = '\0';
+}
+
+static int lfs_ring_openhead(lfs_ring_t *ring, bool truncate) {
+    char segpath[LFS_RING_PATH_MAX+12];
+    lfs_ring_segpath(ring, ring->head, segpath);
+
+    // the segment's first sequence number goes out with its first sync
+    ring->segbase = lfs_tole32(ring->base);
+    ring->attr.type = LFS_RING_ATTR;
+    ring->attr.buffer = &ring->segbase;
+    ring->attr.size = sizeof(ring->segbase);
+    memset(&ring->filecfg, 0, sizeof(ring->filecfg));
+    ring->filecfg.attrs = &ring->attr;
+    ring->filecfg.attr_count = 1;
+
+    int err = lfs_file_opencfg(ring->lfs, &ring->file, segpath,
+            LFS_O_WRONLY | LFS_O_CREAT | LFS_O_APPEND | LFS_O_LOGAPPEND
+                | (truncate ? LFS_O_TRUNC : 0),
+            &ring->filecfg);
+    ring->open = !err;
+    return err;
+}
+
+static int lfs_ring_setstate(lfs_ring_t *ring) {
+    struct lfs_ring_state state = {
+        .record_size     = lfs_tole32(ring->cfg.record_size),
+        .segment_records = lfs_tole32(ring->cfg.segment_records),
+        .segments        = lfs_tole32(ring->cfg.segments),
+        .base            = lfs_tole32(ring->base),
+        .head            = lfs_tole32(ring->head),
+        .full            = lfs_tole32(ring->full),
+    };
+    return lfs_setattr(ring->lfs, ring->path, LFS_RING_ATTR,
+            &state, sizeof(state));
+}
+
+int lfs_ring_open(lfs_t *lfs, lfs_ring_t *ring,
+        const char *path, const struct lfs_ring_config *cfg) {
+    LFS_ASSERT(cfg->record_size > 0);
+    LFS_ASSERT(cfg->segment_records > 0);
+    LFS_ASSERT(cfg->segments >= 2);
+    if (strlen(path) >= LFS_RING_PATH_MAX) {
+        return LFS_ERR_NAMETOOLONG;
+    }
+
+    ring->lfs = lfs;
+    ring->cfg = *cfg;
+    ring->open = false;
+    strcpy(ring->path, path);
+
+    int err = lfs_mkdir(lfs, path);
+    if (err && err != LFS_ERR_EXIST) {
+        return err;
+    }
+
+    // find the head segment
+    struct lfs_ring_state state;
+    lfs_ssize_t res = lfs_getattr(lfs, path, LFS_RING_ATTR,
+            &state, sizeof(state));
+    if (res == LFS_ERR_NOATTR) {
+        ring->base = 0;
+        ring->head = 0;
+        ring->full = 0;
+        err = lfs_ring_setstate(ring);
+        if (err) {
+            return err;
+        }
+    } else if (res < 0) {
+        return res;
+    } else if (res != sizeof(state)
+            || lfs_fromle32(state.record_size) != cfg->record_size
+            || lfs_fromle32(state.segment_records) != cfg->segment_records
+            || lfs_fromle32(state.segments) != cfg->segments) {
+        return LFS_ERR_INVAL;
+    } else {
+        ring->base = lfs_fromle32(state.base);
+        ring->head = lfs_fromle32(state.head);
+        ring->full = lfs_fromle32(state.full);
+        if (ring->head >= cfg->segments || ring->full >= cfg->segments) {
+            return LFS_ERR_CORRUPT;
+        }
+    }
+
+    // if the head segment still starts at an older sequence number, we lost
+    // power before it was reused and its old records no longer belong here
+    char segpath[LFS_RING_PATH_MAX+12];
+    lfs_ring_segpath(ring, ring->head, segpath);
+    uint32_t segbase;
+    res = lfs_getattr(lfs, segpath, LFS_RING_ATTR,
+            &segbase, sizeof(segbase));
+    if (res < 0 && res != LFS_ERR_NOENT && res != LFS_ERR_NOATTR) {
+        return res;
+    }
+    bool stale = (res != sizeof(segbase)
+            || lfs_fromle32(segbase) != ring->base);
+
+    err = lfs_ring_openhead(ring, stale);
+    if (err) {
+        return err;
+    }
+
+    lfs_soff_t size = lfs_file_size(lfs, &ring->file);
+    if (size < 0) {
+        lfs_ring_close(ring);
+        return size;
+    }
+
+    // drop a partial record, appends must stay record aligned
+    if (size % cfg->record_size) {
+        size -= size % cfg->record_size;
+        err = lfs_file_truncate(lfs, &ring->file, size);
+        if (err) {
+            lfs_ring_close(ring);
+            return err;
+        }
+    }
+
+    ring->next = ring->base + size / cfg->record_size;
+    return 0;
+}
+
+int lfs_ring_close(lfs_ring_t *ring) {
+    if (!ring->open) {
+        return 0;
+    }
+
+    ring->open = false;
+    return lfs_file_close(ring->lfs, &ring->file);
+}
+
+int lfs_ring_append(lfs_ring_t *ring, const void *record) {
+    if (ring->next - ring->base == ring->cfg.segment_records) {
+        // head is full, reuse the oldest segment, if this fails the head
+        // stays closed and the next append tries again
+        int err = lfs_ring_close(ring);
+        if (err) {
+            return err;
+        }
+
+        // the truncation is only committed with the first sync, if we lose
+        // power before that lfs_ring_open sees the old segbase
+        uint32_t base = ring->base;
+        uint32_t head = ring->head;
+        ring->base = ring->next;
+        ring->head = (ring->head + 1) % ring->cfg.segments;
+        err = lfs_ring_openhead(ring, true);
+        if (err) {
+            ring->base = base;
+            ring->head = head;
+            return err;
+        }
+
+        ring->full = lfs_min(ring->full + 1, ring->cfg.segments-1);
+
+        err = lfs_ring_setstate(ring);
+        if (err) {
+            return err;
+        }
+    }
+
+    lfs_ssize_t res = lfs_file_write(ring->lfs, &ring->file,
+            record, ring->cfg.record_size);
+    if (res < 0) {
+        return res;
+    }
+
+    ring->next += 1;
+    return 0;
+}
+
+int lfs_ring_sync(lfs_ring_t *ring) {
+    if (!ring->open) {
+        return 0;
+    }
+
+    return lfs_file_sync(ring->lfs, &ring->file);
+}
+
+lfs_ssize_t lfs_ring_read(lfs_ring_t *ring, uint32_t seq,
+        void *buffer, lfs_size_t count) {
+    if (seq - lfs_ring_first(ring) > ring->next - lfs_ring_first(ring)) {
+        return LFS_ERR_NOENT;
+    }
+
+    uint8_t *data = buffer;
+    lfs_size_t n = 0;
+    while (n < count && seq != ring->next) {
+        // records left in this segment
+        lfs_size_t index = (seq - lfs_ring_first(ring))
+                % ring->cfg.segment_records;
+        lfs_size_t diff = lfs_min(count - n, lfs_min(
+                ring->cfg.segment_records - index, ring->next - seq));
+
+        // records in the head segment may still be in its cache
+        if (seq - ring->base < ring->cfg.segment_records) {
+            int err = lfs_ring_sync(ring);
+            if (err) {
+                return err;
+            }
+        }
+
+        char segpath[LFS_RING_PATH_MAX+12];
+        lfs_ring_segpath(ring, lfs_ring_segment(ring, seq), segpath);
+        lfs_file_t file;
+        int err = lfs_file_open(ring->lfs, &file, segpath, LFS_O_RDONLY);
+        if (err) {
+            return err;
+        }
+
+        lfs_soff_t pos = lfs_file_seek(ring->lfs, &file,
+                index * ring->cfg.record_size, LFS_SEEK_SET);
+        lfs_ssize_t res = (pos < 0) ? pos : lfs_file_read(ring->lfs, &file,
+                data, diff * ring->cfg.record_size);
+        err = lfs_file_close(ring->lfs, &file);
+        if (res < 0) {
+            return res;
+        } else if (err) {
+            return err;
+        }
+
+        data += res;
+        n += res / ring->cfg.record_size;
+        seq += res / ring->cfg.record_size;
+        if ((lfs_size_t)res < diff * ring->cfg.record_size) {
+            break;
+        }
+    }
+
+    return n;
+}
+
+uint32_t lfs_ring_first(const lfs_ring_t *ring) {
+    // the segments before the head are full
+    return ring->base - ring->full * ring->cfg.segment_records;
+}
+
+uint32_t lfs_ring_next(const lfs_ring_t *ring) {
+    return ring->next;
+}
+
+#endif
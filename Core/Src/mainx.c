@@ -26,7 +26,8 @@
 
 /* Private includes ----------------------------------------------------------*/
 /* USER CODE BEGIN Includes */
-
+#include <stdlib.h>
+#include "lfs_bench.h"
 /* USER CODE END Includes */
 
 /* Private typedef -----------------------------------------------------------*/
@@ -36,7 +37,20 @@
 
 /* Private define ------------------------------------------------------------*/
 /* USER CODE BEGIN PD */
-
+#define LOG_RECORDS		1000												// Records written by the logging benchmark
+#define LOG_RECORD_SIZE	64
+#define REOPEN_CYCLES	200													// Open-append-close cycles of the reopen benchmark
+#define RING_RECORDS	5000												// Records appended by the ring log benchmark
+#define STREAM_SIZE		(256*1024)											// File read by the streaming benchmark
+#define STREAM_CHUNK	512
+#define STREAM_WORK_US	300													// Processing time per chunk
+#define FRAG_RECORDS	2000												// Records written by the fragment benchmark
+#define TRACE_EVENTS	2000												// Requests in the scheduler benchmark trace
+#define TRACE_TABLE		(32*1024)											// File the trace looks records up in
+#define STRIPE_SECTORS	256													// Sectors per chip of the striping benchmark volume
+#define STRIPE_SIZE		(256*1024)											// File rewritten by the striping benchmark
+#define STRIPE_PASSES	8
+//#define BENCH_SUITE														// Run the lfs_bench.c suite at the end, fills the chip
 /* USER CODE END PD */
 
 /* Private macro -------------------------------------------------------------*/
@@ -47,7 +61,18 @@
 /* Private variables ---------------------------------------------------------*/
 
 /* USER CODE BEGIN PV */
-
+static W25Q_t flash;													// The W25Q64 on SPI1
+static stmlfs_t fs;														// littlefs on all of it
+#ifdef SPI2_CS_Pin														// SPI2 enabled in the .ioc with its /CS pin labelled SPI2_CS
+extern SPI_HandleTypeDef hspi2;											// spi.c
+void MX_SPI2_Init(void);
+static W25Q_t flash2;													// Second W25Q64 on SPI2, striping and mirror benchmarks only
+static stmlfs_t stripefs;
+#endif
+static char oldnames[32][8], newnames[32][8];							// Names for the batched rename
+static uint32_t latency[LOG_RECORDS];									// Logging benchmark, cycles per record
+static struct {uint32_t at_us; uint16_t op; uint16_t arg;} trace[TRACE_EVENTS];	// Scheduler benchmark requests
+static uint32_t read_latency[TRACE_EVENTS];
 /* USER CODE END PV */
 
 /* Private function prototypes -----------------------------------------------*/
@@ -58,7 +83,368 @@ void SystemClock_Config(void);
 
 /* Private user code ---------------------------------------------------------*/
 /* USER CODE BEGIN 0 */
+static int cmp_u32(const void *a, const void *b)
+{
+	uint32_t x=*(const uint32_t *)a, y=*(const uint32_t *)b;
+	return (x>y)-(x<y);
+}
+
+//-------------------------------------------------------------------------------------------------
+// Steady logging benchmark, append a record and sync it, LOG_RECORDS times. With gc set the idle
+// time between records is given to the background garbage collector. Prints the latency
+// percentiles of the write+sync calls.
+//-------------------------------------------------------------------------------------------------
+static void log_benchmark(bool gc)
+{
+	lfs_file_t fp;
+	uint8_t record[LOG_RECORD_SIZE];
+
+	CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;					// Enable the DWT cycle counter
+	DWT->CYCCNT = 0;
+	DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+
+	if (stmlfs_file_open(&fs, &fp, "log.bin", LFS_O_WRONLY | LFS_O_CREAT | LFS_O_TRUNC | LFS_O_APPEND) < 0) {
+		printf("open failed\n");
+		return;
+	}
+
+	for (int i = 0; i < LOG_RECORDS; i++) {
+		memset(record, i, sizeof(record));
+		uint32_t start = DWT->CYCCNT;
+		stmlfs_file_write(&fs, &fp, record, sizeof(record));
+		stmlfs_fflush(&fs, &fp);
+		latency[i] = DWT->CYCCNT - start;
+		if (gc) stmlfs_gc(&fs, 10);									// Idle time between records
+	}
+	stmlfs_file_close(&fs, &fp);
+	stmlfs_remove(&fs, "log.bin");
+
+	qsort(latency, LOG_RECORDS, sizeof(latency[0]), cmp_u32);
+	uint32_t cycles_us = SystemCoreClock/1000000;
+	printf("Logging %s gc: p50 %lu us, p90 %lu us, p99 %lu us, max %lu us\n", gc ? "with" : "without",
+			latency[LOG_RECORDS*50/100]/cycles_us, latency[LOG_RECORDS*90/100]/cycles_us,
+			latency[LOG_RECORDS*99/100]/cycles_us, latency[LOG_RECORDS-1]/cycles_us);
+}
 
+//-------------------------------------------------------------------------------------------------
+// Reopen logging benchmark, open the log, append one record and close it again, REOPEN_CYCLES
+// times. Without LFS_O_LOGAPPEND every reopen copies the partially filled last block to a new
+// block. Prints the bytes programmed per byte logged.
+//-------------------------------------------------------------------------------------------------
+static void reopen_benchmark(bool logappend)
+{
+	lfs_file_t fp;
+	uint8_t record[LOG_RECORD_SIZE];
+	int flags = LFS_O_WRONLY | LFS_O_CREAT | LFS_O_APPEND | (logappend ? LFS_O_LOGAPPEND : 0);
+
+	uint32_t start = stmlfs_progbytes(&fs);
+	for (int i = 0; i < REOPEN_CYCLES; i++) {
+		if (stmlfs_file_open(&fs, &fp, "reopen.bin", flags) < 0) {
+			printf("open failed\n");
+			return;
+		}
+		memset(record, i, sizeof(record));
+		stmlfs_file_write(&fs, &fp, record, sizeof(record));
+		stmlfs_file_close(&fs, &fp);
+	}
+	uint32_t programmed = stmlfs_progbytes(&fs) - start;
+	stmlfs_remove(&fs, "reopen.bin");
+
+	printf("Reopen logging %s LFS_O_LOGAPPEND: %lu bytes programmed for %lu logged, %lu.%02lu per byte\n",
+			logappend ? "with" : "without", programmed, (uint32_t)(REOPEN_CYCLES*LOG_RECORD_SIZE),
+			programmed/(REOPEN_CYCLES*LOG_RECORD_SIZE), (programmed%(REOPEN_CYCLES*LOG_RECORD_SIZE))*100/(REOPEN_CYCLES*LOG_RECORD_SIZE));
+}
+
+//-------------------------------------------------------------------------------------------------
+// Ring log benchmark, append RING_RECORDS records to an 8 segment ring of 256 records each,
+// syncing every 16 records, then read back everything still in the ring. Prints the append and
+// read throughput.
+//-------------------------------------------------------------------------------------------------
+static void ring_benchmark(void)
+{
+	static lfs_ring_t ring;
+	const struct lfs_ring_config cfg = {.record_size = LOG_RECORD_SIZE, .segment_records = 256, .segments = 8};
+	uint8_t record[LOG_RECORD_SIZE*16];
+
+	if (stmlfs_ring_open(&fs, &ring, "ring", &cfg) < 0) {
+		printf("ring open failed\n");
+		return;
+	}
+
+	uint32_t start = HAL_GetTick();
+	for (int i = 0; i < RING_RECORDS; i++) {
+		memset(record, i, LOG_RECORD_SIZE);
+		lfs_ring_append(&ring, record);
+		if ((i % 16) == 15) lfs_ring_sync(&ring);
+	}
+	lfs_ring_sync(&ring);
+	uint32_t append_ms = HAL_GetTick() - start + 1;
+
+	uint32_t seq = lfs_ring_first(&ring), records = 0;
+	lfs_ssize_t n;
+	start = HAL_GetTick();
+	while ((n = lfs_ring_read(&ring, seq, record, 16)) > 0) {
+		seq += n;
+		records += n;
+	}
+	uint32_t read_ms = HAL_GetTick() - start + 1;
+	lfs_ring_close(&ring);
+	stmlfs_remove_recursive(&fs, "ring");
+
+	printf("Ring log: append %lu records/s, read %lu records/s (%lu records kept)\n",
+			(uint32_t)RING_RECORDS*1000/append_ms, records*1000/read_ms, records);
+}
+
+//-------------------------------------------------------------------------------------------------
+// Streaming benchmark, read a STREAM_SIZE file in STREAM_CHUNK pieces and spend STREAM_WORK_US on
+// each piece as a decoder would. With readahead set the flash is read while the CPU is busy.
+// Prints the throughput and how much of the file came from the read-ahead buffers.
+//-------------------------------------------------------------------------------------------------
+static void stream_benchmark(bool readahead)
+{
+	lfs_file_t fp;
+	uint8_t chunk[STREAM_CHUNK];
+	struct littlfs_readahead_t before, after;
+
+	if (stmlfs_file_open(&fs, &fp, "stream.bin", LFS_O_WRONLY | LFS_O_CREAT | LFS_O_TRUNC) < 0) {
+		printf("open failed\n");
+		return;
+	}
+	stmlfs_reserve(&fs, &fp, STREAM_SIZE);
+	for (int i = 0; i < STREAM_SIZE/STREAM_CHUNK; i++) {
+		memset(chunk, i, sizeof(chunk));
+		stmlfs_file_write(&fs, &fp, chunk, sizeof(chunk));
+	}
+	stmlfs_file_close(&fs, &fp);
+
+	stmlfs_readahead(&fs, readahead);
+	stmlfs_readaheadstat(&fs, &before);
+	stmlfs_file_open(&fs, &fp, "stream.bin", LFS_O_RDONLY);
+	uint32_t start = HAL_GetTick();
+	while (stmlfs_file_read(&fs, &fp, chunk, sizeof(chunk)) > 0) {
+		uint32_t work = DWT->CYCCNT;								// Stand-in for decoding the chunk
+		while (DWT->CYCCNT - work < STREAM_WORK_US*(SystemCoreClock/1000000));
+	}
+	uint32_t ms = HAL_GetTick() - start + 1;
+	stmlfs_file_close(&fs, &fp);
+	stmlfs_readaheadstat(&fs, &after);
+	stmlfs_readahead(&fs, true);
+	stmlfs_remove(&fs, "stream.bin");
+
+	printf("Streaming %s read-ahead: %lu KB/s, %lu of %lu bytes read ahead, %lu stalls\n", readahead ? "with" : "without",
+			(uint32_t)STREAM_SIZE/ms, after.hit_bytes - before.hit_bytes, (uint32_t)STREAM_SIZE, after.stalls - before.stalls);
+}
+
+//-------------------------------------------------------------------------------------------------
+// Fragment benchmark, log FRAG_RECORDS records made of a header, payload and CRC trailer held in
+// separate buffers. With vectored set each record is a single stmlfs_file_writev call, otherwise
+// each fragment is written on its own. Prints the records per second.
+//-------------------------------------------------------------------------------------------------
+static void fragment_benchmark(bool vectored)
+{
+	lfs_file_t fp;
+	uint8_t header[8], payload[LOG_RECORD_SIZE-12];
+	uint32_t crc;
+	struct lfs_iovec iov[3] = {{header, sizeof(header)}, {payload, sizeof(payload)}, {&crc, sizeof(crc)}};
+
+	if (stmlfs_file_open(&fs, &fp, "frag.bin", LFS_O_WRONLY | LFS_O_CREAT | LFS_O_TRUNC) < 0) {
+		printf("open failed\n");
+		return;
+	}
+
+	uint32_t start = HAL_GetTick();
+	for (int i = 0; i < FRAG_RECORDS; i++) {
+		memcpy(header, &i, sizeof(i));
+		memset(payload, i, sizeof(payload));
+		crc = lfs_crc(0xffffffff, payload, sizeof(payload));
+		if (vectored) {
+			stmlfs_file_writev(&fs, &fp, iov, 3);
+		} else {
+			for (int j = 0; j < 3; j++) stmlfs_file_write(&fs, &fp, iov[j].buffer, iov[j].size);
+		}
+	}
+	stmlfs_file_close(&fs, &fp);
+	uint32_t ms = HAL_GetTick() - start + 1;
+	stmlfs_remove(&fs, "frag.bin");
+
+	printf("Fragment logging %s writev: %lu records/s\n", vectored ? "with" : "without",
+			(uint32_t)FRAG_RECORDS*1000/ms);
+}
+
+//-------------------------------------------------------------------------------------------------
+// Scheduler benchmark, replay a trace of a logger appending records and syncing every 32 of
+// them, mixed with 256 byte lookups at random places in a table file. Requests arrive 2 ms apart
+// on average, a quarter of them are lookups. With sched set the programs are queued and the idle
+// time until the next request is given to stmlfs_sched_work. Prints the percentiles of the read
+// latency, counted from when the read was due.
+//-------------------------------------------------------------------------------------------------
+enum {TRACE_READ, TRACE_WRITE, TRACE_SYNC};
+
+static void sched_benchmark(bool sched)
+{
+	lfs_file_t table, log;
+	uint8_t buffer[256];
+	uint32_t seed = 1, at = 0, writes = 0, reads = 0;
+	struct littlfs_sched_t before, after;
+
+	for (int i = 0; i < TRACE_EVENTS; i++) {						// Same trace for both runs
+		seed = seed*1103515245 + 12345;
+		at += (seed >> 16) % 4000;
+		trace[i].at_us = at;
+		trace[i].arg = (seed >> 4) % (TRACE_TABLE - sizeof(buffer));
+		if ((seed >> 8) % 4 == 0) trace[i].op = TRACE_READ;
+		else trace[i].op = (++writes % 32 == 0) ? TRACE_SYNC : TRACE_WRITE;
+	}
+
+	if (stmlfs_file_open(&fs, &table, "table.bin", LFS_O_RDWR | LFS_O_CREAT | LFS_O_TRUNC) < 0 ||
+		stmlfs_file_open(&fs, &log, "sched.log", LFS_O_WRONLY | LFS_O_CREAT | LFS_O_TRUNC | LFS_O_APPEND | LFS_O_LOGAPPEND) < 0) {
+		printf("open failed\n");
+		return;
+	}
+	for (int i = 0; i < TRACE_TABLE/(int)sizeof(buffer); i++) {
+		memset(buffer, i, sizeof(buffer));
+		stmlfs_file_write(&fs, &table, buffer, sizeof(buffer));
+	}
+	stmlfs_fflush(&fs, &table);
+
+	stmlfs_sched(&fs, sched);
+	stmlfs_schedstat(&fs, &before);
+	uint32_t cycles_us = SystemCoreClock/1000000;
+	uint32_t start = DWT->CYCCNT;
+	for (int i = 0; i < TRACE_EVENTS; i++) {
+		uint32_t due = trace[i].at_us*cycles_us;
+		while (DWT->CYCCNT - start < due) {							// Idle until the request arrives
+			if (sched) stmlfs_sched_work(&fs, 0);
+		}
+		switch (trace[i].op) {
+			case TRACE_READ:
+				stmlfs_lseek(&fs, &table, trace[i].arg, LFS_SEEK_SET);
+				stmlfs_file_read(&fs, &table, buffer, sizeof(buffer));
+				read_latency[reads++] = DWT->CYCCNT - start - due;
+				break;
+			case TRACE_WRITE:
+				memset(buffer, i, LOG_RECORD_SIZE);
+				stmlfs_file_write(&fs, &log, buffer, LOG_RECORD_SIZE);
+				break;
+			case TRACE_SYNC:
+				stmlfs_fflush(&fs, &log);
+				break;
+		}
+	}
+	stmlfs_file_close(&fs, &log);
+	stmlfs_file_close(&fs, &table);
+	stmlfs_schedstat(&fs, &after);
+	stmlfs_sched(&fs, true);
+	stmlfs_remove(&fs, "sched.log");
+	stmlfs_remove(&fs, "table.bin");
+
+	qsort(read_latency, reads, sizeof(read_latency[0]), cmp_u32);
+	printf("Mixed trace %s scheduler: read p50 %lu us, p90 %lu us, p99 %lu us, max %lu us, %lu reads ahead of programs\n",
+			sched ? "with" : "without", read_latency[reads*50/100]/cycles_us, read_latency[reads*90/100]/cycles_us,
+			read_latency[reads*99/100]/cycles_us, read_latency[reads-1]/cycles_us, after.reads_ahead - before.reads_ahead);
+}
+
+#ifdef SPI2_CS_Pin
+//-------------------------------------------------------------------------------------------------
+// Striping benchmark, format a volume of 2*STRIPE_SECTORS sectors on the first chip alone or
+// striped over both and rewrite a STRIPE_SIZE file on it STRIPE_PASSES times. From the second
+// pass on every block has to be erased before it is programmed again. Prints the write throughput
+// of the last pass. Destroys the filesystem on the first chip.
+//-------------------------------------------------------------------------------------------------
+static void stripe_benchmark(bool striped)
+{
+	lfs_file_t fp;
+	uint8_t chunk[STREAM_CHUNK];
+	uint32_t ms = 0;
+
+	if (striped) stmlfs_init_striped(&stripefs, &flash, &flash2, 0, STRIPE_SECTORS);
+	else stmlfs_init(&stripefs, &flash, 0, 2*STRIPE_SECTORS);
+	if (stmlfs_mount(&stripefs, true) < 0) return;
+
+	for (int pass = 0; pass < STRIPE_PASSES; pass++) {
+		uint32_t start = HAL_GetTick();
+		stmlfs_file_open(&stripefs, &fp, "stripe.bin", LFS_O_WRONLY | LFS_O_CREAT | LFS_O_TRUNC);
+		for (int i = 0; i < STRIPE_SIZE/STREAM_CHUNK; i++) {
+			memset(chunk, pass+i, sizeof(chunk));
+			stmlfs_file_write(&stripefs, &fp, chunk, sizeof(chunk));
+		}
+		stmlfs_file_close(&stripefs, &fp);
+		ms = HAL_GetTick() - start + 1;
+	}
+	stmlfs_unmount(&stripefs);
+
+	printf("Sequential rewrite %s: %lu KB/s\n", striped ? "striped over 2 chips" : "on 1 chip", (uint32_t)STRIPE_SIZE/ms);
+}
+
+//-------------------------------------------------------------------------------------------------
+// Mirror benchmark, write a STRIPE_SIZE file to a volume mirrored on both chips and read it back
+// in STREAM_CHUNK pieces. Then mount the second chip on its own and check it holds the file too.
+// Prints the read throughput and how many reads were split over the two chips.
+//-------------------------------------------------------------------------------------------------
+static void mirror_benchmark(void)
+{
+	lfs_file_t fp;
+	uint8_t chunk[STREAM_CHUNK];
+	struct lfs_info info;
+	struct littlfs_mirror_t stat;
+
+	stmlfs_init_mirrored(&stripefs, &flash, &flash2, 0, STRIPE_SECTORS);
+	if (stmlfs_mount(&stripefs, true) < 0) return;
+	stmlfs_file_open(&stripefs, &fp, "mirror.bin", LFS_O_WRONLY | LFS_O_CREAT | LFS_O_TRUNC);
+	for (int i = 0; i < STRIPE_SIZE/STREAM_CHUNK; i++) {
+		memset(chunk, i, sizeof(chunk));
+		stmlfs_file_write(&stripefs, &fp, chunk, sizeof(chunk));
+	}
+	stmlfs_file_close(&stripefs, &fp);
+
+	stmlfs_file_open(&stripefs, &fp, "mirror.bin", LFS_O_RDONLY);
+	uint32_t start = HAL_GetTick();
+	while (stmlfs_file_read(&stripefs, &fp, chunk, sizeof(chunk)) > 0);
+	uint32_t ms = HAL_GetTick() - start + 1;
+	stmlfs_file_close(&stripefs, &fp);
+	stmlfs_mirrorstat(&stripefs, &stat);
+	stmlfs_unmount(&stripefs);
+
+	stmlfs_init(&stripefs, &flash2, 0, STRIPE_SECTORS);				// The copy alone
+	bool copy = stmlfs_mount(&stripefs, false) == 0 && stmlfs_stat(&stripefs, "mirror.bin", &info) == 0 && info.size == STRIPE_SIZE;
+	stmlfs_unmount(&stripefs);
+
+	printf("Mirrored read: %lu KB/s, %lu reads split over both chips, copy %s\n", (uint32_t)STRIPE_SIZE/ms,
+			stat.split_reads, copy ? "ok" : "bad");
+}
+#endif
+
+#ifdef BENCH_SUITE
+//-------------------------------------------------------------------------------------------------
+// Benchmark suite of lfs_bench.c, the same one Tools/lfsbench.c runs on the host. Fills the chip
+// and ages it, which takes several minutes on a W25Q64.
+//-------------------------------------------------------------------------------------------------
+static uint32_t bench_clock_us(const struct lfs_bench_config *c)
+{
+	UNUSED(c);
+	return HAL_GetTick()*1000;
+}
+
+static uint32_t bench_prog_bytes(const struct lfs_bench_config *c)
+{
+	UNUSED(c);
+	return stmlfs_progbytes(&fs);
+}
+
+static void bench_idle(const struct lfs_bench_config *c, uint32_t us)
+{
+	UNUSED(c);
+	uint32_t start=DWT->CYCCNT;
+	while (DWT->CYCCNT-start < us*(SystemCoreClock/1000000)) stmlfs_sched_work(&fs, 0);	// As in sched_benchmark
+}
+
+static const struct lfs_bench_config bench_config = {
+	.clock_us = bench_clock_us,
+	.prog_bytes = bench_prog_bytes,
+	.idle = bench_idle,
+	.seed = 1,
+};
+#endif
 /* USER CODE END 0 */
 
 /**
@@ -110,19 +496,20 @@ int main(void)
 
   printf("\n\nlittlefs version %x\n",LFS_VERSION);
 
-  W25Q_Reset();
+  W25Q_Init(&flash, &hspi1, SPI1_CS_GPIO_Port, SPI1_CS_Pin, FS_SIZE);
+  W25Q_Reset(&flash);
 
-  printf("Flash Identifier = 0x%08lx\n",W25Q_ReadID());
+  printf("Flash Identifier = 0x%08lx\n",W25Q_ReadID(&flash));
 
-  W25Q_ReadUniqueID();
+  W25Q_ReadUniqueID(&flash);
 
-  printf("StatusReg1=%02x\n",W25Q_ReadStatus(1));
-  printf("StatusReg2=%02x\n",W25Q_ReadStatus(2));
-  printf("StatusReg3=%02x\n",W25Q_ReadStatus(3));
+  printf("StatusReg1=%02x\n",W25Q_ReadStatus(&flash, 1));
+  printf("StatusReg2=%02x\n",W25Q_ReadStatus(&flash, 2));
+  printf("StatusReg3=%02x\n",W25Q_ReadStatus(&flash, 3));
 
   printf("\nRead SFDP Table:\n");
   uint8_t sfdp[256]={0};
-  W25Q_ReadSFDP(sfdp);
+  W25Q_ReadSFDP(&flash, sfdp);
   printf("%c %c %c %c ",sfdp[0],sfdp[1],sfdp[2],sfdp[3]);
   for (int i=4;i<256;i++) printf("%02x ",sfdp[i]);
   printf("\n\n");
@@ -130,7 +517,9 @@ int main(void)
 
   // test file system
   printf("\n\n ********************* Mount lfs ***********************\n\n");
-  stmlfs_mount(true);
+  stmlfs_init(&fs, &flash, 0, FS_SIZE/FS_SECTOR_SIZE);
+  //stmlfs_record(&fs, true);										// Print the calls for Tools/lfsreplay.c
+  stmlfs_mount(&fs, true);
 
   //---------------------------------------------------------------------------------------------
   // We'll create 32 files, verify them, rename them, reverify, and delete them.
@@ -140,7 +529,7 @@ int main(void)
 
 	  sprintf(fn, fn_templ1,i);                                  	// Create file name string
 
-      int err = stmlfs_file_open(&fp, fn, LFS_O_WRONLY | LFS_O_CREAT);// Create the fp
+      int err = stmlfs_file_open(&fs, &fp, fn, LFS_O_WRONLY | LFS_O_CREAT);// Create the fp
       if (err < 0) {
           printf("open failed\n");
           fflush(stdout);
@@ -148,42 +537,44 @@ int main(void)
       }
 
       printf("Write to File %s\n",fn);
-      if ((strlen(fn) + 1) != (uint32_t)stmlfs_file_write(&fp, fn, strlen(fn) + 1)) {// Write the file name to the file
+      if ((strlen(fn) + 1) != (uint32_t)stmlfs_file_write(&fs, &fp, fn, strlen(fn) + 1)) {// Write the file name to the file
           printf("write fails\n");
           fflush(stdout);
           Error_Handler();
       }
 
-      if (stmlfs_file_close(&fp)<0){                          		// flush and close the file
+      if (stmlfs_file_close(&fs, &fp)<0){							// flush and close the file
           printf("closed failed\n");
           fflush(stdout);
           Error_Handler();
       }
   }
 
-  dump_dir();														// Show directory
+  dump_dir(&fs);													// Show directory
 
-  //stmlfs_unmount();                                               	// Unmount & remount
-  //stmlfs_mount(false);
+  //stmlfs_unmount(&fs);                                           	// Unmount & remount
+  //stmlfs_mount(&fs, false);
 
   struct littlfs_fsstat_t stat;                                   	// Display file system sizes
-  stmlfs_fsstat(&stat);
+  stmlfs_fsstat(&fs, &stat);
   printf("FS: blocks %d, block size %d, used %d\n", (int)stat.block_count, (int)stat.block_size,(int)stat.blocks_used);
 
+  const char *oldpaths[32], *newpaths[32];
   for (int i = 0; i < 32; i++) {
-  	  sprintf(fn, fn_templ1, i);
-      sprintf(fn2, fn_templ2, i);
-
-      printf("Rename from %s to %s\n",fn,fn2);
-      if (stmlfs_rename(fn, fn2) < 0) {                           	// rename
-          printf("rename failed\n");
-          fflush(stdout);
-          Error_Handler();
-      }
+  	  sprintf(oldnames[i], fn_templ1, i);
+      sprintf(newnames[i], fn_templ2, i);
+      oldpaths[i] = oldnames[i];
+      newpaths[i] = newnames[i];
+      printf("Rename from %s to %s\n",oldnames[i],newnames[i]);
+  }
+  if (stmlfs_rename_batch(&fs, oldpaths, newpaths, 32) < 0) {		// rename all files, coalesced per metadata pair
+      printf("rename failed\n");
+      fflush(stdout);
+      Error_Handler();
   }
-  dump_dir();														// Show directory
+  dump_dir(&fs);													// Show directory
 
-  stmlfs_fsstat(&stat);                                           	// Display file system sizes
+  stmlfs_fsstat(&fs, &stat);										// Display file system sizes
   printf("FS: blocks %d, block size %d, used %d\n", (int)stat.block_count, (int)stat.block_size,(int)stat.blocks_used);
 
   char buf[32];
@@ -193,33 +584,71 @@ int main(void)
       sprintf(fn2, fn_templ2, i);
 
       printf("Reopen Filename=%s\n",fn2);
-      int err = stmlfs_file_open(&fp, fn2, LFS_O_RDONLY);       	// verify the file's content
+      int err = stmlfs_file_open(&fs, &fp, fn2, LFS_O_RDONLY);		// verify the file's content
       if (err < 0) {
           printf("lfs open failed\n");
           fflush(stdout);
           Error_Handler();
       } else {
-          stmlfs_file_read(&fp, buf, sizeof(buf));
+          stmlfs_file_read(&fs, &fp, buf, sizeof(buf));
           if (strcmp(fn, buf) != 0) {
               printf("lfs read failed\n");
               fflush(stdout);
               Error_Handler();
           }
-          stmlfs_file_close(&fp);
+          stmlfs_file_close(&fs, &fp);
 
-          if (stmlfs_remove(fn2) < 0) {                             // Delete the file
+          if (stmlfs_remove(&fs, fn2) < 0) {                             // Delete the file
               printf("remove failed\n");
               fflush(stdout);
               Error_Handler();
           } else printf("File %s removed\n",fn2);
       }
   }
-  dump_dir();
+  dump_dir(&fs);
 
-  stmlfs_fsstat(&stat);                                         	// Display file system sizes
+  stmlfs_fsstat(&fs, &stat);										// Display file system sizes
   printf("FS: blocks %d, block size %d, used %d\n", (int)stat.block_count, (int)stat.block_size,(int)stat.blocks_used);
   
-  stmlfs_unmount();                                             	// Release any resources we were using
+  log_benchmark(false);												// Write latency without and with idle gc
+  log_benchmark(true);
+  reopen_benchmark(false);											// Bytes programmed per byte logged
+  reopen_benchmark(true);
+  ring_benchmark();													// Fixed size ring log throughput
+  stream_benchmark(false);											// Read while processing, without and with read-ahead
+  stream_benchmark(true);
+  fragment_benchmark(false);										// Header, payload and trailer per record
+  fragment_benchmark(true);
+  sched_benchmark(false);											// Read latency under a mixed trace, programs written through or queued
+  stmlfs_trace_start();												// Block device calls of the next run, decode with Tools/lfstrace.py
+  sched_benchmark(true);
+  stmlfs_trace_stop();
+  stmlfs_trace_dump();
+
+  struct littlfs_stats_t st;
+  stmlfs_stats(&fs, &st, false);									// Work done by every layer since mount
+  printf("Stats: SPI tx %lu rx %lu, busy %lums, reads %lu, programs %lu, erases %lu\n", (unsigned long)st.spi.tx_bytes,
+		  (unsigned long)st.spi.rx_bytes, (unsigned long)st.spi.busy_us/1000, (unsigned long)st.spi.reads,
+		  (unsigned long)st.spi.page_programs, (unsigned long)st.spi.sector_erases);
+  printf("Stats: rcache hits %lu, pcache hits %lu, misses %lu, commits %lu, compactions %lu, relocations %lu, scans %lu\n",
+		  (unsigned long)st.lfs.rcache_hits, (unsigned long)st.lfs.pcache_hits, (unsigned long)st.lfs.cache_misses,
+		  (unsigned long)st.lfs.commits, (unsigned long)st.lfs.compactions, (unsigned long)st.lfs.relocations,
+		  (unsigned long)st.lfs.lookahead_scans);
+  printf("Stats: written %lu, programmed %lu bytes\n", (unsigned long)st.write_bytes, (unsigned long)st.prog_bytes);
+  stmlfs_latency_dump(&fs);											// Latency percentiles per call type
+#ifdef BENCH_SUITE
+  lfs_bench_run(&fs.lfs, &bench_config);							// JSON results for CI, compare with Tools/lfsbench.c
+#endif
+
+  stmlfs_unmount(&fs);												// Release any resources we were using
+#ifdef SPI2_CS_Pin
+  if (hspi2.Instance == NULL) MX_SPI2_Init();						// Unless the generated init list above has it
+  W25Q_Init(&flash2, &hspi2, SPI2_CS_GPIO_Port, SPI2_CS_Pin, FS_SIZE);
+  W25Q_Reset(&flash2);
+  stripe_benchmark(false);											// Sequential write throughput, one chip or two
+  stripe_benchmark(true);
+  mirror_benchmark();												// Reads served by both copies
+#endif
   printf("lfs test done\n");
   fflush(stdout);
 
@@ -308,6 +737,13 @@ PUTCHAR_PROTOTYPE
   return ch;
 }
 
+#if defined(FS_READAHEAD) && (USE_HAL_SPI_REGISTER_CALLBACKS == 0U)
+void HAL_SPI_RxCpltCallback(SPI_HandleTypeDef *hspi)
+{
+  W25Q_SPI_RxCplt(hspi);												// End of a read-ahead transfer
+}
+#endif
+
 /* USER CODE END 4 */
 
 /**
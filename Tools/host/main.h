@@ -0,0 +1,116 @@
+/*
+ * main.h
+ *
+ * Stand-in for the CubeMX main.h when W25Qxx.c is built on Linux against the W25Q emulator in
+ * Tools/w25qemu.c. Declares the part of the STM32 HAL and CMSIS the driver uses, the emulator
+ * implements it. Two chips, the first on SPI1 and the second on SPI2, like the demo board with a
+ * second W25Q64 fitted.
+ */
+#ifndef __MAIN_H
+#define __MAIN_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+
+typedef enum {
+	HAL_OK = 0,
+	HAL_ERROR,
+	HAL_BUSY,
+	HAL_TIMEOUT
+} HAL_StatusTypeDef;
+
+typedef struct {
+	int chip;														// Emulated chip the stream serves
+} DMA_HandleTypeDef;
+
+typedef struct __SPI_HandleTypeDef {
+	int chip;														// Emulated chip on this port
+	DMA_HandleTypeDef *hdmarx;										// NULL, no read-ahead
+	void (*RxCpltCallback)(struct __SPI_HandleTypeDef *hspi);
+} SPI_HandleTypeDef;
+
+typedef enum {
+	HAL_SPI_RX_COMPLETE_CB_ID = 0x02U
+} HAL_SPI_CallbackIDTypeDef;
+
+typedef struct {
+	volatile uint32_t CNT;
+} TIM_HandleTypeDef;
+
+typedef struct {
+	int port;
+} GPIO_TypeDef;
+
+typedef enum {
+	GPIO_PIN_RESET = 0,
+	GPIO_PIN_SET
+} GPIO_PinState;
+
+typedef struct {
+	volatile uint32_t CTRL;
+	volatile uint32_t CYCCNT;
+} DWT_Type;
+
+typedef struct {
+	volatile uint32_t DEMCR;
+} CoreDebug_Type;
+
+extern GPIO_TypeDef w25qemu_gpiod, w25qemu_gpioe;
+extern DWT_Type w25qemu_dwt;
+extern CoreDebug_Type w25qemu_coredebug;
+extern SPI_HandleTypeDef hspi1, hspi2;
+extern DMA_HandleTypeDef hdma_spi1_rx, hdma_spi2_rx;
+extern uint32_t SystemCoreClock;
+
+#define USE_HAL_SPI_REGISTER_CALLBACKS	1U
+#define __DCACHE_PRESENT				1U
+#define D1_DTCMRAM_BASE					0x20000000UL
+
+#define GPIO_PIN_3						0x0008
+#define GPIO_PIN_6						0x0040
+#define GPIO_PIN_7						0x0080
+#define BLUE_LED_Pin					GPIO_PIN_3
+#define BLUE_LED_GPIO_Port				(&w25qemu_gpioe)
+#define SPI1_CS_Pin						GPIO_PIN_6
+#define SPI1_CS_GPIO_Port				(&w25qemu_gpiod)
+#define SPI2_CS_Pin						GPIO_PIN_7
+#define SPI2_CS_GPIO_Port				(&w25qemu_gpiod)
+
+#define DWT								(&w25qemu_dwt)
+#define CoreDebug						(&w25qemu_coredebug)
+#define DWT_CTRL_CYCCNTENA_Msk			(1UL << 0)
+#define CoreDebug_DEMCR_TRCENA_Msk		(1UL << 24)
+
+#define UNUSED(X)						(void)X
+#define __HAL_TIM_SET_COUNTER(h, v)		((h)->CNT = (v))
+#define __HAL_TIM_GET_COUNTER(h)		(++(h)->CNT)
+#define __HAL_DMA_GET_COUNTER(h)		w25qemu_dma_counter(h)
+#define __WFI()							w25qemu_wfi()
+
+uint32_t __get_PRIMASK(void);
+void __set_PRIMASK(uint32_t primask);
+void __disable_irq(void);
+void __enable_irq(void);
+void SCB_InvalidateDCache_by_Addr(void *addr, int32_t size);
+void SCB_CleanDCache_by_Addr(void *addr, int32_t size);
+
+void HAL_Delay(uint32_t ms);
+uint32_t HAL_GetTick(void);
+void HAL_GPIO_WritePin(GPIO_TypeDef *port, uint16_t pin, GPIO_PinState state);
+void HAL_GPIO_TogglePin(GPIO_TypeDef *port, uint16_t pin);
+HAL_StatusTypeDef HAL_SPI_Transmit(SPI_HandleTypeDef *hspi, const uint8_t *data, uint16_t size, uint32_t timeout);
+HAL_StatusTypeDef HAL_SPI_Receive(SPI_HandleTypeDef *hspi, uint8_t *data, uint16_t size, uint32_t timeout);
+HAL_StatusTypeDef HAL_SPI_Receive_DMA(SPI_HandleTypeDef *hspi, uint8_t *data, uint16_t size);
+HAL_StatusTypeDef HAL_SPI_Abort(SPI_HandleTypeDef *hspi);
+HAL_StatusTypeDef HAL_SPI_RegisterCallback(SPI_HandleTypeDef *hspi, HAL_SPI_CallbackIDTypeDef id,
+		void (*callback)(SPI_HandleTypeDef *hspi));
+
+uint32_t w25qemu_dma_counter(DMA_HandleTypeDef *hdma);
+void w25qemu_wfi(void);
+
+void Error_Handler(void);
+
+#endif
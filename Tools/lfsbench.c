@@ -0,0 +1,326 @@
+/*
+ * lfsbench.c
+ *
+ * Runs the benchmark suite of Core/Src/lfs_bench.c against littlefs on an emulated W25Q on Linux,
+ * the same suite the target runs against its flash. Every result is a line of JSON on stdout with
+ * the simulated flash time, operations and MB per second, the write amplification and latency
+ * percentiles, for a CI job to keep and compare against the previous build:
+ *
+ *   gcc -O2 -Ihost -I../Core/Inc -o lfsbench lfsbench.c w25qemu.c ../Core/Src/W25Qxx.c \
+ *       ../Core/Src/lfs.c ../Core/Src/lfs_bench.c ../Core/Src/lfs_lathist.c ../Core/Src/lfs_ring.c \
+ *       ../Core/Src/lfs_async.c
+ *   ./lfsbench
+ *   ./lfsbench -c 4096 -o seq_ > bench.json
+ *
+ * By default littlefs runs straight on a timed image of the flash, only flash time is counted and
+ * the port's scheduler, read-ahead and pre-erase are not modelled. With -m the port itself runs
+ * instead, W25Qxx.c on the SPI level emulator of w25qemu.c, on one chip or on two striped or
+ * mirrored, with the littlefs settings and features of W25Qxx.h:
+ *
+ *   ./lfsbench -m chip -n 512 -o seq_
+ *   ./lfsbench -m stripe -n 256 -o seq_
+ *   ./lfsbench -m mirror -n 512 -o seq_
+ *
+ * -d switches a feature of the port off at run time, to measure what it is worth on the same
+ * build:
+ *
+ *   ./lfsbench -m chip -n 512 -o seq_read -w 640 -d readahead
+ *
+ * -w adds the time the application takes to process what it reads, the read-ahead only pays off
+ * when there is some. The pauses of the mixed_read trace are spent in stmlfs_sched_work, compare
+ * it against -d sched.
+ *
+ * CPU time is otherwise not modelled either way, so compare runs against each other rather than
+ * against the target.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "main.h"
+#include "lfs.h"
+#include "lfs_bench.h"
+#include "W25Qxx.h"
+#include "w25qemu.h"
+
+#define SECTOR_SIZE		4096
+#define PAGE_SIZE		256
+
+struct opts {
+	lfs_size_t block_size;
+	lfs_size_t block_count;
+	lfs_size_t cache_size;
+	lfs_size_t lookahead_size;
+	int32_t block_cycles;
+	double spi_mhz;
+	double prog_us;													// Page program time
+	double erase_ms;												// Sector erase time
+	double work_ns;													// Processing time per byte the sequential reads return
+};
+
+static struct opts opt = {SECTOR_SIZE, 2048, 1024, 32, 100, 12.5, 400, 45, 0};
+static uint8_t *mem;
+static uint32_t *erase_count;
+static uint64_t now_ns, prog_bytes;
+static W25Q_t flash[W25QEMU_CHIPS];										// Port mode, chip 0 on SPI1, chip 1 on SPI2
+static stmlfs_t fs;
+static const char *disable;												// Port mode, feature switched off with -d
+
+//-------------------------------------------------------------------------------------------------
+// Emulated W25Q, timed the same way as in lfsreplay.c. Every call is a command plus 3 address
+// bytes on the SPI bus, programs are split in pages and wait for the page program, erases for
+// each sector.
+//-------------------------------------------------------------------------------------------------
+static uint64_t spi_ns(lfs_size_t bytes)
+{
+	return (uint64_t)((4+bytes)*8*1000/opt.spi_mhz);
+}
+
+static int bd_read(const struct lfs_config *c, lfs_block_t block, lfs_off_t off, void *buffer, lfs_size_t size)
+{
+	memcpy(buffer,mem+(size_t)block*c->block_size+off,size);
+	now_ns+=spi_ns(size);
+	return LFS_ERR_OK;
+}
+
+static int bd_prog(const struct lfs_config *c, lfs_block_t block, lfs_off_t off, const void *buffer, lfs_size_t size)
+{
+	uint8_t *dst=mem+(size_t)block*c->block_size+off;
+	const uint8_t *data=buffer;
+
+	for (lfs_size_t i=0; i<size; i++) dst[i]&=data[i];				// NOR only clears bits
+	for (lfs_size_t n=0; n<size;) {
+		lfs_size_t len=PAGE_SIZE-(off+n)%PAGE_SIZE;
+		if (len>size-n) len=size-n;
+		now_ns+=spi_ns(len)+(uint64_t)(opt.prog_us*1000);
+		n+=len;
+	}
+	prog_bytes+=size;
+	return LFS_ERR_OK;
+}
+
+static int bd_erase(const struct lfs_config *c, lfs_block_t block)
+{
+	memset(mem+(size_t)block*c->block_size,0xFF,c->block_size);
+	erase_count[block]++;
+	for (lfs_size_t n=0; n<c->block_size; n+=SECTOR_SIZE) {
+		now_ns+=spi_ns(0)+(uint64_t)(opt.erase_ms*1000000);
+	}
+	return LFS_ERR_OK;
+}
+
+static int bd_sync(const struct lfs_config *c)
+{
+	(void)c;
+	return LFS_ERR_OK;
+}
+
+static uint32_t bench_clock_us(const struct lfs_bench_config *c)
+{
+	(void)c;
+	return (uint32_t)(now_ns/1000);
+}
+
+static uint32_t bench_prog_bytes(const struct lfs_bench_config *c)
+{
+	(void)c;
+	return (uint32_t)prog_bytes;
+}
+
+static void bench_process(const struct lfs_bench_config *c, lfs_size_t size)
+{
+	(void)c;
+	now_ns+=(uint64_t)(opt.work_ns*size);
+}
+
+static void bench_idle(const struct lfs_bench_config *c, uint32_t us)
+{
+	(void)c;
+	now_ns+=(uint64_t)us*1000;
+}
+
+static uint32_t port_clock_us(const struct lfs_bench_config *c)
+{
+	(void)c;
+	return (uint32_t)(w25qemu_time_ns()/1000);
+}
+
+static uint32_t port_prog_bytes(const struct lfs_bench_config *c)
+{
+	(void)c;
+	return stmlfs_progbytes(&fs);
+}
+
+static void port_process(const struct lfs_bench_config *c, lfs_size_t size)
+{
+	(void)c;
+	w25qemu_cpu((uint64_t)(opt.work_ns*size));						// Read-ahead DMA runs meanwhile
+}
+
+static void port_idle(const struct lfs_bench_config *c, uint32_t us)
+{
+	(void)c;
+	uint64_t until=w25qemu_time_ns()+(uint64_t)us*1000;
+
+	while (w25qemu_time_ns()<until) {								// The demo's idle loop, polled every 10us
+		uint64_t left=until-w25qemu_time_ns();
+		if (stmlfs_sched_work(&fs,0)) w25qemu_cpu(left<10000 ? left : 10000);
+		else w25qemu_cpu(left);
+	}
+}
+
+//-------------------------------------------------------------------------------------------------
+// Port mode, the suite on stmlfs over emulated chips. count is the number of sectors used on each
+// chip, mode is chip, stripe or mirror.
+//-------------------------------------------------------------------------------------------------
+static int run_port(const char *mode, lfs_size_t count, struct lfs_bench_config *bench)
+{
+	struct w25qemu_timing timing = {opt.spi_mhz, opt.prog_us, opt.erase_ms, 20};
+	int err;
+
+	w25qemu_init(&timing);
+	hspi1.hdmarx=&hdma_spi1_rx;										// Read-ahead on both ports
+	hspi2.hdmarx=&hdma_spi2_rx;
+	W25Q_Init(&flash[0],&hspi1,SPI1_CS_GPIO_Port,SPI1_CS_Pin,W25QEMU_SIZE);
+	W25Q_Init(&flash[1],&hspi2,SPI2_CS_GPIO_Port,SPI2_CS_Pin,W25QEMU_SIZE);
+	if (!strcmp(mode,"chip")) err=stmlfs_init(&fs,&flash[0],0,count);
+	else if (!strcmp(mode,"stripe")) err=stmlfs_init_striped(&fs,&flash[0],&flash[1],0,count);
+	else if (!strcmp(mode,"mirror")) err=stmlfs_init_mirrored(&fs,&flash[0],&flash[1],0,count);
+	else err=LFS_ERR_INVAL;
+	if (!err) err=stmlfs_mount(&fs,true);
+	if (!err && disable) {
+		if (!strcmp(disable,"readahead")) stmlfs_readahead(&fs,false);
+		else if (!strcmp(disable,"sched")) stmlfs_sched(&fs,false);
+		else err=LFS_ERR_INVAL;
+	}
+	if (err) {
+		fprintf(stderr,"port %s on %lu sectors failed %d\n",mode,(unsigned long)count,err);
+		return err;
+	}
+
+	bench->clock_us=port_clock_us;
+	bench->prog_bytes=port_prog_bytes;
+	bench->process=port_process;
+	bench->idle=port_idle;
+	int n=lfs_bench_run(&fs.lfs,bench);
+	stmlfs_unmount(&fs);
+
+	uint32_t most=0;
+	uint64_t progs=0;
+	for (int i=0; i<W25QEMU_CHIPS; i++) {
+		struct w25qemu_stat st;
+		w25qemu_stat(i,&st);
+		progs+=st.prog_bytes;
+		for (uint32_t b=0; b<W25QEMU_SIZE/W25QEMU_SECTOR; b++) {
+			if (w25qemu_erases(i,b)>most) most=w25qemu_erases(i,b);
+		}
+	}
+	printf("{\"bench\":\"total\",\"mode\":\"%s\",\"results\":%d,\"ms\":%.3f,\"prog_bytes\":%llu,\"max_erases\":%lu}\n",
+			mode,n,w25qemu_time_ns()/1e6,(unsigned long long)progs,(unsigned long)most);
+	return n;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr,"usage: %s [options]\n"
+			"  -m mode    run the port on emulated chips: chip, stripe over 2 or mirror on 2\n"
+			"  -d feature with -m, switch readahead or sched off\n"
+			"  -b bytes   littlefs block size, a multiple of %d (default %lu)\n"
+			"  -n blocks  block count, sectors per chip with -m (default %lu, a W25Q64)\n"
+			"  -c bytes   cache_size, not with -m (default %lu)\n"
+			"  -l bytes   lookahead_size, not with -m (default %lu)\n"
+			"  -y cycles  block_cycles, -1 disables wear levelling, not with -m (default %ld)\n"
+			"  -s MHz     SPI clock (default %.1f)\n"
+			"  -p us      page program time (default %.0f)\n"
+			"  -e ms      sector erase time (default %.0f)\n"
+			"  -w ns      processing time per byte returned by the sequential reads (default 0)\n"
+			"  -o name    only the benchmarks whose name starts with this\n"
+			"  -z bytes   file size of the sequential and random benchmarks (default 262144)\n"
+			"  -f bytes   fill at most this much and skip aging (default until full)\n"
+			"  -r seed    seed of the random workload (default 1)\n",
+			name,SECTOR_SIZE,(unsigned long)opt.block_size,(unsigned long)opt.block_count,(unsigned long)opt.cache_size,
+			(unsigned long)opt.lookahead_size,(long)opt.block_cycles,opt.spi_mhz,opt.prog_us,opt.erase_ms);
+	exit(2);
+}
+
+int main(int argc, char *argv[])
+{
+	struct lfs_bench_config bench = {
+		.clock_us = bench_clock_us,
+		.prog_bytes = bench_prog_bytes,
+		.process = bench_process,
+		.idle = bench_idle,
+		.seed = 1,
+	};
+	const char *mode=NULL;
+	int c;
+
+	while ((c=getopt(argc,argv,"m:d:b:n:c:l:y:s:p:e:w:o:z:f:r:"))!=-1) {
+		switch (c) {
+		case 'm': mode=optarg; break;
+		case 'd': disable=optarg; break;
+		case 'b': opt.block_size=strtoul(optarg,NULL,0); break;
+		case 'n': opt.block_count=strtoul(optarg,NULL,0); break;
+		case 'c': opt.cache_size=strtoul(optarg,NULL,0); break;
+		case 'l': opt.lookahead_size=strtoul(optarg,NULL,0); break;
+		case 'y': opt.block_cycles=strtol(optarg,NULL,0); break;
+		case 's': opt.spi_mhz=atof(optarg); break;
+		case 'p': opt.prog_us=atof(optarg); break;
+		case 'e': opt.erase_ms=atof(optarg); break;
+		case 'w': opt.work_ns=atof(optarg); break;
+		case 'o': bench.only=optarg; break;
+		case 'z': bench.seq_size=strtoul(optarg,NULL,0); break;
+		case 'f': bench.fill_size=strtoul(optarg,NULL,0); break;
+		case 'r': bench.seed=strtoul(optarg,NULL,0); break;
+		default: usage(argv[0]);
+		}
+	}
+	if (optind!=argc || opt.block_size==0 || (opt.block_size%SECTOR_SIZE) || opt.spi_mhz<=0) usage(argv[0]);
+	if (mode) {
+		int n=run_port(mode,opt.block_count,&bench);
+		return n<0;
+	}
+
+	struct lfs_config cfg = {
+		.read = bd_read,
+		.prog = bd_prog,
+		.erase = bd_erase,
+		.sync = bd_sync,
+		.read_size = PAGE_SIZE,
+		.prog_size = PAGE_SIZE,
+		.block_size = opt.block_size,
+		.block_count = opt.block_count,
+		.cache_size = opt.cache_size,
+		.lookahead_size = opt.lookahead_size,
+		.block_cycles = opt.block_cycles,
+	};
+	mem=malloc((size_t)opt.block_size*opt.block_count);
+	erase_count=calloc(opt.block_count,sizeof(uint32_t));
+	if (!mem || !erase_count) {
+		fprintf(stderr,"out of memory\n");
+		return 1;
+	}
+	memset(mem,0xFF,(size_t)opt.block_size*opt.block_count);
+
+	lfs_t lfs;
+	int err=lfs_format(&lfs,&cfg);
+	if (!err) err=lfs_mount(&lfs,&cfg);
+	if (err) {
+		fprintf(stderr,"format failed %d\n",err);
+		return 1;
+	}
+	int n=lfs_bench_run(&lfs,&bench);
+	lfs_unmount(&lfs);
+
+	uint32_t most=0;
+	for (lfs_block_t b=0; b<opt.block_count; b++) {
+		if (erase_count[b]>most) most=erase_count[b];
+	}
+	printf("{\"bench\":\"total\",\"results\":%d,\"ms\":%.3f,\"prog_bytes\":%llu,\"max_erases\":%lu}\n",
+			n,now_ns/1e6,(unsigned long long)prog_bytes,(unsigned long)most);
+	if (n<0) {
+		fprintf(stderr,"benchmark failed %d\n",n);
+		return 1;
+	}
+	return 0;
+}
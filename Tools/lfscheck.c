@@ -0,0 +1,968 @@
+/*
+ * lfscheck.c
+ *
+ * Regression checks for the littlefs changes of this port, run against a RAM block device on
+ * Linux. Each check prints ok or FAIL with the line that failed, the exit code is the number of
+ * failed checks:
+ *
+ *   gcc -O2 -pthread -DLFS_ASYNC_PTHREAD -I../Core/Inc -o lfscheck lfscheck.c ../Core/Src/lfs.c \
+ *       ../Core/Src/lfs_async.c
+ *   ./lfscheck
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include "lfs.h"
+#include "lfs_async.h"
+
+#define BLOCK_SIZE		4096
+#define BLOCK_COUNT		256
+
+static uint8_t mem[BLOCK_SIZE*BLOCK_COUNT];
+static lfs_t lfs;
+static size_t progged;												// Bytes programmed since the last fresh()
+static size_t erased;												// Blocks erased since the last fresh()
+
+
+// Software CRC, the target has the same one in W25Qxx.c
+uint32_t lfs_crc(uint32_t crc, const void* buffer, size_t size) {
+    static const uint32_t rtable[16] = {
+        0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac, 0x76dc4190, 0x6b6b51f4,
+        0x4db26158, 0x5005713c, 0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c,
+        0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c,
+    };
+
+    const uint8_t* data = buffer;
+
+    for (size_t i = 0; i < size; i++) {
+        crc = (crc >> 4) ^ rtable[(crc ^ (data[i] >> 0)) & 0xf];
+        crc = (crc >> 4) ^ rtable[(crc ^ (data[i] >> 4)) & 0xf];
+    }
+
+    return crc;
+}
+
+static int bd_read(const struct lfs_config *c, lfs_block_t block, lfs_off_t off, void *buffer, lfs_size_t size)
+{
+	memcpy(buffer,mem+(size_t)block*c->block_size+off,size);
+	return LFS_ERR_OK;
+}
+
+static int bd_prog(const struct lfs_config *c, lfs_block_t block, lfs_off_t off, const void *buffer, lfs_size_t size)
+{
+	uint8_t *dst=mem+(size_t)block*c->block_size+off;
+	const uint8_t *data=buffer;
+
+	for (lfs_size_t i=0; i<size; i++) dst[i]&=data[i];				// NOR only clears bits
+	progged+=size;
+	return LFS_ERR_OK;
+}
+
+static int bd_erase(const struct lfs_config *c, lfs_block_t block)
+{
+	memset(mem+(size_t)block*c->block_size,0xFF,c->block_size);
+	erased++;
+	return LFS_ERR_OK;
+}
+
+static int bd_sync(const struct lfs_config *c)
+{
+	(void)c;
+	return LFS_ERR_OK;
+}
+
+static const struct lfs_config cfg = {
+	.read = bd_read,
+	.prog = bd_prog,
+	.erase = bd_erase,
+	.sync = bd_sync,
+	.read_size = 16,
+	.prog_size = 16,
+	.block_size = BLOCK_SIZE,
+	.block_count = BLOCK_COUNT,
+	.cache_size = 256,
+	.lookahead_size = 16,
+	.block_cycles = 500,
+};
+
+// Bail out of the check with the line that failed
+#define CHECK(x) do { if (!(x)) { printf("FAIL %s line %d: %s\n",__func__,__LINE__,#x); return 1; } } while (0)
+
+// Format and mount an empty filesystem for the next check
+static int fresh(void)
+{
+	memset(mem,0xFF,sizeof(mem));
+	progged=0;
+	erased=0;
+	if (lfs_format(&lfs,&cfg)) return -1;
+	return lfs_mount(&lfs,&cfg);
+}
+
+// Read the whole file into buf, returns its size
+static lfs_ssize_t slurp(const char *path, void *buf, lfs_size_t size)
+{
+	lfs_file_t f;
+	int err=lfs_file_open(&lfs,&f,path,LFS_O_RDONLY);
+	if (err) return err;
+	lfs_ssize_t n=lfs_file_read(&lfs,&f,buf,size);
+	lfs_file_close(&lfs,&f);
+	return n;
+}
+
+//-------------------------------------------------------------------------------------------------
+// lfs_file_reserve, an inline file keeps its data in the file cache which the reservation scan
+// also uses, the data must survive it
+//-------------------------------------------------------------------------------------------------
+static int check_reserve_inline(void)
+{
+	lfs_file_t f;
+	char buf[64];
+
+	CHECK(fresh()==0);
+	CHECK(lfs_file_open(&lfs,&f,"a",LFS_O_WRONLY|LFS_O_CREAT)==0);
+	CHECK(lfs_file_write(&lfs,&f,"hello world",11)==11);
+	CHECK(lfs_file_reserve(&lfs,&f,4*BLOCK_SIZE)>0);
+	CHECK(lfs_file_close(&lfs,&f)==0);
+	CHECK(slurp("a",buf,sizeof(buf))==11 && memcmp(buf,"hello world",11)==0);
+
+	// append after the reservation, from a committed inline file
+	CHECK(lfs_file_open(&lfs,&f,"b",LFS_O_WRONLY|LFS_O_CREAT)==0);
+	CHECK(lfs_file_write(&lfs,&f,"abcdef",6)==6);
+	CHECK(lfs_file_close(&lfs,&f)==0);
+	CHECK(lfs_file_open(&lfs,&f,"b",LFS_O_WRONLY|LFS_O_APPEND)==0);
+	CHECK(lfs_file_reserve(&lfs,&f,BLOCK_SIZE)>0);
+	CHECK(lfs_file_write(&lfs,&f,"XYZ",3)==3);
+	CHECK(lfs_file_close(&lfs,&f)==0);
+	CHECK(slurp("b",buf,sizeof(buf))==9 && memcmp(buf,"abcdefXYZ",9)==0);
+
+	// overwrite in the middle, the tail after the position must stay
+	CHECK(lfs_file_open(&lfs,&f,"c",LFS_O_RDWR|LFS_O_CREAT)==0);
+	CHECK(lfs_file_write(&lfs,&f,"abcdef",6)==6);
+	CHECK(lfs_file_seek(&lfs,&f,2,LFS_SEEK_SET)==2);
+	CHECK(lfs_file_reserve(&lfs,&f,BLOCK_SIZE)>0);
+	CHECK(lfs_file_write(&lfs,&f,"ZZ",2)==2);
+	CHECK(lfs_file_close(&lfs,&f)==0);
+	CHECK(slurp("c",buf,sizeof(buf))==6 && memcmp(buf,"abZZef",6)==0);
+
+	CHECK(lfs_unmount(&lfs)==0);
+	CHECK(lfs_mount(&lfs,&cfg)==0);
+	CHECK(slurp("a",buf,sizeof(buf))==11 && memcmp(buf,"hello world",11)==0);
+	CHECK(slurp("b",buf,sizeof(buf))==9 && memcmp(buf,"abcdefXYZ",9)==0);
+	CHECK(slurp("c",buf,sizeof(buf))==6 && memcmp(buf,"abZZef",6)==0);
+	CHECK(lfs_unmount(&lfs)==0);
+	return 0;
+}
+
+//-------------------------------------------------------------------------------------------------
+// lfs_file_reserve, two files reserving and writing side by side, with other allocations in
+// between, must not hand out a block twice
+//-------------------------------------------------------------------------------------------------
+static int check_reserve_interleaved(void)
+{
+	static uint8_t buf[BLOCK_SIZE];
+	lfs_file_t f[2];
+	lfs_file_t g;
+
+	CHECK(fresh()==0);
+	CHECK(lfs_file_open(&lfs,&f[0],"x",LFS_O_WRONLY|LFS_O_CREAT)==0);
+	CHECK(lfs_file_open(&lfs,&f[1],"y",LFS_O_WRONLY|LFS_O_CREAT)==0);
+	CHECK(lfs_file_reserve(&lfs,&f[0],16*BLOCK_SIZE)==17);
+	CHECK(lfs_file_reserve(&lfs,&f[1],16*BLOCK_SIZE)==17);
+	for (int i=0; i<16; i++) {
+		for (int j=0; j<2; j++) {
+			memset(buf,'a'+i+j,sizeof(buf));
+			CHECK(lfs_file_write(&lfs,&f[j],buf,sizeof(buf))==sizeof(buf));
+		}
+		char name[8];
+		snprintf(name,sizeof(name),"s%d",i);
+		CHECK(lfs_file_open(&lfs,&g,name,LFS_O_WRONLY|LFS_O_CREAT)==0);
+		memset(buf,'0'+i,sizeof(buf));
+		CHECK(lfs_file_write(&lfs,&g,buf,sizeof(buf))==sizeof(buf));
+		CHECK(lfs_file_close(&lfs,&g)==0);
+	}
+	CHECK(lfs_file_close(&lfs,&f[0])==0);
+	CHECK(lfs_file_close(&lfs,&f[1])==0);
+
+	CHECK(lfs_unmount(&lfs)==0);
+	CHECK(lfs_mount(&lfs,&cfg)==0);
+	for (int j=0; j<2; j++) {
+		CHECK(lfs_file_open(&lfs,&f[j],j ? "y" : "x",LFS_O_RDONLY)==0);
+		for (int i=0; i<16; i++) {
+			CHECK(lfs_file_read(&lfs,&f[j],buf,sizeof(buf))==sizeof(buf));
+			CHECK(buf[0]=='a'+i+j && buf[sizeof(buf)-1]=='a'+i+j);
+		}
+		CHECK(lfs_file_close(&lfs,&f[j])==0);
+	}
+	for (int i=0; i<16; i++) {
+		char name[8];
+		snprintf(name,sizeof(name),"s%d",i);
+		CHECK(slurp(name,buf,sizeof(buf))==sizeof(buf) && buf[0]=='0'+i);
+	}
+	CHECK(lfs_unmount(&lfs)==0);
+	return 0;
+}
+
+//-------------------------------------------------------------------------------------------------
+// lfs_fs_checkpoint, garbage collection of an unchanged filesystem has nothing to commit and must
+// leave the checkpoint alone, rewriting it each round wears the superblock pair
+//-------------------------------------------------------------------------------------------------
+static int check_checkpoint_gc(void)
+{
+	lfs_file_t f;
+
+	CHECK(fresh()==0);
+	CHECK(lfs_mkdir(&lfs,"d")==0);
+	CHECK(lfs_file_open(&lfs,&f,"d/a",LFS_O_WRONLY|LFS_O_CREAT)==0);
+	CHECK(lfs_file_write(&lfs,&f,"hello world",11)==11);
+	CHECK(lfs_file_close(&lfs,&f)==0);
+	CHECK(lfs_fs_gc(&lfs)==0);
+	CHECK(lfs_fs_checkpoint(&lfs)==0);
+
+	size_t before=progged;
+	for (int i=0; i<50; i++) {
+		CHECK(lfs_fs_gc(&lfs)==0);
+		while (true) {
+			int res=lfs_fs_gcstep(&lfs);
+			CHECK(res>=0);
+			if (!res) break;
+		}
+		CHECK(lfs_fs_checkpoint(&lfs)==0);
+	}
+	CHECK(progged==before);
+	CHECK(lfs_unmount(&lfs)==0);
+	return 0;
+}
+
+//-------------------------------------------------------------------------------------------------
+// lfs_fs_checkpoint, what a mount with the checkpoint finds must be what a full scan finds. The
+// values of lfs.mountck are the LFS_MOUNTCK_ states of lfs.c, lfs.usage.used is LFS_BLOCK_NULL
+// until the used blocks are counted
+//-------------------------------------------------------------------------------------------------
+#define MOUNTCK_NONE	0
+#define MOUNTCK_VALID	1
+#define MOUNTCK_STALE	2
+#define USED_UNKNOWN	((lfs_block_t)-1)
+
+struct mountstate {
+	lfs_block_t root[2];
+	lfs_gstate_t gstate;
+	lfs_ssize_t size;
+};
+
+static void getstate(struct mountstate *s)
+{
+	s->root[0]=lfs.root[0];
+	s->root[1]=lfs.root[1];
+	s->gstate=lfs.gstate;
+	s->size=lfs_fs_size(&lfs);
+}
+
+// Metadata pairs swap their blocks as they are rewritten
+static bool samepair(const lfs_block_t a[2], const lfs_block_t b[2])
+{
+	return (a[0]==b[0] && a[1]==b[1]) || (a[0]==b[1] && a[1]==b[0]);
+}
+
+static bool samestate(const struct mountstate *a, const struct mountstate *b)
+{
+	return samepair(a->root,b->root) && memcmp(&a->gstate,&b->gstate,sizeof(a->gstate))==0 && a->size==b->size;
+}
+
+// Count the blocks in use, lfs_fs_traverse may visit a block more than once
+static int count_block(void *p, lfs_block_t block)
+{
+	static uint8_t seen[BLOCK_COUNT];
+	lfs_size_t *used=p;
+
+	if (*used==0) memset(seen,0,sizeof(seen));
+	if (!seen[block]) {
+		seen[block]=1;
+		(*used)++;
+	}
+	return 0;
+}
+
+// A few directories and files, inline and not
+static int populate(void)
+{
+	static uint8_t buf[3*BLOCK_SIZE];
+	lfs_file_t f;
+
+	if (lfs_mkdir(&lfs,"d") || lfs_mkdir(&lfs,"d/e")) return -1;
+	for (int i=0; i<6; i++) {
+		char name[16];
+		snprintf(name,sizeof(name),i&1 ? "d/e/f%d" : "d/f%d",i);
+		if (lfs_file_open(&lfs,&f,name,LFS_O_WRONLY|LFS_O_CREAT)) return -1;
+		memset(buf,'a'+i,sizeof(buf));
+		lfs_size_t size=i*BLOCK_SIZE/2+10;
+		if (lfs_file_write(&lfs,&f,buf,size)!=(lfs_ssize_t)size || lfs_file_close(&lfs,&f)) return -1;
+	}
+	return 0;
+}
+
+// Rewrite a file in the root until the root pair shares no block with the given one, with a low
+// block_cycles this expands or relocates it, a relocation only replaces one block at a time
+static int moveroot(const lfs_block_t root[2])
+{
+	lfs_file_t f;
+
+	for (int i=0; i<20000; i++) {
+		if (lfs.root[0]!=root[0] && lfs.root[0]!=root[1] && lfs.root[1]!=root[0] && lfs.root[1]!=root[1]) return 0;
+		if (lfs_file_open(&lfs,&f,"r",LFS_O_WRONLY|LFS_O_CREAT|LFS_O_TRUNC)) return -1;
+		if (lfs_file_write(&lfs,&f,&i,sizeof(i))!=sizeof(i) || lfs_file_close(&lfs,&f)) return -1;
+	}
+	return -1;
+}
+
+// Full scan, checkpoint, then a mount with the checkpoint must agree with the full scan, also
+// count the used blocks by hand
+static int mount_matches(const struct lfs_config *c)
+{
+	struct mountstate full, fast;
+	lfs_size_t used=0;
+
+	CHECK(lfs_unmount(&lfs)==0);
+	CHECK(lfs_mount(&lfs,c)==0);
+	CHECK(lfs.mountck==MOUNTCK_NONE);
+	getstate(&full);
+	CHECK(lfs_fs_checkpoint(&lfs)==0);
+	CHECK(lfs_unmount(&lfs)==0);
+	CHECK(lfs_mount(&lfs,c)==0);
+	CHECK(lfs.mountck==MOUNTCK_VALID && lfs.usage.used!=USED_UNKNOWN);
+	getstate(&fast);
+	CHECK(samestate(&full,&fast));
+	CHECK(lfs_fs_traverse(&lfs,count_block,&used)==0 && (lfs_ssize_t)used==fast.size);
+	return 0;
+}
+
+static struct lfs_config wear_cfg;									// cfg with a low block_cycles
+
+static int check_checkpoint_mount(void)
+{
+	lfs_file_t f;
+
+	CHECK(fresh()==0);
+	CHECK(populate()==0);
+	CHECK(mount_matches(&cfg)==0);
+
+	// again after a change, which removed the checkpoint
+	CHECK(lfs_file_open(&lfs,&f,"d/f0",LFS_O_WRONLY|LFS_O_APPEND)==0);
+	CHECK(lfs_file_write(&lfs,&f,"more",4)==4);
+	CHECK(lfs_file_close(&lfs,&f)==0);
+	CHECK(mount_matches(&cfg)==0);
+
+	// with the root moved out of the superblock pair
+	wear_cfg=cfg;
+	wear_cfg.block_cycles=8;
+	CHECK(lfs_unmount(&lfs)==0);
+	CHECK(lfs_mount(&lfs,&wear_cfg)==0);
+	CHECK(moveroot((const lfs_block_t[2]){0,1})==0);
+	CHECK(mount_matches(&wear_cfg)==0);
+	CHECK(lfs_unmount(&lfs)==0);
+	return 0;
+}
+
+//-------------------------------------------------------------------------------------------------
+// lfs_fs_checkpoint, firmware without checkpoint support changes the filesystem without removing
+// the checkpoint, simulated by clearing lfs.mountck. Rewriting the superblock without the
+// generation, or moving the root the checkpoint points to, must make the next mount do a full
+// scan
+//-------------------------------------------------------------------------------------------------
+static int check_checkpoint_fallback(void)
+{
+	static struct lfs_config half_cfg;
+	struct mountstate want, got;
+
+	// mismatched generation, lfs_fs_grow writes the superblock without it
+	half_cfg=cfg;
+	half_cfg.block_count=BLOCK_COUNT/2;
+	memset(mem,0xFF,sizeof(mem));
+	CHECK(lfs_format(&lfs,&half_cfg)==0);
+	CHECK(lfs_mount(&lfs,&half_cfg)==0);
+	CHECK(populate()==0);
+	CHECK(lfs_fs_checkpoint(&lfs)==0);
+	CHECK(lfs_unmount(&lfs)==0);
+	CHECK(lfs_mount(&lfs,&half_cfg)==0);
+	CHECK(lfs.mountck==MOUNTCK_VALID);
+	lfs.mountck=MOUNTCK_NONE;
+	CHECK(lfs_fs_grow(&lfs,BLOCK_COUNT)==0);
+	getstate(&want);
+	CHECK(lfs_unmount(&lfs)==0);
+	CHECK(lfs_mount(&lfs,&cfg)==0);
+	CHECK(lfs.mountck==MOUNTCK_NONE && lfs.usage.used==USED_UNKNOWN);
+	getstate(&got);
+	CHECK(samestate(&want,&got));
+	CHECK(lfs_unmount(&lfs)==0);
+
+	// stale root, the checkpoint points to a root that was relocated and its blocks reused
+	wear_cfg=cfg;
+	wear_cfg.block_cycles=8;
+	CHECK(fresh()==0);
+	CHECK(lfs_unmount(&lfs)==0);
+	CHECK(lfs_mount(&lfs,&wear_cfg)==0);
+	CHECK(populate()==0);
+	CHECK(moveroot((const lfs_block_t[2]){0,1})==0);
+	lfs_block_t old[2]={lfs.root[0],lfs.root[1]};
+	CHECK(lfs_fs_checkpoint(&lfs)==0);
+	CHECK(lfs_unmount(&lfs)==0);
+	CHECK(lfs_mount(&lfs,&wear_cfg)==0);
+	CHECK(lfs.mountck==MOUNTCK_VALID);
+	lfs.mountck=MOUNTCK_NONE;
+	CHECK(moveroot(old)==0);
+	getstate(&want);
+	CHECK(lfs_unmount(&lfs)==0);
+	for (int i=0; i<2; i++) bd_erase(&wear_cfg,old[i]);
+	CHECK(lfs_mount(&lfs,&wear_cfg)==0);
+	CHECK(lfs.mountck==MOUNTCK_STALE && lfs.usage.used==USED_UNKNOWN);
+	getstate(&got);
+	CHECK(samestate(&want,&got));
+
+	// the first commit removes the stale checkpoint for good
+	CHECK(lfs_mkdir(&lfs,"x")==0);
+	CHECK(lfs.mountck==MOUNTCK_NONE);
+	CHECK(lfs_unmount(&lfs)==0);
+	CHECK(lfs_mount(&lfs,&wear_cfg)==0);
+	CHECK(lfs.mountck==MOUNTCK_NONE);
+	CHECK(lfs_unmount(&lfs)==0);
+	return 0;
+}
+
+//-------------------------------------------------------------------------------------------------
+// lfs_fs_checkpoint, every kind of change must remove the checkpoint before it commits, lfs.c
+// asserts this, and a remount after the change must not find one
+//-------------------------------------------------------------------------------------------------
+static int change(int op, lfs_file_t *open)
+{
+	static const char *const oldpaths[]={"d/f0","d/f2"};
+	static const char *const newpaths[]={"d/e/g0","g2"};
+	lfs_file_t f;
+
+	switch (op) {
+	case 0: return lfs_mkdir(&lfs,"n");
+	case 1:
+		if (lfs_file_open(&lfs,&f,"n",LFS_O_WRONLY|LFS_O_CREAT)) return -1;
+		return lfs_file_close(&lfs,&f);
+	case 2:
+		if (lfs_file_open(&lfs,&f,"d/f4",LFS_O_WRONLY|LFS_O_APPEND)) return -1;
+		if (lfs_file_write(&lfs,&f,"x",1)!=1) return -1;
+		return lfs_file_close(&lfs,&f);
+	case 3: return lfs_remove(&lfs,"d/f2");
+	case 4: return lfs_rename(&lfs,"d/f2","d/e/g2");
+	case 5: return lfs_rename_batch(&lfs,oldpaths,newpaths,2);
+	case 6: return lfs_remove_recursive(&lfs,"d");
+	case 7: return lfs_setattr(&lfs,"d/f0",'a',"attr",4);
+	case 8:
+		if (lfs_file_write(&lfs,open,"y",1)!=1) return -1;			// Opened before the checkpoint
+		return lfs_file_sync(&lfs,open);
+	case 9: return lfs_fs_grow(&lfs,BLOCK_COUNT);
+	}
+	return 1;
+}
+
+static int check_checkpoint_removed(void)
+{
+	static struct lfs_config half_cfg;
+	lfs_file_t f;
+	int res;
+
+	half_cfg=cfg;
+	half_cfg.block_count=BLOCK_COUNT/2;
+	for (int op=0; ; op++) {
+		memset(mem,0xFF,sizeof(mem));
+		CHECK(lfs_format(&lfs,&half_cfg)==0);
+		CHECK(lfs_mount(&lfs,&half_cfg)==0);
+		CHECK(populate()==0);
+		CHECK(lfs_file_open(&lfs,&f,"d/e/f1",LFS_O_WRONLY|LFS_O_APPEND)==0);
+		CHECK(lfs_fs_checkpoint(&lfs)==0);
+		CHECK(lfs.mountck==MOUNTCK_VALID);
+		res=change(op,&f);
+		if (res>0) break;
+		CHECK(res==0);
+		CHECK(lfs.mountck==MOUNTCK_NONE);
+		CHECK(lfs_file_close(&lfs,&f)==0);
+		CHECK(lfs_unmount(&lfs)==0);
+		CHECK(lfs_mount(&lfs,op==9 ? &cfg : &half_cfg)==0);
+		CHECK(lfs.mountck==MOUNTCK_NONE);
+		CHECK(lfs_unmount(&lfs)==0);
+	}
+	CHECK(lfs_file_close(&lfs,&f)==0);
+	CHECK(lfs_unmount(&lfs)==0);
+	return 0;
+}
+
+//-------------------------------------------------------------------------------------------------
+// lfs_rename_batch and lfs_remove_recursive, files are named and filled so their content tells
+// which file they were created as
+//-------------------------------------------------------------------------------------------------
+static int mkfile(const char *path, int n, lfs_size_t size)
+{
+	static uint8_t buf[2*BLOCK_SIZE+100];
+	lfs_file_t f;
+
+	memset(buf,n,size);
+	snprintf((char *)buf,size,"%d",n);
+	if (lfs_file_open(&lfs,&f,path,LFS_O_WRONLY|LFS_O_CREAT|LFS_O_EXCL)) return -1;
+	if (lfs_file_write(&lfs,&f,buf,size)!=(lfs_ssize_t)size) return -1;
+	return lfs_file_close(&lfs,&f);
+}
+
+// The file at path must be the one created as n
+static bool isfile(const char *path, int n, lfs_size_t size)
+{
+	static uint8_t buf[2*BLOCK_SIZE+100];
+	char want[16];
+
+	snprintf(want,sizeof(want),"%d",n);
+	return slurp(path,buf,sizeof(buf))==(lfs_ssize_t)size && strcmp((char *)buf,want)==0 && buf[size-1]==(uint8_t)n;
+}
+
+// Number of entries in a directory, and the number of metadata pairs they are spread over
+static int countdir(const char *path, int *pairs)
+{
+	lfs_dir_t dir;
+	struct lfs_info info;
+	lfs_block_t last=(lfs_block_t)-1;
+	int n=0;
+
+	*pairs=0;
+	if (lfs_dir_open(&lfs,&dir,path)) return -1;
+	while (lfs_dir_read(&lfs,&dir,&info)>0) {
+		if (dir.m.pair[0]!=last) {
+			last=dir.m.pair[0];
+			(*pairs)++;
+		}
+		if (strcmp(info.name,".") && strcmp(info.name,"..")) n++;
+	}
+	lfs_dir_close(&lfs,&dir);
+	return n;
+}
+
+// Renames within a directory spread over several metadata pairs, more than LFS_BATCH_MAX of them
+// and to longer names that make the pairs split further while the batch is committed
+#define SPLIT_FILES		48
+
+static int check_rename_batch_split(void)
+{
+	static char oldnames[SPLIT_FILES][16], newnames[SPLIT_FILES][48];
+	const char *oldpaths[SPLIT_FILES], *newpaths[SPLIT_FILES];
+	int pairs;
+
+	CHECK(fresh()==0);
+	CHECK(lfs_mkdir(&lfs,"s")==0);
+	for (int i=0; i<SPLIT_FILES; i++) {
+		snprintf(oldnames[i],sizeof(oldnames[i]),"s/f%02d",i);
+		snprintf(newnames[i],sizeof(newnames[i]),"s/renamed_to_a_much_longer_name_%02d",i);
+		oldpaths[i]=oldnames[i];
+		newpaths[i]=newnames[i];
+		CHECK(mkfile(oldnames[i],i,120)==0);
+	}
+	CHECK(countdir("s",&pairs)==SPLIT_FILES && pairs>1);
+
+	CHECK(lfs_rename_batch(&lfs,oldpaths,newpaths,SPLIT_FILES)==0);
+	for (int pass=0; pass<2; pass++) {
+		CHECK(countdir("s",&pairs)==SPLIT_FILES && pairs>1);
+		for (int i=0; i<SPLIT_FILES; i++) {
+			struct lfs_info info;
+			CHECK(lfs_stat(&lfs,oldnames[i],&info)==LFS_ERR_NOENT);
+			CHECK(isfile(newnames[i],i,120));
+		}
+		CHECK(lfs_unmount(&lfs)==0);
+		CHECK(lfs_mount(&lfs,&cfg)==0);
+	}
+	CHECK(lfs_unmount(&lfs)==0);
+	return 0;
+}
+
+// A batch that moves between directories, replaces an existing file and renames a directory,
+// mixed with renames that can be coalesced
+static int check_rename_batch_move(void)
+{
+	static const char *const oldpaths[]={"a/f0","a/f1","a/f2","b/x","a/f3","a/f4","a/sub","a/f5","a/f6"};
+	static const char *const newpaths[]={"b/g0","b/g1","a/h2","a/x","a/h3","b/y","b/sub","a/h5","a/f5"};
+	static const char *const wantpaths[]={"b/g0","b/g1","a/h2","a/x","a/h3","b/y","a/h5","a/f5"};
+	static const int want[]={0,1,2,10,3,4,5,6};						// What they were created as
+	lfs_size_t used=0;
+	int pairs;
+
+	CHECK(fresh()==0);
+	CHECK(lfs_mkdir(&lfs,"a")==0);
+	CHECK(lfs_mkdir(&lfs,"b")==0);
+	CHECK(lfs_mkdir(&lfs,"a/sub")==0);
+	for (int i=0; i<7; i++) {
+		char name[8];
+		snprintf(name,sizeof(name),"a/f%d",i);
+		CHECK(mkfile(name,i,i&1 ? 2*BLOCK_SIZE : 40)==0);
+	}
+	CHECK(mkfile("a/sub/z",20,40)==0);
+	CHECK(mkfile("b/x",10,40)==0);
+	CHECK(mkfile("b/y",11,2*BLOCK_SIZE)==0);						// Replaced by a/f4
+
+	CHECK(lfs_rename_batch(&lfs,oldpaths,newpaths,sizeof(oldpaths)/sizeof(oldpaths[0]))==0);
+	for (int pass=0; pass<2; pass++) {
+		for (size_t i=0; i<sizeof(wantpaths)/sizeof(wantpaths[0]); i++) {
+			int n=want[i];
+			CHECK(isfile(wantpaths[i],n,n<10 && (n&1) ? 2*BLOCK_SIZE : 40));
+		}
+		CHECK(isfile("b/sub/z",20,40));
+		CHECK(countdir("a",&pairs)==5);								// h2 h3 h5 f5 x
+		CHECK(countdir("b",&pairs)==4);								// g0 g1 y sub
+		CHECK(lfs_unmount(&lfs)==0);
+		CHECK(lfs_mount(&lfs,&cfg)==0);
+	}
+
+	// the replaced file's blocks are free again
+	CHECK(lfs_fs_traverse(&lfs,count_block,&used)==0 && (lfs_ssize_t)used==lfs_fs_size(&lfs));
+	CHECK(lfs_unmount(&lfs)==0);
+	return 0;
+}
+
+// More renames than fit in one batch, to names that sort in a scrambled order so the entries' ids
+// shift both ways, across the batch boundaries as well
+#define OVERFLOW_FILES	(2*LFS_BATCH_MAX+3)
+
+static int check_rename_batch_overflow(void)
+{
+	static char oldnames[OVERFLOW_FILES][16], newnames[OVERFLOW_FILES][16];
+	const char *oldpaths[OVERFLOW_FILES], *newpaths[OVERFLOW_FILES];
+	int pairs;
+
+	CHECK(fresh()==0);
+	CHECK(lfs_mkdir(&lfs,"o")==0);
+	for (int i=0; i<OVERFLOW_FILES; i++) {
+		snprintf(oldnames[i],sizeof(oldnames[i]),"o/a%02d",i);
+		snprintf(newnames[i],sizeof(newnames[i]),"o/b%02d",(i*11)%OVERFLOW_FILES);
+		oldpaths[i]=oldnames[i];
+		newpaths[i]=newnames[i];
+		CHECK(mkfile(oldnames[i],i,20)==0);
+	}
+	CHECK(mkfile("o/a",100,20)==0);									// Sorts before all of them and stays
+	CHECK(mkfile("o/c",101,20)==0);									// Sorts after all of them and stays
+
+	CHECK(lfs_rename_batch(&lfs,oldpaths,newpaths,OVERFLOW_FILES)==0);
+	for (int pass=0; pass<2; pass++) {
+		CHECK(countdir("o",&pairs)==OVERFLOW_FILES+2 && pairs==1);
+		for (int i=0; i<OVERFLOW_FILES; i++) {
+			struct lfs_info info;
+			CHECK(lfs_stat(&lfs,oldnames[i],&info)==LFS_ERR_NOENT);
+			CHECK(isfile(newnames[i],i,20));
+		}
+		CHECK(isfile("o/a",100,20) && isfile("o/c",101,20));
+		CHECK(lfs_unmount(&lfs)==0);
+		CHECK(lfs_mount(&lfs,&cfg)==0);
+	}
+	CHECK(lfs_unmount(&lfs)==0);
+	return 0;
+}
+
+// Remove a nested tree with files open in it at every level, reading, writing and with unsynced
+// data. The files stay usable, closing them must not bring anything back, and all their blocks
+// are free afterwards
+static int check_remove_recursive_open(void)
+{
+	static const char *const paths[]={"t/a","t/b","t/u/c","t/u/v/d","t/u/v/e","t/u/v/w/f"};
+	static uint8_t buf[BLOCK_SIZE];
+	lfs_file_t rd, wr, dirty;
+	struct lfs_info info;
+	lfs_size_t used=0;
+	int pairs;
+
+	CHECK(fresh()==0);
+	lfs_ssize_t empty=lfs_fs_size(&lfs);
+	CHECK(lfs_mkdir(&lfs,"t")==0);
+	CHECK(lfs_mkdir(&lfs,"t/u")==0);
+	CHECK(lfs_mkdir(&lfs,"t/u/v")==0);
+	CHECK(lfs_mkdir(&lfs,"t/u/v/w")==0);
+	CHECK(lfs_mkdir(&lfs,"t/x")==0);
+	for (size_t i=0; i<sizeof(paths)/sizeof(paths[0]); i++) CHECK(mkfile(paths[i],i,2*BLOCK_SIZE)==0);
+
+	CHECK(lfs_file_open(&lfs,&rd,"t/u/c",LFS_O_RDONLY)==0);
+	CHECK(lfs_file_read(&lfs,&rd,buf,100)==100);
+	CHECK(lfs_file_open(&lfs,&wr,"t/u/v/d",LFS_O_WRONLY|LFS_O_APPEND)==0);
+	CHECK(lfs_file_write(&lfs,&wr,buf,100)==100);
+	CHECK(lfs_file_sync(&lfs,&wr)==0);
+	CHECK(lfs_file_open(&lfs,&dirty,"t/u/v/w/f",LFS_O_WRONLY|LFS_O_APPEND)==0);
+	CHECK(lfs_file_write(&lfs,&dirty,buf,sizeof(buf))==sizeof(buf));
+
+	CHECK(lfs_remove_recursive(&lfs,"t")==0);
+	CHECK(lfs_stat(&lfs,"t",&info)==LFS_ERR_NOENT);
+	CHECK(countdir("/",&pairs)==0);
+
+	// the open files still work on their own data
+	memset(buf,0,sizeof(buf));
+	CHECK(lfs_file_read(&lfs,&rd,buf,100)==100 && buf[0]==2 && buf[99]==2);
+	CHECK(lfs_file_write(&lfs,&wr,buf,100)==100);
+	CHECK(lfs_file_close(&lfs,&rd)==0);
+	CHECK(lfs_file_close(&lfs,&wr)==0);
+	CHECK(lfs_file_close(&lfs,&dirty)==0);
+	CHECK(lfs_stat(&lfs,"t",&info)==LFS_ERR_NOENT);
+
+	CHECK(lfs_unmount(&lfs)==0);
+	CHECK(lfs_mount(&lfs,&cfg)==0);
+	CHECK(lfs_stat(&lfs,"t",&info)==LFS_ERR_NOENT);
+	CHECK(countdir("/",&pairs)==0);
+	CHECK(lfs_fs_size(&lfs)==empty);
+	CHECK(lfs_fs_traverse(&lfs,count_block,&used)==0 && (lfs_ssize_t)used==empty);
+
+	// nothing left to clean up either
+	size_t before=progged;
+	CHECK(lfs_fs_mkconsistent(&lfs)==0);
+	CHECK(progged==before);
+	CHECK(lfs_unmount(&lfs)==0);
+	return 0;
+}
+
+//-------------------------------------------------------------------------------------------------
+// LFS_O_LOGAPPEND, appends of odd sizes continue in the last block across close and reopen, sync,
+// remount and truncate, the file must read back exactly as written every time. A truncated block
+// is not erased past the new end and must not be reused, lfs.c would notice programming over it
+// and relocate, so there must be no relocations either
+//-------------------------------------------------------------------------------------------------
+#define LOG_SIZE		(3*BLOCK_SIZE+1000)
+
+// Relocations since the last call, lfs_fs_stats counts per mount
+static uint32_t relocations(void)
+{
+	struct lfs_fsstats stats;
+
+	if (lfs_fs_stats(&lfs,&stats,true)) return -1;
+	return stats.relocations;
+}
+
+// Returns the number of blocks erased, or -1
+static int logappend(int flags)
+{
+	static uint8_t want[LOG_SIZE], got[LOG_SIZE+1];
+	static const lfs_size_t sizes[]={1,7,13,100,333,16,5};
+	lfs_file_t f;
+	lfs_size_t size=0;
+	uint32_t seed=1, moved=0;
+
+	if (fresh()) return -1;
+	for (int i=0; size<LOG_SIZE; i++) {
+		lfs_size_t n=lfs_min(sizes[i%7],LOG_SIZE-size);
+		for (lfs_size_t j=0; j<n; j++) {
+			seed=seed*1103515245+12345;
+			want[size+j]=seed>>16;
+		}
+
+		// every fifth append is split by a sync, the second half goes on after it
+		lfs_size_t first=(i%5==4) ? n/2 : n;
+		if (lfs_file_open(&lfs,&f,"log",LFS_O_WRONLY|LFS_O_CREAT|LFS_O_APPEND|flags)) return -1;
+		if (lfs_file_write(&lfs,&f,want+size,first)!=(lfs_ssize_t)first) return -1;
+		if (first<n) {
+			if (lfs_file_sync(&lfs,&f)) return -1;
+			if (lfs_file_write(&lfs,&f,want+size+first,n-first)!=(lfs_ssize_t)(n-first)) return -1;
+		}
+		size+=n;
+		if (lfs_file_close(&lfs,&f)) return -1;
+
+		if (i%40==39) {
+			moved+=relocations();
+			if (lfs_unmount(&lfs) || lfs_mount(&lfs,&cfg)) return -1;
+		}
+		if (i%97==96) {
+			if (lfs_file_open(&lfs,&f,"log",LFS_O_WRONLY)) return -1;
+			size-=lfs_min(size,150);
+			if (lfs_file_truncate(&lfs,&f,size) || lfs_file_close(&lfs,&f)) return -1;
+		}
+
+		if (slurp("log",got,sizeof(got))!=(lfs_ssize_t)size || memcmp(got,want,size)) {
+			printf("FAIL %s: append %d, %u bytes\n",__func__,i,(unsigned)size);
+			return -1;
+		}
+	}
+	moved+=relocations();
+	if (lfs_unmount(&lfs) || lfs_mount(&lfs,&cfg)) return -1;
+	if (slurp("log",got,sizeof(got))!=(lfs_ssize_t)size || memcmp(got,want,size)) return -1;
+	if (lfs_unmount(&lfs)) return -1;
+	if (moved) {
+		printf("FAIL %s: %u relocations\n",__func__,(unsigned)moved);
+		return -1;
+	}
+	return erased;
+}
+
+static int check_logappend(void)
+{
+	int plain=logappend(0);
+	int log=logappend(LFS_O_LOGAPPEND);
+
+	CHECK(plain>0 && log>0);
+	CHECK(4*log<plain);												// The tail block is reused, not copied
+	return 0;
+}
+
+//-------------------------------------------------------------------------------------------------
+// lfs_async, producer threads queue writes, a sync and a close each, then reads, while a worker
+// thread runs the queue. Every producer's requests must complete in the order they were queued,
+// on the worker, with the results and data of the synchronous calls
+//-------------------------------------------------------------------------------------------------
+#define PRODUCERS		4
+#define REQUESTS		32												// Writes or reads per producer
+#define CHUNK			700
+
+struct producer {
+	int id;
+	lfs_file_t file;
+	lfs_async_req_t req[REQUESTS+2];
+	uint8_t buf[REQUESTS][CHUNK];
+	int done[REQUESTS+2];											// Request index in the order they completed
+	int ndone;
+	int bad;														// Completions out of order, on the wrong thread or failed
+};
+
+static struct lfs_async_pthread async_lock = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER};
+static const struct lfs_async_config async_cfg = {
+	.context = &async_lock,
+	.lock = lfs_async_pthread_lock,
+	.unlock = lfs_async_pthread_unlock,
+	.notify = lfs_async_pthread_notify,
+};
+static lfs_async_t queue;
+static pthread_t worker_thread;
+static pthread_mutex_t done_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool worker_stop;
+
+static void *worker(void *arg)
+{
+	(void)arg;
+	while (true) {
+		while (lfs_async_work(&queue));
+		async_cfg.lock(&async_cfg);
+		bool stop=worker_stop;
+		async_cfg.unlock(&async_cfg);
+		if (stop) return NULL;
+		lfs_async_pthread_wait(&queue);
+	}
+}
+
+static void completed(lfs_async_req_t *req)
+{
+	struct producer *p=req->data;
+	int i=req-p->req;
+	lfs_ssize_t want=(i<REQUESTS) ? CHUNK : 0;
+
+	pthread_mutex_lock(&done_lock);
+	if (!pthread_equal(pthread_self(),worker_thread) || req->result!=want || (p->ndone && p->done[p->ndone-1]>=i)) p->bad++;
+	p->done[p->ndone++]=i;
+	pthread_mutex_unlock(&done_lock);
+}
+
+// Wait for the completion callbacks of a producer's requests
+static void wait_done(struct producer *p, int count)
+{
+	while (true) {
+		pthread_mutex_lock(&done_lock);
+		int n=p->ndone;
+		pthread_mutex_unlock(&done_lock);
+		if (n>=count) return;
+		sched_yield();
+	}
+}
+
+static void *produce_writes(void *arg)
+{
+	struct producer *p=arg;
+
+	for (int i=0; i<REQUESTS; i++) {
+		for (int j=0; j<CHUNK; j++) p->buf[i][j]=(uint8_t)(p->id*REQUESTS+i+j);
+		if (lfs_async_write(&queue,&p->req[i],&p->file,p->buf[i],CHUNK,completed,p)) p->bad++;
+	}
+	if (lfs_async_sync(&queue,&p->req[REQUESTS],&p->file,completed,p)) p->bad++;
+	if (lfs_async_close(&queue,&p->req[REQUESTS+1],&p->file,completed,p)) p->bad++;
+	wait_done(p,REQUESTS+2);
+	return NULL;
+}
+
+static void *produce_reads(void *arg)
+{
+	struct producer *p=arg;
+
+	memset(p->buf,0,sizeof(p->buf));
+	for (int i=0; i<REQUESTS; i++) {
+		if (lfs_async_read(&queue,&p->req[i],&p->file,p->buf[i],CHUNK,completed,p)) p->bad++;
+	}
+	if (lfs_async_close(&queue,&p->req[REQUESTS+1],&p->file,completed,p)) p->bad++;
+	wait_done(p,REQUESTS+1);
+	return NULL;
+}
+
+// Run one producer thread per file against the worker, the files are opened up front as opening
+// is not queued
+static int run_producers(struct producer *p, void *(*fn)(void *), int flags)
+{
+	pthread_t threads[PRODUCERS];
+
+	for (int i=0; i<PRODUCERS; i++) {
+		char name[8];
+		snprintf(name,sizeof(name),"p%d",i);
+		p[i].id=i;
+		p[i].ndone=0;
+		memset(p[i].req,0,sizeof(p[i].req));
+		if (lfs_file_open(&lfs,&p[i].file,name,flags)) return -1;
+	}
+	worker_stop=false;
+	if (pthread_create(&worker_thread,NULL,worker,NULL)) return -1;
+	for (int i=0; i<PRODUCERS; i++) pthread_create(&threads[i],NULL,fn,&p[i]);
+	for (int i=0; i<PRODUCERS; i++) pthread_join(threads[i],NULL);
+	async_cfg.lock(&async_cfg);
+	worker_stop=true;
+	async_cfg.unlock(&async_cfg);
+	async_cfg.notify(&async_cfg);
+	return pthread_join(worker_thread,NULL);
+}
+
+static int check_async_threads(void)
+{
+	static struct producer p[PRODUCERS];
+
+	CHECK(fresh()==0);
+	lfs_async_init(&queue,&lfs,&async_cfg);
+	CHECK(run_producers(p,produce_writes,LFS_O_WRONLY|LFS_O_CREAT)==0);
+	for (int i=0; i<PRODUCERS; i++) {
+		CHECK(p[i].bad==0 && p[i].ndone==REQUESTS+2);
+		for (int j=0; j<REQUESTS+2; j++) CHECK(lfs_async_done(&queue,&p[i].req[j]));
+	}
+
+	CHECK(run_producers(p,produce_reads,LFS_O_RDONLY)==0);
+	for (int i=0; i<PRODUCERS; i++) {
+		CHECK(p[i].bad==0 && p[i].ndone==REQUESTS+1);
+		for (int j=0; j<REQUESTS; j++) {
+			for (int k=0; k<CHUNK; k++) CHECK(p[i].buf[j][k]==(uint8_t)(i*REQUESTS+j+k));
+		}
+	}
+	CHECK(lfs_unmount(&lfs)==0);
+	return 0;
+}
+
+static const struct {
+	const char *name;
+	int (*run)(void);
+} checks[] = {
+	{"reserve_inline", check_reserve_inline},
+	{"reserve_interleaved", check_reserve_interleaved},
+	{"checkpoint_gc", check_checkpoint_gc},
+	{"checkpoint_mount", check_checkpoint_mount},
+	{"checkpoint_fallback", check_checkpoint_fallback},
+	{"checkpoint_removed", check_checkpoint_removed},
+	{"rename_batch_split", check_rename_batch_split},
+	{"rename_batch_move", check_rename_batch_move},
+	{"rename_batch_overflow", check_rename_batch_overflow},
+	{"remove_recursive_open", check_remove_recursive_open},
+	{"logappend", check_logappend},
+	{"async_threads", check_async_threads},
+};
+
+int main(void)
+{
+	int failed=0;
+
+	for (size_t i=0; i<sizeof(checks)/sizeof(checks[0]); i++) {
+		int err=checks[i].run();
+		printf("%-24s %s\n",checks[i].name,err ? "FAIL" : "ok");
+		if (err) failed++;
+	}
+	return failed;
+}
@@ -0,0 +1,745 @@
+/*
+ * lfsreplay.c
+ *
+ * Replays the stmlfs_ calls recorded with stmlfs_record (FS_RECORD in W25Qxx.h) against littlefs
+ * on an emulated W25Q and reports the simulated flash time, bytes read and programmed, erases and
+ * metadata compactions per call type. Run it with different settings to see what they do to the
+ * recorded workload:
+ *
+ *   gcc -O2 -I../Core/Inc -o lfsreplay lfsreplay.c ../Core/Src/lfs.c ../Core/Src/lfs_lathist.c
+ *   ./lfsreplay uart.log
+ *   ./lfsreplay -c 4096 -l 128 -y 500 uart.log
+ *
+ * With -w it also reports the wear the workload causes: erases per block, bytes programmed against
+ * bytes written, the split between metadata and file data and the relocations block_cycles forced.
+ * -Y replays the capture once for each block_cycles in a list and compares them:
+ *
+ *   ./lfsreplay -w uart.log
+ *   ./lfsreplay -Y 50,100,200,500,1000,-1 uart.log
+ *
+ * Only flash time is counted, CPU time and the port's scheduler, read-ahead and pre-erase are not
+ * modelled, so compare runs against each other rather than against the target.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "lfs.h"
+#include "lfs_lathist.h"
+
+#define SECTOR_SIZE		4096
+#define PAGE_SIZE		256
+#define MAX_VOLUMES		8
+#define MAX_LINE		4096
+#define MAX_SWEEP		16
+
+struct opts {
+	lfs_size_t block_size;											// 0 keeps what was recorded
+	lfs_size_t cache_size;
+	lfs_size_t lookahead_size;
+	int32_t block_cycles;
+	double spi_mhz;
+	double prog_us;													// Page program time
+	double erase_ms;												// Sector erase time
+	uint32_t endurance;												// Erase cycles of a sector
+	int verbose;
+	int wear;
+};
+
+struct opstat {
+	const char *name;
+	uint32_t calls;
+	uint64_t ns;
+	uint64_t max_ns;
+	struct lfs_lathist lat;											// In us, for the percentiles
+	uint64_t read_bytes;
+	uint64_t prog_bytes;
+	uint32_t erases;
+	uint32_t compactions;
+};
+
+struct handle {														// Open file or directory by its address on the target
+	unsigned long id;
+	int vol;
+	int dir;
+	union {
+		lfs_file_t file;
+		lfs_dir_t dir;
+	} u;
+	struct handle *next;
+};
+
+struct volume {
+	bool used;
+	bool mounted;
+	lfs_t lfs;
+	struct lfs_config cfg;
+	uint8_t *mem;
+	uint32_t *erase_count;
+	char **batch_old, **batch_new;									// rename_batch pairs until the last one
+	lfs_size_t batch_count;
+	uint64_t write_bytes;											// Of the replayed calls, setup left out
+	uint64_t prog_bytes;
+	uint32_t erases;												// littlefs blocks
+	struct lfs_fsstats fs;											// Summed over every mount
+};
+
+struct wear {														// Erases per block of a volume
+	uint32_t most;
+	lfs_block_t most_block;
+	uint64_t total;
+	lfs_block_t never;
+	double mean;
+};
+
+static struct opts opt = {0, 1024, 32, 100, 12.5, 400, 45, 100000, 0, 0};
+static struct volume vols[MAX_VOLUMES];
+static struct handle *handles;
+static uint64_t now_ns, read_bytes, prog_bytes, erases;
+static uint32_t overwrites, mismatches, skipped;
+static unsigned long lineno;
+
+static struct opstat stats[] = {
+	{.name="mount"}, {.name="unmount"}, {.name="open"}, {.name="close"}, {.name="read"}, {.name="write"}, {.name="sync"}, {.name="seek"},
+	{.name="truncate"}, {.name="reserve"}, {.name="remove"}, {.name="rmtree"}, {.name="rename"}, {.name="rbatch"}, {.name="mkdir"}, {.name="stat"},
+	{.name="getattr"}, {.name="setattr"}, {.name="removeattr"}, {.name="dopen"}, {.name="dread"}, {.name="dclose"}, {.name="gc"}, {.name="checkpoint"},
+	{.name="have"}, {.name="havedir"},
+};
+#define NSTATS	(sizeof(stats)/sizeof(stats[0]))
+
+
+// Software CRC, the target has the same one in W25Qxx.c
+uint32_t lfs_crc(uint32_t crc, const void* buffer, size_t size) {
+    static const uint32_t rtable[16] = {
+        0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac, 0x76dc4190, 0x6b6b51f4,
+        0x4db26158, 0x5005713c, 0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c,
+        0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c,
+    };
+
+    const uint8_t* data = buffer;
+
+    for (size_t i = 0; i < size; i++) {
+        crc = (crc >> 4) ^ rtable[(crc ^ (data[i] >> 0)) & 0xf];
+        crc = (crc >> 4) ^ rtable[(crc ^ (data[i] >> 4)) & 0xf];
+    }
+
+    return crc;
+}
+
+//-------------------------------------------------------------------------------------------------
+// Emulated W25Q, one RAM image per volume. Every call is a command plus 3 address bytes on the
+// SPI bus, programs are split in pages and wait for the page program, erases for each sector.
+//-------------------------------------------------------------------------------------------------
+static uint64_t spi_ns(lfs_size_t bytes)
+{
+	return (uint64_t)((4+bytes)*8*1000/opt.spi_mhz);
+}
+
+static int bd_read(const struct lfs_config *c, lfs_block_t block, lfs_off_t off, void *buffer, lfs_size_t size)
+{
+	struct volume *v=c->context;
+
+	memcpy(buffer,v->mem+(size_t)block*c->block_size+off,size);
+	now_ns+=spi_ns(size);
+	read_bytes+=size;
+	return LFS_ERR_OK;
+}
+
+static int bd_readspan(const struct lfs_config *c, lfs_block_t block, lfs_off_t off, void *buffer, lfs_size_t size)
+{
+	return bd_read(c,block,off,buffer,size);						// The address just keeps counting
+}
+
+static int bd_prog(const struct lfs_config *c, lfs_block_t block, lfs_off_t off, const void *buffer, lfs_size_t size)
+{
+	struct volume *v=c->context;
+	uint8_t *mem=v->mem+(size_t)block*c->block_size+off;
+	const uint8_t *data=buffer;
+
+	for (lfs_size_t i=0; i<size; i++) {
+		if (mem[i]!=0xFF) overwrites++;								// NOR only clears bits
+		mem[i]&=data[i];
+	}
+	for (lfs_size_t n=0; n<size;) {
+		lfs_size_t len=PAGE_SIZE-(off+n)%PAGE_SIZE;
+		if (len>size-n) len=size-n;
+		now_ns+=spi_ns(len)+(uint64_t)(opt.prog_us*1000);
+		n+=len;
+	}
+	prog_bytes+=size;
+	v->prog_bytes+=size;
+	return LFS_ERR_OK;
+}
+
+static int bd_erase(const struct lfs_config *c, lfs_block_t block)
+{
+	struct volume *v=c->context;
+
+	memset(v->mem+(size_t)block*c->block_size,0xFF,c->block_size);
+	v->erase_count[block]++;
+	v->erases++;
+	for (lfs_size_t n=0; n<c->block_size; n+=SECTOR_SIZE) {
+		now_ns+=spi_ns(0)+(uint64_t)(opt.erase_ms*1000000);
+		erases++;
+	}
+	return LFS_ERR_OK;
+}
+
+static int bd_sync(const struct lfs_config *c)
+{
+	(void)c;
+	return LFS_ERR_OK;
+}
+
+static struct volume *volume_open(int vol, lfs_size_t block_size, lfs_size_t block_count)
+{
+	struct volume *v=&vols[vol];
+
+	if (v->used) return v;
+	if (opt.block_size) {											// Same capacity in other blocks
+		block_count=(lfs_size_t)((uint64_t)block_size*block_count/opt.block_size);
+		block_size=opt.block_size;
+	}
+	v->used=true;
+	v->cfg=(struct lfs_config){
+		.context = v,
+		.read = bd_read,
+		.prog = bd_prog,
+		.erase = bd_erase,
+		.sync = bd_sync,
+		.read_span = bd_readspan,
+		.read_size = PAGE_SIZE,
+		.prog_size = PAGE_SIZE,
+		.block_size = block_size,
+		.block_count = block_count,
+		.cache_size = opt.cache_size,
+		.lookahead_size = opt.lookahead_size,
+		.block_cycles = opt.block_cycles,
+	};
+	v->mem=malloc((size_t)block_size*block_count);
+	v->erase_count=calloc(block_count,sizeof(uint32_t));
+	if (!v->mem || !v->erase_count) {
+		fprintf(stderr,"out of memory for volume %d\n",vol);
+		exit(1);
+	}
+	memset(v->mem,0xFF,(size_t)block_size*block_count);
+	lfs_format(&v->lfs,&v->cfg);									// The recorded volume held something, start from empty
+	return v;
+}
+
+//-------------------------------------------------------------------------------------------------
+// Record lines
+//-------------------------------------------------------------------------------------------------
+static char *unescape(char *path)									// %xx back to the character, in place
+{
+	char *out=path;
+
+	for (char *in=path; *in; in++) {
+		if (in[0]=='%' && in[1] && in[2]) {
+			char hex[3]={in[1],in[2],0};
+			*out++=(char)strtoul(hex,NULL,16);
+			in+=2;
+		} else {
+			*out++=*in;
+		}
+	}
+	*out=0;
+	return path;
+}
+
+static struct handle *handle_find(unsigned long id, int vol)
+{
+	for (struct handle *h=handles; h; h=h->next) {
+		if (h->id==id && h->vol==vol) return h;
+	}
+	return NULL;
+}
+
+static struct handle *handle_new(unsigned long id, int vol, int dir)
+{
+	struct handle *h=calloc(1,sizeof(*h));
+	h->id=id;
+	h->vol=vol;
+	h->dir=dir;
+	h->next=handles;
+	handles=h;
+	return h;
+}
+
+static void handle_free(struct handle *h)
+{
+	for (struct handle **p=&handles; *p; p=&(*p)->next) {
+		if (*p==h) {
+			*p=h->next;
+			free(h);
+			return;
+		}
+	}
+}
+
+static void check(const char *ret, long res, const char *line)		// Same result as on the target
+{
+	if (strcmp(ret,"-")==0 || strtol(ret,NULL,10)==res) return;
+	mismatches++;
+	if (opt.verbose) fprintf(stderr,"line %lu: got %ld: %s",lineno,res,line);
+}
+
+static uint8_t *buffer_get(lfs_size_t size)
+{
+	static uint8_t *buf;
+	static lfs_size_t len;
+
+	if (size>len) {
+		buf=realloc(buf,size);
+		for (lfs_size_t i=len; i<size; i++) buf[i]=(uint8_t)(i*7+1);
+		len=size;
+	}
+	return buf;
+}
+
+static void replay(char *line)
+{
+	char copy[MAX_LINE];
+	char *tok[64];
+	int n=0;
+
+	strcpy(copy,line);
+	for (char *t=strtok(line," \r\n"); t && n<64; t=strtok(NULL," \r\n")) tok[n++]=t;
+	if (n<4 || strcmp(tok[0],"R")!=0) return;
+
+	int vol=atoi(tok[2]);
+	const char *op=tok[3];
+	char **a=tok+4;													// Arguments after the op
+	int na=n-4;
+	if (vol<0 || vol>=MAX_VOLUMES) {
+		skipped++;
+		return;
+	}
+
+	struct opstat *st=NULL;
+	for (size_t i=0; i<NSTATS; i++) {
+		if (strcmp(stats[i].name,op)==0) st=&stats[i];
+	}
+	if (!st) {
+		skipped++;
+		return;
+	}
+
+	struct volume *v=&vols[vol];
+	if (strcmp(op,"mount")==0 && na>=4) {
+		v=volume_open(vol,strtoul(a[1],NULL,10),strtoul(a[2],NULL,10));
+	} else if (!v->used) {											// Recording started after the mount
+		v=volume_open(vol,SECTOR_SIZE,2048);
+	}
+	if (!v->mounted && strcmp(op,"mount")!=0) {
+		if (lfs_mount(&v->lfs,&v->cfg)) {
+			fprintf(stderr,"volume %d does not mount\n",vol);
+			exit(1);
+		}
+		v->mounted=true;
+	}
+
+	uint64_t start=now_ns, rd=read_bytes, pr=prog_bytes, er=erases;
+	uint64_t vpr=v->prog_bytes, ver=v->erases;
+	struct lfs_fsstats before={0};									// lfs_mount starts the counts again
+	if (strcmp(op,"mount")!=0) before=v->lfs.stats;
+	struct handle *h=NULL;
+	if (na>=1 && strcmp(op,"open")!=0 && strcmp(op,"dopen")!=0) {
+		h=handle_find(strtoul(a[0],NULL,16),vol);
+	}
+	bool file_op=strcmp(op,"close")==0 || strcmp(op,"read")==0 || strcmp(op,"write")==0 || strcmp(op,"sync")==0 ||
+			strcmp(op,"seek")==0 || strcmp(op,"truncate")==0 || strcmp(op,"reserve")==0;
+	bool dir_op=strcmp(op,"dread")==0 || strcmp(op,"dclose")==0;
+	if ((file_op || dir_op) && (!h || h->dir!=dir_op)) {			// Opened before the recording or failed here
+		skipped++;
+		return;
+	}
+
+	if (strcmp(op,"mount")==0 && na>=4) {
+		if (v->mounted) lfs_unmount(&v->lfs);
+		if (atoi(a[0])) lfs_format(&v->lfs,&v->cfg);
+		int err=lfs_mount(&v->lfs,&v->cfg);
+		v->mounted=(err==0);
+		check(a[3],err,copy);
+	} else if (strcmp(op,"unmount")==0 && na>=1) {
+		int err=lfs_fs_checkpoint(&v->lfs);
+		int uerr=lfs_unmount(&v->lfs);
+		check(a[0],err ? err : uerr,copy);
+		v->mounted=false;
+	} else if (strcmp(op,"open")==0 && na>=4) {
+		h=handle_new(strtoul(a[0],NULL,16),vol,0);
+		int err=lfs_file_open(&v->lfs,&h->u.file,unescape(a[3]),(int)strtoul(a[1],NULL,16));
+		check(a[2],err,copy);
+		if (err==0 && atoi(a[2])<0) lfs_file_close(&v->lfs,&h->u.file);	// Keep the handles as on the target
+		if (err || atoi(a[2])<0) handle_free(h);
+	} else if (strcmp(op,"close")==0 && na>=2) {
+		check(a[1],lfs_file_close(&v->lfs,&h->u.file),copy);
+		handle_free(h);
+	} else if (strcmp(op,"read")==0 && na>=3) {
+		lfs_size_t size=strtoul(a[1],NULL,10);
+		check(a[2],lfs_file_read(&v->lfs,&h->u.file,buffer_get(size),size),copy);
+	} else if (strcmp(op,"write")==0 && na>=3) {
+		lfs_size_t size=strtoul(a[1],NULL,10);
+		lfs_ssize_t res=lfs_file_write(&v->lfs,&h->u.file,buffer_get(size),size);
+		if (res>0) v->write_bytes+=res;
+		check(a[2],res,copy);
+	} else if (strcmp(op,"sync")==0 && na>=2) {
+		check(a[1],lfs_file_sync(&v->lfs,&h->u.file),copy);
+	} else if (strcmp(op,"seek")==0 && na>=4) {
+		check(a[3],lfs_file_seek(&v->lfs,&h->u.file,strtol(a[1],NULL,10),atoi(a[2])),copy);
+	} else if (strcmp(op,"truncate")==0 && na>=3) {
+		check(a[2],lfs_file_truncate(&v->lfs,&h->u.file,strtoul(a[1],NULL,10)),copy);
+	} else if (strcmp(op,"reserve")==0 && na>=3) {
+		check(a[2],lfs_file_reserve(&v->lfs,&h->u.file,strtoul(a[1],NULL,10)),copy);
+	} else if (strcmp(op,"remove")==0 && na>=2) {
+		check(a[0],lfs_remove(&v->lfs,unescape(a[1])),copy);
+	} else if (strcmp(op,"rmtree")==0 && na>=2) {
+		check(a[0],lfs_remove_recursive(&v->lfs,unescape(a[1])),copy);
+	} else if (strcmp(op,"rename")==0 && na>=3) {
+		check(a[0],lfs_rename(&v->lfs,unescape(a[1]),unescape(a[2])),copy);
+	} else if (strcmp(op,"rbatch")==0 && na>=5) {
+		lfs_size_t i=strtoul(a[0],NULL,10), count=strtoul(a[1],NULL,10);
+		if (i==0) {
+			v->batch_old=realloc(v->batch_old,count*sizeof(char*));
+			v->batch_new=realloc(v->batch_new,count*sizeof(char*));
+			v->batch_count=0;
+		}
+		if (i!=v->batch_count || i>=count) {
+			skipped++;
+			return;
+		}
+		v->batch_old[i]=strdup(unescape(a[3]));
+		v->batch_new[i]=strdup(unescape(a[4]));
+		v->batch_count++;
+		if (i+1<count) return;										// Counted once with the last pair
+		check(a[2],lfs_rename_batch(&v->lfs,(const char* const*)v->batch_old,(const char* const*)v->batch_new,count),copy);
+		for (i=0; i<count; i++) {
+			free(v->batch_old[i]);
+			free(v->batch_new[i]);
+		}
+		v->batch_count=0;
+	} else if (strcmp(op,"mkdir")==0 && na>=2) {
+		check(a[0],lfs_mkdir(&v->lfs,unescape(a[1])),copy);
+	} else if (strcmp(op,"havedir")==0 && na>=2) {
+		lfs_mkdir(&v->lfs,unescape(a[1]));
+	} else if (strcmp(op,"have")==0 && na>=3) {					// Files already on the target when it mounted
+		lfs_file_t file;
+		lfs_size_t size=strtoul(a[0],NULL,10);
+		if (lfs_file_open(&v->lfs,&file,unescape(a[2]),LFS_O_WRONLY|LFS_O_CREAT|LFS_O_TRUNC)==0) {
+			for (lfs_size_t n=0; n<size; n+=SECTOR_SIZE) {
+				lfs_size_t len=size-n<SECTOR_SIZE ? size-n : SECTOR_SIZE;
+				lfs_file_write(&v->lfs,&file,buffer_get(len),len);
+			}
+			lfs_file_close(&v->lfs,&file);
+		}
+	} else if (strcmp(op,"stat")==0 && na>=2) {
+		struct lfs_info info;
+		check(a[0],lfs_stat(&v->lfs,unescape(a[1]),&info),copy);
+	} else if (strcmp(op,"getattr")==0 && na>=4) {
+		lfs_size_t size=strtoul(a[1],NULL,10);
+		check(a[2],lfs_getattr(&v->lfs,unescape(a[3]),(uint8_t)atoi(a[0]),buffer_get(size),size),copy);
+	} else if (strcmp(op,"setattr")==0 && na>=4) {
+		lfs_size_t size=strtoul(a[1],NULL,10);
+		check(a[2],lfs_setattr(&v->lfs,unescape(a[3]),(uint8_t)atoi(a[0]),buffer_get(size),size),copy);
+	} else if (strcmp(op,"removeattr")==0 && na>=3) {
+		check(a[1],lfs_removeattr(&v->lfs,unescape(a[2]),(uint8_t)atoi(a[0])),copy);
+	} else if (strcmp(op,"dopen")==0 && na>=3) {
+		h=handle_new(strtoul(a[0],NULL,16),vol,1);
+		int err=lfs_dir_open(&v->lfs,&h->u.dir,unescape(a[2]));
+		check(a[1],err,copy);
+		if (err==0 && atoi(a[1])<0) lfs_dir_close(&v->lfs,&h->u.dir);
+		if (err || atoi(a[1])<0) handle_free(h);
+	} else if (strcmp(op,"dread")==0 && na>=2) {
+		struct lfs_info info;
+		check(a[1],lfs_dir_read(&v->lfs,&h->u.dir,&info),copy);
+	} else if (strcmp(op,"dclose")==0 && na>=2) {
+		check(a[1],lfs_dir_close(&v->lfs,&h->u.dir),copy);
+		handle_free(h);
+	} else if (strcmp(op,"gc")==0 && na>=1) {
+		check(a[0],lfs_fs_gcstep(&v->lfs),copy);
+	} else if (strcmp(op,"checkpoint")==0 && na>=1) {
+		check(a[0],lfs_fs_checkpoint(&v->lfs),copy);
+	} else {
+		skipped++;
+		return;
+	}
+
+	uint64_t ns=now_ns-start;
+	st->calls++;
+	st->ns+=ns;
+	if (ns>st->max_ns) st->max_ns=ns;
+	lfs_lathist_add(&st->lat,(uint32_t)(ns/1000),1);
+	st->read_bytes+=read_bytes-rd;
+	st->prog_bytes+=prog_bytes-pr;
+	st->erases+=(uint32_t)(erases-er);
+	st->compactions+=v->lfs.stats.compactions-before.compactions;
+	if (strncmp(op,"have",4)==0) {									// Wear of the workload, not of setting up what was there
+		v->prog_bytes=vpr;
+		v->erases=(uint32_t)ver;
+		return;
+	}
+	uint32_t *sum=(uint32_t*)&v->fs;
+	const uint32_t *now=(const uint32_t*)&v->lfs.stats, *was=(const uint32_t*)&before;
+	for (size_t i=0; i<sizeof(v->fs)/sizeof(uint32_t); i++) sum[i]+=now[i]-was[i];
+}
+
+//-------------------------------------------------------------------------------------------------
+// Wear analysis
+//-------------------------------------------------------------------------------------------------
+static struct wear wear_get(const struct volume *v)
+{
+	struct wear w={0};
+
+	for (lfs_block_t b=0; b<v->cfg.block_count; b++) {
+		if (v->erase_count[b]>w.most) {
+			w.most=v->erase_count[b];
+			w.most_block=b;
+		}
+		if (v->erase_count[b]==0) w.never++;
+		w.total+=v->erase_count[b];
+	}
+	w.mean=(double)w.total/v->cfg.block_count;
+	return w;
+}
+
+static double wear_runs(const struct wear *w)						// Runs of the workload until the most erased block wears out
+{
+	return w->most ? (double)opt.endurance/w->most : 0;
+}
+
+static void wear_report(const struct volume *v, int vol)
+{
+	struct wear w=wear_get(v);
+	const struct lfs_fsstats *fs=&v->fs;
+	uint64_t prog=v->prog_bytes ? v->prog_bytes : 1;
+	uint32_t erases=v->erases ? v->erases : 1;
+
+	printf("\nvolume %d wear:\n",vol);
+	printf("  written %llu bytes, programmed %llu bytes, %.2f bytes programmed per byte written\n",
+			(unsigned long long)v->write_bytes,(unsigned long long)v->prog_bytes,
+			v->write_bytes ? (double)v->prog_bytes/v->write_bytes : 0.0);
+	printf("  metadata  %10lu bytes programmed %5.1f%%, %7lu block erases %5.1f%%\n",(unsigned long)fs->meta_prog_bytes,
+			100.0*fs->meta_prog_bytes/prog,(unsigned long)fs->meta_erases,100.0*fs->meta_erases/erases);
+	printf("  file data %10llu bytes programmed %5.1f%%, %7lu block erases %5.1f%%\n",
+			(unsigned long long)(v->prog_bytes-fs->meta_prog_bytes),100.0*(v->prog_bytes-fs->meta_prog_bytes)/prog,
+			(unsigned long)(v->erases-fs->meta_erases),100.0*(v->erases-fs->meta_erases)/erases);
+	printf("  %lu commits, %lu compactions, %lu relocations, %lu of them forced by block_cycles %ld\n",
+			(unsigned long)fs->commits,(unsigned long)fs->compactions,(unsigned long)fs->relocations,
+			(unsigned long)fs->wear_relocations,(long)v->cfg.block_cycles);
+	printf("  block erases: mean %.2f, max %lu on block %lu, %.1f times the mean, %lu of %lu blocks never erased\n",
+			w.mean,(unsigned long)w.most,(unsigned long)w.most_block,w.mean>0 ? w.most/w.mean : 0.0,
+			(unsigned long)w.never,(unsigned long)v->cfg.block_count);
+
+	uint32_t buckets[33]={0}, peak=0;								// Blocks by erase count, powers of two
+	int top=0;
+	for (lfs_block_t b=0; b<v->cfg.block_count; b++) {
+		int n=0;
+		while (n<32 && (1u<<n)<=v->erase_count[b]) n++;
+		buckets[n]++;
+		if (n>top) top=n;
+	}
+	for (int n=0; n<=top; n++) if (buckets[n]>peak) peak=buckets[n];
+	printf("  %13s %7s\n","erases","blocks");
+	for (int n=0; n<=top; n++) {
+		char range[32];
+		if (n<2) snprintf(range,sizeof(range),"%d",n);
+		else snprintf(range,sizeof(range),"%lu-%lu",1ul<<(n-1),(1ul<<n)-1);
+		int bar=peak ? (int)((50ull*buckets[n]+peak-1)/peak) : 0;
+		printf("  %13s %7lu %.*s\n",range,(unsigned long)buckets[n],bar,"##################################################");
+	}
+
+	printf("  erased most:");
+	for (int i=0, last=-1; i<10; i++) {								// Ten most erased blocks, ties in block order
+		int best=-1;
+		for (lfs_block_t b=0; b<v->cfg.block_count; b++) {
+			if (v->erase_count[b]==0) continue;
+			if (last>=0 && (v->erase_count[b]>v->erase_count[last] || (v->erase_count[b]==v->erase_count[last] && (int)b<=last))) continue;
+			if (best<0 || v->erase_count[b]>v->erase_count[best]) best=(int)b;
+		}
+		if (best<0) break;
+		printf(" %d%s (%lu)",best,best<2 ? " superblock" : "",(unsigned long)v->erase_count[best]);
+		last=best;
+	}
+	printf("\n");
+	if (w.most) {
+		printf("  at %lu cycles per sector the most erased block wears out after %.0f runs of this workload, %.0f with perfect levelling\n",
+				(unsigned long)opt.endurance,wear_runs(&w),(double)opt.endurance*v->cfg.block_count/w.total);
+	}
+}
+
+//-------------------------------------------------------------------------------------------------
+// One replay of the capture, from empty volumes
+//-------------------------------------------------------------------------------------------------
+static void reset(void)
+{
+	for (int i=0; i<MAX_VOLUMES; i++) {
+		free(vols[i].mem);
+		free(vols[i].erase_count);
+		free(vols[i].batch_old);
+		free(vols[i].batch_new);
+	}
+	memset(vols,0,sizeof(vols));
+	while (handles) handle_free(handles);
+	for (size_t i=0; i<NSTATS; i++) stats[i]=(struct opstat){.name=stats[i].name};
+	now_ns=read_bytes=prog_bytes=erases=0;
+	overwrites=mismatches=skipped=0;
+	lineno=0;
+}
+
+static void run(const char *path, unsigned long *first_ms, unsigned long *last_ms, unsigned long *calls)
+{
+	FILE *f=fopen(path,"r");
+	if (!f) {
+		perror(path);
+		exit(1);
+	}
+	char line[MAX_LINE];
+	reset();
+	*first_ms=*last_ms=*calls=0;
+	while (fgets(line,sizeof(line),f)) {
+		lineno++;
+		if (strncmp(line,"R ",2)!=0) continue;						// Anything else the target printed
+		unsigned long ms=strtoul(line+2,NULL,10);
+		if ((*calls)++==0) *first_ms=ms;
+		*last_ms=ms;
+		replay(line);
+	}
+	fclose(f);
+}
+
+// The calls of the workload summed, setting up what was there left out
+static struct opstat stats_total(void)
+{
+	struct opstat total={.name="total"};
+
+	for (size_t i=0; i<NSTATS; i++) {
+		struct opstat *st=&stats[i];
+		if (strncmp(st->name,"have",4)==0) continue;
+		total.calls+=st->calls;
+		total.ns+=st->ns;
+		if (st->max_ns>total.max_ns) total.max_ns=st->max_ns;
+		total.read_bytes+=st->read_bytes;
+		total.prog_bytes+=st->prog_bytes;
+		total.erases+=st->erases;
+		total.compactions+=st->compactions;
+	}
+	return total;
+}
+
+//-------------------------------------------------------------------------------------------------
+// Replay once for each block_cycles, a row per value summed over the volumes
+//-------------------------------------------------------------------------------------------------
+static void sweep(const char *path, const int32_t *cycles, int count)
+{
+	unsigned long first_ms, last_ms, calls;
+
+	printf("%12s %11s %10s %7s %9s %11s %10s %9s %12s\n","block_cycles","flash ms","prog KB","erases","compacts",
+			"relocations","max erases","max/mean","runs to wear");
+	for (int i=0; i<count; i++) {
+		opt.block_cycles=cycles[i];
+		run(path,&first_ms,&last_ms,&calls);
+
+		struct opstat total=stats_total();								// The same totals as the table without -Y
+		uint32_t relocations=0, most=0;
+		double runs=0, ratio=0;
+		for (int n=0; n<MAX_VOLUMES; n++) {
+			if (!vols[n].used) continue;
+			struct wear w=wear_get(&vols[n]);
+			relocations+=vols[n].fs.wear_relocations;
+			if (w.most>most || runs==0) {							// The volume that wears out first
+				most=w.most;
+				runs=wear_runs(&w);
+				ratio=w.mean>0 ? w.most/w.mean : 0;
+			}
+		}
+		printf("%12ld %11.1f %10.1f %7lu %9lu %11lu %10lu %9.1f %12.0f\n",(long)cycles[i],total.ns/1e6,
+				total.prog_bytes/1024.0,(unsigned long)total.erases,(unsigned long)total.compactions,(unsigned long)relocations,
+				(unsigned long)most,ratio,runs);
+	}
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr,"usage: %s [options] capture.log\n"
+			"  -b bytes   littlefs block size, a multiple of %d (default as recorded)\n"
+			"  -c bytes   cache_size (default %lu)\n"
+			"  -l bytes   lookahead_size (default %lu)\n"
+			"  -y cycles  block_cycles, -1 disables wear levelling (default %ld)\n"
+			"  -s MHz     SPI clock (default %.1f)\n"
+			"  -p us      page program time (default %.0f)\n"
+			"  -e ms      sector erase time (default %.0f)\n"
+			"  -v         print the calls whose result differs from the target\n"
+			"  -w         report erases per block, write amplification and the metadata and data split\n"
+			"  -Y list    replay once per block_cycles in a comma separated list and compare the wear\n"
+			"  -E cycles  erase endurance of a sector (default %lu)\n",
+			name,SECTOR_SIZE,(unsigned long)opt.cache_size,(unsigned long)opt.lookahead_size,(long)opt.block_cycles,
+			opt.spi_mhz,opt.prog_us,opt.erase_ms,(unsigned long)opt.endurance);
+	exit(2);
+}
+
+int main(int argc, char *argv[])
+{
+	int32_t cycles[MAX_SWEEP];
+	int ncycles=0;
+	int c;
+
+	while ((c=getopt(argc,argv,"b:c:l:y:s:p:e:vwY:E:"))!=-1) {
+		switch (c) {
+		case 'b': opt.block_size=strtoul(optarg,NULL,0); break;
+		case 'c': opt.cache_size=strtoul(optarg,NULL,0); break;
+		case 'l': opt.lookahead_size=strtoul(optarg,NULL,0); break;
+		case 'y': opt.block_cycles=strtol(optarg,NULL,0); break;
+		case 's': opt.spi_mhz=atof(optarg); break;
+		case 'p': opt.prog_us=atof(optarg); break;
+		case 'e': opt.erase_ms=atof(optarg); break;
+		case 'v': opt.verbose=1; break;
+		case 'w': opt.wear=1; break;
+		case 'Y':
+			for (char *t=strtok(optarg,","); t && ncycles<MAX_SWEEP; t=strtok(NULL,",")) cycles[ncycles++]=strtol(t,NULL,0);
+			break;
+		case 'E': opt.endurance=strtoul(optarg,NULL,0); break;
+		default: usage(argv[0]);
+		}
+	}
+	if (optind!=argc-1 || (opt.block_size%SECTOR_SIZE) || opt.spi_mhz<=0) usage(argv[0]);
+	for (int i=0; i<ncycles; i++) {
+		if (cycles[i]==0) usage(argv[0]);							// littlefs no longer takes 0
+	}
+	if (ncycles) {
+		sweep(argv[optind],cycles,ncycles);
+		return 0;
+	}
+
+	unsigned long first_ms, last_ms, calls;
+	run(argv[optind],&first_ms,&last_ms,&calls);
+
+	printf("%lu calls over %.1f s on the target\n",calls,(last_ms-first_ms)/1000.0);
+	for (int i=0; i<MAX_VOLUMES; i++) {
+		if (!vols[i].used) continue;
+		uint32_t most=0;
+		for (lfs_block_t b=0; b<vols[i].cfg.block_count; b++) {
+			if (vols[i].erase_count[b]>most) most=vols[i].erase_count[b];
+		}
+		printf("volume %d: block_size %lu block_count %lu cache_size %lu lookahead_size %lu block_cycles %ld, most erased block %lu times\n",
+				i,(unsigned long)vols[i].cfg.block_size,(unsigned long)vols[i].cfg.block_count,(unsigned long)vols[i].cfg.cache_size,
+				(unsigned long)vols[i].cfg.lookahead_size,(long)vols[i].cfg.block_cycles,(unsigned long)most);
+	}
+	printf("\n%-10s %8s %11s %9s %9s %9s %10s %10s %7s %8s\n","call","count","flash ms","p50 ms","p99 ms","max ms","read KB","prog KB",
+			"erases","compacts");
+	for (size_t i=0; i<NSTATS; i++) {
+		struct opstat *st=&stats[i];
+		if (!st->calls) continue;
+		printf("%-10s %8lu %11.1f %9.2f %9.2f %9.2f %10.1f %10.1f %7lu %8lu\n",st->name,(unsigned long)st->calls,st->ns/1e6,
+				lfs_lathist_pct(&st->lat,500,1)/1e3,lfs_lathist_pct(&st->lat,990,1)/1e3,st->max_ns/1e6,st->read_bytes/1024.0,
+				st->prog_bytes/1024.0,(unsigned long)st->erases,(unsigned long)st->compactions);
+	}
+	struct opstat total=stats_total();									// Setting up what was there is not part of the workload
+	printf("%-10s %8lu %11.1f %9s %9s %9.2f %10.1f %10.1f %7lu %8lu\n",total.name,(unsigned long)total.calls,total.ns/1e6,"-","-",total.max_ns/1e6,
+			total.read_bytes/1024.0,total.prog_bytes/1024.0,(unsigned long)total.erases,(unsigned long)total.compactions);
+	printf("\n%lu results differ from the target, %lu lines skipped, %lu bytes programmed over unerased flash\n",
+			(unsigned long)mismatches,(unsigned long)skipped,(unsigned long)overwrites);
+	for (int i=0; i<MAX_VOLUMES && opt.wear; i++) {
+		if (vols[i].used) wear_report(&vols[i],i);
+	}
+	return overwrites ? 1 : 0;
+}
@@ -0,0 +1,142 @@
+#!/usr/bin/env python3
+#
+# lfstrace.py
+#
+# Decodes the block device trace of W25Qxx.c (FS_TRACE), either the UART output of
+# stmlfs_trace_dump or a binary save of stmlfs_tracebuf made with the debugger, and prints
+# a latency histogram per operation and a heatmap of the blocks each volume touched.
+#
+#   python3 lfstrace.py uart.log
+#   python3 lfstrace.py --bin tracebuf.bin --blocks 2048 --csv trace.csv
+#
+import argparse
+import struct
+import sys
+
+MAGIC = 0x5453464C              # "LFST"
+HEADER = struct.Struct('<IHHIII')
+RECORD = struct.Struct('<IIIIHBB')
+OPS = ('read', 'prog', 'erase', 'sync')
+SHADES = ' .:-=+*#%@'
+
+
+class Record:
+    def __init__(self, raw):
+        self.start, self.end, self.off, self.size, self.block, op, self.vol = RECORD.unpack(raw)
+        self.op = OPS[op] if op < len(OPS) else 'op%d' % op
+        self.cycles = (self.end - self.start) & 0xFFFFFFFF      # CYCCNT wraps every few seconds
+
+
+def parse_uart(lines):
+    clock_hz, head, recs = None, 0, []
+    for line in lines:
+        words = line.split()
+        if not words:
+            continue
+        if words[0] == 'LFSTRACE' and words[1] != 'END':
+            version, rec_size, head, count, clock_hz = map(int, words[1:6])
+            if version != 1 or rec_size != RECORD.size:
+                sys.exit('unsupported trace version %d record size %d' % (version, rec_size))
+            recs = []
+        elif words[0] == 'T' and clock_hz is not None:
+            recs.append(Record(bytes.fromhex(words[1])))
+    if clock_hz is None:
+        sys.exit('no LFSTRACE header found')
+    return clock_hz, head, recs
+
+
+def parse_bin(data):
+    magic, version, rec_size, entries, head, clock_hz = HEADER.unpack_from(data)
+    if magic != MAGIC or version != 1 or rec_size != RECORD.size:
+        sys.exit('not a version 1 stmlfs_tracebuf dump')
+    ring = [Record(data[HEADER.size + i*rec_size:HEADER.size + (i+1)*rec_size]) for i in range(entries)]
+    count = min(head, entries)
+    first = (head - count) % entries                            # Oldest record
+    return clock_hz, head, [ring[(first + i) % entries] for i in range(count)]
+
+
+def percentile(sorted_us, p):
+    return sorted_us[min(len(sorted_us) - 1, int(p * len(sorted_us)))]
+
+
+def histograms(recs, clock_hz):
+    cycles_us = clock_hz / 1e6
+    for op in OPS:
+        us = sorted(r.cycles / cycles_us for r in recs if r.op == op)
+        if not us:
+            continue
+        total = sum(r.size for r in recs if r.op == op)
+        print('%-5s %6d calls %9d bytes  p50 %8.1fus  p90 %8.1fus  p99 %8.1fus  max %8.1fus' % (
+            op, len(us), total, percentile(us, 0.5), percentile(us, 0.9), percentile(us, 0.99), us[-1]))
+        buckets = {}
+        for t in us:                                            # Powers of two of a microsecond
+            b = 0
+            while (1 << b) <= t:
+                b += 1
+            buckets[b] = buckets.get(b, 0) + 1
+        most = max(buckets.values())
+        for b in range(min(buckets), max(buckets) + 1):
+            n = buckets.get(b, 0)
+            lo = 0 if b == 0 else 1 << (b - 1)
+            print('  %7dus-%-7dus %6d %s' % (lo, 1 << b, n, '#' * ((50 * n + most - 1) // most)))
+        print()
+
+
+def heatmap(recs, blocks, width):
+    for vol in sorted(set(r.vol for r in recs)):
+        mine = [r for r in recs if r.vol == vol and r.op != 'sync']
+        count = blocks or max(r.block for r in mine) + 1
+        for op in ('read', 'prog', 'erase'):
+            hits = [0] * count
+            for r in mine:
+                if r.op != op:
+                    continue
+                for b in range(r.block, min(count, r.block + max(1, r.size_blocks))):
+                    hits[b] += 1
+            most = max(hits)
+            if most == 0:
+                continue
+            print('volume %d %s, blocks %d, "@" is %d calls' % (vol, op, count, most))
+            for row in range(0, count, width):
+                cells = hits[row:row + width]
+                print('  %5d %s' % (row, ''.join(SHADES[0 if n == 0 else 1 + (len(SHADES) - 2) * n // most] for n in cells)))
+            print()
+
+
+def main():
+    ap = argparse.ArgumentParser(description='Decode a W25Qxx.c block device trace')
+    ap.add_argument('file', help='UART capture holding the stmlfs_trace_dump output, or a binary dump with --bin')
+    ap.add_argument('--bin', action='store_true', help='file is a memory dump of stmlfs_tracebuf')
+    ap.add_argument('--block-size', type=int, default=4096, help='littlefs block size, spreads read_span records over blocks')
+    ap.add_argument('--blocks', type=int, default=0, help='blocks per volume in the heatmap, default the highest one seen')
+    ap.add_argument('--width', type=int, default=64, help='blocks per heatmap row')
+    ap.add_argument('--csv', help='also write the records to this file')
+    args = ap.parse_args()
+
+    if args.bin:
+        with open(args.file, 'rb') as f:
+            clock_hz, head, recs = parse_bin(f.read())
+    else:
+        with open(args.file, errors='replace') as f:
+            clock_hz, head, recs = parse_uart(f)
+
+    if not recs:
+        sys.exit('trace is empty')
+    for r in recs:                                              # A read_span covers several blocks
+        r.size_blocks = (r.off + r.size + args.block_size - 1) // args.block_size
+
+    print('%d records, %d lost to the ring, %.1fMHz, %.1fms traced\n' % (
+        len(recs), head - len(recs), clock_hz / 1e6, ((recs[-1].end - recs[0].start) & 0xFFFFFFFF) * 1e3 / clock_hz))
+    histograms(recs, clock_hz)
+    heatmap(recs, args.blocks, args.width)
+
+    if args.csv:
+        with open(args.csv, 'w') as f:
+            f.write('start,end,us,op,vol,block,off,size\n')
+            for r in recs:
+                f.write('%d,%d,%.2f,%s,%d,%d,%d,%d\n' % (r.start, r.end, r.cycles * 1e6 / clock_hz,
+                        r.op, r.vol, r.block, r.off, r.size))
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,374 @@
+/*
+ * w25qemu.c
+ *
+ * Emulates W25Q64 chips at the SPI level, so W25Qxx.c runs unchanged on Linux with host/main.h
+ * standing in for the CubeMX one. It implements the HAL calls the driver makes: chip select,
+ * SPI transmit and receive, receive by DMA for the read-ahead, the tick and the cycle counter.
+ *
+ * Time only passes on the SPI bus and while the CPU waits, every byte takes 8 SPI clocks and the
+ * chip is busy for the page program, sector erase and erase suspend times. Reads of the status
+ * register see BUSY, WEL and SUS as a real chip would. CPU time is not modelled.
+ *
+ * The emulator aborts on anything a real chip would silently get wrong: a program or erase
+ * without write enable or while busy, a read while programming or erasing, a second transfer on
+ * a port that still has a DMA transfer running.
+ */
+#include <stdlib.h>
+#include "main.h"
+#include "w25qemu.h"
+
+GPIO_TypeDef w25qemu_gpiod, w25qemu_gpioe;
+DWT_Type w25qemu_dwt;
+CoreDebug_Type w25qemu_coredebug;
+DMA_HandleTypeDef hdma_spi1_rx = {0}, hdma_spi2_rx = {1};
+SPI_HandleTypeDef hspi1 = {0, NULL, NULL}, hspi2 = {1, NULL, NULL};
+TIM_HandleTypeDef htim1;
+uint32_t SystemCoreClock = 480000000;
+
+struct chip {
+	uint8_t *mem;
+	uint32_t erases[W25QEMU_SIZE/W25QEMU_SECTOR];
+	bool cs;														// Selected
+	uint8_t cmd[4+256];												// Opcode, address and page program data
+	int ncmd;
+	uint32_t addr;													// Next byte a read returns
+	bool wel;														// Write enable latch
+	uint64_t busy_until;											// BUSY until then
+	bool erasing;													// BUSY is a sector erase
+	uint32_t erase_addr;
+	bool suspended;
+	uint64_t suspend_left;											// Erase time left when suspended
+	SPI_HandleTypeDef *dma;											// Port with a DMA transfer running
+	uint64_t dma_done;
+	struct w25qemu_stat stat;
+};
+
+static struct w25qemu_timing timing = {12.5, 400, 45, 20};
+static struct chip chips[W25QEMU_CHIPS];
+static uint64_t now_ns;
+static uint32_t primask;
+
+
+static void fail(const char *what, int chip)
+{
+	fprintf(stderr,"w25qemu: %s on chip %d at %.3f ms\n",what,chip,now_ns/1e6);
+	abort();
+}
+
+static uint64_t byte_ns(uint32_t bytes)
+{
+	return (uint64_t)(bytes*8*1000/timing.spi_mhz);
+}
+
+static void advance(uint64_t ns)
+{
+	now_ns+=ns;
+	w25qemu_dwt.CYCCNT=(uint32_t)(now_ns*(SystemCoreClock/1000000)/1000);
+}
+
+static void poll(void)												// Finish the DMA transfers that are done by now
+{
+	for (int i=0; i<W25QEMU_CHIPS; i++) {
+		SPI_HandleTypeDef *hspi=chips[i].dma;
+		if (hspi && now_ns>=chips[i].dma_done) {
+			chips[i].dma=NULL;
+			if (hspi->RxCpltCallback) hspi->RxCpltCallback(hspi);
+		}
+	}
+}
+
+static struct chip *chip_of(SPI_HandleTypeDef *hspi)
+{
+	if (!hspi || hspi->chip<0 || hspi->chip>=W25QEMU_CHIPS) {
+		fprintf(stderr,"w25qemu: unknown SPI port\n");
+		abort();
+	}
+	if (chips[hspi->chip].dma) fail("transfer during DMA",hspi->chip);
+	return &chips[hspi->chip];
+}
+
+void w25qemu_init(const struct w25qemu_timing *t)
+{
+	if (t) timing=*t;
+	now_ns=0;
+	for (int i=0; i<W25QEMU_CHIPS; i++) {
+		uint8_t *mem=chips[i].mem;
+		memset(&chips[i],0,sizeof(chips[i]));
+		chips[i].mem=mem ? mem : malloc(W25QEMU_SIZE);
+		if (!chips[i].mem) {
+			fprintf(stderr,"w25qemu: out of memory\n");
+			abort();
+		}
+		memset(chips[i].mem,0xFF,W25QEMU_SIZE);
+	}
+	advance(0);
+}
+
+uint64_t w25qemu_time_ns(void)
+{
+	return now_ns;
+}
+
+void w25qemu_cpu(uint64_t ns)										// The CPU is busy for ns, DMA carries on
+{
+	advance(ns);
+	poll();
+}
+
+void w25qemu_stat(int chip, struct w25qemu_stat *stat)
+{
+	*stat=chips[chip].stat;
+}
+
+uint32_t w25qemu_erases(int chip, uint32_t sector)
+{
+	return chips[chip].erases[sector];
+}
+
+uint8_t *w25qemu_mem(int chip)
+{
+	return chips[chip].mem;
+}
+
+//-------------------------------------------------------------------------------------------------
+// Commands that take effect when chip select goes high
+//-------------------------------------------------------------------------------------------------
+static void execute(struct chip *c, int n)
+{
+	uint32_t addr=((uint32_t)c->cmd[1]<<16)|((uint32_t)c->cmd[2]<<8)|c->cmd[3];
+	bool busy=now_ns<c->busy_until;
+
+	switch (c->cmd[0]) {
+	case 0x06:														// Write enable
+		c->wel=true;
+		break;
+	case 0x04:														// Write disable
+		c->wel=false;
+		break;
+	case 0x02:														// Page program
+		if (!c->wel) fail("program without write enable",n);
+		if (busy || c->suspended) fail("program while busy",n);
+		for (int i=4; i<c->ncmd; i++) {
+			uint32_t a=(addr&~0xFFu)|((addr+i-4)&0xFF);				// Wraps within the page
+			c->mem[a]&=c->cmd[i];									// NOR only clears bits
+		}
+		c->stat.prog_bytes+=c->ncmd-4;
+		c->stat.page_programs++;
+		c->busy_until=now_ns+(uint64_t)(timing.prog_us*1000);
+		c->erasing=false;
+		c->wel=false;
+		break;
+	case 0x20:														// Sector erase
+		if (!c->wel) fail("erase without write enable",n);
+		if (busy || c->suspended) fail("erase while busy",n);
+		addr&=~(W25QEMU_SECTOR-1);
+		memset(c->mem+addr,0xFF,W25QEMU_SECTOR);
+		c->erases[addr/W25QEMU_SECTOR]++;
+		c->stat.sector_erases++;
+		c->busy_until=now_ns+(uint64_t)(timing.erase_ms*1000000);
+		c->erasing=true;
+		c->erase_addr=addr;
+		c->wel=false;
+		break;
+	case 0x60:														// Chip erase
+		if (!c->wel) fail("chip erase without write enable",n);
+		if (busy || c->suspended) fail("chip erase while busy",n);
+		memset(c->mem,0xFF,W25QEMU_SIZE);
+		c->busy_until=now_ns+20000000000ull;
+		c->erasing=false;
+		c->wel=false;
+		break;
+	case 0x75:														// Erase suspend
+		if (busy && c->erasing && !c->suspended) {
+			c->suspend_left=c->busy_until-now_ns;
+			c->busy_until=now_ns+(uint64_t)(timing.suspend_us*1000);
+			c->suspended=true;
+			c->stat.suspends++;
+		}
+		break;
+	case 0x7A:														// Erase resume
+		if (c->suspended) {
+			if (busy) fail("resume before the suspend finished",n);
+			c->busy_until=now_ns+c->suspend_left;
+			c->suspended=false;
+		}
+		break;
+	}
+	c->ncmd=0;
+}
+
+//-------------------------------------------------------------------------------------------------
+// HAL
+//-------------------------------------------------------------------------------------------------
+void HAL_GPIO_WritePin(GPIO_TypeDef *port, uint16_t pin, GPIO_PinState state)
+{
+	poll();
+	if (port!=&w25qemu_gpiod || (pin!=SPI1_CS_Pin && pin!=SPI2_CS_Pin)) return;
+
+	int n=(pin==SPI2_CS_Pin);
+	struct chip *c=&chips[n];
+	if (state==GPIO_PIN_RESET) {
+		if (c->dma) fail("select during DMA",n);
+		c->cs=true;
+		c->ncmd=0;
+	} else {
+		if (c->cs && c->ncmd) execute(c,n);
+		c->cs=false;
+	}
+}
+
+void HAL_GPIO_TogglePin(GPIO_TypeDef *port, uint16_t pin)
+{
+	UNUSED(port);
+	UNUSED(pin);
+}
+
+HAL_StatusTypeDef HAL_SPI_Transmit(SPI_HandleTypeDef *hspi, const uint8_t *data, uint16_t size, uint32_t timeout)
+{
+	UNUSED(timeout);
+	poll();
+	struct chip *c=chip_of(hspi);
+	if (!c->cs) fail("transmit without chip select",hspi->chip);
+
+	for (int i=0; i<size; i++) {
+		if (c->ncmd<(int)sizeof(c->cmd)) c->cmd[c->ncmd++]=data[i];
+	}
+	if ((c->cmd[0]==0x03 && c->ncmd==4) || (c->cmd[0]==0x0B && c->ncmd==5)) {
+		c->addr=((uint32_t)c->cmd[1]<<16)|((uint32_t)c->cmd[2]<<8)|c->cmd[3];
+	}
+	advance(byte_ns(size));
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_SPI_Receive(SPI_HandleTypeDef *hspi, uint8_t *data, uint16_t size, uint32_t timeout)
+{
+	UNUSED(timeout);
+	poll();
+	struct chip *c=chip_of(hspi);
+	if (!c->cs) fail("receive without chip select",hspi->chip);
+
+	advance(byte_ns(size));
+	bool busy=now_ns<c->busy_until;
+	switch (c->cmd[0]) {
+	case 0x05:														// Status register 1, BUSY and WEL
+		memset(data,(busy ? 0x01 : 0)|(c->wel ? 0x02 : 0),size);
+		break;
+	case 0x35:														// Status register 2, SUS
+		memset(data,c->suspended ? 0x80 : 0,size);
+		break;
+	case 0x9F:														// JEDEC ID of a W25Q64
+		for (int i=0; i<size; i++) data[i]=(const uint8_t[]){0xEF,0x40,0x17}[i%3];
+		break;
+	case 0x03:
+	case 0x0B:
+		if (busy && !c->suspended) fail("read while busy",hspi->chip);
+		for (int i=0; i<size; i++) {
+			uint32_t a=c->addr++%W25QEMU_SIZE;
+			bool erasing=c->suspended && a-c->erase_addr<W25QEMU_SECTOR;
+			data[i]=erasing ? 0xA5 : c->mem[a];						// A suspended erase leaves the sector undefined
+		}
+		c->stat.read_bytes+=size;
+		break;
+	default:
+		memset(data,0,size);
+		break;
+	}
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_SPI_Receive_DMA(SPI_HandleTypeDef *hspi, uint8_t *data, uint16_t size)
+{
+	uint64_t start=now_ns;
+	HAL_StatusTypeDef res=HAL_SPI_Receive(hspi,data,size,0);		// The data is in place at once, the time is not
+
+	chips[hspi->chip].dma=hspi;
+	chips[hspi->chip].dma_done=now_ns;
+	now_ns=start;
+	advance(0);
+	return res;
+}
+
+HAL_StatusTypeDef HAL_SPI_Abort(SPI_HandleTypeDef *hspi)
+{
+	chips[hspi->chip].dma=NULL;
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_SPI_RegisterCallback(SPI_HandleTypeDef *hspi, HAL_SPI_CallbackIDTypeDef id,
+		void (*callback)(SPI_HandleTypeDef *hspi))
+{
+	if (id!=HAL_SPI_RX_COMPLETE_CB_ID) return HAL_ERROR;
+	hspi->RxCpltCallback=callback;
+	return HAL_OK;
+}
+
+uint32_t w25qemu_dma_counter(DMA_HandleTypeDef *hdma)
+{
+	poll();
+	struct chip *c=&chips[hdma->chip];
+	if (!c->dma) return 0;
+	uint64_t ns=byte_ns(1);
+	return (uint32_t)((c->dma_done-now_ns+ns-1)/ns);
+}
+
+void w25qemu_wfi(void)												// Sleep until the next DMA transfer is done
+{
+	uint64_t next=UINT64_MAX;
+
+	for (int i=0; i<W25QEMU_CHIPS; i++) {
+		if (chips[i].dma && chips[i].dma_done<next) next=chips[i].dma_done;
+	}
+	if (next==UINT64_MAX) advance(1000);
+	else if (next>now_ns) advance(next-now_ns);
+	poll();
+}
+
+void HAL_Delay(uint32_t ms)
+{
+	advance((uint64_t)ms*1000000);
+	poll();
+}
+
+uint32_t HAL_GetTick(void)
+{
+	poll();
+	return (uint32_t)(now_ns/1000000);
+}
+
+uint32_t __get_PRIMASK(void)
+{
+	return primask;
+}
+
+void __set_PRIMASK(uint32_t mask)
+{
+	primask=mask;
+}
+
+void __disable_irq(void)
+{
+	primask=1;
+}
+
+void __enable_irq(void)
+{
+	primask=0;
+}
+
+void SCB_InvalidateDCache_by_Addr(void *addr, int32_t size)
+{
+	UNUSED(addr);
+	UNUSED(size);
+}
+
+void SCB_CleanDCache_by_Addr(void *addr, int32_t size)
+{
+	UNUSED(addr);
+	UNUSED(size);
+}
+
+void Error_Handler(void)
+{
+	fprintf(stderr,"w25qemu: Error_Handler\n");
+	abort();
+}
@@ -0,0 +1,37 @@
+/*
+ * w25qemu.h
+ *
+ * W25Q64 emulator at the SPI level for running W25Qxx.c on Linux, see w25qemu.c.
+ */
+#ifndef W25QEMU_H
+#define W25QEMU_H
+
+#include <stdint.h>
+
+#define W25QEMU_CHIPS		2											// Chip 0 on SPI1, chip 1 on SPI2
+#define W25QEMU_SIZE		(8*1024*1024)									// W25Q64
+#define W25QEMU_SECTOR		4096
+
+struct w25qemu_timing {
+	double spi_mhz;													// SPI clock
+	double prog_us;													// Page program
+	double erase_ms;												// Sector erase
+	double suspend_us;												// Erase suspend until the chip reads again
+};
+
+struct w25qemu_stat {
+	uint64_t read_bytes;											// Data bytes clocked out of the chip
+	uint64_t prog_bytes;											// Data bytes of page programs
+	uint32_t page_programs;
+	uint32_t sector_erases;
+	uint32_t suspends;
+};
+
+void w25qemu_init(const struct w25qemu_timing *timing);
+uint64_t w25qemu_time_ns(void);
+void w25qemu_cpu(uint64_t ns);
+void w25qemu_stat(int chip, struct w25qemu_stat *stat);
+uint32_t w25qemu_erases(int chip, uint32_t sector);
+uint8_t *w25qemu_mem(int chip);
+
+#endif